@@ -21,69 +21,39 @@
 
 static int initted = 0;
 
-/* This is basically the same as bgrad_cache from fs_iso9660 */
-static void make_mru(ext2_fs_t *fs, ext2_cache_t **cache, int block) {
-    int i;
-    ext2_cache_t *tmp;
-
-    /* Don't try it with the end block */
-    if(block < 0 || block >= fs->cache_size - 1)
-        return;
-
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
-
-    for(i = block; i < fs->cache_size - 1; ++i) {
-        cache[i] = cache[i + 1];
-    }
-
-    cache[fs->cache_size - 1] = tmp;
+/* First device block of a filesystem block */
+static inline uint64_t ext2_dev_block(const ext2_fs_t *fs, uint32_t bl) {
+    return (uint64_t)bl << (fs->sb.s_log_block_size - fs->dev->l_block_size +
+                            10);
 }
 
-/* XXXX: This needs locking! */
 uint8_t *ext2_block_read(ext2_fs_t *fs, uint32_t bl, int *err) {
-    int i;
     uint8_t *rv;
-    ext2_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == bl && cache[i]->flags) {
-            rv = cache[i]->data;
-            make_mru(fs, cache, i);
-            goto out;
-        }
+
+    if(fs->sb.s_blocks_count <= bl) {
+        *err = EIO;
+        return NULL;
     }
 
-    /* If we didn't get anything, did we end up with an invalid entry or do we
-       need to boot someone out? */
-    if(i < 0) {
-        i = 0;
+    if(!(rv = bcache_read(fs->bcache, ext2_dev_block(fs, bl))))
+        *err = EIO;
 
-        /* Make sure that if the block is dirty, we write it back out. */
-        if(cache[0]->flags & EXT2_CACHE_FLAG_DIRTY) {
-            if(ext2_block_write_nc(fs, cache[0]->block, cache[0]->data)) {
-                /* XXXX: Uh oh... */
-                *err = EIO;
-                return NULL;
-            }
-        }
-    }
+    return rv;
+}
 
-    /* Try to read the block in question. */
-    if(ext2_block_read_nc(fs, bl, cache[i]->data)) {
+/* Get a cached block that's about to be overwritten, zeroed and dirty,
+   without reading it. */
+static uint8_t *ext2_block_zero(ext2_fs_t *fs, uint32_t bl, int *err) {
+    uint8_t *rv;
+
+    if(fs->sb.s_blocks_count <= bl) {
         *err = EIO;
-        cache[i]->flags = 0;            /* Mark it as invalid... */
         return NULL;
     }
 
-    cache[i]->block = bl;
-    cache[i]->flags = EXT2_CACHE_FLAG_VALID;
-    rv = cache[i]->data;
-    make_mru(fs, cache, i);
+    if(!(rv = bcache_zero(fs->bcache, ext2_dev_block(fs, bl))))
+        *err = EIO;
 
-out:
     return rv;
 }
 
@@ -124,39 +94,20 @@ int ext2_block_write_nc(ext2_fs_t *fs, uint32_t block_num, const uint8_t *blk) {
 }
 
 int ext2_block_mark_dirty(ext2_fs_t *fs, uint32_t block_num) {
-    int i;
-    ext2_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == block_num && cache[i]->flags) {
-            cache[i]->flags |= EXT2_CACHE_FLAG_DIRTY;
-            make_mru(fs, cache, i);
-            return 0;
-        }
-    }
+    if(bcache_mark_dirty(fs->bcache, ext2_dev_block(fs, block_num)))
+        return -EINVAL;
 
-    return -EINVAL;
+    return 0;
 }
 
 int ext2_block_cache_wb(ext2_fs_t *fs) {
-    int i, err;
-    ext2_cache_t **cache = fs->bcache;
-
     /* Don't even bother if we're mounted read-only. */
     if(!(fs->mnt_flags & EXT2FS_MNT_FLAG_RW))
         return 0;
 
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->flags & EXT2_CACHE_FLAG_DIRTY) {
-            if((err = ext2_block_write_nc(fs, cache[i]->block, cache[i]->data)))
-                return err;
+    if(bcache_flush(fs->bcache))
+        return -EIO;
 
-            cache[i]->flags &= ~EXT2_CACHE_FLAG_DIRTY;
-        }
-    }
-    
     return 0;
 }
 
@@ -187,7 +138,14 @@ uint8_t *ext2_block_alloc(ext2_fs_t *fs, uint32_t bg, uint32_t *bn, int *err) {
             *bn = index + bg * fs->sb.s_blocks_per_group +
                 fs->sb.s_first_data_block;
 
-            if(!(blk = ext2_block_read(fs, *bn, err)))
+            /* Keep the bitmap around while we get the new block. */
+            bcache_pin(fs->bcache,
+                       ext2_dev_block(fs, fs->bg[bg].bg_block_bitmap));
+            blk = ext2_block_zero(fs, *bn, err);
+            bcache_unpin(fs->bcache,
+                         ext2_dev_block(fs, fs->bg[bg].bg_block_bitmap));
+
+            if(!blk)
                 return NULL;
 
             ext2_bit_set((uint32_t *)buf, index);
@@ -196,8 +154,6 @@ uint8_t *ext2_block_alloc(ext2_fs_t *fs, uint32_t bg, uint32_t *bn, int *err) {
             --fs->sb.s_free_blocks_count;
             fs->flags |= EXT2_FS_FLAG_SB_DIRTY;
 
-            memset(blk, 0, fs->block_size);
-            ext2_block_mark_dirty(fs, *bn);
             return blk;
         }
 
@@ -221,7 +177,13 @@ uint8_t *ext2_block_alloc(ext2_fs_t *fs, uint32_t bg, uint32_t *bn, int *err) {
                 *bn = index + bg * fs->sb.s_blocks_per_group +
                     fs->sb.s_first_data_block;
 
-                if(!(blk = ext2_block_read(fs, *bn, err)))
+                bcache_pin(fs->bcache,
+                           ext2_dev_block(fs, fs->bg[bg].bg_block_bitmap));
+                blk = ext2_block_zero(fs, *bn, err);
+                bcache_unpin(fs->bcache,
+                             ext2_dev_block(fs, fs->bg[bg].bg_block_bitmap));
+
+                if(!blk)
                     return NULL;
 
                 ext2_bit_set((uint32_t *)buf, index);
@@ -230,8 +192,6 @@ uint8_t *ext2_block_alloc(ext2_fs_t *fs, uint32_t bg, uint32_t *bn, int *err) {
                 --fs->sb.s_free_blocks_count;
                 fs->flags |= EXT2_FS_FLAG_SB_DIRTY;
 
-                memset(blk, 0, fs->block_size);
-                ext2_block_mark_dirty(fs, *bn);
                 return blk;
             }
 
@@ -274,7 +234,6 @@ ext2_fs_t *ext2_fs_init(kos_blockdev_t *bd, uint32_t flags) {
 ext2_fs_t *ext2_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz) {
     ext2_fs_t *rv;
     uint32_t bc;
-    int j;
     int block_size;
 
 #ifdef EXT2FS_DEBUG
@@ -408,47 +367,20 @@ ext2_fs_t *ext2_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz) {
     }
 #endif /* EXT2FS_DEBUG */
 
-    /* Make space for the block cache. */
-    if(!(rv->bcache = (ext2_cache_t **)malloc(sizeof(ext2_cache_t *) *
-                                              cache_sz))) {
+    /* Set up the block cache. */
+    if(block_size >> bd->l_block_size == 0 ||
+       !(rv->bcache = bcache_create(bd, block_size >> bd->l_block_size,
+                                    cache_sz, EXT2_CACHE_READAHEAD))) {
         free(rv->bg);
         free(rv);
         bd->shutdown(bd);
         return NULL;
     }
 
-    for(j = 0; j < cache_sz; ++j) {
-        if(!(rv->bcache[j] = (ext2_cache_t *)malloc(sizeof(ext2_cache_t))))
-            goto out_cache;
-    }
-
-    for(j = 0; j < cache_sz; ++j) {
-        if(!(rv->bcache[j]->data = (uint8_t *)malloc(block_size)))
-            goto out_bcache;
-
-        rv->bcache[j]->flags = 0;
-    }
-
-    rv->cache_size = cache_sz;
+    if(rv->mnt_flags & EXT2FS_MNT_FLAG_RW)
+        bcache_set_flush_interval(rv->bcache, EXT2_CACHE_FLUSH_MS);
 
     return rv;
-
-out_bcache:
-    for(; j >= 0; --j) {
-        free(rv->bcache[j]->data);
-    }
-
-    j = cache_sz - 1;
-out_cache:
-    for(; j >= 0; --j) {
-        free(rv->bcache[j]);
-    }
-
-    free(rv->bcache);
-    free(rv->bg);
-    free(rv);
-    bd->shutdown(bd);
-    return NULL;
 }
 
 int ext2_fs_sync(ext2_fs_t *fs) {
@@ -499,17 +431,10 @@ int ext2_fs_sync(ext2_fs_t *fs) {
 }
 
 void ext2_fs_shutdown(ext2_fs_t *fs) {
-    int i;
-
     /* Sync the filesystem back to the block device, if needed. */
     ext2_fs_sync(fs);
 
-    for(i = 0; i < fs->cache_size; ++i) {
-        free(fs->bcache[i]->data);
-        free(fs->bcache[i]);
-    }
-
-    free(fs->bcache);
+    bcache_destroy(fs->bcache);
     fs->dev->shutdown(fs->dev);
     free(fs->bg);
     free(fs);
@@ -50,6 +50,18 @@ __BEGIN_DECLS
 */
 #define EXT2_CACHE_BLOCKS       32
 
+/* Number of blocks to read after one that isn't in the block cache, in the
+   same request to the block device. Files tend to be laid out in consecutive
+   blocks, so this saves a request for every block of a file that's read in
+   order, but each block read ahead pushes another one out of the cache. */
+#define EXT2_CACHE_READAHEAD    4
+
+/* How long (in milliseconds) a changed block may stay in the block cache of a
+   filesystem mounted read-write before it's written back on its own. Set this
+   to 0 to only write blocks back when they're pushed out of the cache or the
+   filesystem is synced. */
+#define EXT2_CACHE_FLUSH_MS     2000
+
 /* End tunable filesystem parameters. */
 
 /* Convenience stuff, for in case you want to use this outside of KOS. */
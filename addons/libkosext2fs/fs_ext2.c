@@ -231,7 +231,7 @@ static int fs_ext2_close(void *h) {
 
     mutex_lock(&ext2_mutex);
 
-    if(fd < MAX_EXT2_FILES && fh[fd].mode) {
+    if(fd < MAX_EXT2_FILES && fh[fd].inode_num) {
         ext2_inode_put(fh[fd].inode);
         fh[fd].inode_num = 0;
         fh[fd].mode = 0;
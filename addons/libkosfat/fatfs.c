@@ -16,111 +16,48 @@
 #include "bpb.h"
 #include "fatinternal.h"
 
-/* This is basically the same as bgrad_cache from fs_iso9660 */
-static void make_mru(fat_fs_t *fs, fat_cache_t **cache, int block) {
-    int i;
-    fat_cache_t *tmp;
-
-    /* Don't try it with the end block */
-    if(block < 0 || block >= fs->cache_size - 1)
-        return;
-
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
-
-    for(i = block; i < fs->cache_size - 1; ++i) {
-        cache[i] = cache[i + 1];
+/* Find the cache and device block holding a cluster. Raw blocks (for reading
+   the FAT12/FAT16 root directory) live in the FAT cache, since they're one
+   block each. */
+static bcache_t *fat_cluster_cache(fat_fs_t *fs, uint32_t cl, uint64_t *blk) {
+    if(cl & 0x80000000 && fs->sb.fs_type != FAT_FS_FAT32) {
+        *blk = cl & 0x7FFFFFFF;
+        return fs->fcache;
     }
 
-    cache[fs->cache_size - 1] = tmp;
+    if(fs->sb.num_clusters + 2 <= cl || cl < 2)
+        return NULL;
+
+    *blk = (uint64_t)(cl - 2) * fs->sb.sectors_per_cluster +
+        fs->sb.first_data_block;
+    return fs->bcache;
 }
 
-/* XXXX: This needs locking! */
 uint8_t *fat_cluster_read(fat_fs_t *fs, uint32_t cl, int *err) {
-    int i;
+    bcache_t *c;
+    uint64_t blk;
     uint8_t *rv;
-    fat_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == cl && cache[i]->flags) {
-            rv = cache[i]->data;
-            make_mru(fs, cache, i);
-            goto out;
-        }
-    }
-
-    /* If we didn't get anything, did we end up with an invalid entry or do we
-       need to boot someone out? */
-    if(i < 0) {
-        i = 0;
-
-        /* Make sure that if the block is dirty, we write it back out. */
-        if(cache[0]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if(fat_cluster_write_nc(fs, cache[0]->block, cache[0]->data)) {
-                /* XXXX: Uh oh... */
-                *err = EIO;
-                return NULL;
-            }
-        }
-    }
 
-    /* Try to read the block in question. */
-    if(fat_cluster_read_nc(fs, cl, cache[i]->data)) {
+    if(!(c = fat_cluster_cache(fs, cl, &blk)) || !(rv = bcache_read(c, blk))) {
         *err = EIO;
-        cache[i]->flags = 0;            /* Mark it as invalid... */
         return NULL;
     }
 
-    cache[i]->block = cl;
-    cache[i]->flags = FAT_CACHE_FLAG_VALID;
-    rv = cache[i]->data;
-    make_mru(fs, cache, i);
-
-out:
     return rv;
 }
 
 uint8_t *fat_cluster_clear(fat_fs_t *fs, uint32_t cl, int *err) {
-    int i;
+    bcache_t *c;
+    uint64_t blk;
     uint8_t *rv;
-    fat_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == cl && cache[i]->flags) {
-            rv = cache[i]->data;
-            make_mru(fs, cache, i);
-            goto out;
-        }
-    }
-
-    /* If we didn't get anything, did we end up with an invalid entry or do we
-       need to boot someone out? */
-    if(i < 0) {
-        i = 0;
-
-        /* Make sure that if the block is dirty, we write it back out. */
-        if(cache[0]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if(fat_cluster_write_nc(fs, cache[0]->block, cache[0]->data)) {
-                /* XXXX: Uh oh... */
-                *err = EIO;
-                return NULL;
-            }
-        }
-    }
 
     /* Don't bother reading the cluster from disk, since we're erasing it
        anyway... */
-    cache[i]->block = cl;
-    cache[i]->flags = FAT_CACHE_FLAG_VALID | FAT_CACHE_FLAG_DIRTY;
-    rv = cache[i]->data;
-    make_mru(fs, cache, i);
+    if(!(c = fat_cluster_cache(fs, cl, &blk)) || !(rv = bcache_zero(c, blk))) {
+        *err = EIO;
+        return NULL;
+    }
 
-out:
-    memset(rv, 0, fs->sb.bytes_per_sector * fs->sb.sectors_per_cluster);
     return rv;
 }
 
@@ -180,40 +117,81 @@ int fat_cluster_write_nc(fat_fs_t *fs, uint32_t cluster, const uint8_t *blk) {
     return 0;
 }
 
-int fat_cluster_mark_dirty(fat_fs_t *fs, uint32_t cluster) {
-    int i;
-    fat_cache_t **cache = fs->bcache;
-
-    /* Look through the cache from the most recently used to the least recently
-       used entry. */
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->block == cluster && cache[i]->flags) {
-            cache[i]->flags |= FAT_CACHE_FLAG_DIRTY;
-            make_mru(fs, cache, i);
-            return 0;
-        }
+int fat_clusters_read_direct(fat_fs_t *fs, uint32_t cl, uint32_t n,
+                             uint8_t *buf) {
+    uint64_t blk, cnt = (uint64_t)n * fs->sb.sectors_per_cluster;
+
+    if(!n || cl < 2 || fs->sb.num_clusters + 2 - cl < n)
+        return -EINVAL;
+
+    blk = (uint64_t)(cl - 2) * fs->sb.sectors_per_cluster +
+        fs->sb.first_data_block;
+
+    /* Anything changed in the cache has to get to the device first. */
+    if(bcache_flush_range(fs->bcache, blk, cnt))
+        return -EIO;
+
+    if(fs->dev->read_blocks(fs->dev, blk, cnt, buf))
+        return -EIO;
+
+    return 0;
+}
+
+int fat_clusters_write_direct(fat_fs_t *fs, uint32_t cl, uint32_t n,
+                              const uint8_t *buf) {
+    uint64_t blk, cnt = (uint64_t)n * fs->sb.sectors_per_cluster;
+    uint32_t bs = fat_cluster_size(fs), i;
+    uint8_t *block;
+    int err;
+
+    if(!n || cl < 2 || fs->sb.num_clusters + 2 - cl < n)
+        return -EINVAL;
+
+    blk = (uint64_t)(cl - 2) * fs->sb.sectors_per_cluster +
+        fs->sb.first_data_block;
+
+    /* Whatever the cache has for these clusters is about to be stale, dirty
+       or not, since all of it gets overwritten. */
+    if(!bcache_invalidate_range(fs->bcache, blk, cnt)) {
+        if(fs->dev->write_blocks(fs->dev, blk, cnt, buf))
+            return -EIO;
+
+        return 0;
     }
 
-    return -EINVAL;
+    /* Some of it is pinned, so it can't be dropped and would be written back
+       over this later. Go through the cache instead. */
+    for(i = 0; i < n; ++i) {
+        if(!(block = fat_cluster_clear(fs, cl + i, &err)))
+            return -err;
+
+        memcpy(block, buf + i * bs, bs);
+
+        if((err = fat_cluster_mark_dirty(fs, cl + i)) < 0)
+            return err;
+    }
+
+    return 0;
 }
 
-int fat_cluster_cache_wb(fat_fs_t *fs) {
-    int i, err;
-    fat_cache_t **cache = fs->bcache;
+int fat_cluster_mark_dirty(fat_fs_t *fs, uint32_t cluster) {
+    bcache_t *c;
+    uint64_t blk;
 
+    if(!(c = fat_cluster_cache(fs, cluster, &blk)) ||
+       bcache_mark_dirty(c, blk))
+        return -EINVAL;
+
+    return 0;
+}
+
+int fat_cluster_cache_wb(fat_fs_t *fs) {
     /* Don't even bother if we're mounted read-only. */
     if(!(fs->mnt_flags & FAT_MNT_FLAG_RW))
         return 0;
 
-    for(i = fs->cache_size - 1; i >= 0; --i) {
-        if(cache[i]->flags & FAT_CACHE_FLAG_DIRTY) {
-            if((err = fat_cluster_write_nc(fs, cache[i]->block,
-                                           cache[i]->data)))
-                return err;
-
-            cache[i]->flags &= ~FAT_CACHE_FLAG_DIRTY;
-        }
-    }
+    if(bcache_flush(fs->bcache))
+        return -EIO;
 
     return 0;
 }
@@ -265,8 +243,6 @@ fat_fs_t *fat_fs_init(kos_blockdev_t *bd, uint32_t flags) {
 fat_fs_t *fat_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz,
                          int fcache_sz) {
     fat_fs_t *rv;
-    int j;
-    int block_size, cluster_size;
 
     if(bd->init(bd)) {
         return NULL;
@@ -298,85 +274,27 @@ fat_fs_t *fat_fs_init_ex(kos_blockdev_t *bd, uint32_t flags, int cache_sz,
     fat_print_superblock(&rv->sb);
 #endif
 
-    block_size = rv->sb.bytes_per_sector;
-    cluster_size = rv->sb.bytes_per_sector * rv->sb.sectors_per_cluster;
-
-    /* Make space for the block cache. */
-    if(!(rv->bcache = (fat_cache_t **)malloc(sizeof(fat_cache_t *) *
-                                             cache_sz))) {
+    /* Set up the cluster cache and the FAT cache. */
+    if(!(rv->bcache = bcache_create(bd, rv->sb.sectors_per_cluster, cache_sz,
+                                    FAT_CACHE_READAHEAD))) {
         free(rv);
         bd->shutdown(bd);
         return NULL;
     }
 
-    for(j = 0; j < cache_sz; ++j) {
-        if(!(rv->bcache[j] = (fat_cache_t *)malloc(sizeof(fat_cache_t)))) {
-            goto out_cache;
-        }
-    }
-
-    for(j = 0; j < cache_sz; ++j) {
-        if(!(rv->bcache[j]->data = (uint8_t *)memalign(32, cluster_size))) {
-            goto out_bcache;
-        }
-
-        rv->bcache[j]->flags = 0;
-    }
-
-    rv->cache_size = cache_sz;
-
-    /* Make space for the FAT block cache. */
-    if(!(rv->fcache = (fat_cache_t **)malloc(sizeof(fat_cache_t *) *
-                                             fcache_sz))) {
-        goto out_bcache;
-    }
-
-    for(j = 0; j < fcache_sz; ++j) {
-        if(!(rv->fcache[j] = (fat_cache_t *)malloc(sizeof(fat_cache_t)))) {
-            goto out_fcache;
-        }
+    if(!(rv->fcache = bcache_create(bd, 1, fcache_sz, FAT_FCACHE_READAHEAD))) {
+        bcache_destroy(rv->bcache);
+        free(rv);
+        bd->shutdown(bd);
+        return NULL;
     }
 
-    for(j = 0; j < fcache_sz; ++j) {
-        if(!(rv->fcache[j]->data = (uint8_t *)memalign(32, block_size))) {
-            goto out_fcache2;
-        }
-
-        rv->fcache[j]->flags = 0;
+    if(rv->mnt_flags & FAT_MNT_FLAG_RW) {
+        bcache_set_flush_interval(rv->bcache, FAT_CACHE_FLUSH_MS);
+        bcache_set_flush_interval(rv->fcache, FAT_CACHE_FLUSH_MS);
     }
 
-    rv->fcache_size = fcache_sz;
     return rv;
-
-out_fcache2:
-    for(; j >= 0; --j) {
-        free(rv->fcache[j]->data);
-    }
-
-    j = fcache_sz - 1;
-
-out_fcache:
-    for(; j >= 0; --j) {
-        free(rv->fcache[j]);
-    }
-
-    free(rv->fcache);
-
-out_bcache:
-    for(; j >= 0; --j) {
-        free(rv->bcache[j]->data);
-    }
-
-    j = cache_sz - 1;
-out_cache:
-    for(; j >= 0; --j) {
-        free(rv->bcache[j]);
-    }
-
-    free(rv->bcache);
-    free(rv);
-    bd->shutdown(bd);
-    return NULL;
 }
 
 int fat_fs_sync(fat_fs_t *fs) {
@@ -415,23 +333,11 @@ int fat_fs_sync(fat_fs_t *fs) {
 }
 
 void fat_fs_shutdown(fat_fs_t *fs) {
-    int i;
-
     /* Sync the filesystem back to the block device, if needed. */
     fat_fs_sync(fs);
 
-    for(i = 0; i < fs->cache_size; ++i) {
-        free(fs->bcache[i]->data);
-        free(fs->bcache[i]);
-    }
-
-    free(fs->bcache);
-
-    for(i = 0; i < fs->fcache_size; ++i) {
-        free(fs->fcache[i]->data);
-        free(fs->fcache[i]);
-    }
-
+    bcache_destroy(fs->bcache);
+    bcache_destroy(fs->fcache);
     fs->dev->shutdown(fs->dev);
     free(fs);
 }
@@ -48,6 +48,27 @@ __BEGIN_DECLS
 */
 #define FAT_FCACHE_BLOCKS       8
 
+/* Number of clusters (or FAT blocks) to read after one that isn't in the
+   cache, in the same request to the block device. Reading the next cluster
+   along with one that's needed helps with files laid out in consecutive
+   clusters, but pushes another cluster out of the cache. FAT blocks are small
+   and usually read in order, so it pays to read more of them at once. */
+#define FAT_CACHE_READAHEAD     1
+#define FAT_FCACHE_READAHEAD    4
+
+/* How long (in milliseconds) a changed cluster or FAT block may stay in the
+   cache of a filesystem mounted read-write before it's written back on its
+   own. Set this to 0 to only write them back when they're pushed out of the
+   cache or the filesystem is synced. */
+#define FAT_CACHE_FLUSH_MS      2000
+
+/* Reads and writes of at least two whole clusters go straight between the
+   block device and the caller's buffer (a run of consecutive clusters at a
+   time), rather than through the cluster cache, if the buffer is aligned to
+   this many bytes. Block devices that use DMA need 32 byte alignment. Set this
+   to 0 to always go through the cache. */
+#define FAT_DIRECT_ALIGN        32
+
 /* End tunable filesystem parameters. */
 
 /* Convenience stuff, for in case you want to use this outside of KOS. */
@@ -91,6 +112,16 @@ int fat_cluster_write_nc(fat_fs_t *fs, uint32_t cluster, const uint8_t *blk);
 
 int fat_cluster_mark_dirty(fat_fs_t *fs, uint32_t cluster);
 
+/* Read or write n consecutive clusters straight between the block device and
+   buf, in one request, without going through the cluster cache. The cache is
+   kept up to date, and a write that finds some of the clusters pinned in it
+   goes through the cache instead. These are for big reads and writes of whole
+   clusters. */
+int fat_clusters_read_direct(fat_fs_t *fs, uint32_t cl, uint32_t n,
+                             uint8_t *buf);
+int fat_clusters_write_direct(fat_fs_t *fs, uint32_t cl, uint32_t n,
+                              const uint8_t *buf);
+
 uint32_t fat_block_size(const fat_fs_t *fs);
 uint32_t fat_log_block_size(const fat_fs_t *fs);
 uint32_t fat_cluster_size(const fat_fs_t *fs);
@@ -137,6 +137,12 @@ static int fat_create_entry(fat_fs_t *fs, const char *fn, uint8_t attr,
     return 0;
 }
 
+/* Move the file to the cluster with the given order in its chain. If write is
+   set, clusters are added to the end of the chain as needed; if it's
+   ADVANCE_NOCLEAR, the new clusters aren't cleared, because the caller is
+   going to overwrite all of them. */
+#define ADVANCE_NOCLEAR 2
+
 static int advance_cluster(fat_fs_t *fs, int fd, uint32_t order, int write) {
     uint32_t clo, cl, cl2;
     int err;
@@ -181,7 +187,8 @@ static int advance_cluster(fat_fs_t *fs, int fd, uint32_t order, int write) {
                 }
 
                 /* Clear it. */
-                if(!fat_cluster_clear(fs, cl2, &err)) {
+                if(write != ADVANCE_NOCLEAR &&
+                   !fat_cluster_clear(fs, cl2, &err)) {
                     fat_write_fat(fs, cl2, 0);
                     return -err;
                 }
@@ -367,6 +374,28 @@ static int fs_fat_close(void *h) {
     return rv;
 }
 
+/* Find how many clusters, starting at cl and up to max of them, follow each
+   other on the disk. Returns the cluster after the last of them (which may be
+   an end of chain marker), or FAT_INVALID_CLUSTER on error. */
+static uint32_t cluster_run(fat_fs_t *fs, uint32_t cl, uint32_t max,
+                            uint32_t *n, int *err) {
+    uint32_t next;
+
+    for(*n = 1; ; ++*n, ++cl) {
+        next = fat_read_fat(fs, cl, err);
+
+        if(next == FAT_INVALID_CLUSTER || *n == max || next != cl + 1)
+            return next;
+    }
+}
+
+/* Should cnt bytes be read into or written from buf directly? A single
+   cluster is better off in the cache, which reads ahead. */
+static inline int direct_ok(const void *buf, size_t cnt, uint32_t bs) {
+    return FAT_DIRECT_ALIGN && cnt >= 2 * bs &&
+        !((uintptr_t)buf & (FAT_DIRECT_ALIGN - 1));
+}
+
 static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
     file_t fd = ((file_t)h) - 1;
     fat_fs_t *fs;
@@ -375,7 +404,8 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
     uint8_t *bbuf = (uint8_t *)buf;
     ssize_t rv;
     uint64_t sz, cl;
-    int mode;
+    uint32_t n;
+    int mode, err;
 
     mutex_lock(&fat_mutex);
 
@@ -485,6 +515,38 @@ static ssize_t fs_fat_read(void *h, void *buf, size_t cnt) {
 
     /* While we still have more to read, do it. */
     while(cnt) {
+        /* Read whole clusters that follow each other on the disk straight
+           into the buffer, all at once. */
+        if(direct_ok(bbuf, cnt, bs)) {
+            cl = cluster_run(fs, fh[fd].cluster, cnt / bs, &n, &errno);
+
+            if(cl == FAT_INVALID_CLUSTER) {
+                mutex_unlock(&fat_mutex);
+                return -1;
+            }
+
+            if((err = fat_clusters_read_direct(fs, fh[fd].cluster, n,
+                                               bbuf)) < 0) {
+                mutex_unlock(&fat_mutex);
+                errno = -err;
+                return -1;
+            }
+
+            fh[fd].ptr += n * bs;
+            cnt -= n * bs;
+            bbuf += n * bs;
+
+            if(cnt && fat_is_eof(fs, cl)) {
+                mutex_unlock(&fat_mutex);
+                errno = EIO;
+                return -1;
+            }
+
+            fh[fd].cluster = cl;
+            fh[fd].cluster_order += n;
+            continue;
+        }
+
         if(!(block = fat_cluster_read(fs, fh[fd].cluster, &errno))) {
             mutex_unlock(&fat_mutex);
             return -1;
@@ -544,6 +606,7 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
     uint8_t *block;
     uint8_t *bbuf = (uint8_t *)buf;
     ssize_t rv;
+    uint32_t cl, n;
     int mode, err;
 
     mutex_lock(&fat_mutex);
@@ -601,7 +664,8 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
             cnt -= bs - bo;
 
             if((err = advance_cluster(fs, fd, fh[fd].cluster_order + 1,
-                                      1)) < 0) {
+                                      direct_ok(bbuf, cnt, bs) ?
+                                      ADVANCE_NOCLEAR : 1)) < 0) {
                 mutex_unlock(&fat_mutex);
                 errno = -err;
                 return -1;
@@ -623,6 +687,46 @@ static ssize_t fs_fat_write(void *h, const void *buf, size_t cnt) {
 
     /* While we still have more to write, do it. */
     while(cnt) {
+        /* Write whole clusters that follow each other on the disk straight
+           from the buffer, all at once. Clusters added to the file for this
+           don't need to be cleared, since they're overwritten entirely. */
+        if(direct_ok(bbuf, cnt, bs)) {
+            cl = fh[fd].cluster;
+            n = 1;
+
+            while(cnt > n * bs) {
+                if((err = advance_cluster(fs, fd, fh[fd].cluster_order + 1,
+                                          cnt >= (n + 1) * bs ?
+                                          ADVANCE_NOCLEAR : 1)) < 0) {
+                    mutex_unlock(&fat_mutex);
+                    errno = -err;
+                    return -1;
+                }
+
+                if(fh[fd].cluster != cl + n || cnt < (n + 1) * bs)
+                    break;
+
+                ++n;
+            }
+
+            if((err = fat_clusters_write_direct(fs, cl, n, bbuf)) < 0) {
+                mutex_unlock(&fat_mutex);
+                errno = -err;
+                return -1;
+            }
+
+            fh[fd].ptr += n * bs;
+            cnt -= n * bs;
+            bbuf += n * bs;
+
+            /* Just like below, don't move on to the next cluster if this
+               was the end of the write. */
+            if(!cnt)
+                fh[fd].mode |= 0x80000000;
+
+            continue;
+        }
+
         if(!(block = fat_cluster_read(fs, fh[fd].cluster, &err))) {
             mutex_unlock(&fat_mutex);
             errno = err;
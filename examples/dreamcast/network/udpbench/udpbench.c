@@ -0,0 +1,109 @@
+/* KallistiOS ##version##
+
+   udpbench.c
+
+   This example measures how fast the network stack can move UDP datagrams
+   through itself, by sending them over the loopback address (127.0.0.1) and
+   reading them straight back. Nothing goes out on the wire, so this only
+   measures the stack's own per-packet overhead (buffer allocation, copies and
+   socket lookup), which is what you want when working on the stack itself.
+
+   A network adapter still needs to be present and configured, since that's
+   where the source address of the datagrams comes from.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <kos/init.h>
+#include <kos/net.h>
+#include <arch/timer.h>
+
+KOS_INIT_FLAGS(INIT_DEFAULT | INIT_NET);
+
+#define BENCH_PORT  5150
+#define BATCH       16
+#define ROUNDS      2000
+
+static const size_t sizes[] = { 16, 256, 1024, 1472 };
+
+static int bench(int sock, const struct sockaddr_in *addr, size_t size) {
+    static uint8_t buf[1500];
+    uint64_t start, end;
+    int i, j;
+
+    memset(buf, 0xA5, sizeof(buf));
+    start = timer_us_gettime64();
+
+    for(i = 0; i < ROUNDS; ++i) {
+        for(j = 0; j < BATCH; ++j) {
+            if(sendto(sock, buf, size, 0, (const struct sockaddr *)addr,
+                      sizeof(*addr)) != (ssize_t)size) {
+                perror("sendto");
+                return -1;
+            }
+        }
+
+        for(j = 0; j < BATCH; ++j) {
+            if(recv(sock, buf, sizeof(buf), 0) != (ssize_t)size) {
+                perror("recv");
+                return -1;
+            }
+        }
+    }
+
+    end = timer_us_gettime64();
+
+    printf("%5u bytes: %8.0f packets/s, %7.2f MB/s\n", (unsigned int)size,
+           (double)ROUNDS * BATCH * 1000000.0 / (end - start),
+           (double)ROUNDS * BATCH * size / (end - start));
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in addr;
+    size_t i;
+    int sock;
+
+    (void)argc;
+    (void)argv;
+
+    if(!net_default_dev) {
+        printf("No network device, can't run the benchmark\n");
+        return EXIT_FAILURE;
+    }
+
+    if((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BENCH_PORT);
+    addr.sin_addr.s_addr = htonl(0x7F000001);   /* 127.0.0.1 */
+
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("bind");
+        close(sock);
+        return EXIT_FAILURE;
+    }
+
+    printf("UDP loopback, %d rounds of %d datagrams\n", ROUNDS, BATCH);
+
+    for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        if(bench(sock, &addr, sizes[i]))
+            break;
+    }
+
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,222 @@
+/* KallistiOS ##version##
+
+   include/kos/bcache.h
+
+*/
+
+/** \file    kos/bcache.h
+    \brief   Buffer cache for block devices.
+    \ingroup vfs_blockdev
+
+    This file contains a buffer cache that filesystems can put between
+    themselves and a \ref kos_blockdev_t, so that they don't each need their
+    own. A cache holds a fixed number of buffers, each of which holds a fixed
+    number of consecutive device blocks (a filesystem block or cluster, say).
+    Buffers are found by the first device block they hold, through a hash
+    table, and the least recently used one is reused when another is needed.
+
+    Buffers are written back to the device when they're reused, when the cache
+    is flushed, and (if the cache has a flush interval) in the background once
+    they've been dirty for that long.
+
+    The cache locks itself, so the background flush is safe, but the buffers
+    themselves aren't locked: a buffer that's changed while it's being written
+    back in the background gets written again at the next flush. Filesystems
+    are expected to serialize their own access to the cache.
+
+    \see    kos/blockdev.h
+*/
+
+#ifndef __KOS_BCACHE_H
+#define __KOS_BCACHE_H
+
+#include <kos/cdefs.h>
+__BEGIN_DECLS
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** \addtogroup vfs_blockdev
+    @{
+*/
+
+struct kos_blockdev;
+struct bcache;
+
+/** \brief  Opaque type of a buffer cache. */
+typedef struct bcache bcache_t;
+
+/** \brief  Default interval for flushing dirty buffers in the background,
+            in milliseconds. */
+#define BCACHE_FLUSH_MS     2000
+
+/** \brief  Statistics of a buffer cache.
+
+    \see    bcache_get_stats()
+*/
+typedef struct bcache_stats {
+    uint32_t hits;          /**< \brief Lookups that found their buffer */
+    uint32_t misses;        /**< \brief Lookups that had to read it */
+    uint32_t reads;         /**< \brief read_blocks calls */
+    uint32_t readahead;     /**< \brief Buffers read ahead of a miss */
+    uint32_t writes;        /**< \brief write_blocks calls */
+    uint32_t evictions;     /**< \brief Buffers reused for another block */
+    uint32_t dirty;         /**< \brief Buffers dirty right now */
+} bcache_stats_t;
+
+/** \brief  Create a buffer cache on a block device.
+
+    \param  dev             The device, which must already be initialized.
+    \param  dev_blocks      Device blocks in each buffer.
+    \param  count           Number of buffers, at least 2.
+    \param  readahead       Number of buffers to read after the one that was
+                            asked for when it isn't cached, in the same
+                            read_blocks call. Reading ahead stops at the first
+                            buffer that's already cached, and never takes more
+                            than half the cache.
+
+    \return                 The new cache, or NULL on failure (setting errno).
+*/
+bcache_t *bcache_create(struct kos_blockdev *dev, uint32_t dev_blocks,
+                        size_t count, size_t readahead);
+
+/** \brief  Destroy a buffer cache.
+
+    Dirty buffers are written back first. The device isn't shut down.
+
+    \param  c               The cache to destroy.
+    \retval 0               On success.
+    \retval -1              If a buffer couldn't be written back (setting
+                            errno). The cache is destroyed anyway.
+*/
+int bcache_destroy(bcache_t *c);
+
+/** \brief  Set the background flush interval of a cache.
+
+    \param  c               The cache.
+    \param  ms              How long a buffer may stay dirty before it's
+                            written back, or 0 to only write buffers back when
+                            they're reused or the cache is flushed (the
+                            default).
+*/
+void bcache_set_flush_interval(bcache_t *c, uint32_t ms);
+
+/** \brief  Get a buffer, reading it if needed.
+
+    The buffer stays valid until the next call on the cache, other than
+    bcache_mark_dirty() and the pinning functions, or for as long as it's
+    pinned.
+
+    \param  c               The cache.
+    \param  block           First device block of the buffer.
+    \return                 The buffer's data, or NULL on failure (setting
+                            errno to EIO).
+*/
+uint8_t *bcache_read(bcache_t *c, uint64_t block);
+
+/** \brief  Get a zeroed, dirty buffer without reading it.
+
+    This is for blocks that are about to be overwritten entirely, like newly
+    allocated ones.
+
+    \param  c               The cache.
+    \param  block           First device block of the buffer.
+    \return                 The buffer's data, or NULL on failure (setting
+                            errno).
+*/
+uint8_t *bcache_zero(bcache_t *c, uint64_t block);
+
+/** \brief  Mark a cached buffer as changed.
+
+    \param  c               The cache.
+    \param  block           First device block of the buffer.
+    \retval 0               On success.
+    \retval -1              If the buffer isn't cached (setting errno to
+                            EINVAL).
+*/
+int bcache_mark_dirty(bcache_t *c, uint64_t block);
+
+/** \brief  Keep a cached buffer from being reused.
+
+    Pins nest; each one has to be undone with bcache_unpin(). This is for
+    metadata that's used while other buffers are read, and for buffers that
+    are used often enough that they should never have to be read again.
+
+    \param  c               The cache.
+    \param  block           First device block of the buffer.
+    \retval 0               On success.
+    \retval -1              If the buffer isn't cached (setting errno to
+                            EINVAL).
+*/
+int bcache_pin(bcache_t *c, uint64_t block);
+
+/** \brief  Undo a bcache_pin().
+
+    \param  c               The cache.
+    \param  block           First device block of the buffer.
+    \retval 0               On success.
+    \retval -1              If the buffer isn't cached or pinned (setting
+                            errno to EINVAL).
+*/
+int bcache_unpin(bcache_t *c, uint64_t block);
+
+/** \brief  Write back all dirty buffers.
+
+    Buffers are written in block order. Runs of consecutive buffers are
+    written in a single call, up to as many as the cache reads at once.
+
+    \param  c               The cache.
+    \retval 0               On success.
+    \retval -1              If a buffer couldn't be written (setting errno to
+                            EIO). It stays dirty.
+*/
+int bcache_flush(bcache_t *c);
+
+/** \brief  Write back the dirty buffers holding any of a range of blocks.
+
+    This is for reading the blocks straight from the device, around the
+    cache.
+
+    \param  c               The cache.
+    \param  block           First device block of the range.
+    \param  count           Number of device blocks in the range.
+    \retval 0               On success.
+    \retval -1              If a buffer couldn't be written (setting errno to
+                            EIO). It stays dirty.
+*/
+int bcache_flush_range(bcache_t *c, uint64_t block, uint64_t count);
+
+/** \brief  Drop all buffers without writing them back.
+
+    \param  c               The cache.
+*/
+void bcache_invalidate(bcache_t *c);
+
+/** \brief  Drop the buffers holding any of a range of blocks, without writing
+            them back.
+
+    This is for writing the blocks straight to the device, around the cache,
+    so that the cache doesn't hold on to (or later write back) what was there
+    before.
+
+    \param  c               The cache.
+    \param  block           First device block of the range.
+    \param  count           Number of device blocks in the range.
+    \retval 0               On success.
+    \retval -1              If a buffer in the range is pinned (setting errno
+                            to EBUSY). It's kept, and the rest are dropped.
+*/
+int bcache_invalidate_range(bcache_t *c, uint64_t block, uint64_t count);
+
+/** \brief  Get the statistics of a cache.
+
+    \param  c               The cache.
+    \return                 Its statistics, counted since it was created.
+*/
+bcache_stats_t bcache_get_stats(bcache_t *c);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* !__KOS_BCACHE_H */
@@ -171,6 +171,7 @@ the file */
 */
 #define SHN_UNDEF   0       /**< \brief Undefined, missing, irrelevant */
 #define SHN_ABS     0xfff1  /**< \brief Absolute values */
+#define SHN_COMMON  0xfff2  /**< \brief Common (not yet allocated) */
 /** @} */
 
 /** \brief   ELF Section header.
@@ -359,6 +360,12 @@ typedef struct elf_prog {
     uintptr_t lib_open;         /**< \brief Pointer to library's open function */
     uintptr_t lib_close;        /**< \brief Pointer to library's close function */
 
+    /* Load statistics */
+    uint32_t load_us;           /**< \brief Time taken by elf_load(), in usec */
+    uint32_t bytes_read;        /**< \brief Bytes read from the file */
+    uint32_t peak_temp;         /**< \brief Peak temporary memory used while
+                                             loading, not counting the image */
+
     char fn[256];               /**< \brief Filename of library */
 } elf_prog_t;
 
@@ -366,7 +373,9 @@ typedef struct elf_prog {
     \ingroup elf
 
     This function loads an ELF binary from the VFS and fills in an elf_prog_t
-    for it.
+    for it. Only the headers, symbol table and string table are held in memory
+    while loading. Allocated sections are read straight into the final image,
+    and relocations are streamed through a small buffer.
 
     \param  fn              The filename of the binary on the VFS.
     \param  shell           Unused?
@@ -25,6 +25,7 @@
 __BEGIN_DECLS
 
 #include <stdint.h>
+#include <stddef.h>
 
 /** \addtogroup system_libraries
     @{
@@ -42,6 +43,19 @@ typedef struct export_sym {
     uintptr_t ptr;        /**< \brief A pointer to the symbol. */
 } export_sym_t;
 
+/** \brief  Name hash index for a table of export symbols.
+
+    This is generated alongside each export table by genexports.sh. It is an
+    open-addressed hash table with linear probing, holding 1-based indices into
+    the export table (0 marks an empty slot).
+
+    \headerfile kos/exports.h
+*/
+typedef struct export_hash {
+    uint32_t mask;              /**< \brief Number of slots minus one. */
+    const uint16_t *slots;      /**< \brief The slots themselves. */
+} export_hash_t;
+
 /** \cond */
 /* These are the platform-independent exports */
 extern export_sym_t kernel_symtab[];
@@ -51,6 +65,11 @@ extern export_sym_t arch_symtab[];
 
 /* And these are the subarch-specific exports */
 extern export_sym_t subarch_symtab[];
+
+/* Name hash indices for the above */
+extern const export_hash_t kernel_symtab_hash;
+extern const export_hash_t arch_symtab_hash;
+extern const export_hash_t subarch_symtab_hash;
 /** \endcond */
 
 #ifndef __EXPORTS_FILE
@@ -62,6 +81,17 @@ extern export_sym_t subarch_symtab[];
 typedef struct symtab_handler {
     struct nmmgr_handler nmmgr;   /**< \brief Name manager handler header */
     export_sym_t *table;          /**< \brief Location of the first entry */
+
+    /** \brief  Name hash index generated with the table, or NULL to search
+                the table linearly. */
+    const export_hash_t *hash;
+
+    /** \brief  Entries sorted by address, or NULL. Set up by export_init()
+                for the kernel tables. */
+    export_sym_t **by_addr;
+
+    /** \brief  Number of entries in by_addr. */
+    size_t count;
 } symtab_handler_t;
 #endif
 
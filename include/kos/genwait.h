@@ -28,6 +28,7 @@ __BEGIN_DECLS
 
 #include <kos/thread.h>
 #include <stdint.h>
+#include <stddef.h>
 
 /** \brief  Sleep on an object.
 
@@ -143,6 +144,87 @@ void genwait_check_timeouts(uint64_t now);
 */
 uint64_t genwait_next_timeout(void);
 
+/** \brief  Default number of sleep queues in the genwait hash table. */
+#define GENWAIT_TABLE_SIZE_DEFAULT  128
+
+/** \brief  Maximum number of sleep queues in the genwait hash table. */
+#define GENWAIT_TABLE_SIZE_MAX      65536
+
+/** \brief  Statistics about the genwait sleep queues.
+
+    This structure is filled in by genwait_get_stats(). The wakeup counters
+    accumulate from system startup, or from the last call to
+    genwait_reset_stats().
+
+    \headerfile kos/genwait.h
+*/
+typedef struct genwait_stats {
+    size_t   table_size;    /**< \brief Number of sleep queues */
+    size_t   waiters;       /**< \brief Number of threads currently sleeping */
+    size_t   used_buckets;  /**< \brief Number of non-empty sleep queues */
+    size_t   max_chain;     /**< \brief Length of the longest sleep queue */
+    uint64_t wake_calls;    /**< \brief Number of genwait_wake_*() calls */
+    uint64_t wake_scanned;  /**< \brief Sleeping threads examined by them */
+    uint64_t wake_woken;    /**< \brief Threads actually woken by them */
+} genwait_stats_t;
+
+/** \brief  Resize the genwait hash table.
+
+    Sleeping objects are hashed into a table of sleep queues, and waking up a
+    thread means scanning the sleep queue of its object. If many threads are
+    sleeping at once, a larger table reduces the length of these queues. The
+    threads currently sleeping are moved over to the new table.
+
+    This function is not callable from inside an interrupt, as it may need
+    to allocate memory.
+
+    \param  size            The new number of sleep queues. Must be a power of
+                            two, between 2 and GENWAIT_TABLE_SIZE_MAX.
+
+    \retval 0               On success.
+    \retval -1              On error, errno will be set as appropriate.
+
+    \par    Error Conditions:
+    \em     EINVAL - \p size is not a valid table size \n
+    \em     ENOMEM - out of memory
+
+    \sa genwait_get_table_size
+*/
+int genwait_set_table_size(size_t size);
+
+/** \brief  Get the number of sleep queues in the genwait hash table.
+
+    \return                 The current number of sleep queues.
+
+    \sa genwait_set_table_size
+*/
+size_t genwait_get_table_size(void);
+
+/** \brief  Retrieve statistics about the genwait sleep queues.
+
+    This function gathers the current occupancy of the sleep queues, as well
+    as the accumulated wakeup statistics. Comparing the wake_scanned and
+    wake_woken counters shows how much work the wakeup functions spend on
+    threads sleeping on other objects that hash to the same queue.
+
+    \param  stats           Where to store the statistics. May be NULL.
+    \param  occupancy       An array receiving the number of threads in each
+                            sleep queue. May be NULL.
+    \param  count           The number of entries in \p occupancy.
+
+    \return                 The number of sleep queues in the table.
+
+    \sa genwait_reset_stats
+*/
+size_t genwait_get_stats(genwait_stats_t *stats, size_t *occupancy,
+                         size_t count);
+
+/** \brief  Reset the genwait wakeup statistics.
+
+    \sa genwait_get_stats
+*/
+void genwait_reset_stats(void);
+
 /** \cond */
 /* Initialize the genwait system */
 int genwait_init(void);
@@ -299,6 +299,8 @@ void net_arp_shutdown(void);
     \param  timestamp       The entry's timestamp. Set to 0 for a permanent
                             entry, otherwise set to the current number of
                             milliseconds since boot (i.e, timer_ms_gettime64()).
+                            A permanent entry is only ever replaced by another
+                            permanent one; ARP traffic doesn't change it.
 
     \retval 0               On success.
     \retval -1              Error allocating memory.
@@ -311,7 +313,8 @@ int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
 
     If no entry is found, then an ARP query will be sent and an error will be
     returned. If you specify a packet with the call, it will be sent when the
-    reply comes in.
+    reply comes in. A few packets are held for each address being looked up;
+    past that, the oldest one is dropped.
 
     \param  nif             The network device in use.
     \param  ip_in           The IP address to lookup.
@@ -322,8 +325,9 @@ int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
     \param  data_size       The size of data.
 
     \retval 0               On success.
-    \retval -1              A query is outstanding for that address.
-    \retval -2              Address not found, query generated.
+    \retval -1              Address not found yet, and no packet was held
+                            (either none was given, or it couldn't be).
+    \retval -2              Address not found, packet held for the reply.
     \retval -3              Error allocating memory.
 */
 int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
@@ -365,6 +369,35 @@ int net_arp_input(netif_t *nif, const uint8_t *pkt, int len);
 */
 int net_arp_query(netif_t *nif, const uint8_t ip[4]);
 
+/** \brief   Neighbor cache statistics structure.
+    \ingroup networking_arp
+
+    The ARP and NDP caches each keep a fixed-size table of neighbors, evicting
+    the least recently used entry when they run out of room. Packets sent to a
+    neighbor whose address isn't known yet are held (a few per neighbor) until
+    it answers. These are the counters for one of those tables, retrieved with
+    net_arp_get_stats() or net_ndp_get_stats().
+
+    \headerfile kos/net.h
+*/
+typedef struct net_neigh_stats {
+    uint32_t  hits;                   /** \brief Lookups that found an address */
+    uint32_t  misses;                 /** \brief Lookups that had to ask */
+    uint32_t  evictions;              /** \brief Entries evicted for room */
+    uint32_t  queued;                 /** \brief Packets held for an address */
+    uint32_t  queue_drops;            /** \brief Held packets thrown away */
+    uint32_t  entries;                /** \brief Entries in use right now */
+    uint32_t  deferred;               /** \brief Updates put off while busy */
+    uint32_t  deferred_drops;         /** \brief Updates lost while busy */
+} net_neigh_stats_t;
+
+/** \brief   Retrieve statistics from the ARP cache.
+    \ingroup networking_arp
+
+    \return                 The net_neigh_stats_t structure.
+*/
+net_neigh_stats_t net_arp_get_stats(void);
+
 
 /***** net_input.c *********************************************************/
 
@@ -768,6 +801,11 @@ int net_ndp_insert(netif_t *nif, const uint8_t mac[6], const struct in6_addr *ip
 int net_ndp_lookup(netif_t *net, const struct in6_addr *ip, uint8_t mac_out[6],
                    const ipv6_hdr_t *pkt, const uint8_t *data, int data_size);
 
+/** \brief  Retrieve statistics from the NDP cache.
+    \return                 The net_neigh_stats_t structure.
+*/
+net_neigh_stats_t net_ndp_get_stats(void);
+
 /** @} */
 
 /***** net_udp.c **********************************************************/
@@ -54,11 +54,11 @@ __BEGIN_DECLS
     \ingroup            threading
 
     The thread scheduler itself is a relatively simplistic priority scheduler.
-    There is no provision for priorities to erode over time, so keep that in
-    mind. That practically means that if you have 2 high priority threads that
-    are always runnable and one low priority thread that is always runnable, the
-    low priority thread will never actually run (since it will never get to the
-    front of the run queue because of the high priority threads).
+    Runnable threads are kept in per-priority buckets, so picking the next
+    thread to run does not depend on the number of threads in the system. The
+    priority of a thread that has not run for a while is periodically boosted
+    (aged), so that a low priority thread will eventually get some CPU time
+    even when higher priority threads are always runnable.
 
     The scheduler supports two distinct types of threads: joinable and detached
     threads. A joinable thread is one that can return a value to the creating
@@ -159,6 +159,19 @@ typedef enum kthread_state {
 typedef int tid_t;            /**< \brief Thread ID type */
 typedef int prio_t;           /**< \brief Priority value type */
 
+/** \brief   Timer queue link.
+
+    The kernel keeps things that come due at a given time (threads waiting
+    with a timeout, for instance) in timer queues, which are pairing heaps.
+    This links an item to its first child, its next sibling and its previous
+    sibling (or parent, if it is the first child). You shouldn't touch it.
+*/
+typedef struct timerq_node {
+    struct timerq_node *child;  /**< \brief First child in the heap */
+    struct timerq_node *next;   /**< \brief Next sibling in the heap */
+    struct timerq_node *prev;   /**< \brief Previous sibling or parent */
+} timerq_node_t;
+
 /** \brief   Structure describing one running thread.
 
     Each thread has one of these structures assigned to it, which holds all the
@@ -172,11 +185,18 @@ typedef struct __attribute__((aligned(32))) kthread {
     /** \brief  Thread list handle. Not a function. */
     LIST_ENTRY(kthread) t_list;
 
+    /** \brief  Thread ID hash handle. Not a function either. */
+    LIST_ENTRY(kthread) tid_hash;
+
     /** \brief  Run/Wait queue handle. Once again, not a function. */
     TAILQ_ENTRY(kthread) thdq;
 
-    /** \brief  Timer queue handle (if applicable). Also not a function. */
-    TAILQ_ENTRY(kthread) timerq;
+    /** \brief  Timer queue handle (if applicable). Also not a function.
+
+        This puts the thread in genwait's timer queue, for timed waits, or in
+        the scheduler's, for polling threads with a timeout.
+    */
+    timerq_node_t timerq;
 
     /** \brief  Kernel thread id. */
     tid_t tid;
@@ -187,6 +207,9 @@ typedef struct __attribute__((aligned(32))) kthread {
     /** \brief  Static priority: 0..PRIO_MAX (higher means lower priority). */
     prio_t real_prio;
 
+    /** \brief  Effective priority (with ageing) in the run queue. */
+    prio_t sched_prio;
+
     /** \brief  Thread flags. */
     kthread_flags_t flags;
 
@@ -346,6 +369,11 @@ irq_context_t *thd_choose_new(void);
 /** \brief       Given a thread ID, locates the thread structure.
     \relatesalso kthread_t
 
+    Thread IDs are kept in a hash table that grows with the number of threads,
+    so this takes constant time on average.
+    Note that the IDs of destroyed threads are eventually reused, once the
+    allocation of new IDs wraps around.
+
     \param  tid             The thread ID to retrieve.
 
     \return                 The thread on success, NULL on failure.
@@ -512,6 +540,10 @@ typedef int (*thd_cb_t)(void *);
     Since the callback function is called by the scheduler, the callback will
     be running inside an interrupt context, with all that entails.
 
+    Polling threads are kept apart from the runnable threads, and only a
+    bounded number of callbacks is evaluated on each scheduler pass, so with
+    many threads polling at once, each callback may be called less often.
+
     \param  cb              The polling function.
     \param  data            A pointer provided to the polling function.
     \param  timeout_ms      If non-zero, the number of milliseconds to sleep.
@@ -10,10 +10,15 @@
 
     This file contains the API to create and manage work queues.
 
-    A work queue is a thread that will execute tasks (aka. jobs) that are
-    enqueued by client code, at a predeterminated moment in time. Multiple
-    jobs can be enqueued. Once a job is executed, it is removed from the
-    execution queue.
+    A work queue is a pool of one or more threads that will execute tasks (aka.
+    jobs) that are enqueued by client code, at a predeterminated moment in
+    time. Multiple jobs can be enqueued. Once a job is executed, it is removed
+    from the execution queue.
+
+    Each job has a priority class. When several jobs are due, the ones in the
+    highest class are run first, so a queue of slow low-priority jobs does not
+    hold up time-critical ones as long as there are enough threads in the pool.
+    A given job never runs on more than one thread at a time.
 
     \author Paul Cercueil
 
@@ -39,6 +44,19 @@ struct workqueue;
 */
 typedef struct workqueue workqueue_t;
 
+/** \brief   Job priority classes.
+
+    Jobs are zero-initialized to WORKQUEUE_PRIO_NORMAL.
+*/
+typedef enum workqueue_prio {
+    WORKQUEUE_PRIO_HIGH = -1,   /**< \brief Run before any other due job */
+    WORKQUEUE_PRIO_NORMAL = 0,  /**< \brief Default priority */
+    WORKQUEUE_PRIO_LOW = 1,     /**< \brief Housekeeping, run last */
+} workqueue_prio_t;
+
+/** \brief   Number of priority classes. */
+#define WORKQUEUE_PRIO_COUNT    3
+
 /** \struct  workqueue_job_t
     \brief   Structure describing a job for the work queue.
 */
@@ -50,21 +68,70 @@ typedef struct workqueue_job {
     /** \brief  Routine to call. */
     void (*cb)(workqueue_t *queue, struct workqueue_job *job);
 
+    /** \brief  Priority class of the job. */
+    workqueue_prio_t prio;
+
+    /** \brief  Non-zero while the job is queued. No need to set manually. */
+    int queued;
+
     /** \brief  List handle. No need to set manually. */
     STAILQ_ENTRY(workqueue_job) entry;
 } workqueue_job_t;
 
+/** \brief   Work queue creation attributes.
+
+    A zero-initialized structure gives the same result as workqueue_create().
+*/
+typedef struct workqueue_attr {
+    /** \brief  Number of worker threads. 0 means 1. */
+    unsigned int num_threads;
+
+    /** \brief  Priority of the worker threads. 0 means PRIO_DEFAULT. */
+    prio_t prio;
+
+    /** \brief  Label of the worker threads. NULL means "[workqueue]". */
+    const char *label;
+} workqueue_attr_t;
+
+/** \brief   Work queue statistics.
+
+    Latencies are measured from the time a job was due to the time a worker
+    thread started running it.
+*/
+typedef struct workqueue_stats {
+    uint64_t enqueued;          /**< \brief Jobs enqueued */
+    uint64_t executed;          /**< \brief Jobs run */
+    uint64_t cancelled;         /**< \brief Jobs cancelled while queued */
+    uint64_t latency_total_us;  /**< \brief Sum of all queue latencies */
+    uint64_t latency_max_us;    /**< \brief Worst queue latency */
+    uint64_t busy_us;           /**< \brief Time spent running jobs */
+    uint32_t pending;           /**< \brief Jobs currently queued */
+} workqueue_stats_t;
+
 /** \brief       Create a new work queue.
     \relatesalso workqueue_t
 
-    This function will create a new work queue.
+    This function will create a new work queue with a single thread.
 
     \return                 The new work queue on success, NULL on failure.
 
-    \sa workqueue_destroy
+    \sa workqueue_create_ex, workqueue_destroy
 */
 workqueue_t *workqueue_create(void);
 
+/** \brief       Create a new work queue with the given attributes.
+    \relatesalso workqueue_t
+
+    This function will create a new work queue backed by a pool of threads.
+
+    \param  attr            Creation attributes, or NULL for the defaults.
+
+    \return                 The new work queue on success, NULL on failure.
+
+    \sa workqueue_create, workqueue_destroy
+*/
+workqueue_t *workqueue_create_ex(const workqueue_attr_t *attr);
+
 /** \brief       Destroy a work queue.
     \relatesalso workqueue_t
 
@@ -92,7 +159,8 @@ void workqueue_kill(workqueue_t *wq);
     \relatesalso workqueue_t
 
     This function will enqueue a job to the given work queue. The job's struct
-    must have been initialized properly.
+    must have been initialized properly. If the job is already queued, it is
+    moved according to its new time and priority.
 
     \param  wq              A pointer to the work queue
     \param  job             A pointer to the job to enqueue
@@ -108,6 +176,10 @@ void workqueue_enqueue(workqueue_t *wq, workqueue_job_t *job);
     before the job is set to be executed (note that jobs are automatically
     removed from the work queue right before their execution).
 
+    If the job is running on one of the work queue's threads, this function
+    waits for it to finish, and removes it again if it re-enqueued itself. When
+    called from the job's own callback, it does not wait.
+
     \param  wq              A pointer to the work queue
     \param  job             A pointer to the job to cancel
 
@@ -120,10 +192,19 @@ void workqueue_cancel(workqueue_t *wq, workqueue_job_t *job);
 
     \param  wq              The workqueue whose thread should be returned.
 
-    \return                 A handle to the underlying thread.
+    \return                 A handle to the underlying thread (the first one,
+                            for a work queue with several threads).
 */
 kthread_t *workqueue_get_thread(workqueue_t *wq);
 
+/** \brief       Get statistics for a work queue.
+    \relatesalso workqueue_t
+
+    \param  wq              The work queue.
+    \param  stats           Where to store the statistics.
+*/
+void workqueue_get_stats(workqueue_t *wq, workqueue_stats_t *stats);
+
 __END_DECLS
 
 #endif /* __KOS_WORKQUEUE_H */
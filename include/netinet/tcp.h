@@ -22,6 +22,7 @@
 #define __NETINET_TCP_H
 
 #include <kos/cdefs.h>
+#include <stdint.h>
 
 __BEGIN_DECLS
 
@@ -46,9 +47,57 @@ __BEGIN_DECLS
 */
 
 #define TCP_NODELAY             1 /**< \brief Don't delay to coalesce. */
+#define TCP_KEEPIDLE            4 /**< \brief Idle seconds before keepalive
+                                       probes start (int) */
+#define TCP_KEEPINTVL           5 /**< \brief Seconds between keepalive
+                                       probes (int) */
+#define TCP_KEEPCNT             6 /**< \brief Unanswered keepalive probes
+                                       before dropping (int) */
+#define TCP_INFO               11 /**< \brief Get connection statistics.
+                                       (struct tcp_info, read-only) */
 
 /** @} */
 
+/** \brief   TCP connection statistics.
+    \ingroup networking_tcp
+
+    This structure is filled in by getsockopt() with the TCP_INFO option. Note
+    that unlike some other systems, all times here are in milliseconds and all
+    window sizes are in bytes. Fields that don't apply to the socket's current
+    state (for instance, on a listening socket) are set to zero.
+
+    \headerfile netinet/tcp.h
+*/
+struct tcp_info {
+    uint32_t tcpi_state;            /**< \brief Internal connection state */
+    uint32_t tcpi_rto;              /**< \brief Retransmission timeout */
+    uint32_t tcpi_rtt;              /**< \brief Smoothed round trip time */
+    uint32_t tcpi_rttvar;           /**< \brief Round trip time variation */
+    uint32_t tcpi_snd_mss;          /**< \brief Sending maximum segment size */
+    uint32_t tcpi_snd_cwnd;         /**< \brief Congestion window */
+    uint32_t tcpi_snd_ssthresh;     /**< \brief Slow start threshold */
+    uint32_t tcpi_snd_wnd;          /**< \brief Peer's advertised window */
+    uint32_t tcpi_unacked;          /**< \brief Bytes sent but not yet ACKed */
+    uint32_t tcpi_total_retrans;    /**< \brief Segments retransmitted */
+    uint32_t tcpi_fast_retrans;     /**< \brief Fast retransmits performed */
+    uint32_t tcpi_timeouts;         /**< \brief Retransmission timeouts */
+    uint32_t tcpi_options;          /**< \brief Negotiated TCPI_OPT_* flags */
+    uint32_t tcpi_snd_wscale;       /**< \brief Peer's window scale shift */
+    uint32_t tcpi_rcv_wscale;       /**< \brief Our window scale shift */
+};
+
+/** \defgroup tcpi_opts                Negotiated Options
+    \brief                             Flags for the tcpi_options field of
+                                        struct tcp_info
+    \ingroup                           networking_tcp
+
+    @{
+*/
+#define TCPI_OPT_TIMESTAMPS     1 /**< \brief RFC 7323 timestamps */
+#define TCPI_OPT_SACK           2 /**< \brief RFC 2018 selective ACKs */
+#define TCPI_OPT_WSCALE         4 /**< \brief RFC 7323 window scaling */
+/** @} */
+
 __END_DECLS
 
 #endif /* !__NETINET_TCP_H */
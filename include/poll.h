@@ -10,8 +10,9 @@
 
     This file contains the definitions needed for using the poll() function, as
     directed by the POSIX 2008 standard (aka The Open Group Base Specifications
-    Issue 7). Currently the functionality defined herein only works for sockets,
-    and that is likely how it will stay for some time.
+    Issue 7). Currently the functionality defined herein only works for
+    sockets, pipes and ptys. For watching many file descriptors at once, see
+    the epoll interface in sys/epoll.h.
 
     The poll() function works quite similarly to the select() function that it
     is quite likely that you'd be more familiar with.
@@ -0,0 +1,170 @@
+/* KallistiOS ##version##
+
+   sys/epoll.h
+
+*/
+
+/** \file    sys/epoll.h
+    \brief   Scalable I/O event notification.
+    \ingroup threading_epoll
+
+    This file contains an epoll-style event notification interface, modelled
+    after the one provided by Linux. Unlike poll(), which has to be handed the
+    full set of file descriptors on every call, an epoll instance keeps a
+    persistent interest set. Sockets, pipes and ptys post readiness directly to
+    the instances that have registered interest in them, so a thread waiting on
+    a large number of descriptors is not disturbed by events on unrelated ones.
+
+    Both level-triggered (the default) and edge-triggered (EPOLLET) modes are
+    supported, as is one-shot notification (EPOLLONESHOT). Nesting epoll
+    instances inside one another is not supported.
+*/
+
+#ifndef __SYS_EPOLL_H
+#define __SYS_EPOLL_H
+
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <poll.h>
+
+/** \defgroup threading_epoll   Event Polling
+    \brief                      Scalable epoll-style I/O event notification
+    \ingroup                    threading_posix
+
+    @{
+*/
+
+/** \defgroup epoll_events      Events for epoll
+    \brief                      Masks for the events field of struct epoll_event
+
+    These share their values with the equivalent poll() events.
+
+    @{
+*/
+#define EPOLLIN         POLLIN      /**< \brief Data may be read */
+#define EPOLLRDNORM     POLLRDNORM  /**< \brief Normal data may be read */
+#define EPOLLRDBAND     POLLRDBAND  /**< \brief Priority data may be read */
+#define EPOLLPRI        POLLPRI     /**< \brief High-priority data may be read */
+#define EPOLLOUT        POLLOUT     /**< \brief Data may be written */
+#define EPOLLWRNORM     POLLWRNORM  /**< \brief Normal data may be written */
+#define EPOLLWRBAND     POLLWRBAND  /**< \brief Priority data may be written */
+#define EPOLLERR        POLLERR     /**< \brief Error condition (always set) */
+#define EPOLLHUP        POLLHUP     /**< \brief Hang up (always set) */
+
+#define EPOLLONESHOT    (1U << 30)  /**< \brief Disable after one event */
+#define EPOLLET         (1U << 31)  /**< \brief Edge-triggered notification */
+/** @} */
+
+/** \defgroup epoll_ctl_ops     Operations for epoll_ctl()
+    \brief                      Values for the op parameter of epoll_ctl()
+
+    @{
+*/
+#define EPOLL_CTL_ADD   1           /**< \brief Register a file descriptor */
+#define EPOLL_CTL_DEL   2           /**< \brief Deregister a file descriptor */
+#define EPOLL_CTL_MOD   3           /**< \brief Change registered events */
+/** @} */
+
+/** \brief   Flag for epoll_create1().
+
+    Accepted for compatibility. There is no exec() in KOS, so it does nothing.
+*/
+#define EPOLL_CLOEXEC   02000000
+
+/** \brief   User data attached to a registered file descriptor. */
+typedef union epoll_data {
+    void *ptr;                  /**< \brief Pointer value */
+    int fd;                     /**< \brief File descriptor */
+    uint32_t u32;               /**< \brief 32-bit value */
+    uint64_t u64;               /**< \brief 64-bit value */
+} epoll_data_t;
+
+/** \brief   Structure describing an event of interest or a reported event.
+    \headerfile sys/epoll.h
+*/
+struct epoll_event {
+    uint32_t events;            /**< \brief Event mask (see \ref epoll_events) */
+    epoll_data_t data;          /**< \brief User data, returned unmodified */
+};
+
+/** \brief   Create an epoll instance.
+
+    \param  size        Ignored, but must be greater than zero.
+    \return             A file descriptor for the new instance, or -1 on error
+                        (sets errno as appropriate).
+
+    \par    Error Conditions:
+    \em     EINVAL - size was not positive \n
+    \em     ENOMEM - out of memory \n
+    \em     EMFILE - no more file descriptors available
+*/
+int epoll_create(int size);
+
+/** \brief   Create an epoll instance.
+
+    \param  flags       0 or EPOLL_CLOEXEC.
+    \return             A file descriptor for the new instance, or -1 on error
+                        (sets errno as appropriate).
+
+    \par    Error Conditions:
+    \em     EINVAL - invalid flags \n
+    \em     ENOMEM - out of memory \n
+    \em     EMFILE - no more file descriptors available
+*/
+int epoll_create1(int flags);
+
+/** \brief   Add, modify or remove a file descriptor in an interest set.
+
+    Only descriptors whose filesystem implements polling (sockets, pipes and
+    ptys) may be registered. Registrations are dropped automatically once every
+    descriptor referring to the underlying file has been closed.
+
+    \param  epfd        The epoll instance.
+    \param  op          One of the \ref epoll_ctl_ops.
+    \param  fd          The file descriptor to act on.
+    \param  event       The events of interest and user data (ignored for
+                        EPOLL_CTL_DEL).
+    \return             0 on success, -1 on error (sets errno as appropriate).
+
+    \par    Error Conditions:
+    \em     EBADF - epfd or fd is not a valid descriptor \n
+    \em     EINVAL - epfd is not an epoll instance, fd is an epoll instance,
+                     or op is invalid \n
+    \em     EEXIST - fd is already registered (EPOLL_CTL_ADD) \n
+    \em     ENOENT - fd is not registered (EPOLL_CTL_MOD, EPOLL_CTL_DEL) \n
+    \em     EPERM - fd does not support polling \n
+    \em     EFAULT - event was NULL \n
+    \em     ENOMEM - out of memory \n
+    \em     EBUSY - called from an interrupt while epoll was in use
+*/
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+
+/** \brief   Wait for events on an epoll instance.
+
+    \param  epfd        The epoll instance.
+    \param  events      Array to receive the ready events.
+    \param  maxevents   Number of elements in events.
+    \param  timeout     Maximum time to block, in milliseconds. Pass 0 to
+                        return immediately and -1 to wait indefinitely.
+    \return             The number of events stored, 0 on timeout, or -1 on
+                        error (sets errno as appropriate).
+
+    \par    Error Conditions:
+    \em     EBADF - epfd is not a valid descriptor \n
+    \em     EINVAL - epfd is not an epoll instance, or maxevents is not
+                     positive \n
+    \em     EFAULT - events was NULL \n
+    \em     EPERM - called from an interrupt with a non-zero timeout \n
+    \em     EBUSY - called from an interrupt while epoll was in use
+*/
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout);
+
+/** @} */
+
+__END_DECLS
+
+#endif /* !__SYS_EPOLL_H */
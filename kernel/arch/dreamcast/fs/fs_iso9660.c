@@ -35,6 +35,8 @@ ISO9660 systems, as these were used as references as well.
 
 #include <kos/thread.h>
 #include <kos/mutex.h>
+#include <kos/cond.h>
+#include <kos/timer.h>
 #include <kos/fs.h>
 #include <kos/opts.h>
 #include <kos/dbglog.h>
@@ -52,6 +54,7 @@ ISO9660 systems, as these were used as references as well.
 #include <sys/ioctl.h>
 
 static int init_percd(void);
+static void index_rebuild(void);
 static bool percd_done;
 
 /********************************************************************************/
@@ -193,128 +196,433 @@ static uint32_t iso_733(const uint8_t *from) {
 
 
 /********************************************************************************/
-/* Low-level block caching routines. This implements a simple queue-based
-   LRU/MRU caching system. Whenever a block is requested, it will be placed
-   on the MRU end of the queue. As more blocks are loaded than can fit in
-   the cache, blocks are deleted from the LRU end. */
-
-/* Holds the data for one cache block, and a pointer to the next one.
-   As sectors are read from the disc, they are added to the front of
-   this cache. As the cache fills up, sectors are removed from the end
-   of it. */
-typedef struct {
+/* Drive scheduling. One thread at a time gets the drive, and keeps it for a
+   whole read() (or a block cache fill). Threads waiting for it are let in by
+   the sector they want to read, going up from where the drive last stopped
+   and then starting again from the bottom, so that files being read at the
+   same time cost as few seeks as they can. The stream and the readahead
+   buffers are only touched by whoever has the drive. */
+
+typedef struct iso_waiter {
+    TAILQ_ENTRY(iso_waiter) next;
+    kthread_t   *thd;
+    iso_stats_t *stats;
+    uint32_t    sector;
+    bool        granted;
+} iso_waiter_t;
+
+static TAILQ_HEAD(iso_waiters, iso_waiter) sched_waiters;
+static mutex_t sched_mutex;
+static condvar_t sched_cv;
+static kthread_t *sched_owner;
+static int sched_depth;
+static iso_stats_t *sched_stats;    /* Stats of the file using the drive */
+static iso_stats_t *sched_last;     /* Stats of the last file to send a command */
+static uint32_t sched_head;         /* Sector after the last one read */
+
+static void iso_stream_stop(void);
+
+/* Wait for the drive. stats are those of the file that wants it (if any),
+   and sector is where it wants to read. The thread that has the drive can
+   ask for it again; it keeps it until it's released as often. */
+static void sched_acquire(iso_stats_t *stats, uint32_t sector) {
+    iso_waiter_t w;
+
+    mutex_lock(&sched_mutex);
+
+    if(sched_owner == thd_current) {
+        sched_depth++;
+    }
+    else if(!sched_owner) {
+        sched_owner = thd_current;
+        sched_stats = stats;
+        sched_depth = 1;
+    }
+    else {
+        w.thd = thd_current;
+        w.stats = stats;
+        w.sector = sector;
+        w.granted = false;
+        TAILQ_INSERT_TAIL(&sched_waiters, &w, next);
+
+        while(!w.granted)
+            cond_wait(&sched_cv, &sched_mutex);
+    }
+
+    mutex_unlock(&sched_mutex);
+}
+
+/* Hand the drive to the next waiter in line, if there is one */
+static void sched_release(void) {
+    iso_waiter_t *w, *next = NULL, *lowest = NULL;
+
+    mutex_lock(&sched_mutex);
+
+    if(--sched_depth) {
+        mutex_unlock(&sched_mutex);
+        return;
+    }
+
+    TAILQ_FOREACH(w, &sched_waiters, next) {
+        if(!lowest || w->sector < lowest->sector)
+            lowest = w;
+
+        if(w->sector >= sched_head && (!next || w->sector < next->sector))
+            next = w;
+    }
+
+    if(!next)
+        next = lowest;
+
+    if(next) {
+        TAILQ_REMOVE(&sched_waiters, next, next);
+        sched_owner = next->thd;
+        sched_stats = next->stats;
+        sched_depth = 1;
+        next->granted = true;
+        cond_broadcast(&sched_cv);
+    }
+    else {
+        sched_owner = NULL;
+        sched_stats = NULL;
+    }
+
+    mutex_unlock(&sched_mutex);
+}
+
+/* Count a command about to be sent to the drive, for whoever has it. The drive
+   only does one thing at a time, so this is where a stream that's still going
+   gets stopped: only when someone actually needs the drive for something else,
+   not whenever another file reads. */
+static void sched_account(uint32_t sector, size_t cnt) {
+    iso_stream_stop();
+    sched_last = sched_stats;
+
+    if(sched_stats) {
+        sched_stats->reads++;
+
+        if(sector != sched_head)
+            sched_stats->seeks++;
+    }
+
+    sched_head = sector + cnt;
+}
+
+/********************************************************************************/
+/* Low-level block caching routines. Inode (directory) and data blocks share
+   one pool of blocks, hashed on the sector so that finding one doesn't mean
+   looking at all of them. Each kind has its own LRU list and a quota of blocks
+   it may hold; a kind that's under its quota can take blocks from the other
+   one when there are no free ones left. Data blocks that miss are read
+   together with the sectors after them, so a file read a little at a time
+   doesn't go to the drive for every sector. */
+
+#define CACHE_INODE     0
+#define CACHE_DATA      1
+
+#define CACHE_BLOCKS    32      /* Default size of the pool */
+#define CACHE_QUOTA     16      /* Default quota of each kind */
+#define CACHE_FILL      8       /* Most sectors read at once on a miss */
+
+/* Holds the data for one cache block */
+typedef struct cache_block {
+    LIST_ENTRY(cache_block)     hash;
+    TAILQ_ENTRY(cache_block)    lru;
     uint8_t   *data;          /* Sector data */
     uint32_t  sector;         /* CD sector */
+    int       type;           /* CACHE_INODE or CACHE_DATA */
 } cache_block_t;
 
-/* List of cache blocks (ordered least recently used to most recently) */
-#define NUM_CACHE_BLOCKS 16
-static cache_block_t *icache[NUM_CACHE_BLOCKS];     /* inode cache */
-static cache_block_t *dcache[NUM_CACHE_BLOCKS];     /* data cache */
+LIST_HEAD(cache_list, cache_block);
+TAILQ_HEAD(cache_lru, cache_block);
+
+static struct cache_list *cache_buckets;
+static size_t cache_hash_bits;
+static struct cache_lru cache_lru[2];   /* Most recently used first */
+static struct cache_lru cache_free;
+static size_t cache_used[2], cache_quota[2];
+static iso_cache_stats_t cache_stats;
 
-static unsigned char *cache_data;
+static uint8_t *cache_data;
 static cache_block_t *caches;
+static uint8_t *cache_fill_buf;         /* CACHE_FILL sectors, for fills */
 
 /* Cache modification mutex */
 static mutex_t cache_mutex;
 
+static struct cache_list *bbucket(uint32_t sector) {
+    return &cache_buckets[(sector * 0x9e3779b1u) >> (32 - cache_hash_bits)];
+}
+
+static cache_block_t *bfind(uint32_t sector) {
+    cache_block_t *b;
+
+    LIST_FOREACH(b, bbucket(sector), hash) {
+        if(b->sector == sector)
+            return b;
+    }
+
+    return NULL;
+}
+
+/* Take a block out of the cache, leaving it on no list at all */
+static void bunlink(cache_block_t *b) {
+    LIST_REMOVE(b, hash);
+    TAILQ_REMOVE(&cache_lru[b->type], b, lru);
+    cache_used[b->type]--;
+    b->sector = (uint32_t)-1;
+}
+
+/* Find a block to read a sector of the given kind into, and unlink it */
+static cache_block_t *bget(int type) {
+    cache_block_t *b;
+
+    if(cache_used[type] < cache_quota[type]) {
+        if((b = TAILQ_FIRST(&cache_free))) {
+            TAILQ_REMOVE(&cache_free, b, lru);
+            return b;
+        }
+
+        /* Under quota and nothing free, so the other kind has to give one */
+        if((b = TAILQ_LAST(&cache_lru[!type], cache_lru))) {
+            bunlink(b);
+            return b;
+        }
+    }
+
+    if((b = TAILQ_LAST(&cache_lru[type], cache_lru)))
+        bunlink(b);
+
+    return b;
+}
+
+/* Put a block that's been read into the cache, at the MRU end */
+static void bput(cache_block_t *b, int type, uint32_t sector) {
+    b->type = type;
+    b->sector = sector;
+    LIST_INSERT_HEAD(bbucket(sector), b, hash);
+    TAILQ_INSERT_HEAD(&cache_lru[type], b, lru);
+    cache_used[type]++;
+}
+
 /* Clears all cache blocks */
-static void bclear_cache(cache_block_t **cache) {
+static void bclear(void) {
+    cache_block_t *b;
+    int i;
+
     mutex_lock_scoped(&cache_mutex);
 
-    for(size_t i = 0; i < NUM_CACHE_BLOCKS; i++)
-        cache[i]->sector = (uint32_t)-1;
+    for(i = 0; i < 2; i++) {
+        while((b = TAILQ_FIRST(&cache_lru[i]))) {
+            bunlink(b);
+            TAILQ_INSERT_TAIL(&cache_free, b, lru);
+        }
+    }
 }
 
-/* Graduate a block from its current position to the MRU end of the cache */
-static void bgrad_cache(cache_block_t **cache, int block) {
-    cache_block_t   *tmp;
+/* Set up a pool of the given size. Anything already cached is lost. */
+static int bsetup(size_t blocks, size_t inode_max, size_t data_max) {
+    struct cache_list *buckets;
+    cache_block_t *blks;
+    uint8_t *data;
+    size_t bits, i;
+
+    for(bits = 4; ((size_t)1 << bits) < blocks; bits++)
+        ;
+
+    /* Allocate cache block space, properly aligned for DMA access */
+    buckets = malloc(sizeof(struct cache_list) << bits);
+    blks = malloc(blocks * sizeof(cache_block_t));
+    data = aligned_alloc(32, blocks * 2048);
+
+    if(!buckets || !blks || !data) {
+        free(buckets);
+        free(blks);
+        free(data);
+        errno = ENOMEM;
+        return -1;
+    }
 
-    /* Don't try it with the end block */
-    if(block < 0 || block >= (NUM_CACHE_BLOCKS - 1)) return;
+    mutex_lock_scoped(&cache_mutex);
 
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
+    free(cache_buckets);
+    free(caches);
+    free(cache_data);
 
-    for(size_t i = block; i < (NUM_CACHE_BLOCKS - 1); i++)
-        cache[i] = cache[i + 1];
+    cache_buckets = buckets;
+    cache_hash_bits = bits;
+    caches = blks;
+    cache_data = data;
+    cache_quota[CACHE_INODE] = inode_max;
+    cache_quota[CACHE_DATA] = data_max;
+    cache_used[CACHE_INODE] = cache_used[CACHE_DATA] = 0;
+
+    for(i = 0; i < ((size_t)1 << bits); i++)
+        LIST_INIT(&cache_buckets[i]);
+
+    TAILQ_INIT(&cache_lru[CACHE_INODE]);
+    TAILQ_INIT(&cache_lru[CACHE_DATA]);
+    TAILQ_INIT(&cache_free);
+
+    for(i = 0; i < blocks; i++) {
+        caches[i].data = &cache_data[i * 2048];
+        caches[i].sector = (uint32_t)-1;
+        TAILQ_INSERT_TAIL(&cache_free, &caches[i], lru);
+    }
 
-    cache[NUM_CACHE_BLOCKS - 1] = tmp;
+    return 0;
 }
 
-/* Pulls the requested sector into a cache block and returns the cache
-   block index. Note that the sector in question may already be in the
-   cache, in which case it just returns the containing block. */
+/* Pulls the requested sector into a cache block and returns it, or NULL if
+   it can't be read. Note that the sector in question may already be in the
+   cache, in which case it just returns the containing block. On a miss, up
+   to cnt sectors starting with this one are read, if they aren't cached
+   already. */
 static void iso_break_all(void);
-static void iso_abort_stream(bool lock);
-static int bread_cache(cache_block_t **cache, uint32_t sector) {
-    int i, j, rv;
+static cache_block_t *bread_cache(int type, uint32_t sector, size_t cnt) {
+    cache_block_t *blks[CACHE_FILL], *b;
+    size_t i, n;
+    bool drive = false;
+    int j;
 
-    rv = -1;
     mutex_lock(&cache_mutex);
 
+again:
     /* Look for a pre-existing cache block */
-    for(i = NUM_CACHE_BLOCKS - 1; i >= 0; i--) {
-        if(cache[i]->sector == sector) {
-            bgrad_cache(cache, i);
-            rv = NUM_CACHE_BLOCKS - 1;
-            goto bread_exit;
-        }
+    if((b = bfind(sector))) {
+        TAILQ_REMOVE(&cache_lru[b->type], b, lru);
+        TAILQ_INSERT_HEAD(&cache_lru[b->type], b, lru);
+
+        if(type == CACHE_INODE)
+            cache_stats.inode_hits++;
+        else
+            cache_stats.data_hits++;
+
+        goto bread_exit;
+    }
+
+    /* Get the drive before going any further (but without holding up other
+       cache users), and look again, since someone may have read the block
+       while we waited. */
+    if(!drive) {
+        mutex_unlock(&cache_mutex);
+        sched_acquire(NULL, sector);
+        drive = true;
+        mutex_lock(&cache_mutex);
+        goto again;
     }
 
-    /* If not, look for an open cache slot; if we find one, use it */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        if(cache[i]->sector == (uint32_t)-1) break;
+    if(type == CACHE_INODE)
+        cache_stats.inode_misses++;
+    else
+        cache_stats.data_misses++;
+
+    /* Read as far as we were asked to, up to the first sector that's cached
+       already, without taking up more than half of our quota. */
+    if(cnt > CACHE_FILL)
+        cnt = CACHE_FILL;
+
+    if(cnt > cache_quota[type] / 2)
+        cnt = cache_quota[type] / 2;
+
+    for(n = 0; n < cnt || !n; n++) {
+        if((n && bfind(sector + n)) || !(blks[n] = bget(type)))
+            break;
     }
 
-    /* If we didn't find one, kick an LRU block out of cache */
-    if(i >= NUM_CACHE_BLOCKS) {
-        i = 0;
+    if(!n)
+        goto bread_exit;
+
+    /* Only whoever has the drive reads into the blocks we took and the fill
+       buffer (and the cache can't be resized under it), so the read can go on
+       without the cache locked. */
+    mutex_unlock(&cache_mutex);
+
+    /* Load the requested blocks */
+    sched_account(sector, n);
+    j = cdrom_read_sectors_ex(n == 1 ? blks[0]->data : cache_fill_buf,
+                              sector + 150, n, true);
+
+    if(j == ERR_OK && n > 1) {
+        for(i = 0; i < n; i++)
+            memcpy(blks[i]->data, cache_fill_buf + i * 2048, 2048);
     }
 
-    iso_abort_stream(cache == icache);
-    // dbglog(DBG_DEBUG, "Stream stop for %s read\n", cache == icache ? "cached" : "inode");
+    mutex_lock(&cache_mutex);
+    cache_stats.reads++;
+    cache_stats.sectors += n;
+
+    for(i = n; i-- > 0;) {
+        if(j == ERR_OK)
+            bput(blks[i], type, sector + i);
+        else
+            TAILQ_INSERT_TAIL(&cache_free, blks[i], lru);
+    }
 
-    /* Load the requested block */
-    j = cdrom_read_sectors_ex(cache[i]->data, sector + 150, 1, true);
+    if(j == ERR_OK)
+        b = blks[0];
 
     if(j != ERR_OK) {
         //dbglog(DBG_ERROR, "fs_iso9660: can't read_sectors for %d: %d\n",
         //  sector+150, j);
         if(j == ERR_DISC_CHG || j == ERR_NO_DISC) {
+            mutex_unlock(&cache_mutex);
             init_percd();
+            sched_release();
+            return NULL;
         }
-
-        rv = -1;
-        goto bread_exit;
     }
 
-    cache[i]->sector = sector;
-
-    /* Move it to the most-recently-used position */
-    bgrad_cache(cache, i);
-    rv = NUM_CACHE_BLOCKS - 1;
-
-    /* Return the new cache block index */
 bread_exit:
     mutex_unlock(&cache_mutex);
-    return rv;
+
+    if(drive)
+        sched_release();
+
+    return b;
 }
 
-/* read data block */
-static inline int bdread(uint32_t sector) {
-    return bread_cache(dcache, sector);
+/* read data block, along with up to cnt - 1 more sectors after it */
+static inline cache_block_t *bdread(uint32_t sector, size_t cnt) {
+    return bread_cache(CACHE_DATA, sector, cnt);
 }
 
 /* read inode block */
-static inline int biread(uint32_t sector) {
-    return bread_cache(icache, sector);
+static inline cache_block_t *biread(uint32_t sector) {
+    return bread_cache(CACHE_INODE, sector, 1);
+}
+
+int iso_cache_resize(size_t blocks, size_t inode_max, size_t data_max) {
+    int rv;
+
+    if(blocks < 2 || !inode_max || !data_max) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(inode_max > blocks)
+        inode_max = blocks;
+
+    if(data_max > blocks)
+        data_max = blocks;
+
+    /* Nobody's reading into the cache while we have the drive */
+    sched_acquire(NULL, sched_head);
+    rv = bsetup(blocks, inode_max, data_max);
+    sched_release();
+
+    return rv;
 }
 
-/* Clear both caches */
-static inline void bclear(void) {
-    bclear_cache(dcache);
-    bclear_cache(icache);
+iso_cache_stats_t iso_cache_get_stats(void) {
+    iso_cache_stats_t st;
+
+    mutex_lock(&cache_mutex);
+    st = cache_stats;
+    st.blocks = cache_used[CACHE_INODE] + cache_used[CACHE_DATA];
+    mutex_unlock(&cache_mutex);
+
+    return st;
 }
 
 /********************************************************************************/
@@ -333,7 +641,8 @@ static iso_dirent_t root_dirent;
 /* Per-disc initialization; this is done every time it's discovered that
    a new CD has been inserted. */
 static int init_percd(void) {
-    int     i, blk;
+    int     i;
+    cache_block_t *blk;
     cd_toc_t   toc;
 
     dbglog(DBG_NOTICE, "fs_iso9660: disc change detected\n");
@@ -359,10 +668,10 @@ static int init_percd(void) {
     for(i = 1; i <= 3; i++) {
         blk = biread(session_base + i + 16 - 150);
 
-        if(blk < 0) return blk;
+        if(!blk) return -1;
 
-        if(memcmp((char *)icache[blk]->data, "\02CD001", 6) == 0) {
-            joliet = isjoliet((char *)icache[blk]->data + 88);
+        if(memcmp((char *)blk->data, "\02CD001", 6) == 0) {
+            joliet = isjoliet((char *)blk->data + 88);
             dbglog(DBG_NOTICE, "  (joliet level %d extensions detected)\n", joliet);
 
             if(joliet) break;
@@ -374,19 +683,21 @@ static int init_percd(void) {
         /* Grab and check the volume descriptor */
         blk = biread(session_base + 16 - 150);
 
-        if(blk < 0) return i;
+        if(!blk) return -1;
 
-        if(memcmp((char*)icache[blk]->data, "\01CD001", 6)) {
+        if(memcmp((char*)blk->data, "\01CD001", 6)) {
             dbglog(DBG_ERROR, "fs_iso9660: disc is not iso9660\r\n");
             return -1;
         }
     }
 
     /* Locate the root directory */
-    memcpy(&root_dirent, icache[blk]->data + 156, sizeof(iso_dirent_t));
+    memcpy(&root_dirent, blk->data + 156, sizeof(iso_dirent_t));
     root_extent = iso_733(root_dirent.extent);
     root_size = iso_733(root_dirent.size);
 
+    index_rebuild();
+
     return 0;
 }
 
@@ -432,7 +743,8 @@ static int fncompare(const char *isofn, int isosize, const char *normalfn) {
  */
 static iso_dirent_t *find_object(const char *fn, int dir,
                                  uint32_t dir_extent, uint32_t dir_size) {
-    int     i, c;
+    int     i;
+    cache_block_t   *c;
     iso_dirent_t    *de;
 
     /* RockRidge */
@@ -455,11 +767,11 @@ static iso_dirent_t *find_object(const char *fn, int dir,
     while(size_left > 0) {
         c = biread(dir_extent);
 
-        if(c < 0) return NULL;
+        if(!c) return NULL;
 
         for(i = 0; i < 2048 && i < size_left;) {
             /* Locate the current dirent */
-            de = (iso_dirent_t *)(icache[c]->data + i);
+            de = (iso_dirent_t *)(c->data + i);
 
             if(!de->length) break;
 
@@ -571,9 +883,455 @@ static iso_dirent_t *find_object_path(const char *fn, int dir, iso_dirent_t *sta
     }
 }
 
+/********************************************************************************/
+/* Path index. When it's enabled, the whole directory tree is read once per
+   disc and every object find_object_path() could find goes into a hash table,
+   keyed on a hash of its full path (lowercased, with no version number).
+   Each entry only keeps its own name and the index of its parent directory,
+   so every name is stored once, in a single pool. */
+
+#define INDEX_NONE          ((uint32_t)-1)
+#define INDEX_MAX_ENTRIES   32768
+#define INDEX_READ_SECTORS  16
+#define INDEX_ROOT_HASH     2166136261u
+
+typedef struct {
+    uint32_t hash;          /* Hash of the full path */
+    uint32_t next;          /* Next entry in the same bucket */
+    uint32_t parent;        /* Entry of the containing directory */
+    uint32_t name;          /* Offset of the name in the pool */
+    uint32_t extent;
+    uint32_t size;
+    uint16_t namelen;
+    uint8_t  flags;
+} index_ent_t;
+
+typedef struct {
+    index_ent_t *ents;
+    uint32_t    *buckets;
+    char        *pool;
+    size_t      count, cap;     /* There are as many buckets as cap */
+    size_t      pool_size, pool_cap;
+} path_index_t;
+
+static path_index_t *path_index;
+static bool index_enabled;
+
+/* Protects path_index; it's built without holding this */
+static mutex_t index_mutex;
+
+static inline char index_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/* FNV-1a over "/name", so a path hashes the same built up a component at a
+   time as it does all at once. */
+static uint32_t index_hash(uint32_t h, const char *name, size_t len) {
+    size_t i;
+
+    h = (h ^ '/') * 16777619u;
+
+    for(i = 0; i < len; i++)
+        h = (h ^ (uint8_t)index_lower(name[i])) * 16777619u;
+
+    return h;
+}
+
+static void index_free(path_index_t *idx) {
+    if(!idx)
+        return;
+
+    free(idx->ents);
+    free(idx->buckets);
+    free(idx->pool);
+    free(idx);
+}
+
+/* Double the number of entries (and buckets) */
+static int index_grow(path_index_t *idx) {
+    size_t cap = idx->cap ? idx->cap * 2 : 256;
+    index_ent_t *ents;
+    uint32_t *buckets;
+    size_t i, b;
+
+    if(cap > INDEX_MAX_ENTRIES)
+        return -1;
+
+    if(!(ents = realloc(idx->ents, cap * sizeof(index_ent_t))))
+        return -1;
+
+    idx->ents = ents;
+
+    if(!(buckets = realloc(idx->buckets, cap * sizeof(uint32_t))))
+        return -1;
+
+    idx->buckets = buckets;
+    idx->cap = cap;
+
+    memset(buckets, 0xff, cap * sizeof(uint32_t));
+
+    for(i = 0; i < idx->count; i++) {
+        b = ents[i].hash & (cap - 1);
+        ents[i].next = buckets[b];
+        buckets[b] = i;
+    }
+
+    return 0;
+}
+
+/* Add an object to a directory that's already in the index, with its name
+   already lowercased. Only the first object of each kind with a given name
+   goes in, since that's the one find_object() would find. */
+static int index_add(path_index_t *idx, uint32_t parent, const char *name,
+                     size_t len, uint32_t extent, uint32_t size,
+                     uint8_t flags) {
+    index_ent_t *e;
+    uint32_t h, i;
+    char *pool;
+
+    if(parent == INDEX_NONE)
+        h = INDEX_ROOT_HASH;
+    else
+        h = index_hash(idx->ents[parent].hash, name, len);
+
+    if(idx->cap) {
+        for(i = idx->buckets[h & (idx->cap - 1)]; i != INDEX_NONE; i = e->next) {
+            e = &idx->ents[i];
+
+            if(e->hash == h && e->parent == parent && e->flags == flags &&
+               e->namelen == len && !memcmp(idx->pool + e->name, name, len))
+                return 0;
+        }
+    }
+
+    if(idx->count == idx->cap && index_grow(idx) < 0)
+        return -1;
+
+    if(idx->pool_size + len > idx->pool_cap) {
+        size_t cap = idx->pool_cap ? idx->pool_cap * 2 : 4096;
+
+        if(!(pool = realloc(idx->pool, cap)))
+            return -1;
+
+        idx->pool = pool;
+        idx->pool_cap = cap;
+    }
+
+    e = &idx->ents[idx->count];
+    e->hash = h;
+    e->parent = parent;
+    e->name = idx->pool_size;
+    e->namelen = len;
+    e->extent = extent;
+    e->size = size;
+    e->flags = flags;
+
+    if(len) {
+        memcpy(idx->pool + idx->pool_size, name, len);
+        idx->pool_size += len;
+    }
+
+    e->next = idx->buckets[h & (idx->cap - 1)];
+    idx->buckets[h & (idx->cap - 1)] = idx->count++;
+
+    return 0;
+}
+
+/* Work out the name find_object() would match a dirent with, lowercased */
+static size_t index_name(const iso_dirent_t *de, char *name) {
+    const uint8_t *pnt;
+    int len;
+    size_t i, n = 0;
+
+    if(joliet) {
+        ucs2utfn((uint8_t *)name, (const uint8_t *)de->name, de->name_len);
+        n = strlen(name);
+        goto lower;
+    }
+
+    /* Rock Ridge NM extension */
+    len = de->length - sizeof(iso_dirent_t) + sizeof(de->name) - de->name_len;
+    pnt = (const uint8_t *)de + sizeof(iso_dirent_t) - sizeof(de->name) +
+          de->name_len;
+
+    if((de->name_len & 1) == 0) {
+        pnt++;
+        len--;
+    }
+
+    while((len >= 4) && ((pnt[3] == 1) || (pnt[3] == 2)) && pnt[2] >= 4) {
+        if(strncmp((const char *)pnt, "NM", 2) == 0 && pnt[2] > 5) {
+            n = pnt[2] - 5;
+            memcpy(name, pnt + 5, n);
+        }
+
+        len -= pnt[2];
+        pnt += pnt[2];
+    }
+
+    if(n)
+        goto lower;
+
+    /* Plain ISO9660 name, without the version or a trailing period */
+    while(n < de->name_len && de->name[n] != ';') {
+        name[n] = de->name[n];
+        n++;
+    }
+
+    if(n && name[n - 1] == '.')
+        n--;
+
+lower:
+    for(i = 0; i < n; i++)
+        name[i] = index_lower(name[i]);
+
+    return n;
+}
+
+/* Read the directory tree into a new index. Each directory is read in turn
+   as it's added, so this goes breadth first. */
+static path_index_t *index_build(void) {
+    path_index_t *idx;
+    iso_dirent_t *de;
+    uint8_t *buf;
+    char name[NAME_MAX * 2];
+    uint32_t i, extent, nsect, cnt, s, off;
+    int size_left, rv;
+    size_t len;
+
+    if(!(idx = calloc(1, sizeof(path_index_t))))
+        return NULL;
+
+    if(!(buf = aligned_alloc(32, INDEX_READ_SECTORS * 2048))) {
+        free(idx);
+        return NULL;
+    }
+
+    /* The root is entry 0 */
+    if(index_add(idx, INDEX_NONE, "", 0, root_extent, root_size, 2) < 0)
+        goto fail;
+
+    for(i = 0; i < idx->count; i++) {
+        if(idx->ents[i].flags != 2)
+            continue;
+
+        extent = idx->ents[i].extent;
+        size_left = (int)idx->ents[i].size;
+        nsect = (idx->ents[i].size + 2047) / 2048;
+
+        while(nsect) {
+            cnt = nsect > INDEX_READ_SECTORS ? INDEX_READ_SECTORS : nsect;
+
+            sched_acquire(NULL, extent);
+            sched_account(extent, cnt);
+            rv = cdrom_read_sectors_ex(buf, extent + 150, cnt, true);
+            sched_release();
+
+            if(rv != ERR_OK)
+                goto fail;
+
+            for(s = 0; s < cnt; s++, size_left -= 2048) {
+                for(off = 0; off < 2048 && (int)off < size_left;) {
+                    de = (iso_dirent_t *)(buf + s * 2048 + off);
+
+                    if(!de->length)
+                        break;
+
+                    if(off + de->length > 2048 ||
+                       de->length < sizeof(iso_dirent_t) - 1 + de->name_len)
+                        goto fail;
+
+                    off += de->length;
+
+                    /* Skip . and .., and anything find_object() would */
+                    if((de->name_len == 1 && (uint8_t)de->name[0] <= 1) ||
+                       (de->flags != 0 && de->flags != 2))
+                        continue;
+
+                    if(!(len = index_name(de, name)))
+                        continue;
+
+                    if(index_add(idx, i, name, len, iso_733(de->extent),
+                                 iso_733(de->size), de->flags) < 0)
+                        goto fail;
+                }
+            }
+
+            extent += cnt;
+            nsect -= cnt;
+        }
+    }
+
+    free(buf);
+
+    /* Give back what the doubling didn't use; the buckets stay as they are */
+    if((buf = realloc(idx->ents, idx->count * sizeof(index_ent_t))))
+        idx->ents = (index_ent_t *)buf;
+
+    if(idx->pool_size && (buf = realloc(idx->pool, idx->pool_size)))
+        idx->pool = (char *)buf;
+
+    return idx;
+
+fail:
+    free(buf);
+    index_free(idx);
+    return NULL;
+}
+
+/* Check that an entry's full path is the one between fn and end */
+static bool index_match(const path_index_t *idx, const index_ent_t *e,
+                        const char *fn, const char *end) {
+    const char *start;
+    size_t i;
+
+    while(e->parent != INDEX_NONE) {
+        while(end > fn && end[-1] == '/')
+            end--;
+
+        for(start = end; start > fn && start[-1] != '/'; start--)
+            ;
+
+        if((size_t)(end - start) != e->namelen)
+            return false;
+
+        for(i = 0; i < e->namelen; i++) {
+            if(index_lower(start[i]) != idx->pool[e->name + i])
+                return false;
+        }
+
+        end = start;
+        e = &idx->ents[e->parent];
+    }
+
+    while(end > fn && end[-1] == '/')
+        end--;
+
+    return end == fn;
+}
+
+/* Look an object up in the index, the same way find_object_path() would
+   from the root. */
+static const index_ent_t *index_find(const path_index_t *idx, const char *fn,
+                                     int dir) {
+    const index_ent_t *e;
+    const char *p = fn;
+    uint32_t h = INDEX_ROOT_HASH, i;
+    size_t len;
+    bool trailing = true;
+
+    while(*p) {
+        if(*p == '/') {
+            p++;
+            trailing = true;
+            continue;
+        }
+
+        for(len = 0; p[len] && p[len] != '/'; len++)
+            ;
+
+        h = index_hash(h, p, len);
+        p += len;
+        trailing = false;
+    }
+
+    /* A path ending in a slash can only be a directory */
+    if(trailing && !dir)
+        return NULL;
+
+    for(i = idx->buckets[h & (idx->cap - 1)]; i != INDEX_NONE; i = e->next) {
+        e = &idx->ents[i];
+
+        if(e->hash == h && e->flags == (dir << 1) && index_match(idx, e, fn, p))
+            return e;
+    }
+
+    return NULL;
+}
+
+/* Throw away the index (if any) */
+static void index_drop(void) {
+    path_index_t *idx;
+
+    mutex_lock(&index_mutex);
+    idx = path_index;
+    path_index = NULL;
+    mutex_unlock(&index_mutex);
+
+    index_free(idx);
+}
+
+/* Index the disc, if the index is enabled. If that doesn't work out, lookups
+   search the directories like they would without it. */
+static void index_rebuild(void) {
+    path_index_t *idx;
+
+    index_drop();
+
+    if(!index_enabled)
+        return;
+
+    if(!(idx = index_build())) {
+        dbglog(DBG_WARNING, "fs_iso9660: can't index disc, searching "
+               "directories instead\n");
+        return;
+    }
+
+    dbglog(DBG_INFO, "fs_iso9660: indexed %u paths (%u bytes of names)\n",
+           (unsigned int)idx->count, (unsigned int)idx->pool_size);
+
+    mutex_lock(&index_mutex);
+    path_index = idx;
+    mutex_unlock(&index_mutex);
+}
+
+/* Locate an object by its full path, using the index if there is one. Gives
+   its extent and size in bytes. */
+static int iso_find(const char *fn, int dir, uint32_t *extent,
+                    uint32_t *size) {
+    const index_ent_t *e;
+    iso_dirent_t *de;
+
+    mutex_lock(&index_mutex);
+
+    if(path_index) {
+        /* The index has everything, so there's no need to look any further
+           if it's not there. */
+        if((e = index_find(path_index, fn, dir))) {
+            *extent = e->extent;
+            *size = e->size;
+        }
+
+        mutex_unlock(&index_mutex);
+        return e ? 0 : -1;
+    }
+
+    mutex_unlock(&index_mutex);
+
+    if(!(de = find_object_path(fn, dir, &root_dirent)))
+        return -1;
+
+    *extent = iso_733(de->extent);
+    *size = iso_733(de->size);
+    return 0;
+}
+
+int iso_index_enable(int enable) {
+    index_enabled = enable != 0;
+
+    if(!index_enabled)
+        index_drop();
+    else if(percd_done && !path_index)
+        index_rebuild();
+
+    return 0;
+}
+
 /********************************************************************************/
 /* File primitives */
 
+struct iso_rabuf;
+
 typedef struct iso_fd {
     TAILQ_ENTRY(iso_fd) next;   /* Next handle in the linked list */
     uint32_t first_extent;      /* First sector */
@@ -584,6 +1342,9 @@ typedef struct iso_fd {
     bool broken;                /* True if the CD has been swapped out since open */
     size_t stream_part;         /* Stream DMA part of 32 bytes */
     uint8_t alignas(32) stream_data[32];
+    size_t ra_sectors;          /* Readahead in sectors, or 0 for none */
+    struct iso_rabuf *ra;       /* Readahead buffer, if it has one */
+    iso_stats_t stats;
 } iso_fd_t;
 
 static TAILQ_HEAD(iso_fd_queue, iso_fd) iso_fd_queue;
@@ -606,24 +1367,184 @@ static inline void iso_break_all(void) {
     }
 }
 
-/* Abort the current stream. */
-static inline void iso_abort_stream(bool lock) {
+/* Stop the current stream, if there is one. Needs the drive. */
+static void iso_stream_stop(void) {
     if(stream_fd) {
-        if(lock)
-            mutex_lock(&fh_mutex);
-
         cdrom_stream_stop(false);
         stream_fd->stream_part = 0;
         stream_fd = NULL;
+    }
+}
+
+/* Abort the current stream. Only the thread with the drive can start one,
+   so if there's none now, there won't be one when we get the drive. */
+static void iso_abort_stream(void) {
+    if(stream_fd) {
+        sched_acquire(NULL, sched_head);
+        iso_stream_stop();
+        sched_release();
+    }
+}
+
+/* Readahead. Files with readahead turned on get their small reads from a
+   buffer that's filled with several sectors at once. The buffers are shared
+   by all files: a file keeps its buffer until another file needs one and
+   it's the one that's been used least recently. */
+
+#define RA_BUFFERS      4
+#define RA_MAX_SECTORS  (ISO_READAHEAD_MAX / 2048)
+
+typedef struct iso_rabuf {
+    TAILQ_ENTRY(iso_rabuf) lru;
+    iso_fd_t *owner;
+    uint32_t sector;            /* First sector held */
+    size_t cnt;                 /* Sectors held */
+    bool busy;                  /* Being filled */
+    uint8_t *data;
+} iso_rabuf_t;
+
+static TAILQ_HEAD(iso_rabuf_lru, iso_rabuf) ra_lru;    /* LRU first */
+static iso_rabuf_t *ra_bufs;
+static uint8_t *ra_data;
+
+/* Protects the readahead buffers and who owns them */
+static mutex_t ra_mutex;
+
+static int iso_ra_setup(void) {
+    int i;
+
+    mutex_lock_scoped(&ra_mutex);
+
+    if(ra_bufs)
+        return 0;
+
+    ra_data = aligned_alloc(32, RA_BUFFERS * ISO_READAHEAD_MAX);
+    ra_bufs = calloc(RA_BUFFERS, sizeof(iso_rabuf_t));
 
-        if(lock)
-            mutex_unlock(&fh_mutex);
+    if(!ra_data || !ra_bufs) {
+        free(ra_data);
+        free(ra_bufs);
+        ra_data = NULL;
+        ra_bufs = NULL;
+        return -1;
+    }
+
+    for(i = 0; i < RA_BUFFERS; i++) {
+        ra_bufs[i].data = ra_data + i * ISO_READAHEAD_MAX;
+        TAILQ_INSERT_TAIL(&ra_lru, &ra_bufs[i], lru);
     }
+
+    return 0;
+}
+
+/* Give up a file's readahead buffer */
+static void iso_ra_put(iso_fd_t *fd) {
+    mutex_lock_scoped(&ra_mutex);
+
+    if(fd->ra) {
+        fd->ra->owner = NULL;
+        fd->ra->cnt = 0;
+        fd->ra = NULL;
+    }
+}
+
+/* Forget everything that was read ahead, when the disc goes */
+static void iso_ra_clear(void) {
+    iso_rabuf_t *ra;
+
+    mutex_lock_scoped(&ra_mutex);
+
+    TAILQ_FOREACH(ra, &ra_lru, lru) {
+        if(ra->owner)
+            ra->owner->ra = NULL;
+
+        ra->owner = NULL;
+        ra->cnt = 0;
+    }
+}
+
+/* Copy what we can of a small read from the file's readahead buffer. If fill
+   is set (which needs the drive), the buffer is filled from the read position
+   first if it doesn't have it. Returns the number of bytes copied, 0 if the
+   buffer couldn't be used, or -1 if reading the disc failed. */
+static int iso_ra_read(iso_fd_t *fd, uint8_t *outbuf, size_t toread,
+                       bool fill) {
+    iso_rabuf_t *ra;
+    uint32_t sector = fd->first_extent + fd->ptr / 2048;
+    size_t off, cnt;
+    int rv;
+
+    mutex_lock(&ra_mutex);
+    ra = fd->ra;
+
+    if(!ra || ra->busy || sector < ra->sector || sector >= ra->sector + ra->cnt) {
+        if(!fill)
+            goto none;
+
+        if(!ra) {
+            TAILQ_FOREACH(ra, &ra_lru, lru) {
+                if(!ra->busy)
+                    break;
+            }
+
+            if(!ra)
+                goto none;
+
+            if(ra->owner)
+                ra->owner->ra = NULL;
+
+            ra->owner = fd;
+            fd->ra = ra;
+        }
+
+        ra->busy = true;
+        ra->cnt = 0;
+        mutex_unlock(&ra_mutex);
+
+        cnt = (fd->size + 2047) / 2048 - fd->ptr / 2048;
+
+        if(cnt > fd->ra_sectors)
+            cnt = fd->ra_sectors;
+
+        sched_account(sector, cnt);
+        rv = cdrom_read_sectors_ex(ra->data, sector + 150, cnt, true);
+
+        mutex_lock(&ra_mutex);
+        ra->busy = false;
+
+        if(rv != ERR_OK) {
+            mutex_unlock(&ra_mutex);
+            return -1;
+        }
+
+        ra->sector = sector;
+        ra->cnt = cnt;
+    }
+    else {
+        fd->stats.ra_hits++;
+    }
+
+    off = (sector - ra->sector) * 2048 + fd->ptr % 2048;
+
+    if(toread > ra->cnt * 2048 - off)
+        toread = ra->cnt * 2048 - off;
+
+    memcpy(outbuf, ra->data + off, toread);
+
+    TAILQ_REMOVE(&ra_lru, ra, lru);
+    TAILQ_INSERT_TAIL(&ra_lru, ra, lru);
+
+    mutex_unlock(&ra_mutex);
+    return (int)toread;
+
+none:
+    mutex_unlock(&ra_mutex);
+    return 0;
 }
 
 /* Open a file or directory */
 static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
-    iso_dirent_t    *de;
+    uint32_t extent, size;
     iso_fd_t *fd;
 
     (void)vfs;
@@ -643,9 +1564,7 @@ static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
     percd_done = true;
 
     /* Find the file we want */
-    de = find_object_path(fn, (mode & O_DIR) ? 1 : 0, &root_dirent);
-
-    if(!de) {
+    if(iso_find(fn, (mode & O_DIR) ? 1 : 0, &extent, &size) < 0) {
         errno = ENOENT;
         return 0;
     }
@@ -658,9 +1577,9 @@ static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
 
     /* Fill in the file handle and return the fd */
     *fd = (iso_fd_t){
-        .first_extent = iso_733(de->extent),
+        .first_extent = extent,
         .dir = (mode & O_DIR) != 0,
-        .size = iso_733(de->size),
+        .size = size,
         .broken = false,
         .stream_part = 0,
         .stream_data = {0},
@@ -677,13 +1596,21 @@ static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
 static int iso_close(void * h) {
     iso_fd_t *fd = (iso_fd_t *)h;
 
-    mutex_lock_scoped(&fh_mutex);
+    sched_acquire(NULL, sched_head);
 
     if(fd == stream_fd) {
-        iso_abort_stream(false);
+        iso_stream_stop();
         // dbglog(DBG_DEBUG, "Stream stop on close, fd=%p\n", fd);
     }
 
+    if(sched_last == &fd->stats)
+        sched_last = NULL;
+
+    sched_release();
+    iso_ra_put(fd);
+
+    mutex_lock_scoped(&fh_mutex);
+
     TAILQ_REMOVE(&iso_fd_queue, fd, next);
     free(fd);
 
@@ -697,10 +1624,13 @@ static int iso_stream_done(size_t *remain_size) {
 /* Read from a file */
 static ssize_t iso_read(void *h, void *buf, size_t bytes) {
     int rv, c;
+    cache_block_t *blk;
     size_t toread, thissect;
     uint8_t *outbuf;
     size_t remain_size = 0, req_size;
     uint32_t sector;
+    uint64_t start;
+    bool drive = false;
     iso_fd_t *fd = (iso_fd_t *)h;
 
     /* Check that the fd is valid */
@@ -711,7 +1641,7 @@ static ssize_t iso_read(void *h, void *buf, size_t bytes) {
 
     rv = 0;
     outbuf = (uint8_t *)buf;
-    mutex_lock(&fh_mutex);
+    start = timer_us_gettime64();
 
     /* Read zero or more sectors into the buffer from the current pos */
     while(bytes > 0) {
@@ -720,6 +1650,34 @@ static ssize_t iso_read(void *h, void *buf, size_t bytes) {
 
         if(toread == 0) break;
 
+        /* Small reads come from the readahead buffer when they can, without
+           waiting for the drive. */
+        if(fd->ra_sectors && toread < fd->ra_sectors * 2048 &&
+           stream_fd != fd && !fd->stream_part) {
+            c = iso_ra_read(fd, outbuf, toread, drive);
+
+            if(!c && !drive) {
+                sched_acquire(&fd->stats, fd->first_extent + fd->ptr / 2048);
+                drive = true;
+                c = iso_ra_read(fd, outbuf, toread, true);
+            }
+
+            if(c < 0) {
+                goto read_error;
+            }
+            else if(c > 0) {
+                toread = c;
+                goto end_loop;
+            }
+
+            /* No buffer to be had, so read it the usual way */
+        }
+
+        if(!drive) {
+            sched_acquire(&fd->stats, fd->first_extent + fd->ptr / 2048);
+            drive = true;
+        }
+
         /* If we have partial data from a stream, use it */
         if(fd->stream_part > 0) {
             size_t avail = 32 - fd->stream_part;
@@ -754,16 +1712,19 @@ static ssize_t iso_read(void *h, void *buf, size_t bytes) {
                 // dbglog(DBG_DEBUG, "Stream request: read=%d remain=%d out=%p fd=%p\n",
                 //         toread, remain_size, outbuf, fd);
             }
-            else if(thissect == 2048) {
+            else if(thissect == 2048 && sched_last == &fd->stats) {
+                /* Only start a stream if we were the last to use the drive.
+                   If another file is reading at the same time, the next thing
+                   it does would stop the stream again, and the two would take
+                   turns restarting theirs; plain reads cost no more than that.
+                   The last command being ours also means there's no other
+                   file's stream left to stop. */
                 req_size = (fd->size - fd->ptr);
 
                 if(req_size & 2047) {
                     req_size = (req_size + 2048) & ~2047;
                 }
-                if(stream_fd) {
-                    iso_abort_stream(false);
-                    // dbglog(DBG_DEBUG, "Stream stop for file fd: %p -> %p\n", stream_fd, fd);
-                }
+                sched_account(sector, 0);
                 c = cdrom_stream_start(sector + 150, req_size / 2048, true);
 
                 if(c) {
@@ -789,9 +1750,10 @@ static ssize_t iso_read(void *h, void *buf, size_t bytes) {
             }
 
             if(remain_size == 0) {
-                iso_abort_stream(false);
+                iso_stream_stop();
                 // dbglog(DBG_DEBUG, "Stream stop on end, fd=%p\n", fd);
             }
+            sched_head = fd->first_extent + (fd->ptr + toread) / 2048;
             goto end_loop;
         }
         else if(stream_fd == fd && toread < 32) {
@@ -812,9 +1774,10 @@ static ssize_t iso_read(void *h, void *buf, size_t bytes) {
             //         toread, remain_size, fd->stream_part, outbuf, fd);
 
             if(remain_size == 0) {
-                iso_abort_stream(false);
+                iso_stream_stop();
                 // dbglog(DBG_DEBUG, "Stream stop on end, fd=%p\n", fd);
             }
+            sched_head = fd->first_extent + (fd->ptr + toread) / 2048;
             goto end_loop;
         }
 
@@ -826,20 +1789,29 @@ read_loop:
             /* Round it off to an even sector count. */
             thissect = toread / 2048;
             toread = thissect * 2048;
+            sched_account(sector, thissect);
             c = cdrom_read_sectors_ex(outbuf, sector + 150, thissect, true);
 
             if(c) {
                 goto read_error;
             }
         }
+        else if(fd->ra_sectors &&
+                (c = iso_ra_read(fd, outbuf, toread, true)) != 0) {
+            if(c < 0) {
+                goto read_error;
+            }
+
+            toread = c;
+        }
         else {
             toread = (toread > thissect) ? thissect : toread;
-            c = bdread(sector);
+            blk = bdread(sector, (fd->size - (fd->ptr & ~2047) + 2047) / 2048);
 
-            if(c < 0) {
+            if(!blk) {
                 goto read_error;
             }
-            memcpy(outbuf, dcache[c]->data + (fd->ptr % 2048), toread);
+            memcpy(outbuf, blk->data + (fd->ptr % 2048), toread);
         }
 
 end_loop:
@@ -850,12 +1822,18 @@ end_loop:
         rv += toread;
     }
 
-    mutex_unlock(&fh_mutex);
+    if(drive)
+        sched_release();
+
+    fd->stats.bytes += rv;
+    fd->stats.time_us += timer_us_gettime64() - start;
     return rv;
 
 read_error:
+    if(drive)
+        sched_release();
+
     errno = EIO;
-    mutex_unlock(&fh_mutex);
     return -1;
 }
 
@@ -909,7 +1887,12 @@ static off_t iso_seek(void * h, off_t offset, int whence) {
     if(fd->ptr > fd->size) fd->ptr = fd->size;
 
     if(fd == stream_fd && old_ptr != fd->ptr) {
-        iso_abort_stream(true);
+        sched_acquire(NULL, sched_head);
+
+        if(fd == stream_fd)
+            iso_stream_stop();
+
+        sched_release();
         // dbglog(DBG_DEBUG, "Stream stop on seek: %ld != %ld\n", old_ptr, fd->ptr);
     }
 
@@ -960,7 +1943,7 @@ static void fn_postprocess(char *fnin) {
 
 /* Read a directory entry */
 static const dirent_t *iso_readdir(void * h) {
-    int     c;
+    cache_block_t   *c;
     iso_dirent_t    *de;
 
     /* RockRidge */
@@ -976,16 +1959,16 @@ static const dirent_t *iso_readdir(void * h) {
 
     /* Scan forwards until we find the next valid entry, an
        end-of-entry mark, or run out of dir size. */
-    c = -1;
+    c = NULL;
     de = NULL;
 
     while(fd->ptr < fd->size) {
         /* Get the current dirent block */
         c = biread(fd->first_extent + fd->ptr / 2048);
 
-        if(c < 0) return NULL;
+        if(!c) return NULL;
 
-        de = (iso_dirent_t *)(icache[c]->data + (fd->ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fd->ptr % 2048));
 
         if(de->length) break;
 
@@ -998,9 +1981,9 @@ static const dirent_t *iso_readdir(void * h) {
     /* If we're at the first, skip the two blank entries */
     if(!de->name[0] && de->name_len == 1) {
         fd->ptr += de->length;
-        de = (iso_dirent_t *)(icache[c]->data + (fd->ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fd->ptr % 2048));
         fd->ptr += de->length;
-        de = (iso_dirent_t *)(icache[c]->data + (fd->ptr % 2048));
+        de = (iso_dirent_t *)(c->data + (fd->ptr % 2048));
 
         if(!de->length) return NULL;
     }
@@ -1051,6 +2034,8 @@ static const dirent_t *iso_readdir(void * h) {
 static int iso_ioctl(void *h, int cmd, va_list ap) {
     iso_fd_t *fd = (iso_fd_t *)h;
     void *arg = va_arg(ap, void*);
+    iso_stats_t *st;
+    uint32_t size;
 
     switch(cmd) {
         case IOCTL_FS_ROOTBUS_DMA_READY:
@@ -1061,6 +2046,39 @@ static int iso_ioctl(void *h, int cmd, va_list ap) {
                 return (fd->ptr & 31) ? -1 : 0;
             }
             return (fd->ptr & 2047) ? -1 : 0;
+        case IOCTL_ISO9660_READAHEAD:
+            if(arg == NULL || fd->dir) {
+                errno = EINVAL;
+                return -1;
+            }
+
+            size = *(uint32_t *)arg;
+
+            if(size > ISO_READAHEAD_MAX)
+                size = ISO_READAHEAD_MAX;
+
+            if(size && iso_ra_setup() < 0) {
+                errno = ENOMEM;
+                return -1;
+            }
+
+            fd->ra_sectors = (size + 2047) / 2048;
+
+            if(!fd->ra_sectors)
+                iso_ra_put(fd);
+
+            return 0;
+        case IOCTL_ISO9660_STATS:
+            if(arg == NULL) {
+                errno = EINVAL;
+                return -1;
+            }
+
+            st = (iso_stats_t *)arg;
+            *st = fd->stats;
+            st->bytes_per_sec = st->time_us ?
+                                st->bytes * 1000000 / st->time_us : 0;
+            return 0;
         default:
             errno = EINVAL;
             return -1;
@@ -1083,7 +2101,9 @@ static int iso_rewinddir(void * h) {
 int iso_reset(void) {
     iso_break_all();
     bclear();
-    iso_abort_stream(false);
+    iso_abort_stream();
+    iso_ra_clear();
+    index_drop();
     percd_done = false;
     return 0;
 }
@@ -1116,7 +2136,7 @@ static void iso_vblank(uint32_t evt, void *data) {
 static int iso_stat(vfs_handler_t *vfs, const char *path, struct stat *st,
                     int flag) {
     mode_t md;
-    iso_dirent_t *de;
+    uint32_t extent, size;
     size_t len = strlen(path);
 
     (void)vfs;
@@ -1143,25 +2163,23 @@ static int iso_stat(vfs_handler_t *vfs, const char *path, struct stat *st,
     percd_done = true;
 
     /* First try opening as a file */
-    de = find_object_path(path, 0, &root_dirent);
     md = S_IFREG;
 
     /* If we couldn't get it as a file, try as a directory */
-    if(!de) {
-        de = find_object_path(path, 1, &root_dirent);
+    if(iso_find(path, 0, &extent, &size) < 0) {
         md = S_IFDIR;
-    }
 
-    /* If we still don't have it, then we're not going to get it. */
-    if(!de) {
-        errno = ENOENT;
-        return -1;
+        /* If we still don't have it, then we're not going to get it. */
+        if(iso_find(path, 1, &extent, &size) < 0) {
+            errno = ENOENT;
+            return -1;
+        }
     }
 
     memset(st, 0, sizeof(struct stat));
     st->st_dev = (dev_t)('c' | ('d' << 8));
     st->st_mode = md | S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR | S_IXGRP | S_IXOTH;
-    st->st_size = (md == S_IFDIR) ? -1 : (int)iso_733(de->size);
+    st->st_size = (md == S_IFDIR) ? -1 : (int)size;
     st->st_nlink = (md == S_IFDIR) ? 2 : 1;
     st->st_blksize = 512;
 
@@ -1264,27 +2282,22 @@ static vfs_handler_t vh = {
 
 /* Initialize the file system */
 void fs_iso9660_init(void) {
-    int i;
-
     /* Init the linked list */
     TAILQ_INIT(&iso_fd_queue);
 
     /* Init thread mutexes */
     mutex_init(&cache_mutex, MUTEX_TYPE_NORMAL);
     mutex_init(&fh_mutex, MUTEX_TYPE_NORMAL);
+    mutex_init(&index_mutex, MUTEX_TYPE_NORMAL);
+    mutex_init(&sched_mutex, MUTEX_TYPE_NORMAL);
+    mutex_init(&ra_mutex, MUTEX_TYPE_NORMAL);
+    cond_init(&sched_cv);
+    TAILQ_INIT(&sched_waiters);
+    TAILQ_INIT(&ra_lru);
 
-    /* Allocate cache block space, properly aligned for DMA access */
-    cache_data = aligned_alloc(32, 2 * NUM_CACHE_BLOCKS * 2048);
-    caches = malloc(2 * NUM_CACHE_BLOCKS * sizeof(cache_block_t));
-
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        icache[i] = &caches[i * 2];
-        icache[i]->data = &cache_data[i * 2 * 2048];
-        icache[i]->sector = -1;
-        dcache[i] = &caches[i * 2 + 1];
-        dcache[i]->data = &cache_data[i * 2 * 2048 + 2048];
-        dcache[i]->sector = -1;
-    }
+    /* Allocate the block cache */
+    bsetup(CACHE_BLOCKS, CACHE_QUOTA, CACHE_QUOTA);
+    cache_fill_buf = aligned_alloc(32, CACHE_FILL * 2048);
 
     percd_done = false;
     iso_last_status = -1;
@@ -1302,12 +2315,26 @@ void fs_iso9660_shutdown(void) {
     vblank_handler_remove(iso_vblank_hnd);
 
     /* Dealloc cache block space */
+    free(cache_buckets);
     free(cache_data);
     free(caches);
+    free(cache_fill_buf);
+    cache_buckets = NULL;
+    cache_data = NULL;
+    caches = NULL;
+    index_drop();
+    free(ra_data);
+    free(ra_bufs);
+    ra_data = NULL;
+    ra_bufs = NULL;
 
     /* Free muteces */
     mutex_destroy(&cache_mutex);
     mutex_destroy(&fh_mutex);
+    mutex_destroy(&index_mutex);
+    mutex_destroy(&sched_mutex);
+    mutex_destroy(&ra_mutex);
+    cond_destroy(&sched_cv);
 
     nmmgr_handler_remove(&vh.nmmgr);
 }
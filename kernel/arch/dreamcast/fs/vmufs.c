@@ -5,6 +5,7 @@
 
 */
 
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +28,11 @@ back data (or have written it). There are no handles involved or anything
 else like that. The new fs_vmu sits on top of this and provides a (mostly)
 nice VFS interface similar to the old fs_vmu.
 
+The one exception is that the higher level functions keep a copy of each
+card's root block, directory and FAT between calls, rather than reading them
+all over maple every time. That copy is thrown away whenever the card is
+plugged or unplugged (see vmufs_cache_invalidate()).
+
 This module tends to do more work than it really needs to for some
 functions (like reading a named file) but it does it that way to have very
 clear, concise code that can be audited for bugs more easily. It's not
@@ -48,6 +54,16 @@ Function comments located in vmufs.h.
    be much of an issue :) */
 static mutex_t mutex;
 
+/* Bumped whenever a card comes or goes, or its metadata gets written behind
+   the cache's back. This can happen from the maple IRQ, so we don't take the
+   mutex for it; vmufs_setup() compares it against the value it saw when the
+   cache was filled. */
+static atomic_uint cache_gen[MAPLE_PORT_COUNT][MAPLE_UNIT_COUNT];
+
+void vmufs_cache_invalidate(maple_device_t *dev) {
+    atomic_fetch_add(&cache_gen[dev->port][dev->unit], 1);
+}
+
 /* Convert a decimal number to BCD; max of two digits */
 static uint8_t __pure dec_to_bcd(int dec) {
     uint8_t rv = 0;
@@ -88,6 +104,8 @@ int vmufs_root_read(maple_device_t *dev, vmu_root_t *root_buf) {
 }
 
 int vmufs_root_write(maple_device_t *dev, vmu_root_t *root_buf) {
+    vmufs_cache_invalidate(dev);
+
     /* XXX: Assume root is at 255.. is there some way to figure this out dynamically? */
     if(vmu_block_write(dev, 255, (uint8_t *)root_buf) != 0) {
         dbglog(DBG_ERROR, "vmufs_root_write: can't write block %d on device %c%c\n",
@@ -159,6 +177,7 @@ int vmufs_dir_read(maple_device_t *dev, vmu_root_t *root, vmu_dir_t *dir_buf) {
 }
 
 int vmufs_dir_write(maple_device_t *dev, vmu_root_t *root, vmu_dir_t *dir_buf) {
+    vmufs_cache_invalidate(dev);
     return vmufs_dir_ops(dev, root, dir_buf, true);
 }
 
@@ -199,6 +218,7 @@ int vmufs_fat_read(maple_device_t *dev, vmu_root_t *root, uint16_t *fat_buf) {
 }
 
 int vmufs_fat_write(maple_device_t *dev, vmu_root_t *root, uint16_t *fat_buf) {
+    vmufs_cache_invalidate(dev);
     return vmufs_fat_ops(dev, root, fat_buf, true);
 }
 
@@ -478,9 +498,100 @@ int vmufs_mutex_unlock(void) {
 
 /* ****************** Higher level functions ******************** */
 
-/* Internal function gets everything setup for you */
-static int vmufs_setup(maple_device_t *dev, vmu_root_t *root, vmu_dir_t **dir, int *dirsize,
-                       uint16_t **fat, int *fatsize) {
+/* Everything the higher level functions need to know about one card. The
+   directory and FAT are kept exactly as they would be on the card once the
+   dirty dir blocks and FAT have been written back. */
+typedef struct vmufs_cache {
+    bool        valid;
+    unsigned int gen;       /* cache_gen when this was read */
+    vmu_root_t  root;
+    vmu_dir_t   *dir;
+    int         dirsize;
+    uint16_t    *fat;
+    int         fatsize;
+    bool        fat_dirty;
+} vmufs_cache_t;
+
+static vmufs_cache_t cache[MAPLE_PORT_COUNT][MAPLE_UNIT_COUNT];
+
+/* Forget what we know about a card. This is what happens when anything goes
+   wrong part way through a change, since our copy may not match the card
+   any more. */
+static void vmufs_cache_drop(vmufs_cache_t *c) {
+    free(c->dir);
+    free(c->fat);
+    c->dir = NULL;
+    c->fat = NULL;
+    c->valid = false;
+}
+
+/* Read a card's metadata into its cache */
+static int vmufs_cache_fill(maple_device_t *dev, vmufs_cache_t *c) {
+    int i;
+
+    /* Anything that happens while we're reading makes this stale */
+    c->gen = atomic_load(&cache_gen[dev->port][dev->unit]);
+
+    if(vmufs_root_read(dev, &c->root) < 0)
+        return -1;
+
+    /* Alloc enough space for the whole dir */
+    c->dirsize = vmufs_dir_blocks(&c->root);
+    c->dir = (vmu_dir_t *)calloc(1, c->dirsize);
+
+    if(!c->dir) {
+        dbglog(DBG_ERROR, "vmufs_setup: can't alloc %d bytes for dir on device %c%c\n",
+               c->dirsize, dev->port + 'A', dev->unit + '0');
+        return -1;
+    }
+
+    if(vmufs_dir_ops(dev, &c->root, c->dir, false) < 0)
+        return -1;
+
+    /* Loaded entries should never be dirty, but make sure */
+    for(i = 0; i < c->dirsize / (int)sizeof(vmu_dir_t); i++)
+        c->dir[i].dirty = 0;
+
+    /* Alloc enough space for the fat */
+    c->fatsize = vmufs_fat_blocks(&c->root);
+    c->fat = (uint16_t *)malloc(c->fatsize);
+
+    if(!c->fat) {
+        dbglog(DBG_ERROR, "vmufs_setup: can't alloc %d bytes for FAT on device %c%c\n",
+               c->fatsize, dev->port + 'A', dev->unit + '0');
+        return -1;
+    }
+
+    if(vmufs_fat_ops(dev, &c->root, c->fat, false) < 0)
+        return -1;
+
+    c->fat_dirty = false;
+    c->valid = true;
+    return 0;
+}
+
+/* Write back the FAT, if it has changed */
+static int vmufs_cache_write_fat(maple_device_t *dev, vmufs_cache_t *c) {
+    if(!c->fat_dirty)
+        return 0;
+
+    if(vmufs_fat_ops(dev, &c->root, c->fat, true) < 0)
+        return -1;
+
+    c->fat_dirty = false;
+    return 0;
+}
+
+/* Write back the dir blocks that have dirty entries */
+static int vmufs_cache_write_dir(maple_device_t *dev, vmufs_cache_t *c) {
+    return vmufs_dir_ops(dev, &c->root, c->dir, true);
+}
+
+/* Internal function gets everything setup for you. On success, returns the
+   card's metadata with the mutex held. */
+static vmufs_cache_t *vmufs_setup(maple_device_t *dev) {
+    vmufs_cache_t *c;
+
     /* Check to make sure this is a valid device right now */
     if(!dev || !(dev->info.functions & MAPLE_FUNC_MEMCARD)) {
         if(!dev)
@@ -489,124 +600,74 @@ static int vmufs_setup(maple_device_t *dev, vmu_root_t *root, vmu_dir_t **dir, i
             dbglog(DBG_ERROR, "vmufs_setup: device %c%c is not a memory card\n",
                    dev->port + 'A', dev->unit + '0');
 
-        return -1;
+        return NULL;
     }
 
     vmufs_mutex_lock();
 
-    /* Read its root block */
-    if(!root || vmufs_root_read(dev, root) < 0)
-        goto dead;
-
-    if(dir) {
-        /* Alloc enough space for the whole dir */
-        *dirsize = vmufs_dir_blocks(root);
-        *dir = (vmu_dir_t *)malloc(*dirsize);
-
-        if(!*dir) {
-            dbglog(DBG_ERROR, "vmufs_setup: can't alloc %d bytes for dir on device %c%c\n",
-                   *dirsize, dev->port + 'A', dev->unit + '0');
-            goto dead;
-        }
-
-        /* Ensure that the dir is 0'd to avoid possible uninitialized reads */
-        memset(*dir, 0, sizeof(*dirsize));
-
-        /* Read it */
-        if(vmufs_dir_read(dev, root, *dir) < 0) {
-            free(*dir);
-            *dir = NULL;
-            goto dead;
-        }
-    }
-
-    if(fat) {
-        /* Alloc enough space for the fat */
-        *fatsize = vmufs_fat_blocks(root);
-        *fat = (uint16_t *)malloc(*fatsize);
+    c = &cache[dev->port][dev->unit];
 
-        if(!*fat) {
-            dbglog(DBG_ERROR, "vmufs_setup: can't alloc %d bytes for FAT on device %c%c\n",
-                   *fatsize, dev->port + 'A', dev->unit + '0');
-            if(dir)
-                free(*dir);
-            goto dead;
-        }
+    /* Has the card been swapped since we last looked? */
+    if(c->valid && c->gen != atomic_load(&cache_gen[dev->port][dev->unit]))
+        vmufs_cache_drop(c);
 
-        /* Read it */
-        if(vmufs_fat_read(dev, root, *fat) < 0) {
-            free(*fat);
-            if(dir)
-                free(*dir);
-            goto dead;
-        }
+    if(!c->valid && vmufs_cache_fill(dev, c) < 0) {
+        vmufs_cache_drop(c);
+        vmufs_mutex_unlock();
+        return NULL;
     }
 
     /* Ok, everything's cool */
-    return 0;
-
-dead:
-    vmufs_mutex_unlock();
-    return -1;
+    return c;
 }
 
 /* Internal function to tear everything down for you */
-static void vmufs_teardown(vmu_dir_t *dir, uint16_t *fat) {
-    if(dir)
-        free(dir);
-
-    if(fat)
-        free(fat);
-
+static void vmufs_teardown(void) {
     vmufs_mutex_unlock();
 }
 
 int vmufs_readdir(maple_device_t *dev, vmu_dir_t **outbuf, int *outcnt) {
-    vmu_root_t root;
-    vmu_dir_t *dir;
-    int dircnt = 0, dirsize, rv = 0;
+    vmufs_cache_t *c;
+    int dircnt = 0, rv = 0;
+    size_t i, dcnt;
 
     *outbuf = NULL;
     *outcnt = 0;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, &dir, &dirsize, NULL, NULL) < 0)
+    if(!(c = vmufs_setup(dev)))
         return -1;
 
-    /* Go through and move all entries to the lowest-numbered spots. */
-    for(size_t i = 0; i < dirsize / sizeof(vmu_dir_t); i++) {
-        /* Skip blanks */
-        if(dir[i].filetype == 0)
-            continue;
+    dcnt = c->dirsize / sizeof(vmu_dir_t);
 
-        /* Not a blank -- look for an earlier slot that's empty. If
-           we don't find one, just leave it alone. */
-        for(size_t j = 0; j < i; j++) {
-            if(dir[j].filetype == 0) {
-                memcpy(dir + j, dir + i, sizeof(vmu_dir_t));
-                dir[i].filetype = 0;
-                break;
-            }
-        }
-
-        /* Update the entry count */
-        dircnt++;
+    for(i = 0; i < dcnt; i++) {
+        if(c->dir[i].filetype != 0)
+            dircnt++;
     }
 
-    /* Resize the buffer to match the number of entries */
-    *outcnt = dircnt;
-    *outbuf = (vmu_dir_t *)realloc(dir, dircnt * sizeof(vmu_dir_t));
+    if(!dircnt)
+        goto ex;
+
+    *outbuf = (vmu_dir_t *)malloc(dircnt * sizeof(vmu_dir_t));
 
-    if(!*outbuf && dircnt) {
-        dbglog(DBG_ERROR, "vmufs_readdir: can't realloc %d bytes for dir on device %c%c\n",
+    if(!*outbuf) {
+        dbglog(DBG_ERROR, "vmufs_readdir: can't alloc %d bytes for dir on device %c%c\n",
                dircnt * sizeof(vmu_dir_t), dev->port + 'A', dev->unit + '0');
-        free(dir);
         rv = -2;
         goto ex;
     }
 
+    /* Copy out the entries, skipping the blanks */
+    *outcnt = dircnt;
+    dircnt = 0;
+
+    for(i = 0; i < dcnt; i++) {
+        if(c->dir[i].filetype != 0)
+            memcpy(*outbuf + dircnt++, c->dir + i, sizeof(vmu_dir_t));
+    }
+
 ex:
-    vmufs_teardown(NULL, NULL);
+    vmufs_teardown();
     return rv;
 }
 
@@ -634,20 +695,18 @@ static int vmufs_read_common(maple_device_t *dev, vmu_dir_t *dirent, uint16_t *f
 }
 
 int vmufs_read(maple_device_t *dev, const char *fn, void **outbuf, int *outsize) {
-    vmu_root_t  root;
-    vmu_dir_t   *dir = NULL;
-    uint16_t    *fat = NULL;
-    int     fatsize, dirsize, idx, rv = 0;
+    vmufs_cache_t *c;
+    int     idx, rv = 0;
 
     *outbuf = NULL;
     *outsize = 0;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, &dir, &dirsize, &fat, &fatsize) < 0)
+    if(!(c = vmufs_setup(dev)))
         return -1;
 
     /* Look for the file we want */
-    idx = vmufs_dir_find(&root, dir, fn);
+    idx = vmufs_dir_find(&c->root, c->dir, fn);
 
     if(idx < 0) {
         //dbglog(DBG_ERROR, "vmufs_read: can't find file '%s' on device %c%c\n",
@@ -656,41 +715,39 @@ int vmufs_read(maple_device_t *dev, const char *fn, void **outbuf, int *outsize)
         goto ex;
     }
 
-    if(vmufs_read_common(dev, dir + idx, fat, outbuf, outsize) < 0) {
+    if(vmufs_read_common(dev, c->dir + idx, c->fat, outbuf, outsize) < 0) {
         rv = -3;
         goto ex;
     }
 
 ex:
-    vmufs_teardown(dir, fat);
+    vmufs_teardown();
     return rv;
 }
 
 int vmufs_read_dirent(maple_device_t *dev, vmu_dir_t *dirent, void **outbuf, int *outsize) {
-    vmu_root_t  root;
-    uint16_t      *fat = NULL;
-    int     fatsize, rv = 0;
+    vmufs_cache_t *c;
+    int     rv = 0;
 
     *outbuf = NULL;
     *outsize = 0;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, NULL, NULL, &fat, &fatsize) < 0)
+    if(!(c = vmufs_setup(dev)))
         return -1;
 
-    if(vmufs_read_common(dev, dirent, fat, outbuf, outsize) < 0)
+    if(vmufs_read_common(dev, dirent, c->fat, outbuf, outsize) < 0)
         rv = -2;
 
-    vmufs_teardown(NULL, fat);
+    vmufs_teardown();
     return rv;
 }
 
 /* Returns 0 for success, -7 for 'not enough space', and other values for other errors. :-)  */
 int vmufs_write(maple_device_t *dev, const char *fn, void *inbuf, int insize, int flags) {
-    vmu_root_t  root;
-    vmu_dir_t   *dir = NULL, nd;
-    uint16_t    *fat = NULL;
-    int     oldinsize, fatsize, dirsize, idx, rv = 0, st, fnlength;
+    vmufs_cache_t *c;
+    vmu_dir_t   nd;
+    int     oldinsize, idx, rv = 0, st, fnlength;
 
     /* Round up the size if necessary */
     oldinsize = insize;
@@ -704,11 +761,11 @@ int vmufs_write(maple_device_t *dev, const char *fn, void *inbuf, int insize, in
     }
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, &dir, &dirsize, &fat, &fatsize) < 0)
+    if(!(c = vmufs_setup(dev)))
         return -1;
 
     /* Check if the file already exists */
-    idx = vmufs_dir_find(&root, dir, fn);
+    idx = vmufs_dir_find(&c->root, c->dir, fn);
 
     if(idx >= 0) {
         if(!(flags & VMUFS_OVERWRITE)) {
@@ -718,7 +775,7 @@ int vmufs_write(maple_device_t *dev, const char *fn, void *inbuf, int insize, in
             goto ex;
         }
         else {
-            if(vmufs_file_delete(&root, fat, dir, fn) < 0) {
+            if(vmufs_file_delete(&c->root, c->fat, c->dir, fn) < 0) {
                 dbglog(DBG_ERROR, "vmufs_write: can't delete old file '%s' on device %c%c\n",
                        fn, dev->port + 'A', dev->unit + '0');
                 rv = -3;
@@ -748,7 +805,9 @@ int vmufs_write(maple_device_t *dev, const char *fn, void *inbuf, int insize, in
     // If any of these fail, the action to take can be decided by the caller.
 
     /* Write out the data and update our structs */
-    if((st = vmufs_file_write(dev, &root, fat, dir, &nd, inbuf, insize / 512)) < 0) {
+    c->fat_dirty = true;
+
+    if((st = vmufs_file_write(dev, &c->root, c->fat, c->dir, &nd, inbuf, insize / 512)) < 0) {
         if(st == -2)
             rv = -7;
         else
@@ -757,7 +816,7 @@ int vmufs_write(maple_device_t *dev, const char *fn, void *inbuf, int insize, in
     }
 
     /* Ok, everything's looking good so far.. update the FAT */
-    if(vmufs_fat_write(dev, &root, fat) < 0) {
+    if(vmufs_cache_write_fat(dev, c) < 0) {
         rv = -5;
         goto ex;
     }
@@ -765,7 +824,7 @@ int vmufs_write(maple_device_t *dev, const char *fn, void *inbuf, int insize, in
     /* This is the critical point. If the dir doesn't save correctly, then
        we may have an unusable card (until it's reformatted) or leaked
        blocks not attached to a file. Cross your fingers! */
-    if(vmufs_dir_write(dev, &root, dir) < 0) {
+    if(vmufs_cache_write_dir(dev, c) < 0) {
         /* doh! */
         dbglog(DBG_ERROR, "vmufs_write: warning, card may be corrupted or leaking blocks!\n");
         rv = -6;
@@ -774,27 +833,32 @@ int vmufs_write(maple_device_t *dev, const char *fn, void *inbuf, int insize, in
 
     /* Looks like everything was good */
 ex:
-    vmufs_teardown(dir, fat);
+    /* Our copy of the metadata may have been changed without being written
+       back, so get it from the card next time. */
+    if(rv < 0 && rv != -2)
+        vmufs_cache_drop(c);
+
+    vmufs_teardown();
     return rv;
 }
 
 int vmufs_delete(maple_device_t *dev, const char *fn) {
-    vmu_root_t  root;
-    vmu_dir_t   *dir = NULL;
-    uint16_t    *fat = NULL;
-    int     fatsize, dirsize, rv = 0;
+    vmufs_cache_t *c;
+    int     rv = 0;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, &dir, &dirsize, &fat, &fatsize) < 0)
+    if(!(c = vmufs_setup(dev)))
         return -2;
 
     /* Ok, try to delete the file */
-    rv = vmufs_file_delete(&root, fat, dir, fn);
+    rv = vmufs_file_delete(&c->root, c->fat, c->dir, fn);
 
     if(rv < 0) goto ex;
 
+    c->fat_dirty = true;
+
     /* If we succeeded, write back the dir and fat */
-    if(vmufs_dir_write(dev, &root, dir) < 0) {
+    if(vmufs_cache_write_dir(dev, c) < 0) {
         rv = -2;
         goto ex;
     }
@@ -802,7 +866,7 @@ int vmufs_delete(maple_device_t *dev, const char *fn) {
     /* This is the critical point. If the fat doesn't save correctly, then
        we may have an unusable card (until it's reformatted) or leaked
        blocks not attached to a file. Cross your fingers! */
-    if(vmufs_fat_write(dev, &root, fat) < 0) {
+    if(vmufs_cache_write_fat(dev, c) < 0) {
         /* doh! */
         dbglog(DBG_ERROR, "vmufs_delete: warning, card may be corrupted or leaking blocks!\n");
         rv = -2;
@@ -811,22 +875,26 @@ int vmufs_delete(maple_device_t *dev, const char *fn) {
 
     /* Looks like everything was good */
 ex:
-    vmufs_teardown(dir, fat);
+    /* Not finding the file (-1) doesn't change anything, but anything else
+       may have left our copy different from the card. */
+    if(rv < -1)
+        vmufs_cache_drop(c);
+
+    vmufs_teardown();
     return rv;
 }
 
 int vmufs_free_blocks(maple_device_t *dev) {
-    vmu_root_t  root;
-    uint16_t      *fat = NULL;
-    int     fatsize, rv;
+    vmufs_cache_t *c;
+    int     rv;
 
     /* Init everything */
-    if(vmufs_setup(dev, &root, NULL, NULL, &fat, &fatsize) < 0)
+    if(!(c = vmufs_setup(dev)))
         return -1;
 
-    rv = vmufs_fat_free(&root, fat);
+    rv = vmufs_fat_free(&c->root, c->fat);
 
-    vmufs_teardown(NULL, fat);
+    vmufs_teardown();
     return rv;
 }
 
@@ -836,6 +904,13 @@ int vmufs_init(void) {
 }
 
 int vmufs_shutdown(void) {
+    int p, u;
+
+    for(p = 0; p < MAPLE_PORT_COUNT; p++) {
+        for(u = 0; u < MAPLE_UNIT_COUNT; u++)
+            vmufs_cache_drop(&cache[p][u]);
+    }
+
     mutex_destroy(&mutex);
     return 0;
 }
@@ -164,10 +164,26 @@ static void vmu_periodic(maple_driver_t *drv) {
     maple_driver_foreach(drv, vmu_poll);
 }
 
+/* Whatever vmufs knew about the card in this slot is no good any more */
+static int vmu_attach(maple_driver_t *drv, maple_device_t *dev) {
+    (void)drv;
+
+    vmufs_cache_invalidate(dev);
+    return 0;
+}
+
+static void vmu_detach(maple_driver_t *drv, maple_device_t *dev) {
+    (void)drv;
+
+    vmufs_cache_invalidate(dev);
+}
+
 /* Device Driver Struct */
 static maple_driver_t vmu_drv = {
     .functions = MAPLE_FUNC_MEMCARD | MAPLE_FUNC_LCD | MAPLE_FUNC_CLOCK,
     .name = "VMU Driver",
+    .attach = vmu_attach,
+    .detach = vmu_detach,
     .status_size = sizeof(vmu_state_t)
 };
 
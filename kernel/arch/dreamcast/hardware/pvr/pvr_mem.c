@@ -8,37 +8,26 @@
 #include <assert.h>
 #include <dc/pvr.h>
 #include <stdio.h>
-
-#include <malloc.h> /* For the struct mallinfo defs */
+#include <stdlib.h>
 
 #include <kos/opts.h>
 #include <kos/dbglog.h>
+#include <kos/mutex.h>
 
 #include <arch/stack.h>
 
+#include "pvr_mem_tlsf.h"
+
 /*
 
 This module basically serves as a KOS-friendly front end and support routines
-for the pvr_mem_core module, which is a dlmalloc-derived malloc for use with
-the PVR memory pool.
-
-I was originally going to make a totally separate thing that could be used
-to generically manage any memory pool, but then I realized what a gruelling
-and thankless task that would be when starting with dlmalloc, so we have this
-instead. ^_^;
+for the pvr_mem_tlsf module, a TLSF allocator that keeps its bookkeeping in
+main RAM. Nothing is ever stored in texture memory itself, so allocating and
+freeing never has to touch the (slow, uncached) VRAM bus, and blocks can be
+moved around to defragment the pool.
 
 */
 
-/* Bring in some prototypes from pvr_mem_core.c */
-/* We can't directly include its header because of name clashes with
-   the real malloc header */
-extern void * pvr_int_malloc(size_t bytes);
-extern void pvr_int_free(void *ptr);
-extern struct mallinfo pvr_int_mallinfo(void);
-extern void pvr_int_mem_reset(void);
-extern void pvr_int_malloc_stats(void);
-
-
 #include <kos/thread.h>
 #include <arch/arch.h>
 
@@ -53,77 +42,84 @@ typedef struct memctl {
 
 static LIST_HEAD(memctl_list, memctl) block_list;
 
+/* Relocation callback registered for a movable block */
+typedef struct memreloc {
+    pvr_mem_reloc_cb    cb;
+    void                *data;
+} memreloc_t;
 
 /* PVR RAM base; NULL is considered invalid */
 static pvr_ptr_t pvr_mem_base = NULL;
-static pvr_ptr_t pvr_mem_sbrk = NULL;
-#define CHECK_MEM_SBRK \
-    assert_msg(pvr_mem_sbrk != NULL, \
-               "pvr_mem_* used, but PVR hasn't been initialized yet")
-
-/* Used in pvr_mem_core.c */
-void *pvr_int_sbrk(size_t amt) {
-    uint32_t old, n;
-
-    /* Are we valid? */
-    CHECK_MEM_SBRK;
+static size_t pvr_mem_size = 0;
+static int pvr_mem_inited = 0;
+static tlsf_t pool;
+static mutex_t pool_mutex = MUTEX_INITIALIZER;
 
-    /* Try to increment it */
-    old = (uint32_t)pvr_mem_sbrk;
-    n = old + amt;
-
-    /* Did we run over? */
-    if(n > PVR_RAM_INT_TOP)
-        return (void *) - 1;
+#define CHECK_MEM_BASE \
+    assert_msg(pvr_mem_inited, \
+               "pvr_mem_* used, but PVR hasn't been initialized yet")
 
-    /* Nope, everything's cool */
-    pvr_mem_sbrk = (pvr_ptr_t)n;
-    return (pvr_ptr_t)old;
-}
+#define PVR_MEM_PTR(off)    ((pvr_ptr_t)((uint32_t)pvr_mem_base + (off)))
+#define PVR_MEM_OFF(ptr)    ((uint32_t)(ptr) - (uint32_t)pvr_mem_base)
 
 /* Allocate a chunk of memory from texture space; the returned value
    will be relative to the base of texture memory (zero-based) */
-pvr_ptr_t __weak_symbol pvr_mem_malloc(size_t size) {
-    uint32_t rv32;
+pvr_ptr_t __weak_symbol pvr_mem_malloc_ex(size_t size, size_t align,
+                                          int flags) {
+    tlsf_blk_t  *blk;
+    pvr_ptr_t   rv;
     memctl_t    *ctl;
 
-    CHECK_MEM_SBRK;
+    CHECK_MEM_BASE;
+
+    if(size > pvr_mem_size || align > pvr_mem_size)
+        return NULL;
+
+    mutex_lock(&pool_mutex);
+    blk = tlsf_alloc(&pool, size, align,
+                     (flags & PVR_MEM_HINT_TOP) ? TLSF_TOP : 0);
+    mutex_unlock(&pool_mutex);
+
+    if(!blk)
+        return NULL;
 
-    rv32 = (uint32_t)pvr_int_malloc(size);
-    assert_msg((rv32 & 0x1f) == 0,
-               "dlmalloc's alignment is broken; "
-               "please make a bug report");
+    rv = PVR_MEM_PTR(blk->off);
 
     if(__is_defined(PVR_KM_DBG)) {
         ctl = malloc(sizeof(memctl_t));
         if(!ctl)
-            return (pvr_ptr_t)rv32;
+            return rv;
 
         ctl->size = size;
         ctl->thread = thd_current->tid;
         ctl->addr = arch_get_ret_addr();
-        ctl->block = (pvr_ptr_t)rv32;
+        ctl->block = rv;
         LIST_INSERT_HEAD(&block_list, ctl, list);
     }
 
     if(__is_defined(PVR_KM_DBG_VERBOSE)) {
         printf("Thread %d/%08lx allocated %lu bytes at %08lx\n",
-               ctl->thread, ctl->addr, ctl->size, rv32);
+               ctl->thread, ctl->addr, ctl->size, (uint32_t)rv);
     }
 
-    return (pvr_ptr_t)rv32;
+    return rv;
+}
+
+pvr_ptr_t __weak_symbol pvr_mem_malloc(size_t size) {
+    return pvr_mem_malloc_ex(size, 0, PVR_MEM_HINT_TEXTURE);
 }
 
 /* Free a previously allocated chunk of memory */
 void __weak_symbol pvr_mem_free(pvr_ptr_t chunk) {
     uint32_t    ra;
     memctl_t    *ctl, *tmp;
+    tlsf_blk_t  *blk;
     int     found;
 
     if(__is_defined(PVR_KM_DBG))
         ra = arch_get_ret_addr();
 
-    CHECK_MEM_SBRK;
+    CHECK_MEM_BASE;
 
     if(__is_defined(PVR_KM_DBG_VERBOSE)) {
         printf("Thread %d/%08lx freeing block @ %08lx\n",
@@ -150,7 +146,23 @@ void __weak_symbol pvr_mem_free(pvr_ptr_t chunk) {
         }
     }
 
-    pvr_int_free((void *)chunk);
+    if(!chunk)
+        return;
+
+    mutex_lock(&pool_mutex);
+
+    blk = tlsf_find(&pool, PVR_MEM_OFF(chunk));
+
+    if(blk) {
+        free(blk->udata);
+        tlsf_free(&pool, blk);
+    }
+
+    mutex_unlock(&pool_mutex);
+
+    if(!blk)
+        dbglog(DBG_ERROR, "pvr_mem_free: %08lx was not allocated\n",
+               (uint32_t)chunk);
 }
 
 /* Check the memory block list to see what's allocated */
@@ -164,49 +176,177 @@ void __weak_symbol pvr_mem_print_list(void) {
     LIST_FOREACH(ctl, &block_list, list) {
         printf("  unfreed block at %08lx size %lu, "
                "allocated by thread %d/%08lx\n",
-               (unsigned long)ctl->block, ctl->size, 
+               (unsigned long)ctl->block, ctl->size,
                ctl->thread, (unsigned long)ctl->addr);
     }
     printf("pvr_mem_print_list end block list\n");
 }
 
 /* Return the number of bytes available still in the memory pool */
-static size_t pvr_mem_available_int(void) {
-    struct mallinfo mi = pvr_int_mallinfo();
+size_t __weak_symbol pvr_mem_available(void) {
+    size_t rv;
+
+    if(!pvr_mem_inited)
+        return 0;
 
-    /* This magic formula is modeled after mstats() */
-    return mi.arena - mi.uordblks;
+    mutex_lock(&pool_mutex);
+    rv = pool.size - pool.used;
+    mutex_unlock(&pool_mutex);
+
+    return rv;
 }
 
-size_t __weak_symbol pvr_mem_available(void) {
-    if(!pvr_mem_sbrk)
-        return 0;
+/* Drop the relocation callbacks of every block in the pool */
+static void pvr_mem_drop_relocs(void) {
+    tlsf_blk_t *blk;
 
-    return pvr_mem_available_int() + 
-        (PVR_RAM_INT_TOP - (size_t)pvr_mem_sbrk);
+    for(blk = pool.first; blk; blk = blk->next_phys) {
+        if(!blk->free)
+            free(blk->udata);
+    }
 }
 
 /* Reset the memory pool, equivalent to freeing all textures currently
    residing in RAM. This _must_ be done on a mode change, configuration
    change, etc. */
-void __weak_symbol pvr_mem_reset(void) {    
-    if (pvr_mem_base != NULL) {
-        pvr_mem_sbrk = pvr_mem_base;
-        pvr_int_mem_reset();
-    } else {
-        pvr_mem_sbrk = NULL;
+void __weak_symbol pvr_mem_reset(void) {
+    mutex_lock(&pool_mutex);
+
+    pvr_mem_drop_relocs();
+
+    if(pvr_mem_base != NULL) {
+        if(tlsf_init(&pool, pvr_mem_size) < 0)
+            dbglog(DBG_ERROR, "pvr_mem_reset: out of memory\n");
+
+        pvr_mem_inited = 1;
     }
+    else {
+        tlsf_destroy(&pool);
+        pvr_mem_inited = 0;
+    }
+
+    mutex_unlock(&pool_mutex);
 }
 
 void __weak_symbol pvr_mem_initialize(pvr_ptr_t pvr_texture_base, size_t available_memory) {
-    (void)available_memory;
     pvr_mem_base = pvr_texture_base;
+    pvr_mem_size = pvr_texture_base ? available_memory : 0;
+}
+
+int __weak_symbol pvr_mem_set_movable(pvr_ptr_t chunk, pvr_mem_reloc_cb cb,
+                                      void *data) {
+    tlsf_blk_t *blk;
+    memreloc_t *rel = NULL;
+
+    CHECK_MEM_BASE;
+
+    if(cb) {
+        rel = malloc(sizeof(memreloc_t));
+        if(!rel)
+            return -1;
+
+        rel->cb = cb;
+        rel->data = data;
+    }
+
+    mutex_lock(&pool_mutex);
+
+    blk = tlsf_find(&pool, PVR_MEM_OFF(chunk));
+
+    if(blk) {
+        free(blk->udata);
+        blk->udata = rel;
+        blk->movable = !!rel;
+    }
+
+    mutex_unlock(&pool_mutex);
+
+    if(!blk) {
+        free(rel);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Move data down within VRAM. Everything is a multiple of 32 bytes, and the
+   destination is always below the source, so a forward copy of 32-bit words
+   is safe even if the two overlap. */
+static void pvr_mem_copy(uint32_t dst, uint32_t src, uint32_t size,
+                         void *ctx) {
+    volatile uint32_t *d = (volatile uint32_t *)PVR_MEM_PTR(dst);
+    volatile uint32_t *s = (volatile uint32_t *)PVR_MEM_PTR(src);
+
+    (void)ctx;
+
+    for(size >>= 2; size; size--)
+        *d++ = *s++;
+}
+
+static void pvr_mem_moved(tlsf_blk_t *blk, uint32_t old_off, void *ctx) {
+    memreloc_t *rel = blk->udata;
+    memctl_t *ctl;
+
+    (void)ctx;
+
+    if(__is_defined(PVR_KM_DBG)) {
+        LIST_FOREACH(ctl, &block_list, list) {
+            if(ctl->block == PVR_MEM_PTR(old_off)) {
+                ctl->block = PVR_MEM_PTR(blk->off);
+                break;
+            }
+        }
+    }
+
+    rel->cb(PVR_MEM_PTR(old_off), PVR_MEM_PTR(blk->off), rel->data);
+}
+
+size_t __weak_symbol pvr_mem_compact(void) {
+    size_t rv;
+
+    CHECK_MEM_BASE;
+
+    mutex_lock(&pool_mutex);
+    rv = tlsf_compact(&pool, pvr_mem_copy, pvr_mem_moved, NULL);
+    mutex_unlock(&pool_mutex);
+
+    return rv;
+}
+
+void __weak_symbol pvr_mem_get_info(pvr_mem_info_t *info) {
+    tlsf_stats_t st = { 0 };
+
+    if(pvr_mem_inited) {
+        mutex_lock(&pool_mutex);
+        tlsf_get_stats(&pool, &st);
+        mutex_unlock(&pool_mutex);
+    }
+
+    info->total = st.total;
+    info->used = st.used;
+    info->free = st.free;
+    info->largest_free = st.largest_free;
+    info->used_blocks = st.used_blocks;
+    info->free_blocks = st.free_blocks;
+    info->overhead = st.descriptors * sizeof(tlsf_blk_t);
+    info->fragmentation = st.free ?
+        100 - (unsigned int)((uint64_t)st.largest_free * 100 / st.free) : 0;
 }
 
 /* Print some statistics (like mallocstats) */
 void __weak_symbol pvr_mem_stats(void) {
+    pvr_mem_info_t info;
+
+    pvr_mem_get_info(&info);
+
     printf("pvr_mem_stats():\n");
-    pvr_int_malloc_stats();
-    printf("max sbrk base: %08lx\n", (uint32_t)pvr_mem_sbrk);
+    printf("total bytes     = %10lu\n", (unsigned long)info.total);
+    printf("in use bytes    = %10lu in %lu blocks\n",
+           (unsigned long)info.used, (unsigned long)info.used_blocks);
+    printf("free bytes      = %10lu in %lu blocks\n",
+           (unsigned long)info.free, (unsigned long)info.free_blocks);
+    printf("largest free    = %10lu (%u%% fragmented)\n",
+           (unsigned long)info.largest_free, info.fragmentation);
+    printf("bookkeeping RAM = %10lu\n", (unsigned long)info.overhead);
     pvr_mem_print_list();
 }
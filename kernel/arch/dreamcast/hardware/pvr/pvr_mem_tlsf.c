@@ -0,0 +1,522 @@
+/* KallistiOS ##version##
+
+   pvr_mem_tlsf.c
+
+*/
+
+/* Out-of-band TLSF allocator core for pvr_mem.c.
+
+   Free blocks are kept on one list per size class. The first level splits
+   sizes by power of two and the second level splits each power of two into
+   TLSF_SL_COUNT linear steps; a bitmap for each level says which lists are
+   non-empty, so finding a block that fits is a couple of bit scans no matter
+   how many blocks there are. Every block (free or not) has a descriptor in
+   main RAM linked to its neighbours in address order, which is all that's
+   needed to coalesce on free. The managed memory itself is never read or
+   written, except through the copy callback of tlsf_compact(). */
+
+#include <stdlib.h>
+
+#include "pvr_mem_tlsf.h"
+
+#define TLSF_SLAB_BLKS      64
+
+#define TLSF_HASH(off) \
+    ((((off) >> TLSF_ALIGN_LOG2) * 2654435761U) >> (32 - TLSF_HASH_LOG2))
+
+static inline int tlsf_fls(uint32_t x) {
+    return 31 - __builtin_clz(x);
+}
+
+static inline int tlsf_ffs(uint32_t x) {
+    return __builtin_ctz(x);
+}
+
+/* Size class a block of the given size is filed under. */
+static void mapping_insert(uint32_t size, int *fl, int *sl) {
+    int f;
+
+    if(size < TLSF_SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size >> TLSF_ALIGN_LOG2;
+    }
+    else {
+        f = tlsf_fls(size);
+        *sl = (size >> (f - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+        *fl = f - (TLSF_FL_SHIFT - 1);
+    }
+}
+
+/* Lowest size class where every block is at least the given size. */
+static void mapping_search(uint32_t size, int *fl, int *sl) {
+    if(size >= TLSF_SMALL_BLOCK)
+        size += (1U << (tlsf_fls(size) - TLSF_SL_LOG2)) - 1;
+
+    mapping_insert(size, fl, sl);
+}
+
+static void free_insert(tlsf_t *t, tlsf_blk_t *blk) {
+    tlsf_blk_t **head;
+    int fl, sl;
+
+    mapping_insert(blk->size, &fl, &sl);
+    head = &t->free_lists[fl][sl];
+
+    blk->free = 1;
+    blk->prev = NULL;
+    blk->next = *head;
+
+    if(*head)
+        (*head)->prev = blk;
+
+    *head = blk;
+    t->fl_bitmap |= 1U << fl;
+    t->sl_bitmap[fl] |= 1U << sl;
+    t->free_blocks++;
+}
+
+static void free_remove(tlsf_t *t, tlsf_blk_t *blk) {
+    int fl, sl;
+
+    mapping_insert(blk->size, &fl, &sl);
+
+    if(blk->prev)
+        blk->prev->next = blk->next;
+    else
+        t->free_lists[fl][sl] = blk->next;
+
+    if(blk->next)
+        blk->next->prev = blk->prev;
+
+    if(!t->free_lists[fl][sl]) {
+        t->sl_bitmap[fl] &= ~(1U << sl);
+
+        if(!t->sl_bitmap[fl])
+            t->fl_bitmap &= ~(1U << fl);
+    }
+
+    t->free_blocks--;
+}
+
+static void hash_insert(tlsf_t *t, tlsf_blk_t *blk) {
+    tlsf_blk_t **head = &t->hash[TLSF_HASH(blk->off)];
+
+    blk->prev = NULL;
+    blk->next = *head;
+
+    if(*head)
+        (*head)->prev = blk;
+
+    *head = blk;
+}
+
+static void hash_remove(tlsf_t *t, tlsf_blk_t *blk) {
+    if(blk->prev)
+        blk->prev->next = blk->next;
+    else
+        t->hash[TLSF_HASH(blk->off)] = blk->next;
+
+    if(blk->next)
+        blk->next->prev = blk->prev;
+}
+
+/* Make sure there are at least two spare descriptors, which is the most a
+   single allocation can use. */
+static int blk_reserve(tlsf_t *t) {
+    tlsf_slab_t *slab;
+    int i;
+
+    if(t->spare && t->spare->next)
+        return 0;
+
+    slab = malloc(sizeof(tlsf_slab_t) + TLSF_SLAB_BLKS * sizeof(tlsf_blk_t));
+    if(!slab)
+        return -1;
+
+    slab->next = t->slabs;
+    t->slabs = slab;
+    t->descriptors += TLSF_SLAB_BLKS;
+
+    for(i = 0; i < TLSF_SLAB_BLKS; i++) {
+        slab->blks[i].next = t->spare;
+        t->spare = &slab->blks[i];
+    }
+
+    return 0;
+}
+
+static tlsf_blk_t *blk_get(tlsf_t *t) {
+    tlsf_blk_t *blk = t->spare;
+
+    t->spare = blk->next;
+    return blk;
+}
+
+static void blk_put(tlsf_t *t, tlsf_blk_t *blk) {
+    blk->next = t->spare;
+    t->spare = blk;
+}
+
+/* Put a new descriptor for the given range right after blk in address
+   order. */
+static tlsf_blk_t *phys_split(tlsf_t *t, tlsf_blk_t *blk, uint32_t off,
+                              uint32_t size) {
+    tlsf_blk_t *n = blk_get(t);
+
+    n->off = off;
+    n->size = size;
+    n->align = 0;
+    n->movable = 0;
+    n->udata = NULL;
+    n->prev_phys = blk;
+    n->next_phys = blk->next_phys;
+
+    if(blk->next_phys)
+        blk->next_phys->prev_phys = n;
+
+    blk->next_phys = n;
+    return n;
+}
+
+static void phys_unlink(tlsf_t *t, tlsf_blk_t *blk) {
+    if(blk->prev_phys)
+        blk->prev_phys->next_phys = blk->next_phys;
+    else
+        t->first = blk->next_phys;
+
+    if(blk->next_phys)
+        blk->next_phys->prev_phys = blk->prev_phys;
+
+    blk_put(t, blk);
+}
+
+/* Find a free block of at least the given size and take it off its list. */
+static tlsf_blk_t *free_find(tlsf_t *t, uint32_t size) {
+    tlsf_blk_t *blk;
+    uint32_t map;
+    int fl, sl;
+
+    mapping_search(size, &fl, &sl);
+
+    if(fl < TLSF_FL_COUNT) {
+        map = t->sl_bitmap[fl] & (~0U << sl);
+
+        if(!map) {
+            map = fl + 1 < TLSF_FL_COUNT ? t->fl_bitmap & (~0U << (fl + 1)) : 0;
+
+            if(map) {
+                fl = tlsf_ffs(map);
+                map = t->sl_bitmap[fl];
+            }
+        }
+
+        if(map) {
+            blk = t->free_lists[fl][tlsf_ffs(map)];
+            free_remove(t, blk);
+            return blk;
+        }
+    }
+
+    /* Nothing in the classes that are sure to fit. Blocks in the class the
+       size itself falls in might still be big enough, which matters once the
+       pool is nearly full. */
+    mapping_insert(size, &fl, &sl);
+
+    if(fl >= TLSF_FL_COUNT)
+        return NULL;
+
+    for(blk = t->free_lists[fl][sl]; blk; blk = blk->next) {
+        if(blk->size >= size) {
+            free_remove(t, blk);
+            return blk;
+        }
+    }
+
+    return NULL;
+}
+
+static void tlsf_release(tlsf_t *t) {
+    tlsf_slab_t *slab;
+
+    while((slab = t->slabs)) {
+        t->slabs = slab->next;
+        free(slab);
+    }
+}
+
+int tlsf_init(tlsf_t *t, uint32_t size) {
+    tlsf_blk_t *blk;
+
+    tlsf_release(t);
+    *t = (tlsf_t){ 0 };
+
+    size &= ~(TLSF_ALIGN - 1);
+    if(size >> TLSF_FL_MAX_LOG2)
+        size = (1U << TLSF_FL_MAX_LOG2) - TLSF_ALIGN;
+
+    t->size = size;
+
+    if(!size)
+        return 0;
+
+    if(blk_reserve(t))
+        return -1;
+
+    blk = blk_get(t);
+    *blk = (tlsf_blk_t){ .off = 0, .size = size };
+    t->first = blk;
+    free_insert(t, blk);
+
+    return 0;
+}
+
+void tlsf_destroy(tlsf_t *t) {
+    tlsf_release(t);
+    *t = (tlsf_t){ 0 };
+}
+
+tlsf_blk_t *tlsf_alloc(tlsf_t *t, uint32_t size, uint32_t align, int flags) {
+    tlsf_blk_t *blk, *lead;
+    uint32_t off, end;
+
+    if(align < TLSF_ALIGN)
+        align = TLSF_ALIGN;
+
+    if(!size || size > t->size || align > t->size || (align & (align - 1)))
+        return NULL;
+
+    if(blk_reserve(t))
+        return NULL;
+
+    size = (size + TLSF_ALIGN - 1) & ~(TLSF_ALIGN - 1);
+
+    /* Ask for enough to be able to align the start anywhere in the block */
+    blk = free_find(t, size + align - TLSF_ALIGN);
+    if(!blk)
+        return NULL;
+
+    end = blk->off + blk->size;
+
+    if(flags & TLSF_TOP)
+        off = (end - size) & ~(align - 1);
+    else
+        off = (blk->off + align - 1) & ~(align - 1);
+
+    /* Give back whatever is left on either side. Neither piece can have a
+       free neighbour, since blk didn't. */
+    if(off + size < end)
+        free_insert(t, phys_split(t, blk, off + size, end - off - size));
+
+    if(off > blk->off) {
+        lead = blk;
+        blk = phys_split(t, lead, off, size);
+        lead->size = off - lead->off;
+        free_insert(t, lead);
+    }
+
+    blk->size = size;
+    blk->free = 0;
+    blk->align = align;
+    blk->movable = 0;
+    blk->udata = NULL;
+    hash_insert(t, blk);
+
+    t->used += size;
+    t->used_blocks++;
+
+    return blk;
+}
+
+tlsf_blk_t *tlsf_find(tlsf_t *t, uint32_t off) {
+    tlsf_blk_t *blk;
+
+    for(blk = t->hash[TLSF_HASH(off)]; blk; blk = blk->next) {
+        if(blk->off == off)
+            return blk;
+    }
+
+    return NULL;
+}
+
+void tlsf_free(tlsf_t *t, tlsf_blk_t *blk) {
+    tlsf_blk_t *n;
+
+    hash_remove(t, blk);
+    t->used -= blk->size;
+    t->used_blocks--;
+
+    n = blk->prev_phys;
+    if(n && n->free) {
+        free_remove(t, n);
+        n->size += blk->size;
+        phys_unlink(t, blk);
+        blk = n;
+    }
+
+    n = blk->next_phys;
+    if(n && n->free) {
+        free_remove(t, n);
+        blk->size += n->size;
+        phys_unlink(t, n);
+    }
+
+    blk->movable = 0;
+    blk->udata = NULL;
+    free_insert(t, blk);
+}
+
+uint32_t tlsf_compact(tlsf_t *t, tlsf_copy_fn copy, tlsf_moved_fn moved,
+                      void *ctx) {
+    tlsf_blk_t *blk, *f, *p, *n;
+    uint32_t old, off, total = 0;
+
+    for(blk = t->first; blk; blk = n) {
+        n = blk->next_phys;
+        f = blk->prev_phys;
+
+        /* Only slide a block down into a free block right below it */
+        if(blk->free || !blk->movable || !f || !f->free)
+            continue;
+
+        off = (f->off + blk->align - 1) & ~(blk->align - 1);
+
+        if(off >= blk->off)
+            continue;
+
+        /* Leaving a gap below for alignment takes another descriptor */
+        if(off > f->off && blk_reserve(t))
+            break;
+
+        free_remove(t, f);
+        hash_remove(t, blk);
+
+        old = blk->off;
+        copy(off, old, blk->size, ctx);
+        total += blk->size;
+        blk->off = off;
+
+        if(off > f->off) {
+            /* f stays where it is, and the space freed goes above blk */
+            f->size = off - f->off;
+            free_insert(t, f);
+            f = phys_split(t, blk, off + blk->size, old - off);
+        }
+        else {
+            /* Swap the two blocks around */
+            f->off = off + blk->size;
+
+            p = f->prev_phys;
+            blk->prev_phys = p;
+
+            if(p)
+                p->next_phys = blk;
+            else
+                t->first = blk;
+
+            blk->next_phys = f;
+            f->prev_phys = blk;
+            f->next_phys = n;
+
+            if(n)
+                n->prev_phys = f;
+        }
+
+        hash_insert(t, blk);
+
+        /* The free block may now touch another one */
+        if(n && n->free) {
+            free_remove(t, n);
+            f->size += n->size;
+            phys_unlink(t, n);
+        }
+
+        free_insert(t, f);
+        moved(blk, old, ctx);
+
+        n = f->next_phys;
+    }
+
+    return total;
+}
+
+void tlsf_get_stats(tlsf_t *t, tlsf_stats_t *stats) {
+    tlsf_blk_t *blk;
+    int fl, sl;
+
+    stats->total = t->size;
+    stats->used = t->used;
+    stats->free = t->size - t->used;
+    stats->used_blocks = t->used_blocks;
+    stats->free_blocks = t->free_blocks;
+    stats->descriptors = t->descriptors;
+    stats->largest_free = 0;
+
+    /* The biggest block can only be on the highest non-empty list. */
+    if(t->fl_bitmap) {
+        fl = tlsf_fls(t->fl_bitmap);
+        sl = tlsf_fls(t->sl_bitmap[fl]);
+
+        for(blk = t->free_lists[fl][sl]; blk; blk = blk->next) {
+            if(blk->size > stats->largest_free)
+                stats->largest_free = blk->size;
+        }
+    }
+}
+
+#define CHECK(x) do { if(!(x)) return __LINE__; } while(0)
+
+int tlsf_check(tlsf_t *t) {
+    tlsf_blk_t *blk, *it;
+    uint32_t off = 0, used = 0, nused = 0, nfree = 0;
+    int fl, sl;
+
+    CHECK(t->size ? t->first != NULL : t->first == NULL);
+
+    for(blk = t->first; blk; blk = blk->next_phys) {
+        CHECK(blk->off == off);
+        CHECK(blk->size && !(blk->size & (TLSF_ALIGN - 1)));
+        CHECK(!blk->prev_phys || blk->prev_phys->next_phys == blk);
+        CHECK(!blk->next_phys || blk->next_phys->prev_phys == blk);
+
+        if(blk->free) {
+            CHECK(!blk->prev_phys || !blk->prev_phys->free);
+
+            mapping_insert(blk->size, &fl, &sl);
+            CHECK(t->sl_bitmap[fl] & (1U << sl));
+
+            for(it = t->free_lists[fl][sl]; it && it != blk; it = it->next)
+                ;
+            CHECK(it == blk);
+            nfree++;
+        }
+        else {
+            CHECK(!(blk->off & (blk->align - 1)));
+            CHECK(tlsf_find(t, blk->off) == blk);
+            used += blk->size;
+            nused++;
+        }
+
+        off += blk->size;
+    }
+
+    CHECK(off == t->size);
+    CHECK(used == t->used);
+    CHECK(nused == t->used_blocks);
+    CHECK(nfree == t->free_blocks);
+
+    for(fl = 0; fl < (int)TLSF_FL_COUNT; fl++) {
+        CHECK(!!(t->fl_bitmap & (1U << fl)) == !!t->sl_bitmap[fl]);
+
+        for(sl = 0; sl < (int)TLSF_SL_COUNT; sl++) {
+            CHECK(!!(t->sl_bitmap[fl] & (1U << sl)) ==
+                  !!t->free_lists[fl][sl]);
+
+            for(it = t->free_lists[fl][sl]; it; it = it->next) {
+                CHECK(it->free);
+                CHECK(!it->prev || it->prev->next == it);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,134 @@
+/* KallistiOS ##version##
+
+   pvr_mem_tlsf.h
+
+*/
+
+/* A two-level segregated fit (TLSF) allocator that keeps all of its
+   bookkeeping out of band. It hands out offsets into a pool it never touches
+   itself, so it can manage memory that is slow to access (like VRAM) or that
+   isn't mapped at all. Nothing in here depends on KOS, so the same code can be
+   built on a PC (see utils/pvrmemtest).
+
+   None of these functions lock; that is up to the caller. */
+
+#ifndef __PVR_MEM_TLSF_H
+#define __PVR_MEM_TLSF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Granularity of all blocks, and the minimum alignment of every allocation */
+#define TLSF_ALIGN_LOG2     5
+#define TLSF_ALIGN          (1U << TLSF_ALIGN_LOG2)
+
+/* 16 size classes for each power of two */
+#define TLSF_SL_LOG2        4
+#define TLSF_SL_COUNT       (1U << TLSF_SL_LOG2)
+
+/* Blocks smaller than this all go in the first level, linearly spaced */
+#define TLSF_FL_SHIFT       (TLSF_SL_LOG2 + TLSF_ALIGN_LOG2)
+#define TLSF_SMALL_BLOCK    (1U << TLSF_FL_SHIFT)
+
+/* Enough for pools up to 32MB */
+#define TLSF_FL_MAX_LOG2    25
+#define TLSF_FL_COUNT       (TLSF_FL_MAX_LOG2 - TLSF_FL_SHIFT + 1)
+
+/* Allocated blocks are looked up by offset in a hash of this size */
+#define TLSF_HASH_LOG2      9
+#define TLSF_HASH_SIZE      (1U << TLSF_HASH_LOG2)
+
+/* Flags for tlsf_alloc() */
+#define TLSF_TOP            1   /* Carve the block from the top of the
+                                   free block chosen rather than the bottom */
+
+/* Descriptor of one block of the pool, free or not. */
+typedef struct tlsf_blk {
+    uint32_t off;                       /* Offset in the pool */
+    uint32_t size;                      /* Size in bytes */
+    uint32_t align;                     /* Alignment asked for (used only) */
+    uint8_t free;
+    uint8_t movable;                    /* May be moved by tlsf_compact() */
+
+    struct tlsf_blk *prev_phys;         /* Neighbours in address order */
+    struct tlsf_blk *next_phys;
+
+    /* Free blocks are on a size class list, used ones in the hash. Both
+       share the same links. */
+    struct tlsf_blk *prev;
+    struct tlsf_blk *next;
+
+    void *udata;                        /* For the caller (used only) */
+} tlsf_blk_t;
+
+/* Memory the descriptors are allocated from */
+typedef struct tlsf_slab {
+    struct tlsf_slab *next;
+    tlsf_blk_t blks[];
+} tlsf_slab_t;
+
+typedef struct tlsf_stats {
+    uint32_t total;                     /* Size of the pool */
+    uint32_t used;                      /* Bytes in used blocks */
+    uint32_t free;                      /* Bytes in free blocks */
+    uint32_t largest_free;              /* Size of the biggest free block */
+    uint32_t used_blocks;
+    uint32_t free_blocks;
+    uint32_t descriptors;               /* Descriptors allocated in RAM */
+} tlsf_stats_t;
+
+typedef struct tlsf {
+    uint32_t size;
+
+    uint32_t fl_bitmap;
+    uint32_t sl_bitmap[TLSF_FL_COUNT];
+    tlsf_blk_t *free_lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+
+    tlsf_blk_t *hash[TLSF_HASH_SIZE];
+
+    tlsf_blk_t *first;                  /* Block at offset 0 */
+    tlsf_blk_t *spare;                  /* Unused descriptors */
+    tlsf_slab_t *slabs;
+
+    uint32_t used, used_blocks, free_blocks, descriptors;
+} tlsf_t;
+
+/* Called by tlsf_compact() to move the contents of a block down to a lower
+   offset. The two areas may overlap. */
+typedef void (*tlsf_copy_fn)(uint32_t dst, uint32_t src, uint32_t size,
+                             void *ctx);
+
+/* Called by tlsf_compact() once a block has been moved. */
+typedef void (*tlsf_moved_fn)(tlsf_blk_t *blk, uint32_t old_off, void *ctx);
+
+/* Set up a pool of the given size (rounded down to TLSF_ALIGN). t must be
+   zeroed or have been set up before, in which case anything it managed is
+   forgotten. Returns -1 if out of RAM. */
+int tlsf_init(tlsf_t *t, uint32_t size);
+
+/* Release all the RAM used by the pool. */
+void tlsf_destroy(tlsf_t *t);
+
+/* Allocate a block. align must be a power of two; anything below TLSF_ALIGN
+   is rounded up to it. Returns NULL if there's no room. */
+tlsf_blk_t *tlsf_alloc(tlsf_t *t, uint32_t size, uint32_t align, int flags);
+
+/* Find the used block starting at the given offset, or NULL. */
+tlsf_blk_t *tlsf_find(tlsf_t *t, uint32_t off);
+
+/* Free a block returned by tlsf_alloc() or tlsf_find(). */
+void tlsf_free(tlsf_t *t, tlsf_blk_t *blk);
+
+/* Slide every movable block down into the free space below it, so that
+   free space gathers at the top of the pool. Returns the number of bytes
+   moved. */
+uint32_t tlsf_compact(tlsf_t *t, tlsf_copy_fn copy, tlsf_moved_fn moved,
+                      void *ctx);
+
+void tlsf_get_stats(tlsf_t *t, tlsf_stats_t *stats);
+
+/* Check every invariant of the pool. Returns 0 if all is well, or the line
+   number of the failed check. Slow; meant for tests. */
+int tlsf_check(tlsf_t *t);
+
+#endif /* __PVR_MEM_TLSF_H */
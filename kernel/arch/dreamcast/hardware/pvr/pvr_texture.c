@@ -13,6 +13,7 @@
 #include <kos/regfield.h>
 #include <string.h>
 #include "pvr_internal.h"
+#include "pvr_twiddle.h"
 
 /*
 
@@ -48,117 +49,104 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count) {
     pvr_sq_load((uint32_t *)dst, (const uint32_t *)src, count, PVR_DMA_VRAM64);
 }
 
-/* Linear/iterative twiddling algorithm from Marcus' tatest */
-#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
-                     ((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
-#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
+/* Twiddle a whole texture into VRAM through the store queues, one 32-byte
+   line at a time. Always inlined, so that the format is a constant and each
+   call site gets its own copy of the inner loop. */
+static __always_inline void pvr_txr_twiddle_sq(const txr_twiddle_t *tw,
+                                               pvr_ptr_t dst, int fmt) {
+    uintptr_t dest = ((uintptr_t)dst & 0xffffff) | PVR_TA_TEX_MEM;
+    uint32_t n = 0, end, *d;
+
+    while(n < tw->lines) {
+        /* No more than 1 MiB at once, as in sq_cpy(). */
+        end = tw->lines - n > 0x8000 ? n + 0x8000 : tw->lines;
+        d = sq_lock((void *)dest);
+        dest += (end - n) * 32;
+
+        for(; n < end; n++) {
+            txr_twiddle_line(tw, n, d, fmt);
+            sq_flush(d);
+            d += 8;
+        }
 
-#define MIN(a, b) ( (a)<(b)? (a):(b) )
+        sq_unlock();
+    }
+}
 
 /*
    Load texture data from an SH-4 buffer into PVR RAM, twiddling it
    in the process.
 
-   This is a modified version of Vincent Penne's general twiddling
-   function. The texture can be 16bpp, 8bpp, or 4bpp (i.e., paletted).
-   The rectangle does not need to be a square (not tested with h>w, but
-   this is just a matter of a rotation by PI/2 and UV swapping).
+   The texture can be 16bpp, 8bpp, or 4bpp (i.e., paletted), or 32bpp
+   ARGB8888 that is converted to one of the 16bpp formats on the way. The
+   rectangle does not need to be a square.
 
-   - w and h must be a power of 2
+   - w and h must be powers of 2, from 8 to 1024
    - flags must be a logical OR of the various texture loading
      flags available:
-       PVR_TXRLOAD_4BPP, _8BPP, _16BPP, _32BPP (not supported yet)
+       PVR_TXRLOAD_4BPP, _8BPP, _16BPP, _32BPP_ARGB4444, _32BPP_RGB565,
+       _32BPP_ARGB1555
        PVR_TXRLOAD_VQ (not supported yet)
        PVR_TXRLOAD_INVERT
 
 */
 void pvr_txr_load_ex(const void *src, pvr_ptr_t dst, uint32_t w, uint32_t h,
                      uint32_t flags) {
-    uint32_t x, y, yout, min, mask, bpp, invert;
+    txr_twiddle_t tw;
+    int fmt;
 
     /* Make sure we're attempting something we can do */
     switch(flags & PVR_TXRLOAD_FMT_MASK) {
         case PVR_TXRLOAD_4BPP:
-            bpp = 4;
+            fmt = TW_FMT_4BPP;
             break;
         case PVR_TXRLOAD_8BPP:
-            bpp = 8;
+            fmt = TW_FMT_8BPP;
             break;
         case PVR_TXRLOAD_16BPP:
-            bpp = 16;
+            fmt = TW_FMT_16BPP;
+            break;
+        case PVR_TXRLOAD_32BPP_ARGB4444:
+            fmt = TW_FMT_ARGB4444;
+            break;
+        case PVR_TXRLOAD_32BPP_RGB565:
+            fmt = TW_FMT_RGB565;
+            break;
+        case PVR_TXRLOAD_32BPP_ARGB1555:
+            fmt = TW_FMT_ARGB1555;
             break;
         default:
             assert_msg(0, "Invalid format specifier in `flags'");
-            bpp = 8;
+            return;
     }
 
     assert_msg(!(flags & PVR_TXRLOAD_VQ_LOAD), "VQ compression on the fly not supported yet");
-    invert = (flags & PVR_TXRLOAD_INVERT_Y) ? 1 : 0;
-
-    min = MIN(w, h);
-    mask = min - 1;
-
-    switch(bpp) {
-        case 4: {
-            uint8_t * pixels;
-            uint16_t * vtex;
-            pixels = (uint8_t *) src;
-            vtex = (uint16_t *)dst;
-
-            for(y = 0; y < h; y += 2) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x += 2) {
-                    vtex[TWIDOUT((x & mask) / 2, (yout & mask) / 2) +
-                         (x / min + yout / min)*min * min / 4] =
-                             (pixels[(x + y * w) >> 1] & 15) | ((pixels[(x + (y + 1) * w) >> 1] & 15) << 4) |
-                             ((pixels[(x + y * w) >> 1] >> 4) << 8) | ((pixels[(x + (y + 1) * w) >> 1] >> 4) << 12);
-                }
-            }
-        }
-        break;
-        case 8: {
-            uint8_t * pixels;
-            uint16_t * vtex;
-            pixels = (uint8_t *) src;
-            vtex = (uint16_t *)dst;
-
-            for(y = 0; y < h; y += 2) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x++) {
-                    vtex[TWIDOUT((yout & mask) / 2, x & mask) +
-                         (x / min + yout / min)*min * min / 2] =
-                             pixels[y * w + x] | (pixels[(y + 1) * w + x] << 8);
-                }
-            }
-        }
-        break;
-        case 16: {
-            uint16_t * pixels;
-            uint16_t * vtex;
-            pixels = (uint16_t *) src;
-            vtex = (uint16_t *)dst;
-
-            for(y = 0; y < h; y++) {
-                if(!invert)
-                    yout = y;
-                else
-                    yout = ((h - 1) - y);
-
-                for(x = 0; x < w; x++) {
-                    vtex[TWIDOUT(x & mask, yout & mask) +
-                         (x / min + yout / min)*min * min] = pixels[y * w + x];
-                }
-            }
-        }
-        break;
+
+    if(txr_twiddle_init(&tw, src, w, h, fmt,
+                        !!(flags & PVR_TXRLOAD_INVERT_Y))) {
+        assert_msg(0, "Texture sizes must be powers of 2 from 8 to 1024");
+        return;
+    }
+
+    switch(fmt) {
+        case TW_FMT_4BPP:
+            pvr_txr_twiddle_sq(&tw, dst, TW_FMT_4BPP);
+            break;
+        case TW_FMT_8BPP:
+            pvr_txr_twiddle_sq(&tw, dst, TW_FMT_8BPP);
+            break;
+        case TW_FMT_16BPP:
+            pvr_txr_twiddle_sq(&tw, dst, TW_FMT_16BPP);
+            break;
+        case TW_FMT_ARGB4444:
+            pvr_txr_twiddle_sq(&tw, dst, TW_FMT_ARGB4444);
+            break;
+        case TW_FMT_RGB565:
+            pvr_txr_twiddle_sq(&tw, dst, TW_FMT_RGB565);
+            break;
+        case TW_FMT_ARGB1555:
+            pvr_txr_twiddle_sq(&tw, dst, TW_FMT_ARGB1555);
+            break;
     }
 }
 
@@ -0,0 +1,218 @@
+/* KallistiOS ##version##
+
+   pvr_twiddle.h
+
+*/
+
+/* Twiddling one 32-byte line of texture at a time.
+
+   In twiddled order, the bits of a texel's index alternate between its Y and
+   X coordinates (Y in the even bits, X in the odd ones), within square tiles
+   of min(w, h) texels on a side. The texels that make up 32 consecutive bytes
+   of output are therefore always a small block of the source image: 4x4 at
+   16bpp, 4x8 at 8bpp and 8x8 at 4bpp. This works out which block goes in each
+   output line from the bits of the line number with a small table, then
+   gathers it into eight 32-bit words in a fixed order. The output is written
+   strictly in order and a whole line at a time, as the store queues want it.
+
+   This has no dependencies on the rest of KOS so it can be tested on a PC
+   (see utils/pvrtwiddle). */
+
+#ifndef __PVR_TWIDDLE_H
+#define __PVR_TWIDDLE_H
+
+#include <stdint.h>
+
+/* Source formats */
+#define TW_FMT_4BPP         0
+#define TW_FMT_8BPP         1
+#define TW_FMT_16BPP        2
+#define TW_FMT_ARGB4444     3   /* From ARGB8888 */
+#define TW_FMT_RGB565       4   /* From ARGB8888 */
+#define TW_FMT_ARGB1555     5   /* From ARGB8888 */
+
+typedef struct txr_twiddle {
+    const uint8_t *src;         /* First row of the source, as read */
+    int32_t pitch;              /* Bytes between rows, negative to invert */
+    uint32_t tile_log2;         /* log2(min(w, h)) */
+    uint32_t lines_log2;        /* log2(output lines per tile) */
+    uint32_t tiles_in_x;        /* Tiles go across rather than down */
+    uint32_t lines;             /* Total output lines */
+} txr_twiddle_t;
+
+/* Bits 0, 2, 4 and 6 of a byte, packed together */
+#define TW_DE(b)    (((b) & 1) | (((b) >> 1) & 2) | (((b) >> 2) & 4) | \
+                     (((b) >> 3) & 8))
+#define TW_DE4(n)   TW_DE(n), TW_DE((n) + 1), TW_DE((n) + 2), TW_DE((n) + 3)
+#define TW_DE16(n)  TW_DE4(n), TW_DE4((n) + 4), TW_DE4((n) + 8), \
+                    TW_DE4((n) + 12)
+#define TW_DE64(n)  TW_DE16(n), TW_DE16((n) + 16), TW_DE16((n) + 32), \
+                    TW_DE16((n) + 48)
+
+static const uint8_t tw_deinterleave[256] = {
+    TW_DE64(0), TW_DE64(64), TW_DE64(128), TW_DE64(192)
+};
+
+/* Even bits of a line number within a tile. There are at most 65536 lines in
+   a tile (1024x1024 at 16bpp), so two lookups do. */
+static inline uint32_t tw_even(uint32_t k) {
+    return tw_deinterleave[k & 0xff] | (tw_deinterleave[(k >> 8) & 0xff] << 4);
+}
+
+static inline uint32_t tw_ilog2(uint32_t x) {
+    return 31 - __builtin_clz(x);
+}
+
+/* Set up to twiddle a w x h image, both powers of two and at least 8. Returns
+   -1 if the sizes aren't usable. */
+static inline int txr_twiddle_init(txr_twiddle_t *tw, const void *src,
+                                   uint32_t w, uint32_t h, int fmt,
+                                   int invert) {
+    static const uint8_t bpp_log2[] = { 2, 3, 4, 5, 5, 5 };
+    uint32_t min, bits;
+
+    if(w < 8 || h < 8 || (w & (w - 1)) || (h & (h - 1)) || w > 1024 ||
+       h > 1024)
+        return -1;
+
+    min = w < h ? w : h;
+    bits = bpp_log2[fmt];
+
+    tw->tile_log2 = tw_ilog2(min);
+    tw->tiles_in_x = w > h;
+    tw->pitch = (int32_t)((w << bits) >> 3);
+
+    /* Output is 16bpp when converting from 32bpp */
+    if(bits == 5)
+        bits = 4;
+
+    tw->lines_log2 = 2 * tw->tile_log2 + bits - 8;
+    tw->lines = (w * h) >> (8 - bits);
+    tw->src = src;
+
+    if(invert) {
+        tw->src += (h - 1) * tw->pitch;
+        tw->pitch = -tw->pitch;
+    }
+
+    return 0;
+}
+
+/* One 16-bit texel, converted as needed */
+static inline uint32_t tw_texel16(const uint8_t *row, uint32_t x, int fmt) {
+    uint32_t p;
+
+    if(fmt == TW_FMT_16BPP)
+        return ((const uint16_t *)row)[x];
+
+    p = ((const uint32_t *)row)[x];
+
+    switch(fmt) {
+        case TW_FMT_ARGB4444:
+            return ((p >> 16) & 0xf000) | ((p >> 12) & 0x0f00) |
+                   ((p >> 8) & 0x00f0) | ((p >> 4) & 0x000f);
+        case TW_FMT_RGB565:
+            return ((p >> 8) & 0xf800) | ((p >> 5) & 0x07e0) |
+                   ((p >> 3) & 0x001f);
+        default:
+            return ((p >> 16) & 0x8000) | ((p >> 9) & 0x7c00) |
+                   ((p >> 6) & 0x03e0) | ((p >> 3) & 0x001f);
+    }
+}
+
+/* Two vertically adjacent 16-bit texels */
+static inline uint32_t tw_pair16(const uint8_t *row, int32_t pitch,
+                                 uint32_t x, int fmt) {
+    return tw_texel16(row, x, fmt) | (tw_texel16(row + pitch, x, fmt) << 16);
+}
+
+/* Two 8-bit texels side by side, each with the one below it */
+static inline uint32_t tw_quad8(const uint8_t *row, int32_t pitch,
+                                uint32_t x) {
+    const uint8_t *next = row + pitch;
+
+    return row[x] | (next[x] << 8) | (row[x + 1] << 16) |
+           ((uint32_t)next[x + 1] << 24);
+}
+
+/* A 2x4 block of 4-bit texels, from the byte at x of four rows */
+static inline uint32_t tw_nib4(const uint8_t *row, int32_t pitch, uint32_t x) {
+    uint32_t a = row[x], b = (row + pitch)[x];
+    uint32_t c = (row + 2 * pitch)[x], d = (row + 3 * pitch)[x];
+
+    return (a & 15) | ((b & 15) << 4) | ((a >> 4) << 8) | ((b >> 4) << 12) |
+           ((c & 15) << 16) | ((d & 15) << 20) | ((c >> 4) << 24) |
+           ((d >> 4) << 28);
+}
+
+/* Fill in the eight words of output line n. fmt should be a constant so that
+   this gets specialized for each format. */
+static inline void txr_twiddle_line(const txr_twiddle_t *tw, uint32_t n,
+                                    uint32_t *out, int fmt) {
+    uint32_t tile = n >> tw->lines_log2;
+    uint32_t k = n & ((1U << tw->lines_log2) - 1);
+    uint32_t x, y;
+    const uint8_t *r;
+    int32_t p = tw->pitch;
+
+    /* Top left of the block, in output coordinates */
+    switch(fmt) {
+        case TW_FMT_4BPP:
+            x = tw_even(k >> 1) << 3;
+            y = tw_even(k) << 3;
+            break;
+        case TW_FMT_8BPP:
+            x = tw_even(k) << 2;
+            y = tw_even(k >> 1) << 3;
+            break;
+        default:
+            x = tw_even(k >> 1) << 2;
+            y = tw_even(k) << 2;
+            break;
+    }
+
+    if(tw->tiles_in_x)
+        x += tile << tw->tile_log2;
+    else
+        y += tile << tw->tile_log2;
+
+    r = tw->src + (int32_t)y * p;
+
+    switch(fmt) {
+        case TW_FMT_4BPP:
+            x >>= 1;
+            out[0] = tw_nib4(r, p, x);
+            out[1] = tw_nib4(r, p, x + 1);
+            out[2] = tw_nib4(r + 4 * p, p, x);
+            out[3] = tw_nib4(r + 4 * p, p, x + 1);
+            out[4] = tw_nib4(r, p, x + 2);
+            out[5] = tw_nib4(r, p, x + 3);
+            out[6] = tw_nib4(r + 4 * p, p, x + 2);
+            out[7] = tw_nib4(r + 4 * p, p, x + 3);
+            break;
+
+        case TW_FMT_8BPP:
+            out[0] = tw_quad8(r, p, x);
+            out[1] = tw_quad8(r + 2 * p, p, x);
+            out[2] = tw_quad8(r, p, x + 2);
+            out[3] = tw_quad8(r + 2 * p, p, x + 2);
+            out[4] = tw_quad8(r + 4 * p, p, x);
+            out[5] = tw_quad8(r + 6 * p, p, x);
+            out[6] = tw_quad8(r + 4 * p, p, x + 2);
+            out[7] = tw_quad8(r + 6 * p, p, x + 2);
+            break;
+
+        default:
+            out[0] = tw_pair16(r, p, x, fmt);
+            out[1] = tw_pair16(r, p, x + 1, fmt);
+            out[2] = tw_pair16(r + 2 * p, p, x, fmt);
+            out[3] = tw_pair16(r + 2 * p, p, x + 1, fmt);
+            out[4] = tw_pair16(r, p, x + 2, fmt);
+            out[5] = tw_pair16(r, p, x + 3, fmt);
+            out[6] = tw_pair16(r + 2 * p, p, x + 2, fmt);
+            out[7] = tw_pair16(r + 2 * p, p, x + 3, fmt);
+            break;
+    }
+}
+
+#endif /* __PVR_TWIDDLE_H */
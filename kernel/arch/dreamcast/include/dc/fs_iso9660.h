@@ -29,10 +29,97 @@
 #include <kos/cdefs.h>
 __BEGIN_DECLS
 
+#include <stddef.h>
+#include <stdint.h>
+
 /** \addtogroup gdrom
     @{
 */
 
+/** \brief  Set the readahead of a file.
+
+    Pass a pointer to a uint32_t holding the number of bytes to read ahead
+    (rounded up to whole sectors, and at most \ref ISO_READAHEAD_MAX), or 0 to
+    turn readahead off, which is the default.
+
+    With readahead, reads smaller than that come out of a buffer that's filled
+    that many bytes at a time, so a file that's read a bit at a time (like
+    music) only needs the drive now and then, even while other files are being
+    read. The buffers are shared by all files; there are enough of them for 4
+    files at a time.
+*/
+#define IOCTL_ISO9660_READAHEAD     0x8100
+
+/** \brief  Get the statistics of a file.
+
+    Pass a pointer to an \ref iso_stats_t to fill in.
+*/
+#define IOCTL_ISO9660_STATS         0x8101
+
+/** \brief  Largest readahead for \ref IOCTL_ISO9660_READAHEAD. */
+#define ISO_READAHEAD_MAX           (16 * 2048)
+
+/** \brief  Statistics of an open file.
+
+    Only one file can use the drive at a time. Files waiting for it are let in
+    by where they want to read on the disc, to keep the drive from seeking back
+    and forth between them. These statistics show how well that's working.
+*/
+typedef struct iso_stats {
+    uint64_t bytes;         /**< \brief Bytes read */
+    uint64_t time_us;       /**< \brief Time spent in read(), waiting included */
+    uint32_t bytes_per_sec; /**< \brief bytes over time_us */
+    uint32_t reads;         /**< \brief Commands sent to the drive */
+    uint32_t seeks;         /**< \brief Commands that didn't start where
+                                        the drive last stopped */
+    uint32_t ra_hits;       /**< \brief Reads served from the readahead
+                                        buffer without the drive */
+} iso_stats_t;
+
+/** \brief  Statistics of the block cache.
+
+    The block cache holds directory ("inode") sectors and sectors of files
+    that are read in pieces smaller than a sector, or that aren't aligned.
+    \see iso_cache_get_stats()
+*/
+typedef struct iso_cache_stats {
+    uint32_t inode_hits;    /**< \brief Directory sectors found in the cache */
+    uint32_t inode_misses;  /**< \brief Directory sectors read from the disc */
+    uint32_t data_hits;     /**< \brief File sectors found in the cache */
+    uint32_t data_misses;   /**< \brief File sectors read from the disc */
+    uint32_t reads;         /**< \brief Commands sent to the drive */
+    uint32_t sectors;       /**< \brief Sectors those commands read */
+    uint32_t blocks;        /**< \brief Blocks in use right now */
+} iso_cache_stats_t;
+
+/** \brief  Resize the block cache.
+
+    By default, the cache has 32 blocks of 2048 bytes, up to 16 of which can
+    hold directory sectors and up to 16 file sectors. The two kinds share the
+    blocks: either one can use blocks the other isn't using, up to its own
+    limit. When a file sector isn't in the cache, the sectors of the file that
+    come after it are read along with it (up to 8, or half the file sector
+    limit), so reading a file a little at a time goes to the disc less often.
+
+    Everything in the cache is thrown away. Don't call this while another
+    thread is using /cd.
+
+    \param  blocks          Number of blocks, at least 2.
+    \param  inode_max       Most blocks holding directory sectors.
+    \param  data_max        Most blocks holding file sectors.
+    \retval 0               On success.
+    \retval -1              On error, setting errno to EINVAL or ENOMEM. The
+                            cache is left as it was.
+*/
+int iso_cache_resize(size_t blocks, size_t inode_max, size_t data_max);
+
+/** \brief  Get the statistics of the block cache.
+
+    \return                 The statistics, counted since the cache was
+                            first set up.
+*/
+iso_cache_stats_t iso_cache_get_stats(void);
+
 /** \brief  Reset the internal ISO9660 cache.
 
     This function resets the cache of the ISO9660 driver, breaking connections
@@ -43,6 +130,24 @@ __BEGIN_DECLS
 */
 int iso_reset(void);
 
+/** \brief  Enable or disable the path index.
+
+    With the index enabled, the whole directory tree of each disc is read when
+    the disc is first accessed, and every path on it is kept in a hash table.
+    After that, opening or stat-ing a file takes no disc access at all, which
+    helps a lot when opening many small files. The index takes about 28 bytes
+    plus the length of the name for each file and directory on the disc. Discs
+    with more than 32768 of those are not indexed.
+
+    The index is disabled by default. If a disc is already in use, enabling it
+    indexes that disc right away.
+
+    \param  enable          Non-zero to enable the index, zero to disable it
+                            and free it.
+    \retval 0               On success.
+*/
+int iso_index_enable(int enable);
+
 /* \cond */
 void fs_iso9660_init(void);
 void fs_iso9660_shutdown(void);
@@ -34,31 +34,64 @@ __BEGIN_DECLS
     With this API, programs can set probe points in different functional blocks
     and later obtain statistics about the execution of said functional blocks.
 
+    Besides the totals, the worst time spent in each block is kept. Blocks
+    monitored with perf_monitor_hist() also keep a histogram of their times,
+    from which perf_monitor_print() reports the median and 99th percentile.
+
+    To find out what happened during a particular frame, tracing can be turned
+    on with perf_monitor_trace_start(). Every run through a monitored block
+    then records a begin and an end event, with a timestamp, the thread ID and
+    both performance counters, into a ring buffer. The buffer can be written
+    out with perf_monitor_trace_dump() in the Chrome trace event JSON format,
+    which can be opened in Perfetto (https://ui.perfetto.dev) or
+    chrome://tracing.
+
     @{
 */
 
 /** /cond */
+#define PERF_MONITOR_HIST_SIZE  128
+
+struct perf_monitor_hist {
+    uint32_t buckets[PERF_MONITOR_HIST_SIZE];
+};
+
 struct perf_monitor {
     const char *fn;
     unsigned int line;
+    struct perf_monitor_hist *hist;
     uint64_t calls;
-    uint64_t time_ns, time_start;
-    uint64_t event0, event0_start;
-    uint64_t event1, event1_start;
+    uint64_t time_ns, time_max;
+    uint64_t event0;
+    uint64_t event1;
+};
+
+/* State of one run through a monitored block */
+struct perf_monitor_run {
+    struct perf_monitor *monitor;
+    uint64_t time_start;
+    uint64_t event0_start;
+    uint64_t event1_start;
 };
 
-void __stop_perf_monitor(struct perf_monitor **monitor);
+void __stop_perf_monitor(struct perf_monitor_run *run);
 
-struct perf_monitor *__start_perf_monitor(struct perf_monitor *monitor);
+struct perf_monitor_run __start_perf_monitor(struct perf_monitor *monitor);
 
-#define __perf_monitor(f, l) \
+#define __perf_monitor(f, l, h) \
     static struct perf_monitor __perf_monitor_##l \
-        __attribute__((section(".monitors"))) = { f, l, }; \
-    struct perf_monitor *___perf_monitor_##l \
+        __attribute__((section(".monitors"))) = { f, l, h, }; \
+    struct perf_monitor_run ___perf_monitor_##l \
         __attribute__((cleanup(__stop_perf_monitor))) = \
         __start_perf_monitor(&__perf_monitor_##l)
 
-#define _perf_monitor(f, l) __perf_monitor(f, l)
+#define _perf_monitor(f, l) __perf_monitor(f, l, NULL)
+
+#define __perf_monitor_hist(f, l) \
+    static struct perf_monitor_hist __perf_monitor_hist_##l; \
+    __perf_monitor(f, l, &__perf_monitor_hist_##l)
+
+#define _perf_monitor_hist(f, l) __perf_monitor_hist(f, l)
 
 #define __perf_monitor_if(f, l, tst) ({ \
     static struct perf_monitor __perf_monitor_##l \
@@ -77,6 +110,15 @@ struct perf_monitor *__start_perf_monitor(struct perf_monitor *monitor);
 */
 #define perf_monitor() _perf_monitor(__func__, __LINE__)
 
+/** \brief  Register a performance monitor that keeps a latency histogram
+
+    This works like perf_monitor(), but also sorts the time of every run
+    through the block into a histogram, so that perf_monitor_print() can
+    report the median and 99th percentile. The histogram takes another 512
+    bytes for each block monitored this way.
+*/
+#define perf_monitor_hist() _perf_monitor_hist(__func__, __LINE__)
+
 /** \brief  Register a performance monitor for branch likeliness analysis
 
     This macro is designed to be used inside an "if" expression, for instance:
@@ -105,7 +147,8 @@ void perf_monitor_init(perf_cntr_event_t event1, perf_cntr_event_t event2);
 /** \brief  De-initialize the performance monitor system
 
     After this function is called, the performance counter API can be
-    used again.
+    used again. This also stops tracing and frees the trace buffer, so like
+    perf_monitor_trace_start() it must not be called from an interrupt.
 */
 void perf_monitor_exit(void);
 
@@ -115,6 +158,39 @@ void perf_monitor_exit(void);
 */
 void perf_monitor_print(FILE *f);
 
+/** \brief  Start recording trace events
+
+    Allocates a ring buffer for the given number of events (rounded up to a
+    power of two), or reuses the existing one if it's the same size, and
+    starts recording into it. Each run through a monitored block uses two
+    events. Once the buffer is full the oldest events are overwritten.
+
+    Recording is lock-free and may happen from any thread or interrupt. This
+    function has to wait for anyone still recording an event to finish before
+    it can replace the buffer, so it must not be called from an interrupt.
+
+    \param  nevents         The size of the buffer, in events.
+    \retval 0               On success.
+    \retval -1              If the buffer could not be allocated.
+*/
+int perf_monitor_trace_start(size_t nevents);
+
+/** \brief  Stop recording trace events
+
+    The events recorded so far are kept until tracing is started again or
+    perf_monitor_exit() is called.
+*/
+void perf_monitor_trace_stop(void);
+
+/** \brief  Write recorded trace events as Chrome trace event JSON
+
+    Tracing should be stopped first.
+
+    \param  f               The file to write to.
+    \return                 The number of events written, or -1 on error.
+*/
+int perf_monitor_trace_dump(FILE *f);
+
 /** @} */
 
 __END_DECLS
@@ -24,6 +24,7 @@
 #ifndef __DC_PVR_PVR_MEM_H
 #define __DC_PVR_PVR_MEM_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <kos/cdefs.h>
@@ -48,9 +49,63 @@ typedef void *pvr_ptr_t;
     \brief                   Memory management API for VRAM
     \ingroup                 pvr_vram
 
-    PVR memory management in KOS uses a modified dlmalloc; see the
-    source file pvr_mem_core.c for more info.
+    PVR memory management in KOS uses a TLSF (two-level segregated fit)
+    allocator whose bookkeeping lives entirely in main RAM, so allocating and
+    freeing never touches VRAM itself. Both run in constant time regardless of
+    how many blocks are allocated.
+
+    Blocks may optionally be registered as movable with pvr_mem_set_movable(),
+    which allows pvr_mem_compact() to defragment the pool by moving them.
+*/
+
+/** \defgroup pvr_mem_hints  Allocation hints
+    \brief                   Placement hints for pvr_mem_malloc_ex()
+    \ingroup                 pvr_mem_mgmt
+
+    Textures are placed from the bottom of the pool up by default. Buffers
+    that are allocated once and kept around (like vertex buffers or render
+    targets) can be placed from the top of the pool down instead, which keeps
+    them out of the way of textures that come and go.
+
+    @{
+*/
+#define PVR_MEM_HINT_TEXTURE    0x00    /**< \brief Bottom-up placement */
+#define PVR_MEM_HINT_TOP        0x01    /**< \brief Top-down placement */
+#define PVR_MEM_HINT_BUFFER     PVR_MEM_HINT_TOP    /**< \brief Long-lived buffers */
+/** @} */
+
+/** \brief   PVR RAM pool statistics.
+    \ingroup pvr_mem_mgmt
+
+    \see    pvr_mem_get_info()
 */
+typedef struct pvr_mem_info {
+    size_t total;               /**< \brief Size of the pool */
+    size_t used;                /**< \brief Bytes allocated */
+    size_t free;                /**< \brief Bytes not allocated */
+    size_t largest_free;        /**< \brief Largest block that can be allocated */
+    size_t used_blocks;         /**< \brief Number of allocated blocks */
+    size_t free_blocks;         /**< \brief Number of free blocks */
+    size_t overhead;            /**< \brief Main RAM used for bookkeeping */
+
+    /** \brief Percentage of the free space that is not in the largest free
+               block. 0 means all free space is contiguous. */
+    unsigned int fragmentation;
+} pvr_mem_info_t;
+
+/** \brief   Relocation callback for movable blocks.
+    \ingroup pvr_mem_mgmt
+
+    Called by pvr_mem_compact() once a block has been moved. The callback
+    should update every reference to the block (texture pointers in polygon
+    headers, etc).
+
+    \param  old_ptr         Where the block used to be
+    \param  new_ptr         Where the block is now
+    \param  data            The pointer given to pvr_mem_set_movable()
+*/
+typedef void (*pvr_mem_reloc_cb)(pvr_ptr_t old_ptr, pvr_ptr_t new_ptr,
+                                 void *data);
 
 /** \brief   Allocate a chunk of memory from texture space.
     \ingroup pvr_mem_mgmt
@@ -66,6 +121,21 @@ typedef void *pvr_ptr_t;
 */
 pvr_ptr_t pvr_mem_malloc(size_t size);
 
+/** \brief   Allocate a chunk of memory from texture space, with hints.
+    \ingroup pvr_mem_mgmt
+
+    This works like pvr_mem_malloc(), but allows asking for a stricter
+    alignment and choosing where in the pool the block goes.
+
+    \param  size            The amount of memory to allocate
+    \param  align           The alignment of the block, a power of two. Values
+                            below 32 (including 0) mean 32.
+    \param  flags           One of the \ref pvr_mem_hints
+
+    \return                 A pointer to the memory on success, NULL on error
+*/
+pvr_ptr_t pvr_mem_malloc_ex(size_t size, size_t align, int flags);
+
 /** \brief   Free a block of allocated memory in the PVR RAM pool.
     \ingroup pvr_mem_mgmt
 
@@ -98,6 +168,44 @@ void pvr_mem_reset(void);
 */
 void pvr_mem_initialize(pvr_ptr_t pvr_texture_base, size_t available_memory);
 
+/** \brief   Allow a block to be moved by pvr_mem_compact().
+    \ingroup pvr_mem_mgmt
+
+    Blocks are not movable by default. Once registered, a block may be moved
+    to a lower address by pvr_mem_compact(), and the callback is then called
+    with its old and new addresses.
+
+    \param  chunk           A block returned by pvr_mem_malloc()
+    \param  cb              The relocation callback, or NULL to make the
+                            block unmovable again
+    \param  data            Passed to the callback
+    \retval 0               On success
+    \retval -1              If chunk isn't allocated, or out of memory
+*/
+int pvr_mem_set_movable(pvr_ptr_t chunk, pvr_mem_reloc_cb cb, void *data);
+
+/** \brief   Defragment the PVR RAM pool.
+    \ingroup pvr_mem_mgmt
+
+    Slides every movable block down into the free space below it, so that the
+    free space gathers above. Unmovable blocks stay where they are, and movable
+    blocks never cross them.
+
+    The data is copied through the CPU, and the PVR must not be using any of
+    the movable blocks while this runs. Call it between frames, after
+    pvr_wait_ready() and before pvr_scene_begin().
+
+    \return                 The number of bytes moved
+*/
+size_t pvr_mem_compact(void);
+
+/** \brief   Get statistics about the PVR RAM pool.
+    \ingroup pvr_mem_mgmt
+
+    \param  info            Filled in with the statistics
+*/
+void pvr_mem_get_info(pvr_mem_info_t *info);
+
 /** \brief   Print the list of allocated blocks in the PVR RAM pool.
     \ingroup pvr_mem_mgmt
 
@@ -108,7 +216,7 @@ void pvr_mem_print_list(void);
 /** \brief   Print statistics about the PVR RAM pool.
     \ingroup pvr_mem_mgmt
 
-    This prints out statistics like what malloc_stats() provides. Also, if
+    This prints out the statistics from pvr_mem_get_info(). Also, if
     KM_DBG is enabled in pvr_mem.c, it prints the list of allocated blocks.
 */
 void pvr_mem_stats(void);
@@ -107,6 +107,9 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
 #define PVR_TXRLOAD_4BPP            0x01    /**< \brief 4BPP format */
 #define PVR_TXRLOAD_8BPP            0x02    /**< \brief 8BPP format */
 #define PVR_TXRLOAD_16BPP           0x03    /**< \brief 16BPP format */
+#define PVR_TXRLOAD_32BPP_ARGB4444  0x04    /**< \brief ARGB8888, converted to ARGB4444 */
+#define PVR_TXRLOAD_32BPP_RGB565    0x05    /**< \brief ARGB8888, converted to RGB565 */
+#define PVR_TXRLOAD_32BPP_ARGB1555  0x06    /**< \brief ARGB8888, converted to ARGB1555 */
 #define PVR_TXRLOAD_FMT_MASK        0x0f    /**< \brief Bits used for basic formats */
 
 #define PVR_TXRLOAD_VQ_LOAD         0x10    /**< \brief Do VQ encoding (not supported yet, if ever) */
@@ -126,16 +129,23 @@ void pvr_txr_load(const void *src, pvr_ptr_t dst, size_t count);
     This function loads a texture to the PVR's RAM with the specified set of
     flags. It will currently always twiddle the data, whether you ask it to or
     not, and many of the parameters are just plain not supported at all...
-    Pretty much the only supported flag, other than the format ones is the
-    PVR_TXRLOAD_INVERT_Y one.
+    Pretty much the only supported flags, other than the format ones, are
+    PVR_TXRLOAD_INVERT_Y and PVR_TXRLOAD_SQ (the store queues are always used).
+
+    32-bit ARGB8888 source data can be converted to one of the 16-bit formats
+    while twiddling, with PVR_TXRLOAD_32BPP_ARGB4444, PVR_TXRLOAD_32BPP_RGB565
+    or PVR_TXRLOAD_32BPP_ARGB1555. Each 32-bit texel is read as a native
+    (little-endian) word, with alpha in the top byte.
 
     This will be slower than using pvr_txr_load() in pretty much all cases, so
     unless you need to twiddle your texture, just use that instead.
 
     \param  src             The location to copy from.
     \param  dst             The location to copy to.
-    \param  w               The width of the texture, in pixels.
-    \param  h               The height of the texture, in pixels.
+    \param  w               The width of the texture, in pixels (a power of
+                            two, from 8 to 1024).
+    \param  h               The height of the texture, in pixels (a power of
+                            two, from 8 to 1024).
     \param  flags           Some set of flags, ORed together.
 
     \see    pvr_txrload_constants
@@ -299,6 +299,20 @@ int vmufs_mutex_lock(void);
 */
 int vmufs_mutex_unlock(void);
 
+/** \brief  Throw away the cached metadata for a VMU.
+
+    The higher level functions keep a copy of each card's root block,
+    directory and FAT between calls. The VMU driver calls this whenever a card
+    is plugged in or removed, and the low-level write functions above call it
+    too. If you write to a card's system blocks some other way (for instance
+    with vmu_block_write()), call it yourself afterwards.
+
+    This is safe to call from an interrupt.
+
+    \param  dev             The VMU whose cache to throw away.
+*/
+void vmufs_cache_invalidate(maple_device_t *dev);
+
 
 /* ****************** Higher level functions ******************** */
 
@@ -4,26 +4,150 @@
    Copyright (C) 2024 Paul Cercueil
 */
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <kos/thread.h>
 #include <kos/timer.h>
 #include <dc/perf_monitor.h>
 
 extern struct perf_monitor _monitors_start, _monitors_end;
 
-void __stop_perf_monitor(struct perf_monitor **monitor) {
-    struct perf_monitor *data = *monitor;
+/* One entry of the trace ring buffer. For end events, the counters are the
+   number of events since the matching begin. */
+typedef struct perf_trace_ev {
+    uint64_t time_ns;
+    uint64_t event0;
+    uint64_t event1;
+    const struct perf_monitor *monitor;
+    tid_t tid;
+    char type;
+} perf_trace_ev_t;
+
+static perf_trace_ev_t *trace_buf;
+static size_t trace_size;
+static atomic_size_t trace_head;
+static atomic_bool trace_on;
+static atomic_uint trace_writers;   /* Recording an event right now */
+
+static void perf_trace_event(const struct perf_monitor *monitor, char type,
+                             uint64_t time_ns, uint64_t event0,
+                             uint64_t event1) {
+    perf_trace_ev_t *ev;
+
+    /* Tracing might have been stopped since the caller looked. Once it has,
+       the buffer is left alone until this count drops back to zero. */
+    atomic_fetch_add(&trace_writers, 1);
+
+    if(atomic_load(&trace_on)) {
+        /* Claim a slot; writers never wait on each other. */
+        ev = &trace_buf[atomic_fetch_add(&trace_head, 1) & (trace_size - 1)];
+
+        ev->time_ns = time_ns;
+        ev->event0 = event0;
+        ev->event1 = event1;
+        ev->tid = thd_current ? thd_current->tid : 0;
+        ev->type = type;
+        ev->monitor = monitor;
+    }
+
+    atomic_fetch_sub(&trace_writers, 1);
+}
+
+/* Stop recording, and wait for anyone who is still writing an event out */
+static void perf_trace_quiesce(void) {
+    atomic_store(&trace_on, false);
+
+    while(atomic_load(&trace_writers))
+        thd_pass();
+}
+
+/* Histogram buckets have 4 steps per power of two: within 25% or so. */
+static unsigned int perf_hist_bucket(uint64_t ns) {
+    unsigned int b;
+
+    if(ns < 4)
+        return ns;
+
+    if(ns >> 32)
+        return PERF_MONITOR_HIST_SIZE - 1;
+
+    b = 31 - __builtin_clz((uint32_t)ns);
+    return (b - 1) * 4 + ((ns >> (b - 2)) & 3);
+}
+
+/* Largest time that falls in a bucket */
+static uint64_t perf_hist_value(unsigned int idx) {
+    unsigned int b = idx / 4 + 1;
+
+    if(idx < 4)
+        return idx;
+
+    return ((uint64_t)(4 + (idx & 3) + 1) << (b - 2)) - 1;
+}
+
+static uint64_t perf_hist_percentile(const struct perf_monitor *monitor,
+                                     unsigned int pct) {
+    uint64_t total = 0, target, seen = 0, val;
+    unsigned int i;
+
+    for(i = 0; i < PERF_MONITOR_HIST_SIZE; i++)
+        total += monitor->hist->buckets[i];
+
+    if(!total)
+        return 0;
 
-    data->event0 += perf_cntr_count(PRFC0) - data->event0_start;
-    data->event1 += perf_cntr_count(PRFC1) - data->event1_start;
-    data->time_ns += timer_ns_gettime64() - data->time_start;
+    target = (total * pct + 99) / 100;
+
+    for(i = 0; i < PERF_MONITOR_HIST_SIZE; i++) {
+        seen += monitor->hist->buckets[i];
+
+        if(seen >= target)
+            break;
+    }
+
+    val = perf_hist_value(i);
+    return val < monitor->time_max ? val : monitor->time_max;
 }
 
-struct perf_monitor *__start_perf_monitor(struct perf_monitor *data) {
+void __stop_perf_monitor(struct perf_monitor_run *run) {
+    struct perf_monitor *data = run->monitor;
+    uint64_t time_ns = timer_ns_gettime64();
+    uint64_t event0 = perf_cntr_count(PRFC0) - run->event0_start;
+    uint64_t event1 = perf_cntr_count(PRFC1) - run->event1_start;
+
+    time_ns -= run->time_start;
+
+    data->event0 += event0;
+    data->event1 += event1;
+    data->time_ns += time_ns;
+
+    if(data->hist)
+        data->hist->buckets[perf_hist_bucket(time_ns)]++;
+
+    if(time_ns > data->time_max)
+        data->time_max = time_ns;
+
+    if(atomic_load(&trace_on))
+        perf_trace_event(data, 'E', run->time_start + time_ns, event0, event1);
+}
+
+struct perf_monitor_run __start_perf_monitor(struct perf_monitor *data) {
+    struct perf_monitor_run run;
+
     data->calls++;
-    data->time_start = timer_ns_gettime64();
-    data->event0_start = perf_cntr_count(PRFC0);
-    data->event1_start = perf_cntr_count(PRFC1);
+    run.monitor = data;
+    run.time_start = timer_ns_gettime64();
+    run.event0_start = perf_cntr_count(PRFC0);
+    run.event1_start = perf_cntr_count(PRFC1);
 
-    return data;
+    if(atomic_load(&trace_on))
+        perf_trace_event(data, 'B', run.time_start, run.event0_start,
+                         run.event1_start);
+
+    return run;
 }
 
 void perf_monitor_init(perf_cntr_event_t event1, perf_cntr_event_t event2) {
@@ -37,6 +161,11 @@ void perf_monitor_init(perf_cntr_event_t event1, perf_cntr_event_t event2) {
 }
 
 void perf_monitor_exit(void) {
+    perf_trace_quiesce();
+    free(trace_buf);
+    trace_buf = NULL;
+    trace_size = 0;
+
     perf_cntr_stop(PRFC0);
     perf_cntr_stop(PRFC1);
 
@@ -60,5 +189,85 @@ void perf_monitor_print(FILE *f) {
                 monitor->event0 ? (float)monitor->event0 / (float)monitor->calls : 0.0f,
                 monitor->event1,
                 monitor->event1 ? (float)monitor->event1 / (float)monitor->calls : 0.0f);
+
+        /* Branch monitors don't measure time */
+        if(monitor->hist) {
+            fprintf(f, "\t\tlatency: p50 %llu ns, p99 %llu ns, max %llu ns\n",
+                    perf_hist_percentile(monitor, 50),
+                    perf_hist_percentile(monitor, 99), monitor->time_max);
+        }
+        else if(monitor->time_ns) {
+            fprintf(f, "\t\tlatency: max %llu ns\n", monitor->time_max);
+        }
+    }
+}
+
+int perf_monitor_trace_start(size_t nevents) {
+    size_t size = 1;
+
+    while(size < nevents)
+        size <<= 1;
+
+    perf_trace_quiesce();
+
+    if(size != trace_size) {
+        free(trace_buf);
+        trace_size = 0;
+
+        trace_buf = calloc(size, sizeof(perf_trace_ev_t));
+        if(!trace_buf)
+            return -1;
+
+        trace_size = size;
+    }
+    else {
+        memset(trace_buf, 0, size * sizeof(perf_trace_ev_t));
     }
+
+    atomic_store(&trace_head, 0);
+    atomic_store(&trace_on, true);
+
+    return 0;
+}
+
+void perf_monitor_trace_stop(void) {
+    atomic_store(&trace_on, false);
+}
+
+int perf_monitor_trace_dump(FILE *f) {
+    const perf_trace_ev_t *ev;
+    size_t head, n, i;
+    const char *sep = "";
+    int written = 0;
+
+    if(!trace_buf)
+        return 0;
+
+    head = atomic_load(&trace_head);
+    n = head < trace_size ? head : trace_size;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    for(i = head - n; i < head; i++) {
+        ev = &trace_buf[i & (trace_size - 1)];
+
+        /* A slot that was claimed but never filled in */
+        if(!ev->monitor)
+            continue;
+
+        fprintf(f, "%s{\"name\":\"%s L%u\",\"cat\":\"perf_monitor\","
+                "\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"%s0\":%llu,\"%s1\":%llu}}", sep,
+                ev->monitor->fn, ev->monitor->line, ev->type,
+                ev->time_ns / 1000, (unsigned int)(ev->time_ns % 1000),
+                ev->tid, ev->type == 'B' ? "prfc" : "event", ev->event0,
+                ev->type == 'B' ? "prfc" : "event", ev->event1);
+        sep = ",\n";
+        written++;
+    }
+
+    if(fprintf(f, "\n]}\n") < 0)
+        return -1;
+
+    return written;
 }
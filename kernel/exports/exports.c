@@ -9,14 +9,15 @@
 /*
 
 Just a quick interface to actually make use of all those nifty kernel
-export tables. This just does a linear search through the two tables
-to look for a symbol, for now. This should be optimized later with a
-binary search or something, but loading a new program is generally expected
-to be a somewhat slow process anyway.
+export tables. Each table generated by genexports.sh comes with a hash index
+on the symbol names, which export_lookup() uses when a symtab provides it.
+Tables without one are searched linearly. For export_lookup_addr(), the kernel
+tables are sorted by address at init time and binary searched.
 
 */
 
 #include <string.h>
+#include <stdlib.h>
 #include <kos/nmmgr.h>
 #include <kos/exports.h>
 
@@ -29,7 +30,9 @@ static symtab_handler_t st_kern = {
         NMMGR_TYPE_SYMTAB,
         NMMGR_LIST_INIT
     },
-    kernel_symtab
+    kernel_symtab,
+    &kernel_symtab_hash,
+    NULL, 0         /* Address index, built in export_init() */
 };
 
 static symtab_handler_t st_arch = {
@@ -41,7 +44,9 @@ static symtab_handler_t st_arch = {
         NMMGR_TYPE_SYMTAB,
         NMMGR_LIST_INIT
     },
-    arch_symtab
+    arch_symtab,
+    &arch_symtab_hash,
+    NULL, 0         /* Address index, built in export_init() */
 };
 
 static symtab_handler_t st_subarch = {
@@ -53,10 +58,77 @@ static symtab_handler_t st_subarch = {
         NMMGR_TYPE_SYMTAB,
         NMMGR_LIST_INIT
     },
-    subarch_symtab
+    subarch_symtab,
+    &subarch_symtab_hash,
+    NULL, 0         /* Address index, built in export_init() */
 };
 
+/* Must match the hash computed by utils/genexports/genexports.sh */
+static uint32_t export_hash(const char *name) {
+    uint32_t h = 5381;
+
+    while(*name)
+        h = h * 33 + (uint8_t)*name++;
+
+    return h;
+}
+
+static export_sym_t *symtab_find(symtab_handler_t *sth, const char *name,
+                                 uint32_t h) {
+    const export_hash_t *hash = sth->hash;
+    uint16_t slot;
+    int i;
+
+    if(hash) {
+        for(h &= hash->mask; (slot = hash->slots[h]); h = (h + 1) & hash->mask) {
+            if(!strcmp(name, sth->table[slot - 1].name))
+                return sth->table + slot - 1;
+        }
+
+        return NULL;
+    }
+
+    for(i = 0; sth->table[i].name; i++) {
+        if(!strcmp(name, sth->table[i].name))
+            return sth->table + i;
+    }
+
+    return NULL;
+}
+
+static int addr_cmp(const void *a, const void *b) {
+    const export_sym_t *sa = *(export_sym_t * const *)a;
+    const export_sym_t *sb = *(export_sym_t * const *)b;
+
+    if(sa->ptr < sb->ptr)
+        return -1;
+
+    return sa->ptr > sb->ptr;
+}
+
+/* Build the by-address index for a symtab. If we can't, lookups by address
+   just fall back to a linear scan. */
+static void symtab_index(symtab_handler_t *sth) {
+    size_t i, cnt;
+
+    for(cnt = 0; sth->table[cnt].name; cnt++)
+        ;
+
+    if(!cnt || !(sth->by_addr = malloc(cnt * sizeof(export_sym_t *))))
+        return;
+
+    for(i = 0; i < cnt; i++)
+        sth->by_addr[i] = sth->table + i;
+
+    qsort(sth->by_addr, cnt, sizeof(export_sym_t *), addr_cmp);
+    sth->count = cnt;
+}
+
 void export_init(void) {
+    symtab_index(&st_kern);
+    symtab_index(&st_arch);
+    symtab_index(&st_subarch);
+
     /* Add our two export tables */
     nmmgr_handler_add(&st_kern.nmmgr);
     nmmgr_handler_add(&st_arch.nmmgr);
@@ -66,8 +138,9 @@ void export_init(void) {
 export_sym_t *export_lookup(const char *name) {
     nmmgr_handler_t *nmmgr;
     nmmgr_list_t *nmmgrs;
-    int i;
     symtab_handler_t *sth;
+    export_sym_t *sym;
+    uint32_t h = export_hash(name);
 
     /* Get the name manager list */
     nmmgrs = nmmgr_get_list();
@@ -80,14 +153,8 @@ export_sym_t *export_lookup(const char *name) {
 
         sth = (symtab_handler_t *)nmmgr;
 
-        /* First look through the kernel table */
-        for(i = 0; /* */; i++) {
-            if(sth->table[i].name == NULL)
-                break;
-
-            if(!strcmp(name, sth->table[i].name))
-                return sth->table + i;
-        }
+        if((sym = symtab_find(sth, name, h)))
+            return sym;
     }
 
     return NULL;
@@ -95,8 +162,6 @@ export_sym_t *export_lookup(const char *name) {
 
 export_sym_t *export_lookup_path(const char *name, const char *path) {
     nmmgr_handler_t *nmmgr;
-    symtab_handler_t *sth;
-    int i;
 
     /* Get the name manager list */
     nmmgr = nmmgr_lookup(path);
@@ -104,20 +169,15 @@ export_sym_t *export_lookup_path(const char *name, const char *path) {
     if(nmmgr == NULL) {
         return NULL;
     }
-    sth = (symtab_handler_t *)nmmgr;
 
-    for(i = 0; sth->table[i].name; i++) {
-        if(!strcmp(name, sth->table[i].name))
-            return sth->table + i;
-    }
-
-    return NULL;
+    return symtab_find((symtab_handler_t *)nmmgr, name, export_hash(name));
 }
 
 export_sym_t *export_lookup_addr(uintptr_t addr) {
     nmmgr_handler_t *nmmgr;
     nmmgr_list_t *nmmgrs;
     int i;
+    size_t lo, hi, mid;
     symtab_handler_t *sth;
 
     uintptr_t dist = ~0;
@@ -134,7 +194,28 @@ export_sym_t *export_lookup_addr(uintptr_t addr) {
 
         sth = (symtab_handler_t *)nmmgr;
 
-        /* First look through the kernel table */
+        if(sth->by_addr) {
+            /* Find the last entry at or below the address */
+            lo = 0;
+            hi = sth->count;
+
+            while(lo < hi) {
+                mid = lo + (hi - lo) / 2;
+
+                if(sth->by_addr[mid]->ptr <= addr)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+
+            if(lo && addr - sth->by_addr[lo - 1]->ptr < dist) {
+                dist = addr - sth->by_addr[lo - 1]->ptr;
+                best = sth->by_addr[lo - 1];
+            }
+
+            continue;
+        }
+
         for(i = 0; sth->table[i].name; i++) {
             if(addr - sth->table[i].ptr < dist) {
                 dist = addr - sth->table[i].ptr;
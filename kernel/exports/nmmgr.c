@@ -13,8 +13,16 @@ by a module or the kernel, they can be VFS handlers, they can be just about
 anything. The only requirement is that they implement the nmmgr_handler_t
 interface at the front of their struct.
 
+Since every file operation starts with a lookup here, lookups go through a
+case-insensitive prefix tree of the handler names rather than comparing the
+path against each handler. The tree is rebuilt from the handler list whenever
+a handler is added or removed and swapped in whole, so lookups never lock.
+Old trees are only freed once no lookup can still be using them.
+
 */
 
+#include <ctype.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,6 +33,7 @@ interface at the front of their struct.
 #include <kos/nmmgr.h>
 #include <kos/mutex.h>
 #include <kos/exports.h>
+#include <kos/irq.h>
 
 /* Thread mutex for our name handler list */
 static mutex_t mutex = MUTEX_INITIALIZER;
@@ -33,8 +42,131 @@ static mutex_t mutex = MUTEX_INITIALIZER;
    describe how to handle a given path name. */
 static nmmgr_list_t nmmgr_handlers;
 
-/* Locate a name handler for a given path name */
-nmmgr_handler_t * nmmgr_lookup(const char *fn) {
+/* One character of a handler name. Children of a node are chained through
+   their sibling index; index 0 is the root, so it also means "none". */
+typedef struct nmmgr_node {
+    uint16_t        child;
+    uint16_t        sibling;
+    char            ch;         /* Lowercase */
+    nmmgr_handler_t *hnd;       /* Handler whose name ends here */
+} nmmgr_node_t;
+
+typedef struct nmmgr_index {
+    struct nmmgr_index *retired_next;
+    nmmgr_node_t nodes[];
+} nmmgr_index_t;
+
+/* Current tree, or NULL to search the list instead */
+static _Atomic(nmmgr_index_t *) index_cur;
+
+/* Lookups in progress, and trees replaced while some were */
+static atomic_uint index_readers;
+static nmmgr_index_t *index_retired;
+
+static nmmgr_index_t *nmmgr_index_build(void) {
+    nmmgr_handler_t *hnd;
+    nmmgr_index_t *idx;
+    nmmgr_node_t *nodes;
+    const char *p;
+    size_t total = 1;
+    unsigned int node, i, n = 1;
+    char c;
+
+    SLIST_FOREACH(hnd, &nmmgr_handlers, list_ent)
+        total += strlen(hnd->pathname);
+
+    if(total > UINT16_MAX)
+        return NULL;
+
+    idx = malloc(sizeof(nmmgr_index_t) + total * sizeof(nmmgr_node_t));
+    if(!idx)
+        return NULL;
+
+    nodes = idx->nodes;
+    nodes[0] = (nmmgr_node_t){ 0 };
+
+    SLIST_FOREACH(hnd, &nmmgr_handlers, list_ent) {
+        node = 0;
+
+        for(p = hnd->pathname; *p; p++) {
+            c = tolower((unsigned char)*p);
+
+            for(i = nodes[node].child; i && nodes[i].ch != c;
+                i = nodes[i].sibling)
+                ;
+
+            if(!i) {
+                i = n++;
+                nodes[i] = (nmmgr_node_t){
+                    .sibling = nodes[node].child, .ch = c
+                };
+                nodes[node].child = i;
+            }
+
+            node = i;
+        }
+
+        /* Earlier entries in the list take precedence for the same name */
+        if(node && !nodes[node].hnd)
+            nodes[node].hnd = hnd;
+    }
+
+    return idx;
+}
+
+/* Replace the tree after the list has changed. Call with the mutex held. */
+static void nmmgr_index_update(void) {
+    nmmgr_index_t *idx = NULL, *old;
+
+    /* Can't allocate in an interrupt; lookups will just search the list until
+       the next change. */
+    if(!irq_inside_int())
+        idx = nmmgr_index_build();
+
+    old = atomic_exchange(&index_cur, idx);
+
+    if(old) {
+        old->retired_next = index_retired;
+        index_retired = old;
+    }
+
+    /* A lookup that starts from now on will see the new tree, so if none is
+       running, none can be looking at the old ones. */
+    if(!atomic_load(&index_readers) && !irq_inside_int()) {
+        while((old = index_retired)) {
+            index_retired = old->retired_next;
+            free(old);
+        }
+    }
+}
+
+static nmmgr_handler_t *nmmgr_index_lookup(const nmmgr_index_t *idx,
+                                           const char *fn) {
+    const nmmgr_node_t *nodes = idx->nodes;
+    nmmgr_handler_t *cur = NULL;
+    unsigned int node = 0, i;
+    char c;
+
+    for(; *fn; fn++) {
+        c = tolower((unsigned char)*fn);
+
+        for(i = nodes[node].child; i && nodes[i].ch != c;
+            i = nodes[i].sibling)
+            ;
+
+        if(!i)
+            break;
+
+        node = i;
+
+        if(nodes[node].hnd)
+            cur = nodes[node].hnd;
+    }
+
+    return cur;
+}
+
+static nmmgr_handler_t *nmmgr_list_lookup(const char *fn) {
     nmmgr_handler_t *cur = NULL, *tmp;
     size_t          cur_len = 0, tmp_len;
 
@@ -49,6 +181,24 @@ nmmgr_handler_t * nmmgr_lookup(const char *fn) {
         }
     }
 
+    return cur;
+}
+
+/* Locate a name handler for a given path name */
+nmmgr_handler_t * nmmgr_lookup(const char *fn) {
+    nmmgr_index_t   *idx;
+    nmmgr_handler_t *cur;
+
+    atomic_fetch_add(&index_readers, 1);
+    idx = atomic_load(&index_cur);
+
+    if(idx)
+        cur = nmmgr_index_lookup(idx, fn);
+    else
+        cur = nmmgr_list_lookup(fn);
+
+    atomic_fetch_sub(&index_readers, 1);
+
     if(cur == NULL) {
         /* Couldn't find a handler */
         return NULL;
@@ -71,6 +221,7 @@ int nmmgr_handler_add(nmmgr_handler_t *hnd) {
     mutex_lock(&mutex);
 
     SLIST_INSERT_HEAD(&nmmgr_handlers, hnd, list_ent);
+    nmmgr_index_update();
 
     mutex_unlock(&mutex);
 
@@ -93,6 +244,7 @@ int nmmgr_handler_remove(nmmgr_handler_t *hnd) {
 
     if(tmp) {
         SLIST_REMOVE(&nmmgr_handlers, hnd, nmmgr_handler, list_ent);
+        nmmgr_index_update();
         rv = 0;
     }
 
@@ -114,6 +266,14 @@ void nmmgr_init(void) {
 
 void nmmgr_shutdown(void) {
     nmmgr_handler_t *c, *n;
+    nmmgr_index_t *idx;
+
+    free(atomic_exchange(&index_cur, NULL));
+
+    while((idx = index_retired)) {
+        index_retired = idx->retired_next;
+        free(idx);
+    }
 
     c = SLIST_FIRST(&nmmgr_handlers);
 
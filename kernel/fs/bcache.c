@@ -0,0 +1,568 @@
+/* KallistiOS ##version##
+
+   bcache.c
+
+*/
+
+/* Buffer cache for block devices. Each cache has a fixed set of buffers,
+   hashed on the first device block they hold, on an LRU list (most recently
+   used first) or the free list. Dirty buffers are also on a list of their own,
+   oldest first, which is what the background flush goes through. Caches with
+   a flush interval are on a global list that a single thread looks at; the
+   thread goes away when the list is empty. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+
+#include <kos/bcache.h>
+#include <kos/blockdev.h>
+#include <kos/mutex.h>
+#include <kos/cond.h>
+#include <kos/thread.h>
+#include <kos/timer.h>
+#include <kos/dbglog.h>
+
+#define BUF_VALID   0x01
+#define BUF_DIRTY   0x02
+
+typedef struct bcache_buf {
+    LIST_ENTRY(bcache_buf)  hash;
+    TAILQ_ENTRY(bcache_buf) lru;        /* LRU or free list */
+    TAILQ_ENTRY(bcache_buf) dirty;
+    uint64_t                block;
+    uint64_t                dirtied;    /* When it was first dirtied, in ms */
+    uint8_t                 *data;
+    uint32_t                pins;
+    uint32_t                flags;
+} bcache_buf_t;
+
+LIST_HEAD(bcache_hash, bcache_buf);
+TAILQ_HEAD(bcache_lru, bcache_buf);
+TAILQ_HEAD(bcache_dirty, bcache_buf);
+
+struct bcache {
+    LIST_ENTRY(bcache)      list;       /* Caches with a flush interval */
+    kos_blockdev_t          *dev;
+    uint64_t                dev_count;
+    uint32_t                dev_blocks;
+    uint32_t                flush_ms;
+    size_t                  buf_size;
+    size_t                  count;
+    size_t                  run;        /* Most buffers read or written at once */
+
+    mutex_t                 mutex;
+    struct bcache_hash      *buckets;
+    int                     hash_bits;
+    struct bcache_lru       lru;
+    struct bcache_lru       free;
+    struct bcache_dirty     dirty;
+    bcache_stats_t          stats;
+
+    bcache_buf_t            *bufs;
+    bcache_buf_t            **sorted;   /* Scratch space, count long */
+    uint8_t                 *data;
+    uint8_t                 *staging;   /* run buffers, for runs */
+};
+
+static LIST_HEAD(, bcache) flush_list = LIST_HEAD_INITIALIZER(flush_list);
+static mutex_t flush_mutex = MUTEX_INITIALIZER;
+static condvar_t flush_cv = COND_INITIALIZER;
+static kthread_t *flush_thd;
+
+static struct bcache_hash *bbucket(bcache_t *c, uint64_t block) {
+    uint32_t h = (uint32_t)block ^ (uint32_t)(block >> 32);
+
+    return &c->buckets[(h * 0x9e3779b1u) >> (32 - c->hash_bits)];
+}
+
+static bcache_buf_t *bfind(bcache_t *c, uint64_t block) {
+    bcache_buf_t *b;
+
+    LIST_FOREACH(b, bbucket(c, block), hash) {
+        if(b->block == block)
+            return b;
+    }
+
+    return NULL;
+}
+
+static void bmake_mru(bcache_t *c, bcache_buf_t *b) {
+    if(TAILQ_FIRST(&c->lru) != b) {
+        TAILQ_REMOVE(&c->lru, b, lru);
+        TAILQ_INSERT_HEAD(&c->lru, b, lru);
+    }
+}
+
+static void bdirty(bcache_t *c, bcache_buf_t *b) {
+    if(!(b->flags & BUF_DIRTY)) {
+        b->flags |= BUF_DIRTY;
+        b->dirtied = timer_ms_gettime64();
+        TAILQ_INSERT_TAIL(&c->dirty, b, dirty);
+        c->stats.dirty++;
+    }
+}
+
+static void bclean(bcache_t *c, bcache_buf_t *b) {
+    if(b->flags & BUF_DIRTY) {
+        b->flags &= ~BUF_DIRTY;
+        TAILQ_REMOVE(&c->dirty, b, dirty);
+        c->stats.dirty--;
+    }
+}
+
+/* Write out n buffers holding consecutive blocks, all at once */
+static int bwrite_run(bcache_t *c, bcache_buf_t **bs, size_t n) {
+    const uint8_t *src = bs[0]->data;
+    size_t i;
+
+    if(n > 1) {
+        for(i = 0; i < n; i++)
+            memcpy(c->staging + i * c->buf_size, bs[i]->data, c->buf_size);
+
+        src = c->staging;
+    }
+
+    /* Clean them first, so that anything that dirties them again while
+       they're being written sticks. */
+    for(i = 0; i < n; i++)
+        bclean(c, bs[i]);
+
+    c->stats.writes++;
+
+    if(c->dev->write_blocks(c->dev, bs[0]->block, n * c->dev_blocks, src)) {
+        for(i = 0; i < n; i++)
+            bdirty(c, bs[i]);
+
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Take a buffer off the free list, or reuse the least recently used one that
+   isn't pinned. The buffer comes back on no list at all. */
+static bcache_buf_t *bget(bcache_t *c) {
+    bcache_buf_t *b;
+
+    if((b = TAILQ_FIRST(&c->free))) {
+        TAILQ_REMOVE(&c->free, b, lru);
+        return b;
+    }
+
+    TAILQ_FOREACH_REVERSE(b, &c->lru, bcache_lru, lru) {
+        if(!b->pins)
+            break;
+    }
+
+    if(!b) {
+        errno = ENOBUFS;
+        return NULL;
+    }
+
+    if((b->flags & BUF_DIRTY) && bwrite_run(c, &b, 1))
+        return NULL;
+
+    LIST_REMOVE(b, hash);
+    TAILQ_REMOVE(&c->lru, b, lru);
+    b->flags = 0;
+    c->stats.evictions++;
+
+    return b;
+}
+
+/* Drop a buffer without writing it back, putting it on the free list */
+static void bdrop(bcache_t *c, bcache_buf_t *b) {
+    bclean(c, b);
+    LIST_REMOVE(b, hash);
+    TAILQ_REMOVE(&c->lru, b, lru);
+    b->flags = 0;
+    TAILQ_INSERT_TAIL(&c->free, b, lru);
+}
+
+/* Does a buffer hold any of blocks [first, last)? */
+static inline bool boverlaps(bcache_t *c, bcache_buf_t *b, uint64_t first,
+                             uint64_t last) {
+    return b->block < last && b->block + c->dev_blocks > first;
+}
+
+static void bput(bcache_t *c, bcache_buf_t *b, uint64_t block) {
+    b->block = block;
+    b->flags = BUF_VALID;
+    b->pins = 0;
+    LIST_INSERT_HEAD(bbucket(c, block), b, hash);
+    TAILQ_INSERT_HEAD(&c->lru, b, lru);
+}
+
+/* Write back the buffers that have been dirty for longer than the flush
+   interval. */
+static void bflush_old(bcache_t *c, uint64_t now) {
+    bcache_buf_t *b;
+
+    mutex_lock(&c->mutex);
+
+    while((b = TAILQ_FIRST(&c->dirty)) && now - b->dirtied >= c->flush_ms) {
+        if(bwrite_run(c, &b, 1)) {
+            dbglog(DBG_WARNING, "bcache: can't write back block %llu\n",
+                   (unsigned long long)b->block);
+            break;
+        }
+    }
+
+    mutex_unlock(&c->mutex);
+}
+
+static void *bflush_thd(void *param) {
+    bcache_t *c;
+    uint32_t tick;
+
+    (void)param;
+
+    mutex_lock(&flush_mutex);
+
+    while(!LIST_EMPTY(&flush_list)) {
+        /* Look in often enough that nothing stays dirty much longer than
+           its cache's interval. */
+        tick = UINT32_MAX;
+
+        LIST_FOREACH(c, &flush_list, list) {
+            if(c->flush_ms / 2 < tick)
+                tick = c->flush_ms / 2;
+        }
+
+        cond_wait_timed(&flush_cv, &flush_mutex, tick ? tick : 1);
+
+        LIST_FOREACH(c, &flush_list, list)
+            bflush_old(c, timer_ms_gettime64());
+    }
+
+    flush_thd = NULL;
+    mutex_unlock(&flush_mutex);
+
+    return NULL;
+}
+
+bcache_t *bcache_create(kos_blockdev_t *dev, uint32_t dev_blocks,
+                        size_t count, size_t readahead) {
+    bcache_t *c;
+    size_t i;
+
+    if(!dev || !dev_blocks || count < 2) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(!(c = calloc(1, sizeof(bcache_t))))
+        return NULL;
+
+    c->dev = dev;
+    c->dev_count = dev->count_blocks(dev);
+    c->dev_blocks = dev_blocks;
+    c->buf_size = (size_t)dev_blocks << dev->l_block_size;
+    c->count = count;
+    c->run = 1 + (readahead < count / 2 ? readahead : count / 2);
+
+    for(c->hash_bits = 4; ((size_t)1 << c->hash_bits) < count; c->hash_bits++)
+        ;
+
+    /* Buffers are aligned for DMA */
+    c->buckets = malloc(sizeof(struct bcache_hash) << c->hash_bits);
+    c->bufs = malloc(count * sizeof(bcache_buf_t));
+    c->sorted = malloc(count * sizeof(bcache_buf_t *));
+    c->data = aligned_alloc(32, count * c->buf_size);
+
+    if(c->run > 1)
+        c->staging = aligned_alloc(32, c->run * c->buf_size);
+
+    if(!c->buckets || !c->bufs || !c->sorted || !c->data ||
+       (c->run > 1 && !c->staging)) {
+        free(c->buckets);
+        free(c->bufs);
+        free(c->sorted);
+        free(c->data);
+        free(c->staging);
+        free(c);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    mutex_init(&c->mutex, MUTEX_TYPE_NORMAL);
+    TAILQ_INIT(&c->lru);
+    TAILQ_INIT(&c->free);
+    TAILQ_INIT(&c->dirty);
+
+    for(i = 0; i < ((size_t)1 << c->hash_bits); i++)
+        LIST_INIT(&c->buckets[i]);
+
+    for(i = 0; i < count; i++) {
+        c->bufs[i].data = c->data + i * c->buf_size;
+        c->bufs[i].flags = 0;
+        TAILQ_INSERT_TAIL(&c->free, &c->bufs[i], lru);
+    }
+
+    return c;
+}
+
+int bcache_destroy(bcache_t *c) {
+    int rv;
+
+    bcache_set_flush_interval(c, 0);
+
+    if((rv = bcache_flush(c)))
+        dbglog(DBG_ERROR, "bcache: lost dirty buffers on destroy\n");
+
+    mutex_destroy(&c->mutex);
+    free(c->buckets);
+    free(c->bufs);
+    free(c->sorted);
+    free(c->data);
+    free(c->staging);
+    free(c);
+
+    return rv;
+}
+
+void bcache_set_flush_interval(bcache_t *c, uint32_t ms) {
+    mutex_lock(&flush_mutex);
+
+    if(c->flush_ms)
+        LIST_REMOVE(c, list);
+
+    c->flush_ms = ms;
+
+    if(ms) {
+        LIST_INSERT_HEAD(&flush_list, c, list);
+
+        if(!flush_thd && !(flush_thd = thd_create(true, bflush_thd, NULL)))
+            dbglog(DBG_ERROR, "bcache: can't start the flush thread\n");
+    }
+
+    /* Have the thread look at the new interval (or leave) */
+    cond_signal(&flush_cv);
+    mutex_unlock(&flush_mutex);
+}
+
+uint8_t *bcache_read(bcache_t *c, uint64_t block) {
+    bcache_buf_t **bs, *b;
+    uint64_t next;
+    uint8_t *rv = NULL;
+    size_t i, n;
+
+    mutex_lock(&c->mutex);
+
+    if((b = bfind(c, block))) {
+        bmake_mru(c, b);
+        c->stats.hits++;
+        rv = b->data;
+        goto out;
+    }
+
+    c->stats.misses++;
+    bs = c->sorted;
+
+    /* Read ahead as far as we can, stopping at the end of the device or the
+       first buffer that's already here. */
+    for(n = 1; n < c->run; n++) {
+        next = block + n * c->dev_blocks;
+
+        if(next + c->dev_blocks > c->dev_count || bfind(c, next))
+            break;
+    }
+
+    for(i = 0; i < n; i++) {
+        if(!(bs[i] = bget(c)))
+            break;
+    }
+
+    if(!i) {
+        errno = EIO;
+        goto out;
+    }
+
+    n = i;
+    c->stats.reads++;
+
+    if(c->dev->read_blocks(c->dev, block, n * c->dev_blocks,
+                           n > 1 ? c->staging : bs[0]->data)) {
+        for(i = 0; i < n; i++)
+            TAILQ_INSERT_TAIL(&c->free, bs[i], lru);
+
+        errno = EIO;
+        goto out;
+    }
+
+    /* Put them in backwards, so the one that was asked for ends up most
+       recently used. */
+    for(i = n; i-- > 0;) {
+        if(n > 1)
+            memcpy(bs[i]->data, c->staging + i * c->buf_size, c->buf_size);
+
+        bput(c, bs[i], block + i * c->dev_blocks);
+    }
+
+    c->stats.readahead += n - 1;
+    rv = bs[0]->data;
+
+out:
+    mutex_unlock(&c->mutex);
+    return rv;
+}
+
+uint8_t *bcache_zero(bcache_t *c, uint64_t block) {
+    bcache_buf_t *b;
+    uint8_t *rv = NULL;
+
+    mutex_lock(&c->mutex);
+
+    if((b = bfind(c, block))) {
+        bmake_mru(c, b);
+    }
+    else if((b = bget(c))) {
+        bput(c, b, block);
+    }
+    else {
+        goto out;
+    }
+
+    memset(b->data, 0, c->buf_size);
+    bdirty(c, b);
+    rv = b->data;
+
+out:
+    mutex_unlock(&c->mutex);
+    return rv;
+}
+
+int bcache_mark_dirty(bcache_t *c, uint64_t block) {
+    bcache_buf_t *b;
+
+    mutex_lock_scoped(&c->mutex);
+
+    if(!(b = bfind(c, block))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bdirty(c, b);
+    bmake_mru(c, b);
+
+    return 0;
+}
+
+int bcache_pin(bcache_t *c, uint64_t block) {
+    bcache_buf_t *b;
+
+    mutex_lock_scoped(&c->mutex);
+
+    if(!(b = bfind(c, block))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    b->pins++;
+    return 0;
+}
+
+int bcache_unpin(bcache_t *c, uint64_t block) {
+    bcache_buf_t *b;
+
+    mutex_lock_scoped(&c->mutex);
+
+    if(!(b = bfind(c, block)) || !b->pins) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    b->pins--;
+    return 0;
+}
+
+static int bcmp_block(const void *a, const void *b) {
+    const bcache_buf_t *x = *(const bcache_buf_t * const *)a;
+    const bcache_buf_t *y = *(const bcache_buf_t * const *)b;
+
+    return x->block < y->block ? -1 : x->block > y->block;
+}
+
+/* Write back the dirty buffers holding any of blocks [first, last) */
+static int bflush(bcache_t *c, uint64_t first, uint64_t last) {
+    bcache_buf_t *b;
+    size_t i, j, n = 0;
+
+    TAILQ_FOREACH(b, &c->dirty, dirty) {
+        if(boverlaps(c, b, first, last))
+            c->sorted[n++] = b;
+    }
+
+    qsort(c->sorted, n, sizeof(bcache_buf_t *), bcmp_block);
+
+    for(i = 0; i < n; i = j) {
+        for(j = i + 1; j < n && j - i < c->run; j++) {
+            if(c->sorted[j]->block != c->sorted[j - 1]->block + c->dev_blocks)
+                break;
+        }
+
+        if(bwrite_run(c, &c->sorted[i], j - i))
+            return -1;
+    }
+
+    return 0;
+}
+
+int bcache_flush(bcache_t *c) {
+    mutex_lock_scoped(&c->mutex);
+
+    return bflush(c, 0, UINT64_MAX);
+}
+
+int bcache_flush_range(bcache_t *c, uint64_t block, uint64_t count) {
+    mutex_lock_scoped(&c->mutex);
+
+    return bflush(c, block, block + count);
+}
+
+void bcache_invalidate(bcache_t *c) {
+    bcache_buf_t *b;
+
+    mutex_lock_scoped(&c->mutex);
+
+    while((b = TAILQ_FIRST(&c->lru)))
+        bdrop(c, b);
+}
+
+int bcache_invalidate_range(bcache_t *c, uint64_t block, uint64_t count) {
+    bcache_buf_t *b, *next;
+    int rv = 0;
+
+    mutex_lock_scoped(&c->mutex);
+
+    for(b = TAILQ_FIRST(&c->lru); b; b = next) {
+        next = TAILQ_NEXT(b, lru);
+
+        if(!boverlaps(c, b, block, block + count))
+            continue;
+
+        if(b->pins) {
+            errno = EBUSY;
+            rv = -1;
+            continue;
+        }
+
+        bdrop(c, b);
+    }
+
+    return rv;
+}
+
+bcache_stats_t bcache_get_stats(bcache_t *c) {
+    bcache_stats_t st;
+
+    mutex_lock(&c->mutex);
+    st = c->stats;
+    mutex_unlock(&c->mutex);
+
+    return st;
+}
@@ -16,17 +16,42 @@
 #include <kos/thread.h>
 #include <kos/library.h>
 #include <kos/dbglog.h>
+#include <kos/timer.h>
 
-/* Finds a given symbol in a relocated ELF symbol table */
-static int find_sym(char *name, elf_sym_t *table, int tablelen) {
-    int i;
+/* Size of the buffer relocations are streamed through */
+#define ELF_RELBUF_SIZE 4096
 
-    for(i = 0; i < tablelen; i++) {
-        if(!strcmp((char*)table[i].name, name))
-            return i;
+/* The symbols every loadable library has to define, in the order of the
+   corresponding fields in elf_prog_t. */
+static const char * const lib_entries[] = {
+    ELF_SYM_PREFIX "lib_get_name",
+    ELF_SYM_PREFIX "lib_get_version",
+    ELF_SYM_PREFIX "lib_open",
+    ELF_SYM_PREFIX "lib_close"
+};
+
+#define LIB_ENTRY_CNT   (sizeof(lib_entries) / sizeof(lib_entries[0]))
+
+/* Read exactly sz bytes at the given file offset */
+static int elf_read_at(file_t fd, uint32_t off, void *buf, size_t sz,
+                       elf_prog_t *out) {
+    ssize_t rsz;
+
+    if(fs_seek(fd, off, SEEK_SET) != (off_t)off) {
+        dbglog(DBG_ERROR, "elf_load: can't seek to %08lx\n", off);
+        return -1;
     }
 
-    return -1;
+    rsz = fs_read(fd, buf, sz);
+
+    if(rsz < 0 || (size_t)rsz < sz) {
+        dbglog(DBG_ERROR, "elf_load: only read %d of %d bytes at %08lx\n",
+               rsz, sz, off);
+        return -1;
+    }
+
+    out->bytes_read += sz;
+    return 0;
 }
 
 /* This function tests the header to determine if it's valid. It's separated
@@ -54,30 +79,31 @@ static bool elf_hdr_validate(elf_hdr_t *hdr) {
     return true;
 }
 
-/* Pass in a file descriptor from the virtual file system, and the
-   result will be NULL if the file cannot be loaded, or a pointer to
-   the loaded and relocated executable otherwise. The second variable
-   will be set to the entry point. */
-/* There's a lot of shit in here that's not documented or very poorly
-   documented by Intel.. I hope that this works for future compilers. */
+/* Load a relocatable ELF file into a single freshly allocated image. Only
+   the section headers and the symbol and string tables are read into
+   temporary memory. Allocated sections are read straight into the image, and
+   relocation tables are streamed through a small buffer. */
 int elf_load(const char *fn, klibrary_t *shell, elf_prog_t *out) {
-    uint8_t     *img, *imgout;
-    size_t      sz, rsz;
-    int         i, j, sect;
-    elf_hdr_t   *hdr;
-    elf_shdr_t  *shdrs, *symtabhdr;
-    elf_sym_t   *symtab;
-    int         symtabsize;
-    elf_rel_t   *reltab;
-    elf_rela_t  *relatab;
-    int         reltabsize;
-    char        *stringtab;
-    uint32_t    vma;
+    uint8_t     *imgout = NULL, *relbuf = NULL;
+    size_t      sz, shsz, strsz, symsz, align;
+    uint32_t    i, j, n, sect, off, cnt, vma;
+    uint64_t    start;
+    elf_hdr_t   hdr;
+    elf_shdr_t  *shdrs = NULL, *symtabhdr;
+    elf_sym_t   *symtab = NULL;
+    uint32_t    symtabsize;
+    char        *stringtab = NULL;
+    uintptr_t   *entries[LIB_ENTRY_CNT];
+    uint32_t    *where;
     file_t      fd;
+    int         rv = -1;
 
     (void)shell;
 
-    /* Load the file: needs to change to just load headers */
+    start = timer_us_gettime64();
+    out->data = NULL;
+    out->bytes_read = 0;
+
     fd = fs_open(fn, O_RDONLY);
 
     if(fd == FILEHND_INVALID) {
@@ -85,69 +111,46 @@ int elf_load(const char *fn, klibrary_t *shell, elf_prog_t *out) {
         return -1;
     }
 
-    sz = fs_total(fd);
-    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "Loading ELF file of size %d\n", sz);
-
-    img = aligned_alloc(32, sz);
-
-    if(img == NULL) {
-        dbglog(DBG_ERROR, "elf_load: can't allocate %d bytes for ELF load\n", sz);
-        fs_close(fd);
-        return -1;
-    }
-
-    rsz = fs_read(fd, img, sz);
-
-    /* We close it regardless. */
-    fs_close(fd);
-
-    if(rsz < sz) {
-        dbglog(DBG_ERROR, "elf_load: only read %d of %d bytes\n", rsz, sz);
-        free(img);
-        return -1;
-    }
-
     /* Header is at the front */
-    hdr = (elf_hdr_t *)(img + 0);
+    if(elf_read_at(fd, 0, &hdr, sizeof(hdr), out) < 0)
+        goto out;
 
     /* Test if the header is valid */
-    if(!elf_hdr_validate(hdr))
-        goto error1;
+    if(!elf_hdr_validate(&hdr))
+        goto out;
 
     /* Print some debug info */
-    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "File size is %d bytes\n", sz);
-    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	entry point	%08lx\n", hdr->entry);
-    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	ph offset	%08lx\n", hdr->phoff);
-    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	sh offset	%08lx\n", hdr->shoff);
-    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	flags		%08lx\n", hdr->flags);
-    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	ehsize		%08x\n", hdr->ehsize);
-    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	phentsize	%08x\n", hdr->phentsize);
-    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	phnum		%08x\n", hdr->phnum);
-    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	shentsize	%08x\n", hdr->shentsize);
-    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	shnum		%08x\n", hdr->shnum);
-    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	shstrndx	%08x\n", hdr->shstrndx);
-
-    /* Locate the string table; SH elf files ought to have
-       two string tables, one for section names and one for object
-       string names. We'll look for the latter. */
-    shdrs = (elf_shdr_t *)(img + hdr->shoff);
-    stringtab = NULL;
-
-    for(i = 0; i < hdr->shnum; i++) {
-        if(shdrs[i].type == SHT_STRTAB && i != hdr->shstrndx) {
-            stringtab = (char*)(img + shdrs[i].offset);
-        }
+    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	entry point	%08lx\n", hdr.entry);
+    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	ph offset	%08lx\n", hdr.phoff);
+    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	sh offset	%08lx\n", hdr.shoff);
+    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	flags		%08lx\n", hdr.flags);
+    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	ehsize		%08x\n", hdr.ehsize);
+    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	phentsize	%08x\n", hdr.phentsize);
+    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	phnum		%08x\n", hdr.phnum);
+    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	shentsize	%08x\n", hdr.shentsize);
+    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	shnum		%08x\n", hdr.shnum);
+    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "	shstrndx	%08x\n", hdr.shstrndx);
+
+    if(hdr.shentsize != sizeof(elf_shdr_t) || !hdr.shnum) {
+        dbglog(DBG_ERROR, "elf_load: ELF has no usable section headers\n");
+        goto out;
     }
 
-    if(!stringtab) {
-        dbglog(DBG_ERROR, "elf_load: ELF contains no object string table\n");
-        goto error1;
+    /* Section headers */
+    shsz = hdr.shnum * sizeof(elf_shdr_t);
+
+    if(!(shdrs = malloc(shsz))) {
+        dbglog(DBG_ERROR, "elf_load: can't allocate %d bytes for section headers\n", shsz);
+        goto out;
     }
 
+    if(elf_read_at(fd, hdr.shoff, shdrs, shsz, out) < 0)
+        goto out;
+
     /* Locate the symbol table */
     symtabhdr = NULL;
 
-    for(i = 0; i < hdr->shnum; i++) {
+    for(i = 0; i < hdr.shnum; i++) {
         if(shdrs[i].type == SHT_SYMTAB || shdrs[i].type == SHT_DYNSYM) {
             symtabhdr = shdrs + i;
             break;
@@ -156,267 +159,319 @@ int elf_load(const char *fn, klibrary_t *shell, elf_prog_t *out) {
 
     if(!symtabhdr) {
         dbglog(DBG_ERROR, "elf_load: ELF contains no symbol table\n");
-        goto error1;
+        goto out;
     }
 
-    symtab = (elf_sym_t *)(img + symtabhdr->offset);
-    symtabsize = symtabhdr->size / sizeof(elf_sym_t);
+    /* Locate its string table. SH elf files ought to have two string tables,
+       one for section names and one for object string names. The symbol table
+       links to the latter, but look for it if that link is bogus. */
+    n = symtabhdr->link;
 
-    /* Relocate symtab entries for quick access */
-    for(i = 0; i < symtabsize; i++)
-        symtab[i].name = (uint32_t)(stringtab + symtab[i].name);
+    if(n >= hdr.shnum || shdrs[n].type != SHT_STRTAB) {
+        for(i = 0, n = 0; i < hdr.shnum; i++) {
+            if(shdrs[i].type == SHT_STRTAB && i != hdr.shstrndx)
+                n = i;
+        }
+    }
+
+    if(!n) {
+        dbglog(DBG_ERROR, "elf_load: ELF contains no object string table\n");
+        goto out;
+    }
 
-    /* Build the final memory image */
+    /* Read both in. These and the section headers are all we keep around. */
+    strsz = shdrs[n].size;
+    symsz = symtabhdr->size;
+    symtabsize = symsz / sizeof(elf_sym_t);
+
+    stringtab = malloc(strsz + 1);
+    symtab = malloc(symsz);
+    relbuf = malloc(ELF_RELBUF_SIZE);
+
+    if(!stringtab || !symtab || !relbuf) {
+        dbglog(DBG_ERROR, "elf_load: can't allocate %d bytes for symbols\n",
+               strsz + symsz + ELF_RELBUF_SIZE);
+        goto out;
+    }
+
+    out->peak_temp = shsz + strsz + 1 + symsz + ELF_RELBUF_SIZE;
+
+    if(elf_read_at(fd, shdrs[n].offset, stringtab, strsz, out) < 0 ||
+       elf_read_at(fd, symtabhdr->offset, symtab, symsz, out) < 0)
+        goto out;
+
+    stringtab[strsz] = '\0';
+
+    for(i = 0; i < symtabsize; i++) {
+        if(symtab[i].name >= strsz) {
+            dbglog(DBG_ERROR, "elf_load: symbol %ld has a bad name\n", i);
+            goto out;
+        }
+    }
+
+    /* Lay out the final memory image. The image itself is aligned for the
+       most demanding section, and at least to a cache line. */
     sz = 0;
+    align = 32;
 
-    for(i = 0; i < hdr->shnum; i++) {
+    for(i = 0; i < hdr.shnum; i++) {
         if(shdrs[i].flags & SHF_ALLOC) {
+            if(shdrs[i].addralign & (shdrs[i].addralign - 1)) {
+                dbglog(DBG_ERROR, "elf_load: section %ld has a bad alignment "
+                       "%ld\n", i, shdrs[i].addralign);
+                goto out;
+            }
+
+            if(shdrs[i].addralign > 1)
+                sz = (sz + shdrs[i].addralign - 1) & ~(shdrs[i].addralign - 1);
+
+            if(shdrs[i].addralign > align)
+                align = shdrs[i].addralign;
+
             shdrs[i].addr = sz;
             sz += shdrs[i].size;
-
-            if(shdrs[i].addralign && (shdrs[i].addr % shdrs[i].addralign)) {
-                uint32_t orig = shdrs[i].addr;
-                shdrs[i].addr = (shdrs[i].addr + shdrs[i].addralign)
-                                & ~(shdrs[i].addralign - 1);
-                sz += shdrs[i].addr - orig;
-            }
         }
     }
 
     dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "Final image is %d bytes\n", sz);
-    out->data = imgout = malloc(sz);
+    out->data = imgout = aligned_alloc(align, (sz + align - 1) & ~(align - 1));
 
     if(out->data == NULL) {
         dbglog(DBG_ERROR, "elf_load: can't allocate %d bytes for ELF program data\n", sz);
-        goto error1;
+        goto out;
     }
 
     out->size = sz;
     vma = (uint32_t)imgout;
 
-    for(i = 0; i < hdr->shnum; i++) {
-        if(shdrs[i].flags & SHF_ALLOC) {
-            if(shdrs[i].type == SHT_NOBITS) {
-                dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), 
-                     "  setting %ld bytes of zeros at %08lx\n",
-                     shdrs[i].size, shdrs[i].addr);
-                memset(imgout + shdrs[i].addr, 0, shdrs[i].size);
-            }
-            else {
-                dbglog(DBG_SOURCE(ELF_DBG_VERBOSE),
-                     "  copying %ld bytes from %08lx to %08lx\n",
-                     shdrs[i].size, shdrs[i].offset, shdrs[i].addr);
-                memcpy(imgout + shdrs[i].addr,
-                       img + shdrs[i].offset,
-                       shdrs[i].size);
-            }
+    /* Read the sections straight into place */
+    for(i = 0; i < hdr.shnum; i++) {
+        if(!(shdrs[i].flags & SHF_ALLOC))
+            continue;
+
+        if(shdrs[i].type == SHT_NOBITS) {
+            dbglog(DBG_SOURCE(ELF_DBG_VERBOSE),
+                   "  setting %ld bytes of zeros at %08lx\n",
+                   shdrs[i].size, shdrs[i].addr);
+            memset(imgout + shdrs[i].addr, 0, shdrs[i].size);
+        }
+        else {
+            dbglog(DBG_SOURCE(ELF_DBG_VERBOSE),
+                   "  reading %ld bytes from %08lx to %08lx\n",
+                   shdrs[i].size, shdrs[i].offset, shdrs[i].addr);
+
+            if(elf_read_at(fd, shdrs[i].offset, imgout + shdrs[i].addr,
+                           shdrs[i].size, out) < 0)
+                goto out;
         }
     }
 
-    /* Go through and patch in any symbols that are undefined */
+    /* In one pass over the symbol table, patch in any symbols that are
+       undefined and pick out the library entry points. */
+    entries[0] = &out->lib_get_name;
+    entries[1] = &out->lib_get_version;
+    entries[2] = &out->lib_open;
+    entries[3] = &out->lib_close;
+
+    for(j = 0; j < LIB_ENTRY_CNT; j++)
+        *entries[j] = 0;
+
     for(i = 1; i < symtabsize; i++) {
-        export_sym_t * sym;
-
-        /* dbglog(DBG_KDEBUG, " symbol '%s': value %04lx, size %04lx, info %02x, other %02x, shndx %04lx\n",
-            (const char *)(symtab[i].name),
-            symtab[i].value, symtab[i].size,
-            symtab[i].info,
-            symtab[i].other,
-            symtab[i].shndx); */
-        if(symtab[i].shndx != SHN_UNDEF || ELF32_ST_TYPE(symtab[i].info) == STT_SECTION) {
-            // dbglog(DBG_KDEBUG, " symbol '%s': skipping\n", (const char *)(symtab[i].name));
+        const char *name = stringtab + symtab[i].name;
+        export_sym_t *sym;
+
+        if(ELF32_ST_TYPE(symtab[i].info) == STT_SECTION)
+            continue;
+
+        if(symtab[i].shndx != SHN_UNDEF) {
+            if(symtab[i].shndx >= hdr.shnum ||
+               ELF32_ST_BIND(symtab[i].info) == STB_LOCAL)
+                continue;
+
+            for(j = 0; j < LIB_ENTRY_CNT; j++) {
+                if(!*entries[j] && !strcmp(name, lib_entries[j])) {
+                    *entries[j] = vma + shdrs[symtab[i].shndx].addr
+                                  + symtab[i].value;
+                    break;
+                }
+            }
+
             continue;
         }
 
         /* Find the symbol in our exports */
-        sym = export_lookup((const char *)(symtab[i].name + ELF_SYM_PREFIX_LEN));
+        sym = export_lookup(name + ELF_SYM_PREFIX_LEN);
 
         if(!sym) {
-            dbglog(DBG_ERROR, " symbol '%s' is undefined\n", (const char *)(symtab[i].name));
-            goto error3;
+            dbglog(DBG_ERROR, " symbol '%s' is undefined\n", name);
+            goto out;
         }
 
         /* Patch it in */
         dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), " symbol '%s' patched to 0x%x\n",
-             (const char *)(symtab[i].name),
-             sym->ptr);
+               name, sym->ptr);
         symtab[i].value = sym->ptr;
     }
 
-    /* Process the relocations */
-    reltab = NULL;
-    relatab = NULL;
+    for(j = 0; j < LIB_ENTRY_CNT; j++) {
+        if(!*entries[j]) {
+            dbglog(DBG_ERROR, "elf_load: ELF contains no %s()\n",
+                   lib_entries[j] + ELF_SYM_PREFIX_LEN);
+            goto out;
+        }
+    }
 
-    for(i = 0; i < hdr->shnum; i++) {
-        if(shdrs[i].type != SHT_REL && shdrs[i].type != SHT_RELA) continue;
+    /* Process the relocations, a buffer at a time */
+    cnt = 0;
+
+    for(i = 0; i < hdr.shnum; i++) {
+        uint32_t entsz;
+
+        if(shdrs[i].type == SHT_RELA)
+            entsz = sizeof(elf_rela_t);
+        else if(shdrs[i].type == SHT_REL)
+            entsz = sizeof(elf_rel_t);
+        else
+            continue;
 
         sect = shdrs[i].info;
-        dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "Relocating (%s) on section %d\n",
-            shdrs[i].type == SHT_REL ? "SHT_REL" : "SHT_RELA", sect);
+        dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "Relocating (%s) on section %ld\n",
+               shdrs[i].type == SHT_REL ? "SHT_REL" : "SHT_RELA", sect);
 
-        switch(shdrs[i].type) {
-            case SHT_RELA:
-                relatab = (elf_rela_t *)(img + shdrs[i].offset);
-                reltabsize = shdrs[i].size / sizeof(elf_rela_t);
+        if(sect >= hdr.shnum || !(shdrs[sect].flags & SHF_ALLOC))
+            continue;
 
-                for(j = 0; j < reltabsize; j++) {
-                    int sym;
+        for(off = 0; off + entsz <= shdrs[i].size; ) {
+            n = (shdrs[i].size - off) / entsz;
 
-                    // XXX Does non-sh ever use RELA?
-                    if(ELF32_R_TYPE(relatab[j].info) != R_SH_DIR32) {
-                        dbglog(DBG_ERROR, "elf_load: ELF contains unknown RELA type %02x\n",
-                               ELF32_R_TYPE(relatab[j].info));
-                        goto error3;
-                    }
+            if(n > ELF_RELBUF_SIZE / entsz)
+                n = ELF_RELBUF_SIZE / entsz;
 
-                    sym = ELF32_R_SYM(relatab[j].info);
-
-                    if(symtab[sym].shndx == SHN_UNDEF) {
-                        dbglog(DBG_SOURCE(ELF_DBG_VERBOSE),
-                             "  Writing undefined RELA %08lx(%08lx+%08lx) -> %08lx\n",
-                             symtab[sym].value + relatab[j].addend,
-                             symtab[sym].value,
-                             relatab[j].addend,
-                             vma + shdrs[sect].addr + relatab[j].offset);
-                        *((uint32_t *)(imgout
-                                     + shdrs[sect].addr
-                                     + relatab[j].offset))
-                        =     symtab[sym].value
-                              + relatab[j].addend;
-                    }
-                    else {
-                        dbglog(DBG_SOURCE(ELF_DBG_VERBOSE),
-                             "  Writing RELA %08lx(%08lx+%08lx+%08lx+%08lx) -> %08lx\n",
-                             vma + shdrs[symtab[sym].shndx].addr + symtab[sym].value + relatab[j].addend,
-                             vma, shdrs[symtab[sym].shndx].addr, symtab[sym].value, relatab[j].addend,
-                             vma + shdrs[sect].addr + relatab[j].offset);
-                        *((uint32_t*)(imgout
-                                    + shdrs[sect].addr      /* assuming 1 == .text */
-                                    + relatab[j].offset))
-                        +=    vma
-                              + shdrs[symtab[sym].shndx].addr
-                              + symtab[sym].value
-                              + relatab[j].addend;
-                    }
-                }
+            if(elf_read_at(fd, shdrs[i].offset + off, relbuf, n * entsz, out) < 0)
+                goto out;
 
-                break;
+            off += n * entsz;
+            cnt += n;
 
-            case SHT_REL:
-                reltab = (elf_rel_t *)(img + shdrs[i].offset);
-                reltabsize = shdrs[i].size / sizeof(elf_rel_t);
+            for(j = 0; j < n; j++) {
+                uint32_t roff, rinfo, value, sym, shndx;
+                int32_t addend = 0;
 
-                for(j = 0; j < reltabsize; j++) {
-                    int sym, info, pcrel;
+                if(entsz == sizeof(elf_rela_t)) {
+                    elf_rela_t *rela = (elf_rela_t *)relbuf + j;
 
-                    // XXX Does non-ia32 ever use REL?
-                    info = ELF32_R_TYPE(reltab[j].info);
+                    roff = rela->offset;
+                    rinfo = rela->info;
+                    addend = rela->addend;
 
-                    if(info != R_386_32 && info != R_386_PC32) {
-                        dbglog(DBG_ERROR, "elf_load: ELF contains unknown REL type %02x\n", info);
-                        goto error3;
+                    // XXX Does non-sh ever use RELA?
+                    if(ELF32_R_TYPE(rinfo) != R_SH_DIR32) {
+                        dbglog(DBG_ERROR, "elf_load: ELF contains unknown RELA type %02x\n",
+                               ELF32_R_TYPE(rinfo));
+                        goto out;
                     }
+                }
+                else {
+                    elf_rel_t *rel = (elf_rel_t *)relbuf + j;
 
-                    pcrel = (info == R_386_PC32);
-
-                    sym = ELF32_R_SYM(reltab[j].info);
+                    roff = rel->offset;
+                    rinfo = rel->info;
 
-                    if(symtab[sym].shndx == SHN_UNDEF) {
-                        uint32_t value = symtab[sym].value;
+                    // XXX Does non-ia32 ever use REL?
+                    if(ELF32_R_TYPE(rinfo) != R_386_32 &&
+                       ELF32_R_TYPE(rinfo) != R_386_PC32) {
+                        dbglog(DBG_ERROR, "elf_load: ELF contains unknown REL type %02x\n",
+                               ELF32_R_TYPE(rinfo));
+                        goto out;
+                    }
+                }
 
-                        if(sect == 1 && j < 5) {
-                            dbglog(DBG_SOURCE(ELF_DBG_VERBOSE),
-                                 "  Writing undefined %s %08lx -> %08lx",
-                                 pcrel ? "PCREL" : "ABSREL",
-                                 value,
-                                 vma + shdrs[sect].addr + reltab[j].offset);
-                        }
+                sym = ELF32_R_SYM(rinfo);
 
-                        if(pcrel)
-                            value -= vma + shdrs[sect].addr + reltab[j].offset;
+                if(sym >= symtabsize || shdrs[sect].size < 4 ||
+                   roff > shdrs[sect].size - 4) {
+                    dbglog(DBG_ERROR, "elf_load: bad relocation %08lx/%08lx\n",
+                           roff, rinfo);
+                    goto out;
+                }
 
-                        *((uint32_t *)(imgout
-                                     + shdrs[sect].addr
-                                     + reltab[j].offset))
-                        += value;
+                where = (uint32_t *)(imgout + shdrs[sect].addr + roff);
+                shndx = symtab[sym].shndx;
 
-                        if(sect == 1 && j < 5) {
-                            dbglog(DBG_SOURCE(ELF_DBG_VERBOSE),"(%08lx)\n",
-                             *((uint32_t *)(imgout + shdrs[sect].addr + reltab[j].offset)));
-                        }
-                    }
-                    else {
-                        uint32_t value = vma + shdrs[symtab[sym].shndx].addr
-                                       + symtab[sym].value;
-
-                        if(sect == 1 && j < 5) {
-                            dbglog(DBG_SOURCE(ELF_DBG_VERBOSE),
-                                 "  Writing %s %08lx(%08lx+%08lx+%08lx) -> %08lx",
-                                 pcrel ? "PCREL" : "ABSREL",
-                                 value,
-                                 vma, shdrs[symtab[sym].shndx].addr, symtab[sym].value,
-                                 vma + shdrs[sect].addr + reltab[j].offset);
-                        }
-
-                        if(pcrel)
-                            value -= vma + shdrs[sect].addr + reltab[j].offset;
-
-                        *((uint32_t*)(imgout
-                                    + shdrs[sect].addr
-                                    + reltab[j].offset))
-                        += value;
-
-                        if(sect == 1 && j < 5) {
-                            dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "(%08lx)\n",
-                             *((uint32_t *)(imgout + shdrs[sect].addr + reltab[j].offset)));
-                        }
-                    }
+                /* Undefined symbols were patched with their absolute address
+                   above, everything else is relative to its section. Symbols
+                   in the other reserved sections (common ones, for instance)
+                   or in sections that aren't loaded have nowhere to go. */
+                if(shndx == SHN_UNDEF || shndx == SHN_ABS) {
+                    value = symtab[sym].value + addend;
+                }
+                else if(shndx < hdr.shnum && (shdrs[shndx].flags & SHF_ALLOC)) {
+                    value = vma + shdrs[shndx].addr + symtab[sym].value
+                            + addend;
+                }
+                else if(shndx == SHN_COMMON) {
+                    dbglog(DBG_ERROR, "elf_load: symbol '%s' is common; "
+                           "build with -fno-common\n",
+                           stringtab + symtab[sym].name);
+                    goto out;
+                }
+                else {
+                    dbglog(DBG_ERROR, "elf_load: symbol '%s' is in section "
+                           "%04lx, which isn't loaded\n",
+                           stringtab + symtab[sym].name, shndx);
+                    goto out;
                 }
 
-                break;
+                dbglog(DBG_SOURCE(ELF_DBG_VERBOSE),
+                       "  Writing %08lx -> %08lx\n",
+                       value, vma + shdrs[sect].addr + roff);
+
+                if(entsz == sizeof(elf_rela_t)) {
+                    /* RELA against an undefined symbol replaces the field */
+                    if(shndx == SHN_UNDEF)
+                        *where = value;
+                    else
+                        *where += value;
+                }
+                else {
+                    if(ELF32_R_TYPE(rinfo) == R_386_PC32)
+                        value -= vma + shdrs[sect].addr + roff;
 
+                    *where += value;
+                }
+            }
         }
     }
 
-    if(reltab == NULL && relatab == NULL) {
+    if(!cnt) {
         dbglog(DBG_WARNING, "elf_load warning: found no REL(A) sections; did you forget -r?\n");
     }
 
-    /* Look for the program entry points and deal with that */
-    {
-        int sym;
-
-#define DO_ONE(symname, outp) \
-    sym = find_sym(ELF_SYM_PREFIX symname, symtab, symtabsize); \
-    if(sym < 0) { \
-        dbglog(DBG_ERROR, "elf_load: ELF contains no %s()\n", symname); \
-        goto error3; \
-    } \
-    \
-    out->outp = (vma + shdrs[symtab[sym].shndx].addr \
-                 + symtab[sym].value);
-
-        DO_ONE("lib_get_name", lib_get_name);
-        DO_ONE("lib_get_version", lib_get_version);
-        DO_ONE("lib_open", lib_open);
-        DO_ONE("lib_close", lib_close);
-#undef DO_ONE
-    }
+    /* Flush the icache for that zone */
+    icache_sync_range((uint32_t)out->data, out->size);
+
+    out->load_us = (uint32_t)(timer_us_gettime64() - start);
 
-    free(img);
     dbglog(DBG_SOURCE(ELF_DBG_VERBOSE), "elf_load final ELF stats: memory image at %p, size %08lx\n", out->data, out->size);
+    dbglog(DBG_SOURCE(ELF_DBG_VERBOSE),
+           "elf_load: %s loaded in %lu us, %lu bytes read, %lu bytes temporary\n",
+           fn, out->load_us, out->bytes_read, out->peak_temp);
 
-    /* Flush the icache for that zone */
-    icache_sync_range((uint32_t)out->data, out->size);
+    rv = 0;
 
-    return 0;
+out:
+    if(rv < 0) {
+        free(out->data);
+        out->data = NULL;
+    }
 
-error3:
-    free(out->data);
+    free(relbuf);
+    free(symtab);
+    free(stringtab);
+    free(shdrs);
+    fs_close(fd);
 
-error1:
-    free(img);
-    return -1;
+    return rv;
 }
 
 /* Free a loaded ELF program */
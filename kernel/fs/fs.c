@@ -41,6 +41,8 @@ something like this:
 #include <kos/nmmgr.h>
 #include <kos/dbglog.h>
 
+#include "../libc/koslib/epoll_int.h"
+
 /* File handle structure; this is an entirely internal structure so it does
    not go in a header file. */
 typedef struct fs_hnd {
@@ -174,6 +176,8 @@ static int fs_hnd_unref(fs_hnd_t *ref) {
     assert(ref->refcnt > 0);
 
     if(atomic_fetch_sub(&ref->refcnt, 1) == 1) {
+        __epoll_hnd_close(ref->hnd);
+
         if(ref->handler && ref->handler->close)
             retval = ref->handler->close(ref->hnd);
 
@@ -38,12 +38,16 @@ or space present.
 
 #include <sys/ioctl.h>
 #include <sys/queue.h>
+#include <poll.h>
+
+#include "../libc/koslib/epoll_int.h"
 
 /* pty buffer size */
 #define PTY_BUFFER_SIZE 1024
 
 /* Forward-declare some stuff */
 struct ptyhalf;
+struct pipefd;
 typedef LIST_HEAD(ptylist, ptyhalf) ptylist_t;
 
 /* This struct represents one half of a pty. Each end is openable as a
@@ -62,6 +66,9 @@ typedef struct ptyhalf {
 
     unsigned int id;
 
+    /* Everyone who has this end open, for posting poll events */
+    LIST_HEAD(pipefdlist, pipefd) fds;
+
     mutex_t     mutex;
     condvar_t   ready_read, ready_write;
 } ptyhalf_t;
@@ -89,6 +96,8 @@ typedef struct dirlist {
 
 /* We'll have one of these for each opened pipe */
 typedef struct pipefd {
+    LIST_ENTRY(pipefd) list;
+
     /* Our directory or pty */
     union {
         ptyhalf_t   * p;
@@ -104,6 +113,20 @@ typedef struct pipefd {
 /* Here incase fs_pty_create() fails */
 static void pty_destroy_unused(void);
 
+/* Post poll events to everyone who has the given end open. Call with the
+   ptyhalf's mutex held. */
+static void pty_post(ptyhalf_t *ph, short events) {
+    struct pipefd *fdobj;
+
+    mutex_lock(&list_mutex);
+
+    LIST_FOREACH(fdobj, &ph->fds, list) {
+        __epoll_event_trigger(fdobj, events);
+    }
+
+    mutex_unlock(&list_mutex);
+}
+
 #define PF_PTY  0
 #define PF_DIR  1
 
@@ -391,6 +414,11 @@ static void *pty_open_file(const char *fn, int mode) {
     fdobj->d.p = ph;
     fdobj->type = PF_PTY;
     fdobj->mode = mode;
+
+    mutex_lock(&list_mutex);
+    LIST_INSERT_HEAD(&ph->fds, fdobj, list);
+    mutex_unlock(&list_mutex);
+
     return (void *)fdobj;
 }
 
@@ -431,12 +459,17 @@ static int pty_close(void *h) {
         if(mutex_lock_irqsafe(&fdobj->d.p->mutex))
             return -1;
 
+        mutex_lock(&list_mutex);
+        LIST_REMOVE(fdobj, list);
+        mutex_unlock(&list_mutex);
+
         fdobj->d.p->refcnt--;
 
         if(fdobj->d.p->refcnt <= 0) {
             /* Unblock anyone who might be waiting on the other end */
             cond_broadcast(&fdobj->d.p->other->ready_read);
             cond_broadcast(&fdobj->d.p->ready_write);
+            pty_post(fdobj->d.p->other, POLLHUP | POLLRDNORM | POLLWRNORM);
         }
 
         mutex_unlock(&fdobj->d.p->mutex);
@@ -512,6 +545,7 @@ static ssize_t pty_read(void *h, void *buf, size_t bytes) {
 
     /* Wake anyone waiting for write space */
     cond_broadcast(&ph->ready_write);
+    pty_post(ph->other, POLLWRNORM);
 
 done:
     mutex_unlock(&ph->mutex);
@@ -583,6 +617,7 @@ static ssize_t pty_write(void *h, const void *buf, size_t bytes) {
 
     /* Wake anyone waiting on read */
     cond_broadcast(&ph->ready_read);
+    pty_post(ph, POLLRDNORM);
 
 done:
     mutex_unlock(&ph->mutex);
@@ -729,6 +764,37 @@ static int pty_fcntl(void *h, int cmd, va_list ap) {
     return rv;
 }
 
+/* Poll for readiness. This is called by poll() and epoll with the epoll lock
+   held. Nothing is locked in here, since the counts are only a snapshot anyway:
+   a change made right after this is posted by pty_post(), which the reader or
+   writer calls with the ptyhalf's mutex held. That only takes list_mutex, and
+   posting events never waits for the epoll lock. */
+static short pty_poll(void *h, short events) {
+    pipefd_t *fdobj = (pipefd_t *)h;
+    ptyhalf_t *ph;
+    short rv = 0;
+
+    if(fdobj->type != PF_PTY)
+        return POLLNVAL;
+
+    ph = fdobj->d.p;
+
+    /* The unattached console acts like a regular file */
+    if(ph->id == 0 && !ph->master && ph->other->refcnt == 0)
+        return events & (POLLRDNORM | POLLWRNORM);
+
+    if(ph->cnt || ph->other->refcnt == 0)
+        rv |= POLLRDNORM;
+
+    if(ph->other->cnt < PTY_BUFFER_SIZE)
+        rv |= POLLWRNORM;
+
+    if(ph->other->refcnt == 0)
+        rv |= POLLHUP;
+
+    return rv & (events | POLLHUP);
+}
+
 static int pty_rewinddir(void *h) {
     pipefd_t *fdobj = (pipefd_t *)h;
     dirlist_t *dl;
@@ -794,7 +860,7 @@ static vfs_handler_t vh = {
     NULL,
     NULL,
     pty_fcntl,
-    NULL,
+    pty_poll,
     NULL,
     NULL,
     NULL,
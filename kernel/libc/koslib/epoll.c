@@ -0,0 +1,582 @@
+/* KallistiOS ##version##
+
+   epoll.c
+
+*/
+
+/* Persistent interest sets for sockets, pipes and ptys.
+
+   Every registration is hashed on the VFS handle of the file it watches. When
+   a file has something to report, its filesystem calls __epoll_event_trigger()
+   with its handle and only the registrations in that handle's bucket are
+   visited. Ready registrations are queued on their instance's ready list, so
+   epoll_wait() never has to scan the whole interest set. poll() uses the same
+   machinery with a short-lived instance on its stack.
+
+   Posting an event doesn't take __epoll_mutex (see epoll_int.h), so events
+   that come in during an interrupt are never lost to a busy mutex. */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include <kos/fs.h>
+#include <kos/irq.h>
+#include <kos/timer.h>
+
+#include "epoll_int.h"
+
+#define EP_HASH_SIZE    64
+#define EP_HASH(hnd)    ((((uintptr_t)(hnd)) >> 4) & (EP_HASH_SIZE - 1))
+
+/* Reported whether they were asked for or not. */
+#define EP_ALWAYS       (POLLERR | POLLHUP | POLLNVAL)
+#define EP_FLAGS        (EPOLLET | EPOLLONESHOT)
+
+mutex_t __epoll_mutex = MUTEX_INITIALIZER;
+
+static struct epitems ep_hash[EP_HASH_SIZE];
+static int ep_nitems;
+
+/* Instances closed in an interrupt while epoll was busy, for whoever has it
+   to free. */
+static LIST_HEAD(epinsts, epinst) ep_closed = LIST_HEAD_INITIALIZER(ep_closed);
+
+static int ep_close(void *h);
+
+static vfs_handler_t vh = {
+    /* Name handler */
+    {
+        { 0 },          /* Name */
+        0,              /* tbfi */
+        0x00010000,     /* Version 1.0 */
+        0,              /* Flags */
+        NMMGR_TYPE_VFS,
+        NMMGR_LIST_INIT,
+    },
+
+    0, NULL,        /* No cache, privdata */
+
+    NULL,           /* open */
+    ep_close,       /* close */
+    NULL,           /* read */
+    NULL,           /* write */
+    NULL,           /* seek */
+    NULL,           /* tell */
+    NULL,           /* total */
+    NULL,           /* readdir */
+    NULL,           /* ioctl */
+    NULL,           /* rename */
+    NULL,           /* unlink */
+    NULL,           /* mmap */
+    NULL,           /* complete */
+    NULL,           /* stat */
+    NULL,           /* mkdir */
+    NULL,           /* rmdir */
+    NULL,           /* fcntl */
+    NULL,           /* poll */
+    NULL,           /* link */
+    NULL,           /* symlink */
+    NULL,           /* seek64 */
+    NULL,           /* tell64 */
+    NULL,           /* total64 */
+    NULL,           /* readlink */
+    NULL,           /* rewinddir */
+    NULL            /* fstat */
+};
+
+static inline uint32_t ep_mask(const epitem_t *it) {
+    return (it->event.events & ~EP_FLAGS) | EP_ALWAYS;
+}
+
+/* Put an item on its instance's ready list. Call with interrupts disabled. */
+static void ep_queue(epitem_t *it) {
+    if(it->ready)
+        return;
+
+    it->ready = 1;
+    TAILQ_INSERT_TAIL(&it->ep->ready, it, rdy_entry);
+    cond_broadcast(&it->ep->cv);
+}
+
+void __epoll_inst_init(epinst_t *ep) {
+    LIST_INIT(&ep->items);
+    TAILQ_INIT(&ep->ready);
+    cond_init(&ep->cv);
+}
+
+void __epoll_item_link(epinst_t *ep, epitem_t *it) {
+    irq_disable_scoped();
+
+    it->ep = ep;
+    it->ready = 0;
+    it->disabled = 0;
+    it->revents = 0;
+
+    LIST_INSERT_HEAD(&ep_hash[EP_HASH(it->hnd)], it, hash_entry);
+    LIST_INSERT_HEAD(&ep->items, it, ep_entry);
+    ++ep_nitems;
+}
+
+void __epoll_item_unlink(epitem_t *it) {
+    irq_disable_scoped();
+
+    if(it->ready)
+        TAILQ_REMOVE(&it->ep->ready, it, rdy_entry);
+
+    LIST_REMOVE(it, hash_entry);
+    LIST_REMOVE(it, ep_entry);
+    it->ready = 0;
+    --ep_nitems;
+}
+
+/* Ask the file itself whether it is ready, queueing the item if so. */
+void __epoll_item_check(epitem_t *it) {
+    uint32_t rev;
+
+    if(it->disabled || !it->hnd)
+        return;
+
+    rev = (uint16_t)it->hndl->poll(it->hnd, (short)(ep_mask(it) & 0xFFFF));
+    rev &= ep_mask(it);
+
+    if(rev) {
+        irq_disable_scoped();
+        it->revents |= rev;
+        ep_queue(it);
+    }
+}
+
+/* Cut an item loose from a handle that's going away, letting its owner know.
+   Call with interrupts disabled. */
+static void ep_detach(epitem_t *it) {
+    it->hnd = NULL;
+    it->revents |= POLLNVAL;
+    ep_queue(it);
+}
+
+static void ep_free(epinst_t *ep) {
+    epitem_t *it;
+
+    while((it = LIST_FIRST(&ep->items))) {
+        __epoll_item_unlink(it);
+        free(it);
+    }
+
+    cond_destroy(&ep->cv);
+    free(ep);
+}
+
+/* Let go of __epoll_mutex, first freeing the instances that were closed while
+   we had it. If one is closed between the last check and the unlock, we go
+   around again. */
+void __epoll_unlock(void) {
+    epinst_t *ep;
+    irq_mask_t old;
+
+    for(;;) {
+        for(;;) {
+            old = irq_disable();
+
+            if((ep = LIST_FIRST(&ep_closed)))
+                LIST_REMOVE(ep, closed_entry);
+
+            irq_restore(old);
+
+            if(!ep)
+                break;
+
+            ep_free(ep);
+        }
+
+        mutex_unlock(&__epoll_mutex);
+
+        /* If it's busy again, whoever has it will take care of it */
+        if(LIST_EMPTY(&ep_closed) || mutex_lock_irqsafe(&__epoll_mutex))
+            break;
+    }
+}
+
+/* Sleep until something is on the ready list. A deadline of 0 means forever.
+   Returns -1 on timeout. Interrupts stay disabled from checking the list to
+   going to sleep, so that an event can't slip in between. */
+int __epoll_inst_wait(epinst_t *ep, uint64_t deadline) {
+    uint64_t now;
+    int tmp = errno, ms;
+
+    irq_disable_scoped();
+
+    while(TAILQ_EMPTY(&ep->ready)) {
+        ms = 0;
+
+        if(deadline) {
+            now = timer_ms_gettime64();
+
+            if(now >= deadline) {
+                errno = tmp;
+                return -1;
+            }
+
+            ms = (int)(deadline - now);
+        }
+
+        if(cond_wait_timed(&ep->cv, &__epoll_mutex, ms) && errno != ETIMEDOUT)
+            return -1;
+    }
+
+    errno = tmp;
+    return 0;
+}
+
+void __epoll_event_trigger(void *hnd, short events) {
+    epitem_t *it;
+    uint32_t ev = (uint16_t)events;
+
+    if(!hnd)
+        return;
+
+    irq_disable_scoped();
+
+    LIST_FOREACH(it, &ep_hash[EP_HASH(hnd)], hash_entry) {
+        if(it->hnd != hnd || it->disabled || !(ev & ep_mask(it)))
+            continue;
+
+        it->revents |= ev & ep_mask(it);
+        ep_queue(it);
+    }
+}
+
+void __epoll_hnd_close(void *hnd) {
+    epitem_t *it, *tmp;
+
+    /* Most files are never watched, so don't bother locking for them. */
+    if(!ep_nitems)
+        return;
+
+    /* In an interrupt, with someone else in the middle of using epoll. We
+       can't free anything they might be looking at, but the handle mustn't be
+       used again, so just cut its registrations loose. epoll_wait() drops
+       them when it comes across them. */
+    if(mutex_lock_irqsafe(&__epoll_mutex)) {
+        irq_disable_scoped();
+
+        LIST_FOREACH(it, &ep_hash[EP_HASH(hnd)], hash_entry) {
+            if(it->hnd == hnd)
+                ep_detach(it);
+        }
+
+        return;
+    }
+
+    LIST_FOREACH_SAFE(it, &ep_hash[EP_HASH(hnd)], hash_entry, tmp) {
+        if(it->hnd != hnd)
+            continue;
+
+        if(it->dynamic) {
+            __epoll_item_unlink(it);
+            free(it);
+        }
+        else {
+            /* Belongs to a poll() in progress, which cleans up after itself.
+               Just let it know the file went away. */
+            irq_disable_scoped();
+            ep_detach(it);
+        }
+    }
+
+    __epoll_unlock();
+}
+
+static int ep_close(void *h) {
+    epinst_t *ep = (epinst_t *)h;
+
+    /* In an interrupt, with epoll busy. Leave it to whoever has it. */
+    if(mutex_lock_irqsafe(&__epoll_mutex)) {
+        irq_disable_scoped();
+        LIST_INSERT_HEAD(&ep_closed, ep, closed_entry);
+        return 0;
+    }
+
+    ep_free(ep);
+    __epoll_unlock();
+
+    return 0;
+}
+
+static epinst_t *ep_get(int epfd) {
+    vfs_handler_t *hndl = fs_get_handler(epfd);
+
+    if(!hndl) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    if(hndl != &vh) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return (epinst_t *)fs_get_handle(epfd);
+}
+
+static epitem_t *ep_find(epinst_t *ep, void *hnd, int fd) {
+    epitem_t *it;
+
+    LIST_FOREACH(it, &ep_hash[EP_HASH(hnd)], hash_entry) {
+        if(it->ep == ep && it->hnd == hnd && it->fd == fd)
+            return it;
+    }
+
+    return NULL;
+}
+
+int epoll_create1(int flags) {
+    epinst_t *ep;
+    file_t fd;
+
+    if(flags & ~EPOLL_CLOEXEC) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!(ep = malloc(sizeof(epinst_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    __epoll_inst_init(ep);
+
+    if((fd = fs_open_handle(&vh, ep)) == FILEHND_INVALID) {
+        cond_destroy(&ep->cv);
+        free(ep);
+        return -1;
+    }
+
+    return fd;
+}
+
+int epoll_create(int size) {
+    if(size <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return epoll_create1(0);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    epinst_t *ep;
+    epitem_t *it, *nit = NULL;
+    vfs_handler_t *hndl;
+    irq_mask_t old;
+    void *hnd;
+    int rv = 0;
+
+    if(!(ep = ep_get(epfd)))
+        return -1;
+
+    hndl = fs_get_handler(fd);
+    hnd = fs_get_handle(fd);
+
+    if(!hndl || !hnd) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if(hndl == &vh || fd == epfd) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!hndl->poll) {
+        errno = EPERM;
+        return -1;
+    }
+
+    if(op != EPOLL_CTL_DEL && !event) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(op == EPOLL_CTL_ADD) {
+        if(!(nit = calloc(1, sizeof(epitem_t)))) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    if(mutex_lock_irqsafe(&__epoll_mutex)) {
+        free(nit);
+        return -1;
+    }
+
+    it = ep_find(ep, hnd, fd);
+
+    switch(op) {
+        case EPOLL_CTL_ADD:
+            if(it) {
+                errno = EEXIST;
+                rv = -1;
+                break;
+            }
+
+            nit->hndl = hndl;
+            nit->hnd = hnd;
+            nit->fd = fd;
+            nit->event = *event;
+            nit->dynamic = 1;
+            __epoll_item_link(ep, nit);
+            __epoll_item_check(nit);
+            nit = NULL;
+            break;
+
+        case EPOLL_CTL_MOD:
+            if(!it) {
+                errno = ENOENT;
+                rv = -1;
+                break;
+            }
+
+            old = irq_disable();
+            it->event = *event;
+            it->disabled = 0;
+            it->revents = 0;
+            irq_restore(old);
+
+            __epoll_item_check(it);
+            break;
+
+        case EPOLL_CTL_DEL:
+            if(!it) {
+                errno = ENOENT;
+                rv = -1;
+                break;
+            }
+
+            __epoll_item_unlink(it);
+            free(it);
+            break;
+
+        default:
+            errno = EINVAL;
+            rv = -1;
+    }
+
+    __epoll_unlock();
+    free(nit);
+
+    return rv;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout) {
+    struct epready again;
+    epinst_t *ep;
+    epitem_t *it;
+    uint64_t deadline = 0;
+    uint32_t rev = 0;
+    irq_mask_t old;
+    int n = 0;
+
+    if(!(ep = ep_get(epfd)))
+        return -1;
+
+    if(!events) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if(maxevents <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(timeout > 0)
+        deadline = timer_ms_gettime64() + timeout;
+
+    if(mutex_lock_irqsafe(&__epoll_mutex))
+        return -1;
+
+    for(;;) {
+        TAILQ_INIT(&again);
+
+        while(n < maxevents) {
+            old = irq_disable();
+
+            if((it = TAILQ_FIRST(&ep->ready))) {
+                TAILQ_REMOVE(&ep->ready, it, rdy_entry);
+                it->ready = 0;
+                rev = it->revents;
+                it->revents = 0;
+            }
+
+            irq_restore(old);
+
+            if(!it)
+                break;
+
+            /* Its file was closed during an interrupt, while we were busy */
+            if(!it->hnd) {
+                __epoll_item_unlink(it);
+                free(it);
+                continue;
+            }
+
+            if(it->disabled)
+                continue;
+
+            /* Edge-triggered items report what was posted to them. Level-
+               triggered ones are asked again, since the condition that queued
+               them may have been consumed in the meantime. */
+            if(!(it->event.events & EPOLLET))
+                rev = (uint16_t)it->hndl->poll(it->hnd,
+                                               (short)(ep_mask(it) & 0xFFFF));
+
+            rev &= ep_mask(it);
+
+            if(!rev)
+                continue;
+
+            events[n].events = rev;
+            events[n].data = it->event.data;
+            ++n;
+
+            if(it->event.events & EPOLLONESHOT) {
+                it->disabled = 1;
+            }
+            else if(!(it->event.events & EPOLLET)) {
+                /* Still ready until proven otherwise on the next call. If an
+                   event queued it again in the meantime, take it back so that
+                   it isn't reported twice. */
+                old = irq_disable();
+
+                if(it->ready)
+                    TAILQ_REMOVE(&ep->ready, it, rdy_entry);
+
+                it->ready = 1;
+                TAILQ_INSERT_TAIL(&again, it, rdy_entry);
+                irq_restore(old);
+            }
+        }
+
+        old = irq_disable();
+        TAILQ_CONCAT(&ep->ready, &again, rdy_entry);
+        irq_restore(old);
+
+        if(n || !timeout)
+            break;
+
+        /* We can't actually wait while we're in an interrupt. */
+        if(irq_inside_int()) {
+            errno = EPERM;
+            n = -1;
+            break;
+        }
+
+        if(__epoll_inst_wait(ep, deadline))
+            break;
+    }
+
+    __epoll_unlock();
+    return n;
+}
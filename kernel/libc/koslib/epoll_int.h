@@ -0,0 +1,78 @@
+/* KallistiOS ##version##
+
+   epoll_int.h
+
+*/
+
+/* Internal interfaces shared between epoll.c, poll.c and the filesystems that
+   post events. Everything in here (other than the event hooks) must be called
+   with __epoll_mutex held, and the mutex must be let go of with
+   __epoll_unlock().
+
+   The mutex only keeps callers of epoll_ctl(), epoll_wait() and poll(), and
+   files being closed, from getting in each other's way. Events are posted
+   without it, as they may come in during an interrupt: the per-handle hash,
+   the ready lists and the revents, ready, disabled and hnd fields of each
+   registration are only ever changed with interrupts disabled. */
+
+#ifndef __KOSLIB_EPOLL_INT_H
+#define __KOSLIB_EPOLL_INT_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/queue.h>
+
+#include <kos/fs.h>
+#include <kos/mutex.h>
+#include <kos/cond.h>
+
+struct epinst;
+
+/* One registration of a file in an interest set. */
+typedef struct epitem {
+    LIST_ENTRY(epitem) hash_entry;  /* Chain in the per-handle hash */
+    LIST_ENTRY(epitem) ep_entry;    /* Owning instance's registrations */
+    TAILQ_ENTRY(epitem) rdy_entry;  /* Owning instance's ready list */
+
+    struct epinst *ep;              /* Owning instance */
+    vfs_handler_t *hndl;            /* Handler of the watched file */
+    void *hnd;                      /* VFS handle of the watched file */
+    int fd;                         /* Descriptor used to register it */
+
+    struct epoll_event event;       /* Events of interest and user data */
+    uint32_t revents;               /* Events posted since last reported */
+
+    int ready;                      /* Non-zero while on the ready list */
+    int disabled;                   /* EPOLLONESHOT item that has fired */
+    int dynamic;                    /* Allocated by epoll_ctl() */
+} epitem_t;
+
+/* An interest set. */
+typedef struct epinst {
+    LIST_HEAD(epitems, epitem) items;
+    TAILQ_HEAD(epready, epitem) ready;
+    condvar_t cv;
+
+    /* On the list of instances closed while epoll was busy */
+    LIST_ENTRY(epinst) closed_entry;
+} epinst_t;
+
+extern mutex_t __epoll_mutex;
+
+void __epoll_unlock(void);
+
+void __epoll_inst_init(epinst_t *ep);
+void __epoll_item_link(epinst_t *ep, epitem_t *it);
+void __epoll_item_unlink(epitem_t *it);
+void __epoll_item_check(epitem_t *it);
+int __epoll_inst_wait(epinst_t *ep, uint64_t deadline);
+
+/* Post events on a VFS handle to everyone watching it. */
+void __epoll_event_trigger(void *hnd, short events);
+
+/* Drop all registrations of a VFS handle that is being closed. In an
+   interrupt, if epoll is busy, they're cut loose from the handle instead and
+   dropped later on. */
+void __epoll_hnd_close(void *hnd);
+
+#endif /* !__KOSLIB_EPOLL_INT_H */
@@ -7,67 +7,40 @@
 
 #include <poll.h>
 #include <errno.h>
-#include <sys/queue.h>
+#include <stdlib.h>
 
 #include <kos/fs.h>
 #include <kos/irq.h>
-#include <kos/mutex.h>
-#include <kos/cond.h>
+#include <kos/timer.h>
 
-struct poll_int {
-    LIST_ENTRY(poll_int) entry;
-    struct pollfd *fds;
-    nfds_t nfds;
-    int nmatched;
-    condvar_t cv;
-};
-
-LIST_HEAD(polllist, poll_int) poll_list;
-
-static mutex_t mutex = MUTEX_INITIALIZER;
+#include "epoll_int.h"
 
+/* Called by sockets when something happens on them. Events are delivered only
+   to the poll() and epoll instances watching that particular file. */
 void __poll_event_trigger(int fd, short event) {
-    struct poll_int *i;
-    nfds_t j;
-    int gotone = 0;
-    short mask;
-
-    if(mutex_lock_irqsafe(&mutex))
-        /* XXXX: Uhh... this is bad... */
-        return;
-
-    /* Look through the list of poll fds for any that match */
-    LIST_FOREACH(i, &poll_list, entry) {
-        for(j = 0; j < i->nfds; ++j) {
-            if(i->fds[j].fd == fd) {
-                mask = i->fds[j].events | POLLERR | POLLHUP | POLLNVAL;
-                if(event & mask) {
-                    i->fds[j].revents |= event & mask;
-                    ++i->nmatched;
-                    gotone = 1;
-                }
-            }
-        }
-
-        /* If we got any events, signal the waiting thread to wake it up. */
-        if(gotone) {
-            cond_signal(&i->cv);
-            gotone = 0;
-        }
-    }
-
-    mutex_unlock(&mutex);
+    __epoll_event_trigger(fs_get_handle(fd), event);
 }
 
 int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
-    struct poll_int p = { { 0 }, fds, nfds, 0, COND_INITIALIZER };
-    int tmp;
+    epinst_t ep;
+    epitem_t *items = NULL;
+    int nmatched = 0, tmp;
     nfds_t i;
     vfs_handler_t *hndl;
     void *hnd;
 
-    if(mutex_lock_irqsafe(&mutex))
+    if(nfds && !(items = calloc(nfds, sizeof(epitem_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    __epoll_inst_init(&ep);
+
+    if(mutex_lock_irqsafe(&__epoll_mutex)) {
+        free(items);
+        cond_destroy(&ep.cv);
         return -1;
+    }
 
     /* Check if any of the fds already match */
     for(i = 0; i < nfds; ++i) {
@@ -78,7 +51,7 @@ int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
         /* If we didn't get one of these, then assume its a bad fd. */
         if(!hndl || !hnd) {
             fds[i].revents = POLLNVAL;
-            ++p.nmatched;
+            ++nmatched;
             continue;
         }
 
@@ -87,51 +60,63 @@ int poll(struct pollfd fds[], nfds_t nfds, int timeout) {
                handler. */
             if(fds[i].events & (POLLRDNORM | POLLWRNORM)) {
                 fds[i].revents |= (POLLRDNORM | POLLWRNORM) & fds[i].events;
-                ++p.nmatched;
+                ++nmatched;
             }
         }
         else {
+            /* Register interest before asking, since events are posted
+               without the lock and one could come in right after. */
+            items[i].hndl = hndl;
+            items[i].hnd = hnd;
+            items[i].fd = fds[i].fd;
+            items[i].event.events = (uint16_t)fds[i].events;
+
+            if(timeout && !irq_inside_int())
+                __epoll_item_link(&ep, &items[i]);
+
             if((fds[i].revents = hndl->poll(hnd, fds[i].events))) {
-                ++p.nmatched;
+                ++nmatched;
             }
         }
     }
 
     /* If the user specified a 0 timeout, or we've already matched something,
        bail out now. */
-    if(p.nmatched || !timeout) {
-        mutex_unlock(&mutex);
-        return p.nmatched;
-    }
+    if(nmatched || !timeout)
+        goto out;
 
     /* We can't actually wait while we're in an interrupt, so if we got this far
        it is an error. */
     if(irq_inside_int()) {
-        mutex_unlock(&mutex);
         errno = EPERM;
-        return -1;
+        nmatched = -1;
+        goto out;
     }
 
-    /* Map to the value used by cond_wait_timed() */
-    if(timeout == -1)
-        timeout = 0;
+    tmp = __epoll_inst_wait(&ep, timeout > 0 ?
+                            timer_ms_gettime64() + timeout : 0);
 
-    /* Add this instance to the list */
-    LIST_INSERT_HEAD(&poll_list, &p, entry);
+    /* Nothing gets posted to them once they're off the list */
+    while(!LIST_EMPTY(&ep.items))
+        __epoll_item_unlink(LIST_FIRST(&ep.items));
 
-    tmp = errno;
-    if(cond_wait_timed(&p.cv, &mutex, timeout)) {
-        errno = tmp;
-        tmp = 0;
+    if(tmp)
         goto out;
-    }
 
-    tmp = p.nmatched;
+    for(i = 0; i < nfds; ++i) {
+        if(items[i].revents) {
+            fds[i].revents = items[i].revents;
+            ++nmatched;
+        }
+    }
 
 out:
-    /* Remove this instance from the list */
-    LIST_REMOVE(&p, entry);
+    while(!LIST_EMPTY(&ep.items))
+        __epoll_item_unlink(LIST_FIRST(&ep.items));
+
+    __epoll_unlock();
+    cond_destroy(&ep.cv);
+    free(items);
 
-    mutex_unlock(&mutex);
-    return tmp;
+    return nmatched;
 }
@@ -18,6 +18,7 @@
 #include <kos/timer.h>
 
 #include "net_ipv4.h"
+#include "net_neigh.h"
 
 /*
 
@@ -38,217 +39,51 @@ typedef struct {
     uint8_t pr_recv[6];
 } __packed arp_pkt_t;
 
-/* Structure describing an ARP entry; each entry contains a MAC address,
-   an IP address, and a timestamp from 'jiffies'. The timestamp allows
-   aging and eventual removal. */
-typedef struct netarp {
-    /* ARP cache list handle */
-    LIST_ENTRY(netarp)  ac_list;
-
-    /* Mac address */
-    uint8_t             mac[6];
-
-    /* Associated IP address */
-    uint8_t             ip[4];
-
-    /* Cache entry time; if zero, this entry won't expire */
-    uint64_t            timestamp;
-
-    /* Optional packet to send when the entry is filled in */
-    ip_hdr_t            *pkt;
-
-    /* Additional data for that packet, if any */
-    uint8_t             *data;
-
-    /* Size of the additional data for the packet */
-    int                 data_size;
-} netarp_t;
-
-/* Define the list type */
-LIST_HEAD(netarp_list, netarp);
-
 /**************************************************************************/
 /* Variables */
 
 /* ARP cache */
-struct netarp_list net_arp_cache = LIST_HEAD_INITIALIZER(0);
+static net_neigh_table_t arp_cache;
 
 /**************************************************************************/
 /* Cache management */
 
-/* Garbage collect timed out entries */
-static int net_arp_gc(netif_t *nif) {
-    netarp_t *a1, *a2;
-    uint64_t now = timer_ms_gettime64();
-
-    a1 = LIST_FIRST(&net_arp_cache);
-
-    while(a1 != NULL) {
-        a2 = LIST_NEXT(a1, ac_list);
-
-        if(a1->timestamp) {
-            if(now >= (a1->timestamp + 120 * 1000)) {
-                LIST_REMOVE(a1, ac_list);
-
-                if(a1->pkt) {
-                    free(a1->pkt);
-                    free(a1->data);
-                }
-
-                free(a1);
-                a1 = a2;
-                continue;
-            }
-
-            /* If the entry is incomplete and it's been more than 5 seconds
-               since we queried it, try again. */
-            if(a1->mac[0] == 0 && a1->mac[1] == 0 && a1->mac[2] == 0 &&
-               a1->mac[3] == 0 && a1->mac[4] == 0 && a1->mac[5] == 0 &&
-               now > (a1->timestamp + 5 * 1000)) {
-                net_arp_query(nif, a1->ip);
-            }
-        }
-
-        a1 = a2;
-    }
+/* Re-send a packet that was waiting on an ARP reply */
+static void net_arp_output(netif_t *nif, void *hdr, const uint8_t *data,
+                           size_t size) {
+    net_ipv4_send_packet(nif, (ip_hdr_t *)hdr, data, size);
+}
 
-    return 0;
+static void net_arp_solicit(netif_t *nif, const uint8_t *ip) {
+    net_arp_query(nif, ip);
 }
 
 /* Add an entry to the ARP cache manually */
 int net_arp_insert(netif_t *nif, const uint8_t mac[6], const uint8_t ip[4],
                    uint64_t timestamp) {
-    netarp_t *cur;
-
-    /* First make sure the entry isn't already there */
-    LIST_FOREACH(cur, &net_arp_cache, ac_list) {
-        if(!memcmp(ip, cur->ip, 4)) {
-            memcpy(cur->mac, mac, 6);
-            cur->timestamp = timestamp;
-
-            /* Send our queued packet, if we have one */
-            if(cur->pkt) {
-                net_ipv4_send_packet(nif, cur->pkt, cur->data, cur->data_size);
-                free(cur->pkt);
-                free(cur->data);
-
-                cur->pkt = NULL;
-                cur->data = NULL;
-                cur->data_size = 0;
-            }
-
-            return 0;
-        }
-    }
-
-    /* It's not there, add an entry */
-    cur = (netarp_t *)malloc(sizeof(netarp_t));
-
-    if(cur == NULL)
-        return -1;
-
-    memcpy(cur->mac, mac, 6);
-    memcpy(cur->ip, ip, 4);
-    cur->timestamp = timestamp;
-    cur->pkt = NULL;
-    cur->data = NULL;
-    cur->data_size = 0;
-    LIST_INSERT_HEAD(&net_arp_cache, cur, ac_list);
-
-    /* Garbage collect expired entries */
-    net_arp_gc(nif);
-
-    return 0;
+    return net_neigh_update(&arp_cache, nif, ip, mac,
+                            timestamp ? 0 : NET_NEIGH_PERMANENT);
 }
 
 /* Look up an entry from the ARP cache; if no entry is found, then an ARP
-   query will be sent and an error will be returned. Thus your packet send
-   should also fail. Later when the transmit retries, hopefully the answer
-   will have arrived. */
+   query will be sent and the packet (if any) will be held until the answer
+   comes in. */
 int net_arp_lookup(netif_t *nif, const uint8_t ip_in[4], uint8_t mac_out[6],
                    const ip_hdr_t *pkt, const uint8_t *data, int data_size) {
-    netarp_t *cur;
-
-    /* Garbage collect expired entries */
-    net_arp_gc(nif);
-
-    /* Look for the entry */
-    LIST_FOREACH(cur, &net_arp_cache, ac_list) {
-        if(!memcmp(ip_in, cur->ip, 4)) {
-            if(cur->mac[0] == 0 && cur->mac[1] == 0 &&
-               cur->mac[2] == 0 && cur->mac[3] == 0 &&
-               cur->mac[4] == 0 && cur->mac[5] == 0) {
-                return -1;
-            }
-
-            memcpy(mac_out, cur->mac, 6);
-
-            if(cur->timestamp != 0)
-                cur->timestamp = timer_ms_gettime64();
-
-            return 0;
-        }
-    }
-
-    /* It's not there... Add an incomplete ARP entry */
-    cur = (netarp_t *)malloc(sizeof(netarp_t));
-
-    if(cur == NULL)
-        return -3;
-
-    memset(cur, 0, sizeof(netarp_t));
-    memcpy(cur->ip, ip_in, 4);
-    cur->timestamp = timer_ms_gettime64();
-
-    /* Copy our packet if we have one to copy. */
-    if(pkt && data && data_size) {
-        cur->data = (uint8_t *)malloc(data_size);
-
-        if(cur->data) {
-            cur->pkt = (ip_hdr_t *)malloc(sizeof(ip_hdr_t));
-
-            if(!cur->pkt) {
-                free(cur->data);
-                cur->data = NULL;
-            }
-            else {
-                memcpy(cur->pkt, pkt, sizeof(ip_hdr_t));
-                memcpy(cur->data, data, data_size);
-                cur->data_size = data_size;
-            }
-        }
-    }
-
-    LIST_INSERT_HEAD(&net_arp_cache, cur, ac_list);
-
-    /* Generate an ARP who-has packet */
-    net_arp_query(nif, ip_in);
-
-    /* Return failure */
-    memset(mac_out, 0, 6);
-    return -2;
+    return net_neigh_lookup(&arp_cache, nif, ip_in, mac_out, pkt, data,
+                            data_size > 0 ? (size_t)data_size : 0);
 }
 
 /* Do a reverse ARP lookup: look for an IP for a given mac address; note
    that if this fails, you have no recourse. */
 int net_arp_revlookup(netif_t *nif, uint8_t ip_out[4], const uint8_t mac_in[6]) {
-    netarp_t *cur;
-
     (void)nif;
 
-    /* Look for the entry */
-    LIST_FOREACH(cur, &net_arp_cache, ac_list) {
-        if(!memcmp(mac_in, cur->mac, 6)) {
-            memcpy(ip_out, cur->ip, 4);
-
-            if(cur->timestamp != 0)
-                cur->timestamp = timer_ms_gettime64();
-
-            return 0;
-        }
-    }
+    return net_neigh_revlookup(&arp_cache, ip_out, mac_in);
+}
 
-    return -1;
+net_neigh_stats_t net_arp_get_stats(void) {
+    return net_neigh_get_stats(&arp_cache);
 }
 
 /* Send an ARP reply packet on the specified network adapter */
@@ -365,8 +200,18 @@ int net_arp_query(netif_t *nif, const uint8_t ip[4]) {
 
 /* Init */
 int net_arp_init(void) {
-    /* Initialize the ARP cache */
-    LIST_INIT(&net_arp_cache);
+    /* Initialize the ARP cache. Entries that haven't been heard from in 30
+       seconds get checked on when they're next used, and go away after two
+       minutes. Unanswered queries are repeated every second, three times. */
+    arp_cache.addr_len = 4;
+    arp_cache.hdr_len = sizeof(ip_hdr_t);
+    arp_cache.reachable_ms = 30 * 1000;
+    arp_cache.expire_ms = 120 * 1000;
+    arp_cache.retrans_ms = 1000;
+    arp_cache.max_probes = 3;
+    arp_cache.solicit = net_arp_solicit;
+    arp_cache.output = net_arp_output;
+    net_neigh_init(&arp_cache);
 
     return 0;
 }
@@ -374,21 +219,5 @@ int net_arp_init(void) {
 /* Shutdown */
 void net_arp_shutdown(void) {
     /* Free all ARP entries */
-    netarp_t *a1, *a2;
-
-    a1 = LIST_FIRST(&net_arp_cache);
-
-    while(a1 != NULL) {
-        a2 = LIST_NEXT(a1, ac_list);
-
-        if(a1->pkt) {
-            free(a1->pkt);
-            free(a1->data);
-        }
-
-        free(a1);
-        a1 = a2;
-    }
-
-    LIST_INIT(&net_arp_cache);
+    net_neigh_shutdown(&arp_cache);
 }
@@ -20,6 +20,7 @@
 #include "net_dhcp.h"
 #include "net_ipv4.h"
 #include "net_ipv6.h"
+#include "net_pbuf.h"
 
 /*
 
@@ -47,6 +48,11 @@ netif_t *net_default_dev = NULL;
 
 workqueue_t *net_wq;
 
+static const workqueue_attr_t net_wq_attr = {
+    .num_threads = 2,
+    .label = "[net workqueue]",
+};
+
 /**************************************************************************/
 /* Driver list management
    Note that this stuff might be used before net_core is actually
@@ -160,11 +166,18 @@ int net_init(uint32_t ip) {
     if(net_dev_init() < 0)
         return -1;
 
-    /* Initialize the network thread. */
-    net_wq = workqueue_create();
+    /* Initialize the network threads. Use two, so that a slow job doesn't
+       hold up the others. */
+    net_wq = workqueue_create_ex(&net_wq_attr);
     if(!net_wq)
         return -1;
 
+    /* Initialize the packet buffer pool */
+    if(net_pbuf_init() < 0) {
+        workqueue_destroy(net_wq);
+        return -1;
+    }
+
     /* Initialize the ARP cache */
     net_arp_init();
 
@@ -256,6 +269,9 @@ void net_shutdown(void) {
     /* Shut down the network thread */
     workqueue_destroy(net_wq);
 
+    /* Release the packet buffer pool */
+    net_pbuf_shutdown();
+
     /* Shut down all activated network devices */
     LIST_FOREACH(cur, &net_if_list, if_list) {
         if(cur->flags & NETIF_RUNNING && cur->if_stop)
@@ -141,16 +141,16 @@ int net_ipv4_send_packet(netif_t *net, ip_hdr_t *hdr, const uint8_t *data,
            that it can decide what to do. */
         err = net_arp_lookup(net, dest_ip, dest_mac, hdr, data, size);
 
-        if(err == -1) {
-            errno = ENETUNREACH;
-            ++ipv4_stats.pkt_send_failed;
-            return -1;
-        }
-        else if(err == -2) {
+        if(err == -2) {
             /* It'll send when the ARP reply comes in (assuming one does), so
                return success. */
             return 0;
         }
+        else if(err < 0) {
+            errno = ENETUNREACH;
+            ++ipv4_stats.pkt_send_failed;
+            return -1;
+        }
     }
 
     /* Fill in the ethernet header */
@@ -264,16 +264,16 @@ int net_ipv4_send_inplace(netif_t *net, uint8_t *frame, size_t size, int id,
            that it can decide what to do. */
         err = net_arp_lookup(net, dest_ip, dest_mac, hdr, data, size);
 
-        if(err == -1) {
-            errno = ENETUNREACH;
-            ++ipv4_stats.pkt_send_failed;
-            return -1;
-        }
-        else if(err == -2) {
+        if(err == -2) {
             /* It'll send when the ARP reply comes in (assuming one does), so
                return success. */
             return 0;
         }
+        else if(err < 0) {
+            errno = ENETUNREACH;
+            ++ipv4_stats.pkt_send_failed;
+            return -1;
+        }
     }
 
     /* Put the IP header / data into our ethernet packet */
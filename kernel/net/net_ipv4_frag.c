@@ -294,6 +294,7 @@ int net_ipv4_reassemble(netif_t *src, const ip_hdr_t *hdr, const uint8_t *data,
 
 static workqueue_job_t net_ipv4_frag_wq_job = {
     .cb = net_ipv4_frag_job,
+    .prio = WORKQUEUE_PRIO_LOW,
 };
 
 int net_ipv4_frag_init(void) {
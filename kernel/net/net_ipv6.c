@@ -114,13 +114,13 @@ int net_ipv6_send_packet(netif_t *net, ipv6_hdr_t *hdr, const uint8_t *data,
 
         err = net_ndp_lookup(net, &dst, dst_mac, hdr, data, data_size);
 
-        if(err == -1) {
+        if(err == -2) {
+            return 0;
+        }
+        else if(err < 0) {
             errno = ENETUNREACH;
             ++ipv6_stats.pkt_send_failed;
-            return err;
-        }
-        else if(err == -2) {
-            return 0;
+            return -1;
         }
     }
 
@@ -0,0 +1,402 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_neigh.c
+
+*/
+
+#include <stdbool.h>
+#include <string.h>
+#include <kos/irq.h>
+#include <kos/timer.h>
+
+#include "net_neigh.h"
+
+/* Neighbor caches, shared by ARP and NDP. See net_neigh.h for how entries
+   move between states. */
+
+static struct net_neigh_list *neigh_bucket(net_neigh_table_t *tbl,
+                                           const uint8_t *addr) {
+    uint32_t h = 0, w;
+    size_t i;
+
+    for(i = 0; i < tbl->addr_len; i += 4) {
+        memcpy(&w, addr + i, 4);
+        h = (h ^ w) * 0x9e3779b1u;
+    }
+
+    return &tbl->buckets[h >> (32 - NET_NEIGH_HASH_BITS)];
+}
+
+static net_neigh_t *neigh_find(net_neigh_table_t *tbl, const uint8_t *addr) {
+    net_neigh_t *n;
+
+    LIST_FOREACH(n, neigh_bucket(tbl, addr), hash) {
+        if(!memcmp(n->addr, addr, tbl->addr_len))
+            return n;
+    }
+
+    return NULL;
+}
+
+/* Throw away the packets waiting on an entry */
+static void neigh_drop_queue(net_neigh_table_t *tbl, net_neigh_t *n) {
+    net_pbuf_t *pb;
+
+    while((pb = TAILQ_FIRST(&n->queue))) {
+        TAILQ_REMOVE(&n->queue, pb, queue);
+        net_pbuf_free(pb);
+        ++tbl->stats.queue_drops;
+    }
+
+    n->qlen = 0;
+}
+
+static void neigh_free(net_neigh_table_t *tbl, net_neigh_t *n) {
+    neigh_drop_queue(tbl, n);
+
+    LIST_REMOVE(n, hash);
+    TAILQ_REMOVE(&tbl->lru, n, lru);
+    LIST_INSERT_HEAD(&tbl->free, n, hash);
+    --tbl->stats.entries;
+}
+
+/* Get a new, incomplete entry for addr, evicting the least recently used
+   one if the table is full. */
+static net_neigh_t *neigh_alloc(net_neigh_table_t *tbl, netif_t *nif,
+                                const uint8_t *addr) {
+    net_neigh_t *n = LIST_FIRST(&tbl->free);
+
+    if(!n) {
+        TAILQ_FOREACH_REVERSE(n, &tbl->lru, net_neigh_lru, lru) {
+            if(!n->permanent)
+                break;
+        }
+
+        /* Everything's permanent. Somebody's been busy... */
+        if(!n)
+            return NULL;
+
+        neigh_free(tbl, n);
+        ++tbl->stats.evictions;
+    }
+
+    LIST_REMOVE(n, hash);
+
+    memcpy(n->addr, addr, tbl->addr_len);
+    memset(n->mac, 0, 6);
+    n->state = NET_NEIGH_INCOMPLETE;
+    n->permanent = 0;
+    n->probes = 0;
+    n->qlen = 0;
+    n->nif = nif;
+    n->confirmed = 0;
+    n->probed = 0;
+    TAILQ_INIT(&n->queue);
+
+    LIST_INSERT_HEAD(neigh_bucket(tbl, addr), n, hash);
+    TAILQ_INSERT_HEAD(&tbl->lru, n, lru);
+    ++tbl->stats.entries;
+
+    return n;
+}
+
+/* Bring an entry's state up to date. Returns false if it should go. */
+static bool neigh_age(net_neigh_table_t *tbl, net_neigh_t *n, uint64_t now) {
+    if(n->permanent)
+        return true;
+
+    switch(n->state) {
+        case NET_NEIGH_INCOMPLETE:
+            /* Give up once the last query has gone unanswered */
+            return n->probes < tbl->max_probes ||
+                   now < n->probed + tbl->retrans_ms;
+
+        case NET_NEIGH_REACHABLE:
+            if(now < n->confirmed + tbl->reachable_ms)
+                return true;
+
+            n->state = NET_NEIGH_STALE;
+            __fallthrough;
+
+        default:
+            return now < n->confirmed + tbl->expire_ms;
+    }
+}
+
+/* Hold a packet until the entry is resolved. If the queue is full, the oldest
+   packet makes room. */
+static int neigh_enqueue(net_neigh_table_t *tbl, net_neigh_t *n,
+                         const void *hdr, const uint8_t *data, size_t size) {
+    net_pbuf_t *pb;
+
+    if(!(pb = net_pbuf_alloc(0, tbl->hdr_len + size)))
+        return -1;
+
+    memcpy(pb->data, hdr, tbl->hdr_len);
+    memcpy(pb->data + tbl->hdr_len, data, size);
+
+    if(n->qlen == NET_NEIGH_QLEN) {
+        net_pbuf_t *old = TAILQ_FIRST(&n->queue);
+
+        TAILQ_REMOVE(&n->queue, old, queue);
+        net_pbuf_free(old);
+        ++tbl->stats.queue_drops;
+        --n->qlen;
+    }
+
+    TAILQ_INSERT_TAIL(&n->queue, pb, queue);
+    ++n->qlen;
+    ++tbl->stats.queued;
+
+    return 0;
+}
+
+/* Apply an update to the table, which must be locked. Packets that were
+   waiting for the address are moved to q, to be sent once the table has been
+   unlocked, since sending looks the address up again. Each one remembers
+   which interface to go out on in its cb. */
+static int neigh_apply(net_neigh_table_t *tbl, netif_t *nif,
+                       const uint8_t *addr, const uint8_t mac[6], int flags,
+                       struct net_pbuf_queue *q) {
+    net_neigh_t *n;
+    net_pbuf_t *pb;
+
+    if(!(n = neigh_find(tbl, addr)) && !(n = neigh_alloc(tbl, nif, addr)))
+        return -1;
+
+    /* Permanent entries only get replaced by other permanent ones */
+    if(n->permanent && !(flags & NET_NEIGH_PERMANENT))
+        return 0;
+
+    /* An unsolicited address is only a hint, unless it's one we already
+       had. */
+    if((flags & NET_NEIGH_UNSOLICITED) &&
+       (n->state == NET_NEIGH_INCOMPLETE || memcmp(n->mac, mac, 6)))
+        n->state = NET_NEIGH_STALE;
+    else
+        n->state = NET_NEIGH_REACHABLE;
+
+    memcpy(n->mac, mac, 6);
+    n->permanent = !!(flags & NET_NEIGH_PERMANENT);
+    n->probes = 0;
+    n->nif = nif;
+    n->confirmed = timer_ms_gettime64();
+
+    TAILQ_FOREACH(pb, &n->queue, queue)
+        *(netif_t **)pb->cb = nif;
+
+    TAILQ_CONCAT(q, &n->queue, queue);
+    n->qlen = 0;
+
+    return 0;
+}
+
+/* Unlock the table, applying the updates that were set aside while it was
+   locked first, and then send whatever was waiting on them (and on q). An
+   update may be set aside between the last check and the unlock, in which
+   case we go around again. */
+static void neigh_unlock(net_neigh_table_t *tbl, struct net_pbuf_queue *q) {
+    struct net_pbuf_queue sendq = TAILQ_HEAD_INITIALIZER(sendq);
+    net_neigh_deferred_t upd[NET_NEIGH_DEFERRED];
+    unsigned int i, count;
+    net_pbuf_t *pb;
+    irq_mask_t old;
+
+    if(q)
+        TAILQ_CONCAT(&sendq, q, queue);
+
+    for(;;) {
+        old = irq_disable();
+        count = tbl->ndeferred;
+        memcpy(upd, tbl->deferred, count * sizeof(upd[0]));
+        tbl->ndeferred = 0;
+        irq_restore(old);
+
+        for(i = 0; i < count; i++)
+            neigh_apply(tbl, upd[i].nif, upd[i].addr, upd[i].mac,
+                        upd[i].flags, &sendq);
+
+        mutex_unlock(&tbl->mutex);
+
+        /* If it's busy again, whoever has it will take care of it */
+        if(!tbl->ndeferred || mutex_lock_irqsafe(&tbl->mutex))
+            break;
+    }
+
+    while((pb = TAILQ_FIRST(&sendq))) {
+        TAILQ_REMOVE(&sendq, pb, queue);
+        tbl->output(*(netif_t **)pb->cb, pb->data, pb->data + tbl->hdr_len,
+                    pb->len - tbl->hdr_len);
+        net_pbuf_free(pb);
+    }
+}
+
+/* Set an update aside for whoever has the table locked. Only called in
+   interrupt context. */
+static void neigh_defer(net_neigh_table_t *tbl, netif_t *nif,
+                        const uint8_t *addr, const uint8_t mac[6], int flags) {
+    net_neigh_deferred_t *upd;
+
+    if(tbl->ndeferred == NET_NEIGH_DEFERRED) {
+        ++tbl->stats.deferred_drops;
+        return;
+    }
+
+    upd = &tbl->deferred[tbl->ndeferred++];
+    upd->nif = nif;
+    memcpy(upd->addr, addr, tbl->addr_len);
+    memcpy(upd->mac, mac, 6);
+    upd->flags = flags;
+    ++tbl->stats.deferred;
+}
+
+int net_neigh_lookup(net_neigh_table_t *tbl, netif_t *nif,
+                     const uint8_t *addr, uint8_t mac_out[6],
+                     const void *hdr, const uint8_t *data, size_t size) {
+    net_neigh_t *n;
+    uint64_t now = timer_ms_gettime64();
+    bool solicit = false;
+    int rv;
+
+    memset(mac_out, 0, 6);
+
+    if(mutex_lock_irqsafe(&tbl->mutex))
+        return -3;
+
+    n = neigh_find(tbl, addr);
+
+    if(n && !neigh_age(tbl, n, now)) {
+        neigh_free(tbl, n);
+        n = NULL;
+    }
+
+    if(n && n->state != NET_NEIGH_INCOMPLETE) {
+        memcpy(mac_out, n->mac, 6);
+
+        /* Check up on stale neighbors, but not too often */
+        if(n->state == NET_NEIGH_STALE && now >= n->probed + tbl->retrans_ms) {
+            n->probed = now;
+            solicit = true;
+        }
+
+        TAILQ_REMOVE(&tbl->lru, n, lru);
+        TAILQ_INSERT_HEAD(&tbl->lru, n, lru);
+        ++tbl->stats.hits;
+        rv = 0;
+    }
+    else {
+        ++tbl->stats.misses;
+
+        if(!n && !(n = neigh_alloc(tbl, nif, addr))) {
+            neigh_unlock(tbl, NULL);
+            return -3;
+        }
+
+        if(now >= n->probed + tbl->retrans_ms) {
+            n->probed = now;
+            ++n->probes;
+            solicit = true;
+        }
+
+        /* The packet only goes out later if it was actually held */
+        if(hdr && data && size && !neigh_enqueue(tbl, n, hdr, data, size))
+            rv = -2;
+        else
+            rv = -1;
+    }
+
+    neigh_unlock(tbl, NULL);
+
+    if(solicit)
+        tbl->solicit(nif, addr);
+
+    return rv;
+}
+
+int net_neigh_update(net_neigh_table_t *tbl, netif_t *nif,
+                     const uint8_t *addr, const uint8_t mac[6], int flags) {
+    struct net_pbuf_queue q = TAILQ_HEAD_INITIALIZER(q);
+    int rv;
+
+    if(mutex_lock_irqsafe(&tbl->mutex)) {
+        if(!irq_inside_int())
+            return -1;
+
+        neigh_defer(tbl, nif, addr, mac, flags);
+        return 0;
+    }
+
+    rv = neigh_apply(tbl, nif, addr, mac, flags, &q);
+    neigh_unlock(tbl, &q);
+
+    return rv;
+}
+
+int net_neigh_revlookup(net_neigh_table_t *tbl, uint8_t *addr_out,
+                        const uint8_t mac[6]) {
+    net_neigh_t *n;
+    int rv = -1;
+
+    if(mutex_lock_irqsafe(&tbl->mutex))
+        return -1;
+
+    TAILQ_FOREACH(n, &tbl->lru, lru) {
+        if(n->state != NET_NEIGH_INCOMPLETE && !memcmp(n->mac, mac, 6)) {
+            memcpy(addr_out, n->addr, tbl->addr_len);
+            rv = 0;
+            break;
+        }
+    }
+
+    neigh_unlock(tbl, NULL);
+    return rv;
+}
+
+void net_neigh_gc(net_neigh_table_t *tbl) {
+    net_neigh_t *n, *tmp;
+    uint64_t now = timer_ms_gettime64();
+
+    if(mutex_lock_irqsafe(&tbl->mutex))
+        return;
+
+    TAILQ_FOREACH_SAFE(n, &tbl->lru, lru, tmp) {
+        if(!neigh_age(tbl, n, now))
+            neigh_free(tbl, n);
+    }
+
+    neigh_unlock(tbl, NULL);
+}
+
+net_neigh_stats_t net_neigh_get_stats(net_neigh_table_t *tbl) {
+    return tbl->stats;
+}
+
+void net_neigh_init(net_neigh_table_t *tbl) {
+    int i;
+
+    mutex_init(&tbl->mutex, MUTEX_TYPE_NORMAL);
+
+    for(i = 0; i < NET_NEIGH_HASH_SIZE; i++)
+        LIST_INIT(&tbl->buckets[i]);
+
+    TAILQ_INIT(&tbl->lru);
+    LIST_INIT(&tbl->free);
+
+    for(i = 0; i < NET_NEIGH_SIZE; i++)
+        LIST_INSERT_HEAD(&tbl->free, &tbl->entries[i], hash);
+
+    memset(&tbl->stats, 0, sizeof(tbl->stats));
+    tbl->ndeferred = 0;
+}
+
+void net_neigh_shutdown(net_neigh_table_t *tbl) {
+    net_neigh_t *n;
+
+    mutex_lock(&tbl->mutex);
+
+    while((n = TAILQ_FIRST(&tbl->lru)))
+        neigh_free(tbl, n);
+
+    mutex_unlock(&tbl->mutex);
+    mutex_destroy(&tbl->mutex);
+}
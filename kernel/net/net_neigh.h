@@ -0,0 +1,166 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_neigh.h
+
+*/
+
+#ifndef __LOCAL_NET_NEIGH_H
+#define __LOCAL_NET_NEIGH_H
+
+#include <kos/cdefs.h>
+
+__BEGIN_DECLS
+
+#include <stdint.h>
+#include <sys/queue.h>
+#include <kos/mutex.h>
+#include <kos/net.h>
+
+#include "net_pbuf.h"
+
+/* Neighbor caches.
+
+   This is the part of ARP and NDP that remembers which link-layer address
+   goes with which protocol address. Each table has a fixed number of entries,
+   hashed on the protocol address, and evicts the least recently used entry
+   when it runs out. Entries go through a cut down version of the states in
+   RFC 4861:
+
+   - Incomplete: we've asked, and nobody has answered yet. Up to
+     NET_NEIGH_QLEN packets wait here for the answer, and the question is
+     repeated every retrans_ms, up to max_probes times.
+   - Reachable: the neighbor has been heard from within reachable_ms.
+   - Stale: we have an address, but haven't heard from the neighbor lately.
+     The address is still used, but using it asks again (at most once every
+     retrans_ms). Stale entries are dropped once they haven't been heard from
+     in expire_ms.
+
+   Nothing here runs on a timer: everything happens as entries are looked up
+   or updated.
+
+   Lookups and updates may happen in interrupt context, where the table's
+   mutex can only be tried. An update that finds the table busy (an ARP reply
+   coming in while a thread is sending, say) is set aside and applied by
+   whoever holds the table when they let go of it, so that it isn't lost.
+   A lookup that finds the table busy fails, and its packet is dropped like
+   any other that couldn't be sent.
+
+   Permanent entries are only ever changed by another permanent update.
+   Anything else we hear about their address is ignored. */
+
+/* Entries in each table */
+#define NET_NEIGH_SIZE          64
+
+/* Hash buckets in each table */
+#define NET_NEIGH_HASH_BITS     5
+#define NET_NEIGH_HASH_SIZE     (1 << NET_NEIGH_HASH_BITS)
+
+/* Packets held per incomplete entry */
+#define NET_NEIGH_QLEN          3
+
+/* Updates set aside while the table is busy */
+#define NET_NEIGH_DEFERRED      4
+
+/* Longest protocol address (IPv6) */
+#define NET_NEIGH_ADDR_MAX      16
+
+#define NET_NEIGH_INCOMPLETE    0
+#define NET_NEIGH_REACHABLE     1
+#define NET_NEIGH_STALE         2
+
+/* Flags for net_neigh_update() */
+#define NET_NEIGH_UNSOLICITED   0x01    /* Only a hint: a different address
+                                           makes the entry stale */
+#define NET_NEIGH_PERMANENT     0x02    /* Never expires or gets evicted */
+
+typedef struct net_neigh {
+    LIST_ENTRY(net_neigh)   hash;
+    TAILQ_ENTRY(net_neigh)  lru;
+
+    uint8_t                 addr[NET_NEIGH_ADDR_MAX];
+    uint8_t                 mac[6];
+    uint8_t                 state;
+    uint8_t                 permanent;
+    uint8_t                 probes;
+    uint8_t                 qlen;
+
+    netif_t                 *nif;
+    uint64_t                confirmed;  /* Last heard from */
+    uint64_t                probed;     /* Last asked about */
+
+    /* Packets waiting for the address, each holding its header followed by
+       the data */
+    struct net_pbuf_queue   queue;
+} net_neigh_t;
+
+/* An update that came in while the table was busy */
+typedef struct net_neigh_deferred {
+    netif_t                 *nif;
+    uint8_t                 addr[NET_NEIGH_ADDR_MAX];
+    uint8_t                 mac[6];
+    int                     flags;
+} net_neigh_deferred_t;
+
+LIST_HEAD(net_neigh_list, net_neigh);
+TAILQ_HEAD(net_neigh_lru, net_neigh);
+
+typedef struct net_neigh_table {
+    /* Filled in by the protocol */
+    size_t                  addr_len;
+    size_t                  hdr_len;
+    uint32_t                reachable_ms;
+    uint32_t                expire_ms;
+    uint32_t                retrans_ms;
+    uint32_t                max_probes;
+
+    /* Ask who has addr */
+    void                    (*solicit)(netif_t *nif, const uint8_t *addr);
+
+    /* Send a packet that was waiting for an address */
+    void                    (*output)(netif_t *nif, void *hdr,
+                                      const uint8_t *data, size_t size);
+
+    /* Private */
+    mutex_t                 mutex;
+    struct net_neigh_list   buckets[NET_NEIGH_HASH_SIZE];
+    struct net_neigh_lru    lru;        /* Most recently used first */
+    struct net_neigh_list   free;
+    net_neigh_stats_t       stats;
+    net_neigh_t             entries[NET_NEIGH_SIZE];
+
+    /* Only touched with interrupts disabled */
+    volatile unsigned int   ndeferred;
+    net_neigh_deferred_t    deferred[NET_NEIGH_DEFERRED];
+} net_neigh_table_t;
+
+void net_neigh_init(net_neigh_table_t *tbl);
+void net_neigh_shutdown(net_neigh_table_t *tbl);
+
+/* Find the link-layer address for addr. If there isn't one yet, hdr, data and
+   size describe a packet to send once there is (hdr may be NULL).
+
+   Returns 0 with the address in mac_out, -1 if the address isn't known yet
+   and the packet wasn't held (or there wasn't one), -2 if the packet is being
+   held for a reply, or -3 if we couldn't do anything with it. */
+int net_neigh_lookup(net_neigh_table_t *tbl, netif_t *nif,
+                     const uint8_t *addr, uint8_t mac_out[6],
+                     const void *hdr, const uint8_t *data, size_t size);
+
+/* Record that addr is at mac, sending anything that was waiting for it. If
+   the table is busy in interrupt context, the update is applied once it
+   isn't anymore. */
+int net_neigh_update(net_neigh_table_t *tbl, netif_t *nif,
+                     const uint8_t *addr, const uint8_t mac[6], int flags);
+
+/* Find the protocol address for a link-layer address. */
+int net_neigh_revlookup(net_neigh_table_t *tbl, uint8_t *addr_out,
+                        const uint8_t mac[6]);
+
+/* Drop entries that have expired or given up. */
+void net_neigh_gc(net_neigh_table_t *tbl);
+
+net_neigh_stats_t net_neigh_get_stats(net_neigh_table_t *tbl);
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_NEIGH_H */
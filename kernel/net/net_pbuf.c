@@ -0,0 +1,129 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_pbuf.c
+
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <kos/irq.h>
+#include <kos/dbglog.h>
+
+#include "net_pbuf.h"
+
+/* Each pooled buffer takes up this much space, header included. Rounded up so
+   that every buffer in the pool stays cache-line aligned. */
+#define POOL_STRIDE \
+    ((sizeof(net_pbuf_t) + NET_PBUF_POOL_BUFSZ + 31) & ~(size_t)31)
+
+/* While a buffer is sitting in the pool, its first bytes hold the free list
+   link instead. */
+struct pool_ent {
+    SLIST_ENTRY(pool_ent) next;
+};
+
+static uint8_t *pool;
+static SLIST_HEAD(, pool_ent) pool_free = SLIST_HEAD_INITIALIZER(pool_free);
+static net_pbuf_stats_t stats;
+
+static void pbuf_setup(net_pbuf_t *pb, size_t size, uint32_t flags,
+                       size_t headroom, size_t len) {
+    pb->size = size;
+    pb->flags = flags;
+    pb->data = pb->buf + headroom;
+    pb->len = len;
+}
+
+net_pbuf_t *net_pbuf_alloc(size_t headroom, size_t len) {
+    net_pbuf_t *pb = NULL;
+    struct pool_ent *ent;
+    size_t size = headroom + len;
+
+    if(size <= NET_PBUF_POOL_BUFSZ) {
+        irq_disable_scoped();
+
+        if((ent = SLIST_FIRST(&pool_free))) {
+            SLIST_REMOVE_HEAD(&pool_free, next);
+            pb = (net_pbuf_t *)ent;
+
+            ++stats.pool_allocs;
+            if(--stats.pool_free < stats.pool_low)
+                stats.pool_low = stats.pool_free;
+        }
+    }
+
+    if(pb) {
+        pbuf_setup(pb, NET_PBUF_POOL_BUFSZ, NET_PBUF_POOLED, headroom, len);
+        return pb;
+    }
+
+    /* Too big for the pool, or the pool has run dry. */
+    if(!(pb = memalign(32, sizeof(net_pbuf_t) + size))) {
+        ++stats.failed;
+        errno = ENOBUFS;
+        return NULL;
+    }
+
+    ++stats.heap_allocs;
+    pbuf_setup(pb, size, 0, headroom, len);
+    return pb;
+}
+
+void net_pbuf_free(net_pbuf_t *pb) {
+    struct pool_ent *ent;
+
+    if(!(pb->flags & NET_PBUF_POOLED)) {
+        free(pb);
+        return;
+    }
+
+    ent = (struct pool_ent *)pb;
+
+    irq_disable_scoped();
+    SLIST_INSERT_HEAD(&pool_free, ent, next);
+    ++stats.pool_free;
+}
+
+void net_pbuf_get_stats(net_pbuf_stats_t *out) {
+    irq_disable_scoped();
+    *out = stats;
+}
+
+int net_pbuf_init(void) {
+    struct pool_ent *ent;
+    int i;
+
+    if(pool)
+        return 0;
+
+    if(!(pool = memalign(32, POOL_STRIDE * NET_PBUF_POOL_COUNT))) {
+        dbglog(DBG_ERROR, "net_pbuf: couldn't allocate buffer pool\n");
+        return -1;
+    }
+
+    for(i = NET_PBUF_POOL_COUNT - 1; i >= 0; --i) {
+        ent = (struct pool_ent *)(pool + i * POOL_STRIDE);
+        SLIST_INSERT_HEAD(&pool_free, ent, next);
+    }
+
+    stats.pool_free = stats.pool_low = NET_PBUF_POOL_COUNT;
+    return 0;
+}
+
+void net_pbuf_shutdown(void) {
+    if(!pool)
+        return;
+
+    /* Anything still out there is going to be written back into the pool when
+       it's freed, so the pool can't go away until everything is back. */
+    if(stats.pool_free != NET_PBUF_POOL_COUNT) {
+        dbglog(DBG_WARNING, "net_pbuf: %u buffers still in use at shutdown\n",
+               (unsigned int)(NET_PBUF_POOL_COUNT - stats.pool_free));
+        return;
+    }
+
+    SLIST_INIT(&pool_free);
+    free(pool);
+    pool = NULL;
+}
@@ -0,0 +1,88 @@
+/* KallistiOS ##version##
+
+   kernel/net/net_pbuf.h
+
+*/
+
+#ifndef __LOCAL_NET_PBUF_H
+#define __LOCAL_NET_PBUF_H
+
+#include <kos/cdefs.h>
+
+__BEGIN_DECLS
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+/* Packet buffers.
+
+   A packet buffer holds one packet's worth of data, optionally with some room
+   left in front of it (headroom) for a sender to build the lower layers'
+   headers in place, as UDP does for net_ipv4_send_inplace(). Buffers come from
+   a preallocated pool when they're small enough, so the common case never
+   touches malloc(). The pool is protected by disabling IRQs, so buffers can be
+   allocated and freed in interrupt context.
+
+   Only UDP and the neighbor cache's queue of packets waiting on address
+   resolution use these so far. The drivers, IPv4/IPv6 and TCP still pass
+   around plain pointers to their data, so received packets are still copied
+   on their way up the stack, and there's no reference counting to let more
+   than one layer hold on to a buffer. Carrying these from the drivers' receive
+   paths all the way to the sockets and back out through if_tx would mean
+   changing net_input() and the netif interface for every driver, and it
+   hasn't been done. */
+
+/* Size of the data area of a pooled buffer. This is enough for a full ethernet
+   frame, with a bit to spare. */
+#define NET_PBUF_POOL_BUFSZ     1600
+
+/* Number of buffers in the pool. */
+#define NET_PBUF_POOL_COUNT     32
+
+typedef struct net_pbuf {
+    /* Whoever owns the buffer at the moment may use this to queue it. */
+    TAILQ_ENTRY(net_pbuf) queue;
+
+    uint8_t *data;              /* Start of the packet data */
+    size_t len;                 /* Length of the packet data */
+    size_t size;                /* Size of buf */
+    uint32_t flags;
+
+    /* Scratch space for the protocol that owns the buffer (e.g. the address a
+       datagram came from). */
+    alignas(8) uint8_t cb[32];
+
+    alignas(32) uint8_t buf[];
+} net_pbuf_t;
+
+#define NET_PBUF_POOLED     0x00000001  /* Came from the pool */
+
+TAILQ_HEAD(net_pbuf_queue, net_pbuf);
+
+/* Allocate a buffer with len bytes of data, preceded by headroom bytes of
+   space for headers. The data is left uninitialized. Returns NULL and sets
+   errno to ENOBUFS if no memory is available. */
+net_pbuf_t *net_pbuf_alloc(size_t headroom, size_t len);
+
+/* Free a buffer, returning it to the pool if it came from there. */
+void net_pbuf_free(net_pbuf_t *pb);
+
+/* Statistics for the pool. */
+typedef struct net_pbuf_stats {
+    uint32_t pool_free;         /* Buffers currently in the pool */
+    uint32_t pool_low;          /* Fewest buffers ever left in the pool */
+    uint32_t pool_allocs;       /* Allocations served from the pool */
+    uint32_t heap_allocs;       /* Allocations that had to use malloc() */
+    uint32_t failed;            /* Allocations that failed outright */
+} net_pbuf_stats_t;
+
+void net_pbuf_get_stats(net_pbuf_stats_t *stats);
+
+int net_pbuf_init(void);
+void net_pbuf_shutdown(void);
+
+__END_DECLS
+
+#endif /* !__LOCAL_NET_PBUF_H */
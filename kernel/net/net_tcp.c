@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <poll.h>
 #include <sys/socket.h>
@@ -19,7 +20,9 @@
 #include <kos/cond.h>
 #include <kos/mutex.h>
 #include <kos/thread.h>
-#include <kos/rwsem.h>
+#include <kos/worker_thread.h>
+#include <kos/genwait.h>
+#include <kos/irq.h>
 #include <kos/fs_socket.h>
 
 #include <kos/timer.h>
@@ -29,6 +32,7 @@
 #include "net_core.h"
 #include "net_ipv4.h"
 #include "net_ipv6.h"
+#include "../thread/timerq.h"
 
 /* Since some of this is a bit odd in its implementation, here's a few notes on
    what my thinking was while writing all of this...
@@ -46,22 +50,19 @@
    suspend an IRQ while its being processed.
 
    On locking:
-   I took a two-leveled locking approach when writing all of this code. The
-   first-level of locking is on the list of sockets itself. This is done with a
-   reader/writer semaphore. If the function in question will ever modify the
-   list of sockets in any way, it acquires the write lock. Otherwise, it will
-   always acquire the read lock. The second level of locking is on the
-   individual socket level. This is done with a standard mutex. When looking at
-   an individual socket, grab that mutex in addition to the read or write lock,
-   as is appropriate. The only function that is somewhat counter-intuitive in
-   its locking is bind(). The bind() function, even though it does not modify
-   the list itself, does grab the write lock. The reason for this is fairly
-   simple. If bind() were to grab the read lock, then iterate through the list
-   of sockets looking for duplicate binds, there is a possibility that a second
-   call to bind() in another thread could cause a deadlock due to the locking
-   and unlocking of the mutexes on the individual sockets. To prevent this
-   problem, I have it grab the write lock instead. That way, no two bind() calls
-   can be active at a time.
+   Each socket has its own mutex, which is held whenever the socket's state is
+   looked at or changed. The socket functions find their socket through the
+   fs_socket handle, so that mutex is all they need. The list of sockets and
+   the lookup tables used to match incoming segments (see below) aren't behind
+   a lock of their own: they're only ever changed or walked with IRQs disabled,
+   which is quick, since nothing in there blocks. That means incoming segments
+   on different sockets don't get in each other's way, and neither bind() nor
+   close() on one socket holds up traffic on all the others. Something that
+   finds a socket in the lookup tables (or the timer queue) takes a reference
+   on it before turning IRQs back on, and then waits for its mutex with
+   tcp_sock_lock(). That keeps the socket from being freed out from underneath
+   it in the meantime: if it's closed while we wait, the last one waiting on
+   it frees it instead.
 
    On listening:
    When a connection comes in for a socket that is in the listening state, that
@@ -74,22 +75,41 @@
    real socket created for them until they are accept()ed.
 
    On matching sockets:
-   All new sockets (including those created by accept()) are added to the head
-   of the list. Since we cannot bind a socket to an already used port for
-   listening, that means that any fully-created sockets should appear in the
-   list in front of those created for listening to a port (and thus that are
-   only partially-created). This simplifies the procedure for finding matching
-   sockets for incoming packets, since this makes sure that the fully-created
-   socket will be found first if it exists when simply iterating through the
-   list of sockets.
+   Incoming segments are matched with two hash tables rather than by walking
+   the whole list of sockets. Connected sockets (including those created by
+   accept()) are looked up by remote address and both ports, and only if none
+   of them match is the segment checked against the sockets listening on (or
+   otherwise bound to) its destination port. This way, a fully-created socket
+   is always found ahead of the listening socket on the same port it came from,
+   and the cost of demultiplexing a segment doesn't grow with the number of
+   open connections. Sockets created by accept() are only in the connection
+   table, so a busy listener's port bucket doesn't fill up with its own
+   connections.
+
+   On timers:
+   Each socket has a small set of timers (retransmission, persist, delayed ACK,
+   keepalive and TIME-WAIT), and sockets with any of them armed sit in a timer
+   queue keyed on their earliest deadline (the same pairing heap the thread
+   code uses for timeouts). That queue is protected by disabling IRQs, since
+   packets can come in (and arm timers) from IRQ context. A single worker
+   thread sleeps until the first socket in the queue comes due, so nothing at
+   all runs while every connection is idle. Pushing a deadline back doesn't
+   move the socket in the queue; the thread just wakes up early, sees nothing
+   due, and files the socket under its real deadline.
 
    On what's actually here:
-   I didn't bother implementing any TCP extensions beyond RFC 793. That means
-   that I just ignore things like the timestamp option and the selective
-   acknowledgement option. That also means that the window size maxes out at
-   65535. Some extensions may be implemented in the future, if I see fit to do
-   so. That all said, everything in here works just fine over IPv4 or IPv6, and
-   can be used just fine to communicate with "normal" TCP/IP implementations.
+   I didn't originally bother implementing any TCP extensions beyond RFC 793,
+   but a few have been added since. The sender does slow start, congestion
+   avoidance and NewReno fast retransmit/fast recovery (RFC 5681 and 6582), with
+   the retransmission timeout derived from a smoothed RTT estimate (RFC 6298,
+   Karn's algorithm). The counters for all of that can be read back with the
+   TCP_INFO socket option. Window scaling and timestamps (RFC 7323) and
+   selective acknowledgements (RFC 2018) are used when the other side agrees to
+   them. Keepalives (SO_KEEPALIVE, with the TCP_KEEPIDLE, TCP_KEEPINTVL and
+   TCP_KEEPCNT options) are supported too. Any other options are just
+   ignored. That all said, everything in here
+   works just fine over IPv4 or IPv6, and can be used just fine to communicate
+   with "normal" TCP/IP implementations.
 */
 
 typedef struct tcp_hdr {
@@ -113,6 +133,9 @@ struct lsock {
     uint32_t isn;
     uint32_t wnd;
     uint16_t mss;
+    uint8_t wscale;
+    uint8_t opt_flags;
+    uint32_t ts_recent;
 };
 
 /* Send/receive variables... */
@@ -139,11 +162,44 @@ struct rcvrec {
 
 struct tcp_ooo_seg {
     uint32_t seq;
-    uint16_t len;
+    uint32_t len;
+};
+
+/* A range of sequence numbers, as carried by the SACK option (RFC 2018) */
+struct tcp_sack_blk {
+    uint32_t start;
+    uint32_t end;
+};
+
+/* Maximum number of SACK blocks in one segment (with timestamps, only 3 fit),
+   and the number of SACKed ranges a sender remembers. */
+#define TCP_SACK_MAX_BLOCKS 4
+#define TCP_SACK_SCOREBOARD 8
+
+/* Per-socket timers */
+#define TCP_TIMER_REXMT     0   /* retransmission (of SYNs or data) */
+#define TCP_TIMER_PERSIST   1   /* zero window probe */
+#define TCP_TIMER_DELACK    2   /* delayed ACK */
+#define TCP_TIMER_KEEP      3   /* keepalive */
+#define TCP_TIMER_2MSL      4   /* TIME-WAIT */
+#define TCP_TIMER_REAP      5   /* closed socket waiting to be freed */
+#define TCP_TIMER_COUNT     6
+
+/* TCP options parsed out of an incoming segment */
+struct tcp_opts {
+    uint16_t mss;
+    uint8_t wscale;
+    uint8_t flags;          /* TCP_OPTF_* present in the segment */
+    uint32_t tsval;
+    uint32_t tsecr;
+    int sack_count;
+    struct tcp_sack_blk sack[TCP_SACK_MAX_BLOCKS];
 };
 
 struct tcp_sock {
     LIST_ENTRY(tcp_sock) sock_list;
+    LIST_ENTRY(tcp_sock) port_list;     /* tcp_ports, once bound */
+    LIST_ENTRY(tcp_sock) conn_list;     /* tcp_conns, once connected */
     struct sockaddr_in6 local_addr;
     struct sockaddr_in6 remote_addr;
 
@@ -153,12 +209,27 @@ struct tcp_sock {
     file_t sock;
     int state;
     mutex_t mutex;
+    int refs;           /* Waiting in tcp_sock_lock(), see there */
     short poll_pending; /* Accumulated POLL* events while mutex is held */
     int hop_limit;
     int tos;
     uint32_t rcvbuf_sz;
     uint32_t sndbuf_sz;
 
+    /* Timer deadlines in ms, 0 when not armed. The socket is kept in the
+       tcp_timers queue until timer_next, which is never later than the
+       earliest of these (but may be earlier, if a timer was pushed back). */
+    uint64_t timers[TCP_TIMER_COUNT];
+    uint64_t timer_next;
+    timerq_node_t timer_node;
+
+    /* Keepalive settings (in seconds) and state */
+    uint32_t keep_idle;
+    uint32_t keep_intvl;
+    uint32_t keep_cnt;
+    uint32_t keep_probes;
+    uint64_t last_rcv;
+
     union {
         struct {
             int backlog;
@@ -181,26 +252,82 @@ struct tcp_sock {
             uint32_t sndbuf_head;
             uint32_t sndbuf_acked;
             uint32_t sndbuf_tail;
-            uint64_t timer;
             condvar_t send_cv;
             condvar_t recv_cv;
             struct tcp_ooo_seg ooo[TCP_OOO_MAX];
             int ooo_count;
+            uint32_t ooo_last;      /* seq of the latest OOO segment */
             uint8_t ack_pending;    /* segments since last ACK */
+
+            /* Negotiated options (RFC 7323 and 2018) */
+            uint8_t opt_flags;      /* TCP_OPTF_* in use */
+            uint8_t snd_wscale;     /* shift for windows the peer sends */
+            uint8_t rcv_wscale;     /* shift for windows we advertise */
+            uint32_t ts_recent;     /* latest timestamp from the peer */
+            uint32_t last_ack_sent;
+            struct tcp_sack_blk sacked[TCP_SACK_SCOREBOARD];
+            int sacked_count;       /* ranges above snd.una the peer has */
+            uint32_t rxt_next;      /* where to look for the next hole */
+
+            /* Congestion control (RFC 5681/6582) and retransmission timer
+               (RFC 6298) state. */
+            uint32_t snd_max;       /* highest sequence number sent */
+            uint32_t cwnd;
+            uint32_t ssthresh;
+            uint32_t recover;       /* snd_max when recovery was entered */
+            uint32_t rtt_seq;       /* sequence number being timed */
+            uint64_t rtt_time;      /* when rtt_seq was sent */
+            int32_t srtt;           /* smoothed RTT, in ms << 3 */
+            int32_t rttvar;         /* RTT variation, in ms << 2 */
+            uint32_t rto;           /* current retransmission timeout (ms) */
+            uint8_t dupacks;
+            uint8_t cc_flags;
+            uint32_t retransmits;
+            uint32_t fast_retransmits;
+            uint32_t timeouts;
         } data;
     };
 };
 
 LIST_HEAD(tcp_sock_list, tcp_sock);
 
+/* Every socket, for net_tcp_shutdown(). Only touched with IRQs disabled. */
 static struct tcp_sock_list tcp_socks = LIST_HEAD_INITIALIZER(0);
-static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
+
+/* Lookup tables for incoming segments. Every socket that was given a local
+   port by bind() or connect() is in tcp_ports, hashed on that port, and every
+   socket with a remote end is in tcp_conns, hashed on the remote address and
+   both ports. Sockets created by accept() share their listener's port and are
+   only in tcp_conns. The local address isn't part of either hash, since a
+   socket may be bound to the unspecified address. Both are only changed or
+   searched with IRQs disabled, since segments can arrive in an IRQ handler. */
+#define TCP_PORT_HASH_BITS  5
+#define TCP_CONN_HASH_BITS  7
+#define TCP_PORT_HASH_SIZE  (1 << TCP_PORT_HASH_BITS)
+#define TCP_CONN_HASH_SIZE  (1 << TCP_CONN_HASH_BITS)
+
+static struct tcp_sock_list tcp_ports[TCP_PORT_HASH_SIZE];
+static struct tcp_sock_list tcp_conns[TCP_CONN_HASH_SIZE];
+
+/* Timer queue (see timerq.h) of the sockets with armed timers, keyed on
+   timer_next. Only touched with IRQs disabled, since segments can arrive in an
+   IRQ handler. */
+static uint64_t tcp_timer_key(const timerq_node_t *node) {
+    return timerq_entry(node, struct tcp_sock, timer_node)->timer_next;
+}
+
+static timerq_t tcp_timers = TIMERQ_INITIALIZER(tcp_timer_key);
+static kthread_worker_t *tcp_timer_thd;
+static bool tcp_timer_quit;
 
 /* Default starting window size for connections. Must fit in uint16_t (max
    65535 without RFC 1323 window scaling). Larger = more in-flight data =
    better throughput on links with any latency or reordering. */
 #define TCP_DEFAULT_WINDOW  65535
 
+/* Largest receive buffer (and thus window) we'll allow, with window scaling. */
+#define TCP_MAX_WINDOW      (1024 * 1024)
+
 /* Default MSS */
 #define TCP_DEFAULT_MSS     1460
 
@@ -208,14 +335,34 @@ static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
    to be 15 seconds, since that's what Mac OS X does. */
 #define TCP_DEFAULT_MSL     15000
 
-/* Default retransmission timeout (in milliseconds). */
+/* Default retransmission timeout (in milliseconds). This is used until the
+   first RTT sample is taken on a connection. */
 #define TCP_DEFAULT_RTTO    2000
 
+/* Bounds on the retransmission timeout computed from the RTT estimate (in
+   milliseconds). RFC 6298 suggests a 1 second minimum, but that is far too
+   conservative for the sort of LAN most of these consoles live on. */
+#define TCP_MIN_RTO         200
+#define TCP_MAX_RTO         60000
+
+/* Number of duplicate ACKs that trigger a fast retransmit */
+#define TCP_DUPACK_THRESH   3
+
 /* Default hop limit (or ttl for IPv4) for new sockets */
 #define TCP_DEFAULT_HOPS    64
 
-/* Period at which the workqueue job will run */
-#define TCP_POLL_PERIOD_MS  10
+/* How long an ACK may be held back waiting for more segments to arrive (in
+   milliseconds). This is kept short, since we only ACK every 8th segment. */
+#define TCP_DELACK_MS       5
+
+/* Granularity of our clock (in milliseconds), for the RTO calculation */
+#define TCP_CLOCK_GRAN      1
+
+/* Default keepalive settings (in seconds), as per RFC 1122 section 4.2.3.6 */
+#define TCP_KEEPIDLE_DEFAULT    7200
+#define TCP_KEEPINTVL_DEFAULT   75
+#define TCP_KEEPCNT_DEFAULT     9
+#define TCP_KEEP_MAX            32767
 
 /* Flags that can be set in the off_flags field of the above struct */
 #define TCP_FLAG_FIN    0x01
@@ -241,16 +388,40 @@ static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
 #define TCP_STATE_TIME_WAIT     10
 
 #define TCP_STATE_RESET         0x80000000
-#define TCP_STATE_ACCEPTING     0x40000000
 
 /* Internal flags */
 #define TCP_IFLAG_CANBEDEL      0x00000001
 #define TCP_IFLAG_QUEUEDCLOSE   0x00000002
 #define TCP_IFLAG_ACCEPTWAIT    0x00000004
+#define TCP_IFLAG_KEEPALIVE     0x00000008
+#define TCP_IFLAG_DEAD          0x00000010  /* Freed while refs was held */
+
+/* Flags for the cc_flags field of the socket */
+#define TCP_CC_RTTVALID         0x01    /* srtt/rttvar hold a real sample */
+#define TCP_CC_TIMING           0x02    /* rtt_seq is being timed */
+#define TCP_CC_RECOVERY         0x04    /* in NewReno fast recovery */
 
 #define TCP_OPT_EOL             0
 #define TCP_OPT_NOP             1
 #define TCP_OPT_MSS             2
+#define TCP_OPT_WSCALE          3
+#define TCP_OPT_SACK_PERM       4
+#define TCP_OPT_SACK            5
+#define TCP_OPT_TS              8
+
+/* Length of the timestamp option, padded with two NOPs */
+#define TCP_TS_OPT_LEN          12
+
+/* Largest window shift allowed by RFC 7323 */
+#define TCP_MAX_WSCALE          14
+
+/* Flags for the TCP options a segment carries/a connection uses */
+#define TCP_OPTF_WSCALE         0x01
+#define TCP_OPTF_SACK_PERM      0x02
+#define TCP_OPTF_TS             0x04
+#define TCP_OPTF_SACK           0x08    /* only in struct tcp_opts */
+#define TCP_OPTF_ALL            (TCP_OPTF_WSCALE | TCP_OPTF_SACK_PERM | \
+                                 TCP_OPTF_TS)
 
 /* A few macros for comparing sequence numbers */
 #define SEQ_LT(x, y)    (((int32_t)((x) - (y))) < 0)
@@ -259,6 +430,7 @@ static rw_semaphore_t tcp_sem = RWSEM_INITIALIZER;
 #define SEQ_GE(x, y)    (((int32_t)((x) - (y))) >= 0)
 
 #define MAX(x, y)       ((x) > (y) ? (x) : (y))
+#define MIN(x, y)       ((x) < (y) ? (x) : (y))
 
 /* Forward declarations */
 static fs_socket_proto_t proto;
@@ -269,7 +441,134 @@ static void tcp_rst(netif_t *net, const struct in6_addr *src,
 static int tcp_send_syn(struct tcp_sock *sock, int ack);
 static void tcp_send_ack(struct tcp_sock *sock);
 static void tcp_send_data(struct tcp_sock *sock, int resend);
+static void tcp_cc_init(struct tcp_sock *sock);
+static uint8_t tcp_wscale(uint32_t bufsz);
 static void tcp_send_fin_ack(struct tcp_sock *sock);
+static void tcp_keep_arm(struct tcp_sock *sock);
+
+/* The socket whose timers come due first, or NULL if none are armed. Must be
+   called with IRQs disabled. */
+static inline struct tcp_sock *tcp_timer_first(void) {
+    timerq_node_t *node = timerq_first(&tcp_timers);
+
+    return node ? timerq_entry(node, struct tcp_sock, timer_node) : NULL;
+}
+
+/* Take a socket out of the timer queue. Must be called with IRQs disabled. */
+static void tcp_timer_remove(struct tcp_sock *sock) {
+    timerq_remove(&tcp_timers, &sock->timer_node);
+    sock->timer_next = 0;
+}
+
+/* Put a socket in the timer queue (or move it), to come due at when. Must be
+   called with IRQs disabled. */
+static void tcp_timer_link(struct tcp_sock *sock, uint64_t when) {
+    if(sock->timer_next)
+        tcp_timer_remove(sock);
+
+    sock->timer_next = when;
+    timerq_insert(&tcp_timers, &sock->timer_node);
+}
+
+static void tcp_timer_unlink(struct tcp_sock *sock) {
+    irq_disable_scoped();
+
+    if(sock->timer_next)
+        tcp_timer_remove(sock);
+}
+
+/* Arm one of a socket's timers to go off in ms milliseconds. The socket only
+   has to move in the timer queue if this is now its earliest deadline; a timer
+   that gets pushed back is left where it was, and the timer thread just finds
+   nothing to do when it comes up early. That keeps the common case of
+   restarting the retransmission timer on every ACK cheap. */
+static void tcp_timer_set(struct tcp_sock *sock, int which, uint32_t ms) {
+    uint64_t when = timer_ms_gettime64() + ms;
+
+    sock->timers[which] = when;
+
+    if(!sock->timer_next || when < sock->timer_next) {
+        irq_disable_scoped();
+        tcp_timer_link(sock, when);
+
+        /* If this is the new earliest deadline, the timer thread needs to know
+           about it. */
+        if(tcp_timer_first() == sock && tcp_timer_thd) {
+            thd_worker_wakeup(tcp_timer_thd);
+            genwait_wake_one(&tcp_timers);
+        }
+    }
+}
+
+static inline void tcp_timer_clear(struct tcp_sock *sock, int which) {
+    sock->timers[which] = 0;
+}
+
+static inline unsigned int tcp_port_hash(uint16_t port) {
+    return ((uint32_t)port * 0x9e3779b1u) >> (32 - TCP_PORT_HASH_BITS);
+}
+
+static inline unsigned int tcp_conn_hash(const struct in6_addr *raddr,
+                                         uint16_t rport, uint16_t lport) {
+    uint32_t h = raddr->__s6_addr.__s6_addr32[0] ^
+                 raddr->__s6_addr.__s6_addr32[1] ^
+                 raddr->__s6_addr.__s6_addr32[2] ^
+                 raddr->__s6_addr.__s6_addr32[3];
+
+    h ^= ((uint32_t)rport << 16) | lport;
+    return (h * 0x9e3779b1u) >> (32 - TCP_CONN_HASH_BITS);
+}
+
+/* Add a socket to the table of local ports, now that it has one of its own.
+   Must be called with IRQs disabled. */
+static void tcp_hash_bind(struct tcp_sock *sock) {
+    if(!sock->port_list.le_prev) {
+        LIST_INSERT_HEAD(&tcp_ports[tcp_port_hash(sock->local_addr.sin6_port)],
+                         sock, port_list);
+    }
+}
+
+/* Add a socket to the table of connections, now that it has a remote end. If
+   it was already in there (under an earlier remote end, from a connect() that
+   didn't work out), it's moved. Must be called with IRQs disabled. */
+static void tcp_hash_connect(struct tcp_sock *sock) {
+    if(sock->conn_list.le_prev)
+        LIST_REMOVE(sock, conn_list);
+
+    LIST_INSERT_HEAD(&tcp_conns[tcp_conn_hash(&sock->remote_addr.sin6_addr,
+                                              sock->remote_addr.sin6_port,
+                                              sock->local_addr.sin6_port)],
+                     sock, conn_list);
+}
+
+/* Take a socket back out of the lookup tables. Must be called with IRQs
+   disabled. */
+static void tcp_hash_remove(struct tcp_sock *sock) {
+    if(sock->port_list.le_prev) {
+        LIST_REMOVE(sock, port_list);
+        sock->port_list.le_prev = NULL;
+    }
+
+    if(sock->conn_list.le_prev) {
+        LIST_REMOVE(sock, conn_list);
+        sock->conn_list.le_prev = NULL;
+    }
+}
+
+/* Is any socket using the given local port (in network byte order)? Sockets
+   created by accept() don't count, since their listener already does. Must be
+   called with IRQs disabled, and the port claimed (with tcp_hash_bind()) before
+   they're turned back on, so two bind() calls can't both get the same one. */
+static bool tcp_port_in_use(uint16_t port) {
+    struct tcp_sock *i;
+
+    LIST_FOREACH(i, &tcp_ports[tcp_port_hash(port)], port_list) {
+        if(i->local_addr.sin6_port == port)
+            return true;
+    }
+
+    return false;
+}
 
 /* Sockets interface... */
 static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
@@ -296,60 +595,94 @@ static int net_tcp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     sock->hop_limit = TCP_DEFAULT_HOPS;
     sock->rcvbuf_sz = TCP_DEFAULT_WINDOW;
     sock->sndbuf_sz = TCP_DEFAULT_WINDOW;
-
-    if(rwsem_write_lock_irqsafe(&tcp_sem)) {
-        free(sock);
-        return -1;
-    }
+    sock->keep_idle = TCP_KEEPIDLE_DEFAULT;
+    sock->keep_intvl = TCP_KEEPINTVL_DEFAULT;
+    sock->keep_cnt = TCP_KEEPCNT_DEFAULT;
 
     hnd->data = sock;
 
+    irq_disable_scoped();
     LIST_INSERT_HEAD(&tcp_socks, sock, sock_list);
-    rwsem_write_unlock(&tcp_sem);
 
     return 0;
 }
 
-static struct tcp_sock *
-net_tcp_write_lock_and_get_sock(net_socket_t *hnd, rw_semaphore_t *sem) {
+static struct tcp_sock *net_tcp_lock_and_get_sock(net_socket_t *hnd) {
     struct tcp_sock *sock;
 
-    if(rwsem_write_lock_irqsafe(sem))
-        return NULL;
-
     if(!(sock = (struct tcp_sock *)hnd->data)) {
-        rwsem_write_unlock(sem);
         errno = EBADF;
         return NULL;
     }
 
-    if(mutex_lock_irqsafe(&sock->mutex)) {
-        rwsem_write_unlock(sem);
+    if(mutex_lock_irqsafe(&sock->mutex))
         return NULL;
-    }
 
     return sock;
 }
 
-static struct tcp_sock *
-net_tcp_read_lock_and_get_sock(net_socket_t *hnd, rw_semaphore_t *sem) {
-    struct tcp_sock *sock;
+/* Lock a socket that was found in the lookup tables or the timer queue. The
+   caller takes a reference on it (by bumping refs) before turning IRQs back on
+   after finding it, and this drops that reference again once it has the mutex.
+   If the socket was freed in the meantime, tcp_sock_free() left it to us, so
+   the last one out frees it. Returns -1 if the socket is gone, or (in an IRQ)
+   if somebody else has it locked. */
+static int tcp_sock_lock(struct tcp_sock *sock) {
+    uint32_t flags;
+    bool dead, last;
+    int rv;
 
-    if(rwsem_read_lock_irqsafe(sem))
-        return NULL;
+    rv = mutex_lock_irqsafe(&sock->mutex);
 
-    if(!(sock = (struct tcp_sock *)hnd->data)) {
-        rwsem_read_unlock(sem);
-        errno = EBADF;
-        return NULL;
-    }
+    flags = irq_disable();
+    --sock->refs;
+    last = !sock->refs;
+    dead = !rv && (sock->intflags & TCP_IFLAG_DEAD);
+    irq_restore(flags);
 
-    if(mutex_lock_irqsafe(&sock->mutex)) {
-        rwsem_read_unlock(sem);
-        return NULL;
+    if(dead) {
+        mutex_unlock(&sock->mutex);
+
+        if(last) {
+            mutex_destroy(&sock->mutex);
+            free(sock);
+        }
+
+        return -1;
     }
 
-    return sock;
+    return rv;
+}
+
+/* Take a socket out of everything it's on and free it. Anything else it owns
+   has to have been cleaned up already. Must be called with the socket's mutex
+   held, which is released. If somebody found the socket and is still waiting
+   in tcp_sock_lock() for it, the socket is just marked as dead for them to
+   free. */
+static void tcp_sock_free(struct tcp_sock *sock) {
+    uint32_t flags;
+    bool dead;
+
+    flags = irq_disable();
+    LIST_REMOVE(sock, sock_list);
+    tcp_hash_remove(sock);
+
+    if(sock->timer_next)
+        tcp_timer_remove(sock);
+
+    dead = sock->refs != 0;
+
+    if(dead)
+        sock->intflags |= TCP_IFLAG_DEAD;
+
+    irq_restore(flags);
+
+    mutex_unlock(&sock->mutex);
+
+    if(!dead) {
+        mutex_destroy(&sock->mutex);
+        free(sock);
+    }
 }
 
 static void net_tcp_close(net_socket_t *hnd) {
@@ -357,26 +690,9 @@ static void net_tcp_close(net_socket_t *hnd) {
     struct lsock *ls;
     int i;
 
-retry:
-    if(!(sock = net_tcp_write_lock_and_get_sock(hnd, &tcp_sem)))
+    if(!(sock = net_tcp_lock_and_get_sock(hnd)))
         return;
 
-    /* This is to work-around the ugly issue discussed in the accept() function.
-       This is... well, bad... Granted, you really shouldn't ever have this
-       happening if you're sane... */
-    if(sock->state == (TCP_STATE_LISTEN | TCP_STATE_ACCEPTING)) {
-        mutex_unlock(&sock->mutex);
-        rwsem_write_unlock(&tcp_sem);
-
-        if(irq_inside_int()) {
-            errno = EWOULDBLOCK;
-            return;
-        }
-
-        thd_pass();
-        goto retry;
-    }
-
     /* Deal with queued data and/or connections and sending the closing messages
        as appropriate. */
     switch(sock->state) {
@@ -393,10 +709,14 @@ retry:
             }
 
             /* If we were waiting on an accept call, then we have to let it
-               handle tearing down the connection... */
+               handle tearing down the connection... Wake it up, since nothing
+               else is going to now. */
             if(sock->intflags & TCP_IFLAG_ACCEPTWAIT) {
                 sock->state = TCP_STATE_CLOSED;
-                goto ret_no_remove;
+                sock->sock = FILEHND_INVALID;
+                cond_signal(&sock->listen.cv);
+                mutex_unlock(&sock->mutex);
+                return;
             }
 
             free(sock->listen.queue);
@@ -456,12 +776,7 @@ retry:
     }
 
 ret_remove:
-    LIST_REMOVE(sock, sock_list);
-    mutex_unlock(&sock->mutex);
-    mutex_destroy(&sock->mutex);
-    free(sock);
-
-    rwsem_write_unlock(&tcp_sem);
+    tcp_sock_free(sock);
     return;
 
 ret_no_remove:
@@ -474,10 +789,14 @@ ret_no_remove:
 
     sock->sock = FILEHND_INVALID;
 
-    /* Don't free anything here, it will be dealt with later on in the
-       workqueue job. */
+    /* Don't free anything here, it will be dealt with later on by the timer
+       thread, either when the connection finishes closing or right away if
+       there's nothing left to wait for. */
+    if((sock->intflags & TCP_IFLAG_CANBEDEL) &&
+            (sock->state & 0x0F) == TCP_STATE_CLOSED)
+        tcp_timer_set(sock, TCP_TIMER_REAP, 0);
+
     mutex_unlock(&sock->mutex);
-    rwsem_write_unlock(&tcp_sem);
     return;
 }
 
@@ -486,6 +805,7 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     struct tcp_sock *sock, *sock2;
     net_socket_t *newhnd;
     struct lsock lsock;
+    uint32_t flags;
     int canblock = 1;
     int fd;
 
@@ -494,14 +814,12 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         return -1;
     }
 
-    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+    if(!(sock = net_tcp_lock_and_get_sock(hnd)))
         return -1;
 
     canblock = !irq_inside_int()
         && !(sock->flags & FS_SOCKET_NONBLOCK);
 
-    rwsem_read_unlock(&tcp_sem);
-
     /* Make sure the socket is listening... */
     if(sock->state != TCP_STATE_LISTEN) {
         errno = EINVAL;
@@ -521,30 +839,26 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
            wait for an incoming connection. */
         sock->intflags |= TCP_IFLAG_ACCEPTWAIT;
         cond_wait(&sock->listen.cv, &sock->mutex);
+        sock->intflags &= ~TCP_IFLAG_ACCEPTWAIT;
 
         /* If we come out of the wait in the closed state, that means that the
            user has run a close() on the socket in another thread. Bail out in a
            graceful fashion. */
         if(sock->state == TCP_STATE_CLOSED) {
-            mutex_unlock(&sock->mutex);
-            rwsem_write_lock(&tcp_sem);
-            mutex_lock(&sock->mutex);
             free(sock->listen.queue);
             cond_destroy(&sock->listen.cv);
-            LIST_REMOVE(sock, sock_list);
-            mutex_unlock(&sock->mutex);
-            mutex_destroy(&sock->mutex);
-            free(sock);
-
-            rwsem_write_unlock(&tcp_sem);
+            tcp_sock_free(sock);
 
             errno = EINTR;              /* Close enough, I suppose. */
             return -1;
         }
     }
 
-    /* We now have a connection to use, so, lets grab it and release the lock on
-       the old socket. */
+    /* We now have a connection to use, so, lets grab it. The listening socket
+       stays locked until the new one is in the lookup tables, so that anything
+       else that comes in for the connection in the meantime (like the other
+       end sending its <SYN> again) goes to the new socket rather than getting
+       queued on the listener a second time. */
     lsock = sock->listen.queue[sock->listen.head++];
     --sock->listen.count;
 
@@ -626,6 +940,10 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     sock2->hop_limit = sock->hop_limit;
     sock2->rcvbuf_sz = sock->rcvbuf_sz;
     sock2->sndbuf_sz = sock->sndbuf_sz;
+    sock2->intflags = sock->intflags & TCP_IFLAG_KEEPALIVE;
+    sock2->keep_idle = sock->keep_idle;
+    sock2->keep_intvl = sock->keep_intvl;
+    sock2->keep_cnt = sock->keep_cnt;
     sock2->data.rcv.wnd = sock->rcvbuf_sz;
 
     /* Fill in the address, if they asked for it. */
@@ -665,56 +983,6 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
         }
     }
 
-    if(irq_inside_int()) {
-        if(rwsem_write_trylock(&tcp_sem)) {
-            /* Kabuki dance to clean things up... */
-            mutex_unlock(&sock->mutex);
-
-            newhnd->protocol = NULL;
-            fs_close(sock2->sock);
-            cond_destroy(&sock2->data.recv_cv);
-            cond_destroy(&sock2->data.send_cv);
-            free(sock2->data.sndbuf);
-            free(sock2->data.rcvbuf);
-            mutex_destroy(&sock2->mutex);
-            free(sock2);
-            errno = EWOULDBLOCK;
-            return -1;
-        }
-    }
-    /* Ugh... I really need to find a better way to deal with this... There is
-       a possibility (however slight) that between here and when the write lock
-       is locked that we might get a SYN packet again for this connection that
-       might end up screwing something up later. Honestly, I can't think of any
-       non-hackish way of dealing with this that would not result in a possible
-       deadlock.
-
-       Anyone have any ideas? The only two possibilities that I can think of are
-       either doing the actual work of building sockets in the IRQ when the
-       listening socket gets the incoming SYN or holding the write lock through
-       this whole function. Both open up their own cans of worms, so to speak...
-       The first one means we need to be able to do socket() calls reliably in
-       an IRQ, which I really don't want to touch. The second would essentially
-       mean that during an accept() where we end up blocking waiting for an
-       incoming connection, no other socket write operations can take place.
-       That is absolutely unacceptable. Locking the write lock right here,
-       before releasing the socket lock would create the possibility of a
-       deadlock in bind() or close().
-
-       The hacked-up solution here basically means that the socket can't accept
-       any more SYNs for queueing until the socket actually gets added to the
-       list of sockets... Not really a very good solution, but it should do the
-       trick until I can come up with something else to do. Note that this also
-       means that calling accept() with the same socket in two threads is
-       unacceptable (and the second one will probably end up with an EINVAL
-       error because of this). */
-    else {
-        sock->state |= TCP_STATE_ACCEPTING;
-        mutex_unlock(&sock->mutex);
-        rwsem_write_lock(&tcp_sem);
-        mutex_lock(&sock->mutex);
-    }
-
     newhnd->data = sock2;
 
     /* Bad way of generating an initial sequence number, but technically correct
@@ -728,28 +996,48 @@ static int net_tcp_accept(net_socket_t *hnd, struct sockaddr *addr,
     sock2->data.rcv.nxt = lsock.isn + 1;
     sock2->data.rcv.irs = lsock.isn;
 
+    /* Answer with whichever options the other side offered. */
+    sock2->data.opt_flags = lsock.opt_flags;
+
+    if(lsock.opt_flags & TCP_OPTF_WSCALE) {
+        sock2->data.snd_wscale = lsock.wscale;
+        sock2->data.rcv_wscale = tcp_wscale(sock2->rcvbuf_sz);
+    }
+
+    if(lsock.opt_flags & TCP_OPTF_TS) {
+        sock2->data.ts_recent = lsock.ts_recent;
+
+        if(sock2->data.snd.mss > 2 * TCP_TS_OPT_LEN)
+            sock2->data.snd.mss -= TCP_TS_OPT_LEN;
+    }
+
+    tcp_cc_init(sock2);
+
     /* Since nothing else has a pointer to this socket, this will not fail. */
     mutex_trylock(&sock2->mutex);
 
     /* Send the <SYN,ACK> packet now, add it to the list, and clean up. */
     tcp_send_syn(sock2, 1);
-    sock2->data.timer = timer_ms_gettime64();
+    tcp_timer_set(sock2, TCP_TIMER_REXMT, TCP_DEFAULT_RTTO);
     fd = sock2->sock;
+
+    flags = irq_disable();
     LIST_INSERT_HEAD(&tcp_socks, sock2, sock_list);
-    mutex_unlock(&sock2->mutex);
+    tcp_hash_connect(sock2);
+    irq_restore(flags);
 
-    sock->state &= ~TCP_STATE_ACCEPTING;
+    mutex_unlock(&sock2->mutex);
     mutex_unlock(&sock->mutex);
-    rwsem_write_unlock(&tcp_sem);
 
     return fd;
 }
 
 static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
                         socklen_t addr_len) {
-    struct tcp_sock *sock, *iter;
+    struct tcp_sock *sock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
+    uint32_t flags;
 
     /* Verify the parameters sent in first */
     if(addr == NULL) {
@@ -797,26 +1085,23 @@ static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
             return -1;
     }
 
-    if(!(sock = net_tcp_write_lock_and_get_sock(hnd, &tcp_sem)))
+    if(!(sock = net_tcp_lock_and_get_sock(hnd)))
         return -1;
 
     /* Make sure the socket is still in the closed state and hasn't already been
        bound. */
     if(sock->state == TCP_STATE_LISTEN) {
         mutex_unlock(&sock->mutex);
-        rwsem_write_unlock(&tcp_sem);
         errno = EINVAL;
         return -1;
     }
     else if(sock->state != TCP_STATE_CLOSED) {
         mutex_unlock(&sock->mutex);
-        rwsem_write_unlock(&tcp_sem);
         errno = EISCONN;
         return -1;
     }
     else if(sock->local_addr.sin6_port) {
         mutex_unlock(&sock->mutex);
-        rwsem_write_unlock(&tcp_sem);
         errno = EINVAL;
         return -1;
     }
@@ -825,65 +1110,35 @@ static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
        on the socket itself */
     if(addr->sa_family != sock->domain) {
         mutex_unlock(&sock->mutex);
-        rwsem_write_unlock(&tcp_sem);
         errno = EINVAL;
         return -1;
     }
 
+    /* Incoming segments are matched against the local address, so it has to
+       be set with IRQs disabled. */
+    flags = irq_disable();
+
     /* See if we requested a specific port or not */
     if(realaddr6.sin6_port != 0) {
         /* Make sure we don't already have a socket bound to the port
            specified */
-        LIST_FOREACH(iter, &tcp_socks, sock_list) {
-            if(iter == sock)
-                continue;
-
-            if(mutex_lock_irqsafe(&iter->mutex)) {
-                mutex_unlock(&sock->mutex);
-                rwsem_write_unlock(&tcp_sem);
-                return -1;
-            }
-
-            if(iter->local_addr.sin6_port == realaddr6.sin6_port) {
-                mutex_unlock(&iter->mutex);
-                mutex_unlock(&sock->mutex);
-                rwsem_write_unlock(&tcp_sem);
-                errno = EADDRINUSE;
-                return -1;
-            }
-
-            mutex_unlock(&iter->mutex);
+        if(tcp_port_in_use(realaddr6.sin6_port)) {
+            irq_restore(flags);
+            mutex_unlock(&sock->mutex);
+            errno = EADDRINUSE;
+            return -1;
         }
 
         sock->local_addr = realaddr6;
     }
     else {
         static uint16_t next_bind_ephemeral = 1024;
-        uint16_t port = next_bind_ephemeral, tmp = 0;
+        uint16_t port = next_bind_ephemeral;
 
         /* Grab the first unused port >= next_bind_ephemeral. */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &tcp_socks, sock_list) {
-                if(iter == sock)
-                    continue;
-
-                if(mutex_lock_irqsafe(&iter->mutex)) {
-                    mutex_unlock(&sock->mutex);
-                    rwsem_write_unlock(&tcp_sem);
-                    return -1;
-                }
-
-                if(iter->local_addr.sin6_port == htons(port)) {
-                    mutex_unlock(&iter->mutex);
-                    ++port;
-                    if(port > 65000) port = 1024;
-                    break;
-                }
-
-                mutex_unlock(&iter->mutex);
-            }
+        while(tcp_port_in_use(htons(port))) {
+            ++port;
+            if(port > 65000) port = 1024;
         }
 
         sock->local_addr = realaddr6;
@@ -892,18 +1147,21 @@ static int net_tcp_bind(net_socket_t *hnd, const struct sockaddr *addr,
         if(next_bind_ephemeral > 65000) next_bind_ephemeral = 1024;
     }
 
-    /* Release the locks, we're done */
+    tcp_hash_bind(sock);
+    irq_restore(flags);
+
+    /* Release the lock, we're done */
     mutex_unlock(&sock->mutex);
-    rwsem_write_unlock(&tcp_sem);
 
     return 0;
 }
 
 static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
                            socklen_t addr_len) {
-    struct tcp_sock *sock, *iter;
+    struct tcp_sock *sock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
+    uint32_t flags;
 
     if(addr == NULL) {
         errno = EDESTADDRREQ;
@@ -954,7 +1212,7 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
             return -1;
     }
 
-    if(!(sock = net_tcp_write_lock_and_get_sock(hnd, &tcp_sem)))
+    if(!(sock = net_tcp_lock_and_get_sock(hnd)))
         return -1;
 
     /* Make sure the socket is still in the CLOSED state */
@@ -970,7 +1228,6 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
         }
 
         mutex_unlock(&sock->mutex);
-        rwsem_write_unlock(&tcp_sem);
         return -1;
     }
 
@@ -978,7 +1235,6 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
        on the socket itself */
     if(addr->sa_family != sock->domain) {
         mutex_unlock(&sock->mutex);
-        rwsem_write_unlock(&tcp_sem);
         errno = EINVAL;
         return -1;
     }
@@ -987,66 +1243,20 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     if(IN6_IS_ADDR_UNSPECIFIED(&realaddr6.sin6_addr) ||
             realaddr6.sin6_port == 0) {
         mutex_unlock(&sock->mutex);
-        rwsem_write_unlock(&tcp_sem);
         errno = EADDRNOTAVAIL;
         return -1;
     }
 
-    /* See if the socket is already bound to a local port */
-    if(!sock->local_addr.sin6_port) {
-        static uint16_t next_ephemeral = 1024;
-        uint16_t port = next_ephemeral, tmp = 0;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &tcp_socks, sock_list) {
-                if(iter == sock)
-                    continue;
-
-                if(mutex_lock_irqsafe(&iter->mutex)) {
-                    mutex_unlock(&sock->mutex);
-                    rwsem_write_unlock(&tcp_sem);
-                    return -1;
-                }
-
-                if(iter->local_addr.sin6_port == htons(port)) {
-                    mutex_unlock(&iter->mutex);
-                    ++port;
-                    break;
-                }
-
-                mutex_unlock(&iter->mutex);
-            }
-        }
-
-        sock->local_addr.sin6_port = htons(port);
-        next_ephemeral = port + 1;
-        if(next_ephemeral > 65000) next_ephemeral = 1024;
-
-        if(addr->sa_family == AF_INET) {
-            sock->local_addr.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
-            sock->local_addr.sin6_addr.__s6_addr.__s6_addr32[3] =
-                htonl(net_ipv4_address(net_default_dev->ip_addr));
-        }
-    }
-
-    /* Set the remote address on the socket and go to the SYN-SENT state (this
-       includes setting up all the data we need for that). */
-    sock->remote_addr = realaddr6;
-
+    /* Set up all the data we need for the SYN-SENT state. */
     if(!(sock->data.rcvbuf = (uint8_t *)malloc(sock->rcvbuf_sz))) {
         errno = ENOBUFS;
         mutex_unlock(&sock->mutex);
-        rwsem_write_unlock(&tcp_sem);
         return -1;
     }
 
     if(!(sock->data.sndbuf = (uint8_t *)malloc(sock->sndbuf_sz))) {
         errno = ENOBUFS;
         mutex_unlock(&sock->mutex);
-        rwsem_write_unlock(&tcp_sem);
         free(sock->data.rcvbuf);
         return -1;
     }
@@ -1054,7 +1264,6 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     if(cond_init(&sock->data.send_cv)) {
         errno = ENOBUFS;
         mutex_unlock(&sock->mutex);
-        rwsem_write_unlock(&tcp_sem);
         free(sock->data.sndbuf);
         free(sock->data.rcvbuf);
         return -1;
@@ -1063,7 +1272,6 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     if(cond_init(&sock->data.recv_cv)) {
         errno = ENOBUFS;
         mutex_unlock(&sock->mutex);
-        rwsem_write_unlock(&tcp_sem);
         cond_destroy(&sock->data.send_cv);
         free(sock->data.sndbuf);
         free(sock->data.rcvbuf);
@@ -1076,17 +1284,51 @@ static int net_tcp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     sock->data.snd.iss = timer_us_gettime64() >> 2;
     sock->data.snd.una = sock->data.snd.iss;
     sock->data.snd.nxt = sock->data.snd.iss + 1;
+    sock->data.opt_flags = TCP_OPTF_ALL;
+    sock->data.rcv_wscale = tcp_wscale(sock->rcvbuf_sz);
+    sock->data.snd_wscale = 0;
+    sock->data.ts_recent = 0;
+
+    /* Incoming segments are matched against the addresses, so they have to be
+       set (and the socket put in the lookup tables) with IRQs disabled. */
+    flags = irq_disable();
+
+    /* See if the socket is already bound to a local port */
+    if(!sock->local_addr.sin6_port) {
+        static uint16_t next_ephemeral = 1024;
+        uint16_t port = next_ephemeral;
+
+        /* Grab the first unused port >= next_ephemeral. */
+        while(tcp_port_in_use(htons(port))) {
+            ++port;
+            if(port > 65000) port = 1024;
+        }
+
+        sock->local_addr.sin6_port = htons(port);
+        next_ephemeral = port + 1;
+        if(next_ephemeral > 65000) next_ephemeral = 1024;
+
+        if(addr->sa_family == AF_INET) {
+            sock->local_addr.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
+            sock->local_addr.sin6_addr.__s6_addr.__s6_addr32[3] =
+                htonl(net_ipv4_address(net_default_dev->ip_addr));
+        }
+    }
+
+    /* Set the remote address on the socket and go to the SYN-SENT state. */
+    sock->remote_addr = realaddr6;
     sock->state = TCP_STATE_SYN_SENT;
+    tcp_hash_bind(sock);
+    tcp_hash_connect(sock);
+    irq_restore(flags);
 
     /* Send a <SYN> packet */
     if(tcp_send_syn(sock, 0) == -1) {
-        rwsem_write_unlock(&tcp_sem);
         mutex_unlock(&sock->mutex);
         return -1;
     }
 
-    /* Release the write lock... */
-    rwsem_write_unlock(&tcp_sem);
+    tcp_timer_set(sock, TCP_TIMER_REXMT, TCP_DEFAULT_RTTO);
 
     /* Now, lets see if this is socket is non-blocking... */
     if(sock->flags & FS_SOCKET_NONBLOCK || irq_inside_int()) {
@@ -1127,14 +1369,13 @@ static int net_tcp_listen(net_socket_t *hnd, int backlog) {
 
     /* Lock the socket's mutex, since we're going to be manipulating its state
        in here... */
-    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+    if(!(sock = net_tcp_lock_and_get_sock(hnd)))
         return -1;
 
     /* Make sure the socket is still in the closed state, otherwise we can't
        actually move it to the listening state */
     if(sock->state != TCP_STATE_CLOSED) {
         mutex_unlock(&sock->mutex);
-        rwsem_read_unlock(&tcp_sem);
         errno = EINVAL;
         return -1;
     }
@@ -1142,7 +1383,6 @@ static int net_tcp_listen(net_socket_t *hnd, int backlog) {
     /* Make sure the socket has been bound */
     if(!sock->local_addr.sin6_port) {
         mutex_unlock(&sock->mutex);
-        rwsem_read_unlock(&tcp_sem);
         errno = EDESTADDRREQ;
         return -1;
     }
@@ -1152,7 +1392,6 @@ static int net_tcp_listen(net_socket_t *hnd, int backlog) {
 
     if(!sock->listen.queue) {
         mutex_unlock(&sock->mutex);
-        rwsem_read_unlock(&tcp_sem);
         errno = ENOBUFS;
         return -1;
     }
@@ -1161,7 +1400,6 @@ static int net_tcp_listen(net_socket_t *hnd, int backlog) {
         free(sock->listen.queue);
         sock->listen.queue = NULL;
         mutex_unlock(&sock->mutex);
-        rwsem_read_unlock(&tcp_sem);
         errno = ENOBUFS;
         return -1;
     }
@@ -1172,7 +1410,6 @@ static int net_tcp_listen(net_socket_t *hnd, int backlog) {
 
     /* We're done now, clean up the locks */
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
 
     return 0;
 }
@@ -1194,11 +1431,9 @@ static ssize_t net_tcp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
 
     /* Lock the socket's mutex, since we're going to be manipulating its state
        in here... */
-    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+    if(!(sock = net_tcp_lock_and_get_sock(hnd)))
         return -1;
 
-    rwsem_read_unlock(&tcp_sem);
-
     /* Make sure they haven't shut down the socket... */
     if(sock->flags & (SHUT_RD << 24)) {
         goto out;
@@ -1309,14 +1544,12 @@ static ssize_t net_tcp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
         if((old_wnd == 0 && sock->data.rcv.wnd > 0) ||
                 sock->data.rcv.wnd >= old_wnd + sock->data.snd.mss) {
             tcp_send_ack(sock);
-            sock->data.ack_pending = 0;
         }
         /* Flush any pending delayed ACK now that the app has read.
-           This gets the ACK out immediately instead of waiting up to
-           10ms for the timer, reducing effective RTT significantly. */
+           This gets the ACK out immediately instead of waiting for the
+           delayed ACK timer, reducing effective RTT. */
         else if(sock->data.ack_pending > 0) {
             tcp_send_ack(sock);
-            sock->data.ack_pending = 0;
         }
     }
 
@@ -1404,11 +1637,9 @@ static ssize_t net_tcp_sendto(net_socket_t *hnd, const void *message,
 
     /* Lock the socket's mutex, since we're going to be manipulating its state
        in here... */
-    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+    if(!(sock = net_tcp_lock_and_get_sock(hnd)))
         return -1;
 
-    rwsem_read_unlock(&tcp_sem);
-
     /* Check if the socket has been shut down for writing. */
     if(sock->flags & (SHUT_WR << 24)) {
         errno = EPIPE;
@@ -1516,12 +1747,11 @@ out:
 static int net_tcp_shutdownsock(net_socket_t *hnd, int how) {
     struct tcp_sock *sock;
 
-    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+    if(!(sock = net_tcp_lock_and_get_sock(hnd)))
         return -1;
 
     if(how & 0xFFFFFFFC) {
         mutex_unlock(&sock->mutex);
-        rwsem_read_unlock(&tcp_sem);
         errno = EINVAL;
         return -1;
     }
@@ -1529,22 +1759,55 @@ static int net_tcp_shutdownsock(net_socket_t *hnd, int how) {
     sock->flags |= (how << 24);
 
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
 
     return 0;
 }
 
+static void tcp_get_info(struct tcp_sock *sock, struct tcp_info *info) {
+    memset(info, 0, sizeof(struct tcp_info));
+    info->tcpi_state = sock->state & ~TCP_STATE_RESET;
+
+    /* Listening and never-connected sockets don't have any of this. */
+    if(info->tcpi_state == TCP_STATE_LISTEN || !sock->data.snd.mss)
+        return;
+
+    info->tcpi_rto = sock->data.rto;
+    info->tcpi_rtt = sock->data.srtt >> 3;
+    info->tcpi_rttvar = sock->data.rttvar >> 2;
+    info->tcpi_snd_mss = sock->data.snd.mss;
+    info->tcpi_snd_cwnd = sock->data.cwnd;
+    info->tcpi_snd_ssthresh = sock->data.ssthresh;
+    info->tcpi_snd_wnd = sock->data.snd.wnd;
+    info->tcpi_unacked = sock->data.snd.nxt - sock->data.snd.una;
+    info->tcpi_total_retrans = sock->data.retransmits;
+    info->tcpi_fast_retrans = sock->data.fast_retransmits;
+    info->tcpi_timeouts = sock->data.timeouts;
+
+    if(sock->data.opt_flags & TCP_OPTF_TS)
+        info->tcpi_options |= TCPI_OPT_TIMESTAMPS;
+
+    if(sock->data.opt_flags & TCP_OPTF_SACK_PERM)
+        info->tcpi_options |= TCPI_OPT_SACK;
+
+    if(sock->data.opt_flags & TCP_OPTF_WSCALE)
+        info->tcpi_options |= TCPI_OPT_WSCALE;
+
+    info->tcpi_snd_wscale = sock->data.snd_wscale;
+    info->tcpi_rcv_wscale = sock->data.rcv_wscale;
+}
+
 static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
                               void *option_value, socklen_t *option_len) {
     int tmp;
     struct tcp_sock *sock;
+    struct tcp_info info;
 
     if(!option_value || !option_len) {
         errno = EFAULT;
         return -1;
     }
 
-    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+    if(!(sock = net_tcp_lock_and_get_sock(hnd)))
         return -1;
 
     switch(level) {
@@ -1570,6 +1833,10 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
                 case SO_TYPE:
                     tmp = SOCK_STREAM;
                     goto copy_int;
+
+                case SO_KEEPALIVE:
+                    tmp = !!(sock->intflags & TCP_IFLAG_KEEPALIVE);
+                    goto copy_int;
             }
 
             break;
@@ -1610,6 +1877,31 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
                 case TCP_NODELAY:
                     tmp = 1;
                     goto copy_int;
+
+                case TCP_KEEPIDLE:
+                    tmp = sock->keep_idle;
+                    goto copy_int;
+
+                case TCP_KEEPINTVL:
+                    tmp = sock->keep_intvl;
+                    goto copy_int;
+
+                case TCP_KEEPCNT:
+                    tmp = sock->keep_cnt;
+                    goto copy_int;
+
+                case TCP_INFO:
+                    tcp_get_info(sock, &info);
+
+                    if(*option_len >= sizeof(struct tcp_info)) {
+                        memcpy(option_value, &info, sizeof(struct tcp_info));
+                        *option_len = sizeof(struct tcp_info);
+                    }
+                    else {
+                        memcpy(option_value, &info, *option_len);
+                    }
+
+                    goto simply_return;
             }
 
             break;
@@ -1617,13 +1909,11 @@ static int net_tcp_getsockopt(net_socket_t *hnd, int level, int option_name,
 
     /* If it wasn't handled, return that error. */
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
     errno = ENOPROTOOPT;
     return -1;
 
 ret_inval:
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
     errno = EINVAL;
     return -1;
 
@@ -1638,7 +1928,6 @@ copy_int:
 
 simply_return:
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
     return 0;
 }
 
@@ -1653,7 +1942,7 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
         return -1;
     }
 
-    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+    if(!(sock = net_tcp_lock_and_get_sock(hnd)))
         return -1;
 
     switch(level) {
@@ -1669,11 +1958,14 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     tmp = *(uint32_t *)option_value;
-                    /* Receive buffer size must be in the range 256 - 65535 */
+                    /* Receive buffer size must be in the range 256 -
+                       TCP_MAX_WINDOW. Anything over 65535 can only be fully
+                       used if the peer agrees to window scaling, and only
+                       takes effect on connections made after it's set. */
                     if(tmp < 256)
                         tmp = 256;
-                    else if(tmp > 65535)
-                        tmp = 65535;
+                    else if(tmp > TCP_MAX_WINDOW)
+                        tmp = TCP_MAX_WINDOW;
 
                     new_ptr = realloc(sock->data.rcvbuf, tmp);
                     if(!new_ptr)
@@ -1704,6 +1996,25 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                     sock->data.sndbuf = new_ptr;
                     sock->sndbuf_sz = tmp;
                     goto ret_success;
+
+                case SO_KEEPALIVE:
+                    if(option_len != sizeof(int))
+                        goto ret_inval;
+
+                    tmp = *((int *)option_value);
+
+                    if(tmp) {
+                        if(!(sock->intflags & TCP_IFLAG_KEEPALIVE)) {
+                            sock->intflags |= TCP_IFLAG_KEEPALIVE;
+                            tcp_keep_arm(sock);
+                        }
+                    }
+                    else {
+                        sock->intflags &= ~TCP_IFLAG_KEEPALIVE;
+                        tcp_timer_clear(sock, TCP_TIMER_KEEP);
+                    }
+
+                    goto ret_success;
             }
 
             break;
@@ -1791,32 +2102,64 @@ static int net_tcp_setsockopt(net_socket_t *hnd, int level, int option_name,
                         goto ret_inval;
 
                     goto ret_success;
-            }
 
-            break;
-    }
+                case TCP_KEEPIDLE:
+                case TCP_KEEPINTVL:
+                    if(option_len != sizeof(int))
+                        goto ret_inval;
 
-    /* If it wasn't handled, return that error. */
-    mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
-    errno = ENOPROTOOPT;
+                    tmp = *((int *)option_value);
+
+                    if(tmp < 1 || tmp > TCP_KEEP_MAX)
+                        goto ret_inval;
+
+                    if(option_name == TCP_KEEPIDLE) {
+                        sock->keep_idle = tmp;
+
+                        /* Start the new idle period now, like other systems
+                           do, rather than waiting out the old one. */
+                        if(!sock->keep_probes)
+                            tcp_keep_arm(sock);
+                    }
+                    else {
+                        sock->keep_intvl = tmp;
+                    }
+
+                    goto ret_success;
+
+                case TCP_KEEPCNT:
+                    if(option_len != sizeof(int))
+                        goto ret_inval;
+
+                    tmp = *((int *)option_value);
+
+                    if(tmp < 1 || tmp > 127)
+                        goto ret_inval;
+
+                    sock->keep_cnt = tmp;
+                    goto ret_success;
+            }
+
+            break;
+    }
+
+    /* If it wasn't handled, return that error. */
+    mutex_unlock(&sock->mutex);
+    errno = ENOPROTOOPT;
     return -1;
 
 ret_inval:
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
     errno = EINVAL;
     return -1;
 
 ret_nomem:
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
     errno = ENOMEM;
     return -1;
 
 ret_success:
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
     return 0;
 }
 
@@ -1831,7 +2174,7 @@ static int net_tcp_getsockname(net_socket_t *hnd, struct sockaddr *name,
         return -1;
     }
 
-    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+    if(!(sock = net_tcp_lock_and_get_sock(hnd)))
         return -1;
 
     if(sock->domain == AF_INET) {
@@ -1871,13 +2214,11 @@ static int net_tcp_getsockname(net_socket_t *hnd, struct sockaddr *name,
     }
 
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
     errno = ENOTSOCK;
     return -1;
 
 ret_success:
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
     return 0;
 }
 
@@ -1891,30 +2232,18 @@ static int net_tcp_getpeername(net_socket_t *hnd, struct sockaddr *name, socklen
         return -1;
     }
 
-    if(irq_inside_int()) {
-        if(rwsem_read_trylock(&tcp_sem)) {
-            errno = EWOULDBLOCK;
-            return -1;
-        }
-    } else {
-        rwsem_read_lock(&tcp_sem);
-    }
-
     if(!(sock = (struct tcp_sock *)hnd->data)) {
-        rwsem_read_unlock(&tcp_sem);
         errno = EBADF;
         return -1;
     }
 
     if(mutex_lock_irqsafe(&sock->mutex)) {
-        rwsem_read_unlock(&tcp_sem);
         errno = EWOULDBLOCK;
         return -1;
     }
 
     if(sock->state == TCP_STATE_CLOSED) {
         mutex_unlock(&sock->mutex);
-        rwsem_read_unlock(&tcp_sem);
         errno = ENOTCONN;
         return -1;
     }
@@ -1953,13 +2282,11 @@ static int net_tcp_getpeername(net_socket_t *hnd, struct sockaddr *name, socklen
     }
 
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
     errno = ENOTSOCK;
     return -1;
 
 ret_success:
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
     return 0;
 }
 
@@ -1969,7 +2296,7 @@ static int net_tcp_fcntl(net_socket_t *hnd, int cmd, va_list ap) {
     int rv = -1;
     long val;
 
-    if(!(sock = net_tcp_read_lock_and_get_sock(hnd, &tcp_sem)))
+    if(!(sock = net_tcp_lock_and_get_sock(hnd)))
         return -1;
 
     switch(cmd) {
@@ -2002,7 +2329,6 @@ static int net_tcp_fcntl(net_socket_t *hnd, int cmd, va_list ap) {
 
 out:
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
     return rv;
 }
 
@@ -2010,20 +2336,11 @@ static short net_tcp_poll(net_socket_t *hnd, short events) {
     struct tcp_sock *sock;
     short rv = 0;
 
-    if(rwsem_read_lock_irqsafe(&tcp_sem))
-        return 0;
-
-    /* Lock the mutex on the socket itself first. We need to pull some data from
-       it that doesn't affect the rest of the list, so let's start there... */
-    if(!(sock = (struct tcp_sock *)hnd->data)) {
-        rwsem_read_unlock(&tcp_sem);
+    if(!(sock = (struct tcp_sock *)hnd->data))
         return POLLNVAL;
-    }
 
-    if(mutex_lock_irqsafe(&sock->mutex)) {
-        rwsem_read_unlock(&tcp_sem);
+    if(mutex_lock_irqsafe(&sock->mutex))
         return 0;
-    }
 
     switch(sock->state) {
         case TCP_STATE_LISTEN:
@@ -2069,7 +2386,6 @@ static short net_tcp_poll(net_socket_t *hnd, short events) {
     }
 
     mutex_unlock(&sock->mutex);
-    rwsem_read_unlock(&tcp_sem);
     return rv & (events | POLLHUP | POLLERR);
 }
 
@@ -2138,10 +2454,185 @@ static void tcp_bpkt_rst(netif_t *net, const struct in6_addr *src,
                   dst, src);
 }
 
+/* Window value to put in the header of an outgoing segment. The window in a
+   <SYN> is never scaled. */
+static inline uint16_t tcp_wnd_field(const struct tcp_sock *sock, int syn) {
+    uint32_t wnd = sock->data.rcv.wnd;
+
+    if(!syn)
+        wnd >>= sock->data.rcv_wscale;
+
+    return htons(wnd > 65535 ? 65535 : wnd);
+}
+
+/* Smallest window shift that lets us advertise a buffer of the given size. */
+static uint8_t tcp_wscale(uint32_t bufsz) {
+    uint8_t shift = 0;
+
+    while(shift < TCP_MAX_WSCALE && (bufsz >> shift) > 65535)
+        ++shift;
+
+    return shift;
+}
+
+static inline uint32_t tcp_ts_now(void) {
+    return (uint32_t)timer_ms_gettime64();
+}
+
+static inline void tcp_put32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline uint32_t tcp_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* Describe the out-of-order queue as SACK blocks. The block holding the most
+   recently received segment goes first, as RFC 2018 asks, and the rest follow
+   in sequence order. */
+static int tcp_sack_gen(const struct tcp_sock *sock, struct tcp_sack_blk *blks,
+                        int max) {
+    struct tcp_sack_blk r[TCP_OOO_MAX], t;
+    int n = 0, i, j, first = 0, cnt = 0;
+
+    /* Sort the table by sequence number... */
+    for(i = 0; i < sock->data.ooo_count; ++i) {
+        t.start = sock->data.ooo[i].seq;
+        t.end = t.start + sock->data.ooo[i].len;
+
+        if(SEQ_LE(t.end, sock->data.rcv.nxt))
+            continue;
+
+        for(j = n; j > 0 && SEQ_GT(r[j - 1].start, t.start); --j)
+            r[j] = r[j - 1];
+
+        r[j] = t;
+        ++n;
+    }
+
+    if(!n)
+        return 0;
+
+    /* ...and merge any ranges that touch. */
+    for(i = 1, j = 0; i < n; ++i) {
+        if(SEQ_LE(r[i].start, r[j].end)) {
+            if(SEQ_GT(r[i].end, r[j].end))
+                r[j].end = r[i].end;
+        }
+        else {
+            r[++j] = r[i];
+        }
+    }
+
+    n = j + 1;
+
+    for(i = 0; i < n; ++i) {
+        if(SEQ_GE(sock->data.ooo_last, r[i].start) &&
+                SEQ_LT(sock->data.ooo_last, r[i].end)) {
+            first = i;
+            break;
+        }
+    }
+
+    blks[cnt++] = r[first];
+
+    for(i = 0; i < n && cnt < max; ++i) {
+        if(i != first)
+            blks[cnt++] = r[i];
+    }
+
+    return cnt;
+}
+
+/* Fill in the options that go on every segment of a connection once it's
+   synchronized: timestamps, if they were negotiated, and SACK blocks if sack is
+   non-zero and we're holding out-of-order data. Returns the length written,
+   which is always a multiple of 4. Every segment built with this acknowledges
+   all we've received, so it also takes care of any pending delayed ACK. */
+static int tcp_put_opts(struct tcp_sock *sock, uint8_t *opts, int sack) {
+    struct tcp_sack_blk blks[TCP_SACK_MAX_BLOCKS];
+    int len = 0, n, i;
+
+    if(sock->data.opt_flags & TCP_OPTF_TS) {
+        opts[0] = TCP_OPT_NOP;
+        opts[1] = TCP_OPT_NOP;
+        opts[2] = TCP_OPT_TS;
+        opts[3] = 10;
+        tcp_put32(opts + 4, tcp_ts_now());
+        tcp_put32(opts + 8, sock->data.ts_recent);
+        len = TCP_TS_OPT_LEN;
+    }
+
+    if(sack && (sock->data.opt_flags & TCP_OPTF_SACK_PERM) &&
+            sock->data.ooo_count) {
+        n = tcp_sack_gen(sock, blks, (40 - 4 - len) / 8);
+
+        if(n) {
+            opts[len] = TCP_OPT_NOP;
+            opts[len + 1] = TCP_OPT_NOP;
+            opts[len + 2] = TCP_OPT_SACK;
+            opts[len + 3] = 2 + 8 * n;
+            len += 4;
+
+            for(i = 0; i < n; ++i) {
+                tcp_put32(opts + len, blks[i].start);
+                tcp_put32(opts + len + 4, blks[i].end);
+                len += 8;
+            }
+        }
+    }
+
+    sock->data.last_ack_sent = sock->data.rcv.nxt;
+    sock->data.ack_pending = 0;
+    tcp_timer_clear(sock, TCP_TIMER_DELACK);
+    return len;
+}
+
 static int tcp_send_syn(struct tcp_sock *sock, int ack) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t) + 4];
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + 24];
     tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
+    uint8_t *opts = hdr->options;
     uint16_t cs;
+    int len;
+
+    /* Fill in our SYN options. We always send our MSS, and whichever of the
+       RFC 7323/2018 options are still in play. When answering a <SYN> that
+       means only the ones the other side offered. */
+    opts[0] = TCP_OPT_MSS;
+    opts[1] = 4;
+    opts[2] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
+    opts[3] = TCP_DEFAULT_MSS & 0xFF;
+    len = 4;
+
+    if(sock->data.opt_flags & TCP_OPTF_WSCALE) {
+        opts[len] = TCP_OPT_NOP;
+        opts[len + 1] = TCP_OPT_WSCALE;
+        opts[len + 2] = 3;
+        opts[len + 3] = sock->data.rcv_wscale;
+        len += 4;
+    }
+
+    if(sock->data.opt_flags & TCP_OPTF_SACK_PERM) {
+        opts[len] = TCP_OPT_NOP;
+        opts[len + 1] = TCP_OPT_NOP;
+        opts[len + 2] = TCP_OPT_SACK_PERM;
+        opts[len + 3] = 2;
+        len += 4;
+    }
+
+    if(sock->data.opt_flags & TCP_OPTF_TS) {
+        opts[len] = TCP_OPT_NOP;
+        opts[len + 1] = TCP_OPT_NOP;
+        opts[len + 2] = TCP_OPT_TS;
+        opts[len + 3] = 10;
+        tcp_put32(opts + len + 4, tcp_ts_now());
+        tcp_put32(opts + len + 8, ack ? sock->data.ts_recent : 0);
+        len += TCP_TS_OPT_LEN;
+    }
 
     /* Fill in the base packet */
     hdr->src_port = sock->local_addr.sin6_port;
@@ -2150,101 +2641,167 @@ static int tcp_send_syn(struct tcp_sock *sock, int ack) {
     hdr->ack = htonl(sock->data.rcv.nxt);
 
     if(ack) {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_OFFSET(6));
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_FLAG_ACK |
+                               TCP_OFFSET(5 + len / 4));
     }
     else {
-        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(6));
+        hdr->off_flags = htons(TCP_FLAG_SYN | TCP_OFFSET(5 + len / 4));
     }
 
-    hdr->wnd = htons(sock->data.rcv.wnd);
+    hdr->wnd = tcp_wnd_field(sock, 1);
     hdr->checksum = 0;
     hdr->urg = 0;
 
-    /* Fill in our SYN options. The only one we worry about right now is MSS. */
-    hdr->options[0] = TCP_OPT_MSS;
-    hdr->options[1] = 4;
-    hdr->options[2] = (TCP_DEFAULT_MSS >> 8) & 0xFF;
-    hdr->options[3] = TCP_DEFAULT_MSS & 0xFF;
+    sock->data.last_ack_sent = sock->data.rcv.nxt;
+    len += sizeof(tcp_hdr_t);
 
     /* Calculate the real checksum */
     cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
                                   &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t) + 4, IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t) + 4, cs);
+                                  len, IPPROTO_TCP);
+    hdr->checksum = net_ipv4_checksum(rawpkt, len, cs);
 
-    return net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t) + 4,
+    return net_ipv6_send(sock->data.net, rawpkt, len,
                          sock->hop_limit, sock->tos, IPPROTO_TCP,
                          &sock->local_addr.sin6_addr,
                          &sock->remote_addr.sin6_addr);
 }
 
 static void tcp_send_fin_ack(struct tcp_sock *sock) {
-    uint8_t rawpkt[sizeof(tcp_hdr_t)];
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + TCP_TS_OPT_LEN];
     tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
     uint16_t cs;
+    int len = tcp_put_opts(sock, hdr->options, 0);
 
     /* Fill in the base packet */
     hdr->src_port = sock->local_addr.sin6_port;
     hdr->dst_port = sock->remote_addr.sin6_port;
     hdr->seq = htonl(sock->data.snd.nxt);
     hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_FIN | TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
+    hdr->off_flags = htons(TCP_FLAG_FIN | TCP_FLAG_ACK |
+                           TCP_OFFSET(5 + len / 4));
+    hdr->wnd = tcp_wnd_field(sock, 0);
     hdr->checksum = 0;
     hdr->urg = 0;
 
+    len += sizeof(tcp_hdr_t);
+
     /* Calculate the real checksum */
     cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
                                   &sock->remote_addr.sin6_addr,
-                                  sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr->checksum = net_ipv4_checksum(rawpkt, sizeof(tcp_hdr_t), cs);
+                                  len, IPPROTO_TCP);
+    hdr->checksum = net_ipv4_checksum(rawpkt, len, cs);
 
-    net_ipv6_send(sock->data.net, rawpkt, sizeof(tcp_hdr_t), sock->hop_limit,
+    net_ipv6_send(sock->data.net, rawpkt, len, sock->hop_limit,
                   sock->tos, IPPROTO_TCP, &sock->local_addr.sin6_addr,
                   &sock->remote_addr.sin6_addr);
+
+    /* It takes up a sequence number, so it has to be retransmitted if it's
+       lost like anything else would. */
+    tcp_timer_set(sock, TCP_TIMER_REXMT, sock->data.rto);
 }
 
-static void tcp_send_ack(struct tcp_sock *sock) {
-    tcp_hdr_t hdr;
+/* Send a bare ACK with the given sequence number. Normally that's snd.nxt, but
+   keepalive probes use snd.una - 1 to make the other side answer. */
+static void tcp_send_ack_seq(struct tcp_sock *sock, uint32_t seq) {
+    uint8_t rawpkt[sizeof(tcp_hdr_t) + 40];
+    tcp_hdr_t *hdr = (tcp_hdr_t *)rawpkt;
     uint16_t c;
+    int len = tcp_put_opts(sock, hdr->options, 1);
 
     /* Fill in the base packet */
-    hdr.src_port = sock->local_addr.sin6_port;
-    hdr.dst_port = sock->remote_addr.sin6_port;
-    hdr.seq = htonl(sock->data.snd.nxt);
-    hdr.ack = htonl(sock->data.rcv.nxt);
-    hdr.off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr.wnd = htons(sock->data.rcv.wnd);
-    hdr.checksum = 0;
-    hdr.urg = 0;
+    hdr->src_port = sock->local_addr.sin6_port;
+    hdr->dst_port = sock->remote_addr.sin6_port;
+    hdr->seq = htonl(seq);
+    hdr->ack = htonl(sock->data.rcv.nxt);
+    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5 + len / 4));
+    hdr->wnd = tcp_wnd_field(sock, 0);
+    hdr->checksum = 0;
+    hdr->urg = 0;
+
+    len += sizeof(tcp_hdr_t);
 
     /* Calculate the real checksum */
     c = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
                                  &sock->remote_addr.sin6_addr,
-                                 sizeof(tcp_hdr_t), IPPROTO_TCP);
-    hdr.checksum = net_ipv4_checksum((const uint8_t *)&hdr, sizeof(tcp_hdr_t), c);
+                                 len, IPPROTO_TCP);
+    hdr->checksum = net_ipv4_checksum(rawpkt, len, c);
 
-    net_ipv6_send(sock->data.net, (const uint8_t *)&hdr, sizeof(tcp_hdr_t),
+    net_ipv6_send(sock->data.net, rawpkt, len,
                   sock->hop_limit, sock->tos, IPPROTO_TCP, &sock->local_addr.sin6_addr,
                   &sock->remote_addr.sin6_addr);
 }
 
-static void tcp_send_data(struct tcp_sock *sock, int resend) {
-    uint32_t wnd = sock->data.snd.wnd, snd;
-    int sz;
+static void tcp_send_ack(struct tcp_sock *sock) {
+    tcp_send_ack_seq(sock, sock->data.snd.nxt);
+}
+
+/* Build and send a single data segment of len bytes, starting at offset head
+   in the send buffer. */
+static void tcp_send_seg(struct tcp_sock *sock, uint32_t seq, uint32_t head,
+                         uint32_t len) {
     alignas(32) uint8_t frame[NET_IPV4_FRAME_HDR_SIZE + 1500];
     uint8_t *seg = frame + NET_IPV4_FRAME_HDR_SIZE;
     tcp_hdr_t *hdr = (tcp_hdr_t *)seg;
+    int optlen = tcp_put_opts(sock, hdr->options, 0);
+    uint8_t *buf = seg + sizeof(tcp_hdr_t) + optlen;
+    uint8_t *sb = sock->data.sndbuf + head;
     uint16_t cs;
-    uint8_t *sb, *buf;
-    uint32_t seq, unacked, head;
-    int v4;
-    uint32_t v4src = 0, v4dst = 0;
+    int sz;
+
+    hdr->src_port = sock->local_addr.sin6_port;
+    hdr->dst_port = sock->remote_addr.sin6_port;
+    hdr->seq = htonl(seq);
+    hdr->ack = htonl(sock->data.rcv.nxt);
+    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5 + optlen / 4));
+    hdr->wnd = tcp_wnd_field(sock, 0);
+    hdr->checksum = 0;
+    hdr->urg = 0;
+
+    /* Copy in the data (unavoidable copy) */
+    if(head + len <= sock->sndbuf_sz) {
+        memcpy(buf, sb, len);
+    }
+    else {
+        sz = sock->sndbuf_sz - head;
+        memcpy(buf, sb, sz);
+        memcpy(buf + sz, sock->data.sndbuf, len - sz);
+    }
+
+    sz = len + sizeof(tcp_hdr_t) + optlen;
+
+    /* Calculate the checksum */
+    cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
+                                  &sock->remote_addr.sin6_addr, sz,
+                                  IPPROTO_TCP);
+    hdr->checksum = net_ipv4_checksum(seg, sz, cs);
+
+    /* Use the zero-extra-copy IPv4 path when both ends are V4-mapped. */
+    if(IN6_IS_ADDR_V4MAPPED(&sock->local_addr.sin6_addr) &&
+            IN6_IS_ADDR_V4MAPPED(&sock->remote_addr.sin6_addr))
+        net_ipv4_send_inplace(sock->data.net, frame, sz, -1,
+                              sock->hop_limit, sock->tos, IPPROTO_TCP,
+                              sock->local_addr.sin6_addr.__s6_addr.__s6_addr32[3],
+                              sock->remote_addr.sin6_addr.__s6_addr.__s6_addr32[3]);
+    else
+        net_ipv6_send(sock->data.net, seg, sz, sock->hop_limit, sock->tos,
+                      IPPROTO_TCP, &sock->local_addr.sin6_addr,
+                      &sock->remote_addr.sin6_addr);
+}
+
+/* Send as much queued data as the send window allows. The usable window is the
+   smaller of the peer's advertised window and our congestion window. If resend
+   is non-zero, everything after snd.una is treated as unsent (go-back-N after a
+   retransmission timeout). */
+static void tcp_send_data(struct tcp_sock *sock, int resend) {
+    uint32_t wnd = MIN(sock->data.snd.wnd, sock->data.cwnd), snd;
+    uint32_t seq, unacked, head, start;
+    int idle = sock->data.snd.nxt == sock->data.snd.una, probe = 0;
 
     if(!resend) {
         seq = sock->data.snd.nxt;
         unacked = sock->data.snd.nxt - sock->data.snd.una;
-        wnd -= unacked;
+        wnd = wnd > unacked ? wnd - unacked : 0;
         head = sock->data.sndbuf_head;
     }
     else {
@@ -2253,32 +2810,27 @@ static void tcp_send_data(struct tcp_sock *sock, int resend) {
         head = sock->data.sndbuf_acked;
     }
 
-    if(!wnd)
+    /* If the peer has closed its window and there's nothing in flight, probe
+       it with a single byte so we'll hear about it reopening. */
+    if(!sock->data.snd.wnd && (resend || idle)) {
         wnd = 1;
+        probe = 1;
+    }
 
-    /* Use the zero-extra-copy IPv4 path when both ends are V4-mapped. */
-    v4 = IN6_IS_ADDR_V4MAPPED(&sock->local_addr.sin6_addr) &&
-         IN6_IS_ADDR_V4MAPPED(&sock->remote_addr.sin6_addr);
+    start = seq;
 
-    if(v4) {
-        v4src = sock->local_addr.sin6_addr.__s6_addr.__s6_addr32[3];
-        v4dst = sock->remote_addr.sin6_addr.__s6_addr.__s6_addr32[3];
+    /* Start timing a segment if we aren't already, but never one that is
+       being retransmitted (Karn's algorithm). */
+    if(!(sock->data.cc_flags & TCP_CC_TIMING) && wnd &&
+            sock->data.sndbuf_cur_sz - unacked &&
+            SEQ_GE(seq, sock->data.snd_max)) {
+        sock->data.rtt_seq = seq;
+        sock->data.rtt_time = timer_ms_gettime64();
+        sock->data.cc_flags |= TCP_CC_TIMING;
     }
 
-    /* Fill in the base packet */
-    hdr->src_port = sock->local_addr.sin6_port;
-    hdr->dst_port = sock->remote_addr.sin6_port;
-    hdr->ack = htonl(sock->data.rcv.nxt);
-    hdr->off_flags = htons(TCP_FLAG_ACK | TCP_OFFSET(5));
-    hdr->wnd = htons(sock->data.rcv.wnd);
-    hdr->urg = 0;
-
     /* Put on some data if we should do so */
     while(sock->data.sndbuf_cur_sz - unacked && wnd) {
-        hdr->seq = htonl(seq);
-        hdr->checksum = 0;
-        buf = seg + sizeof(tcp_hdr_t);
-        sb = sock->data.sndbuf + head;
         snd = wnd;
 
         if(snd > sock->data.snd.mss)
@@ -2287,44 +2839,445 @@ static void tcp_send_data(struct tcp_sock *sock, int resend) {
         if(snd > sock->data.sndbuf_cur_sz - unacked)
             snd = sock->data.sndbuf_cur_sz - unacked;
 
-        /* Copy in the data(unavoidable copy) */
-        if(head + snd <= sock->sndbuf_sz) {
-            memcpy(buf, sb, snd);
-            head += snd;
+        /* Don't chop off a runt just because the window ends partway into the
+           next segment; wait for an ACK to open it up the rest of the way
+           (RFC 1122 section 4.2.3.4). */
+        if(snd < sock->data.snd.mss && snd < sock->data.sndbuf_cur_sz -
+                unacked && unacked && !probe)
+            break;
 
-            if(head == sock->sndbuf_sz)
-                head = 0;
-        }
-        else {
-            sz = sock->sndbuf_sz - head;
-            memcpy(buf, sb, sz);
-            memcpy(buf + sz, sock->data.sndbuf, snd - sz);
-            head = snd - sz;
-        }
+        tcp_send_seg(sock, seq, head, snd);
+
+        head += snd;
+
+        if(head >= sock->sndbuf_sz)
+            head -= sock->sndbuf_sz;
 
-        sz = snd + sizeof(tcp_hdr_t);
         wnd -= snd;
         seq += snd;
         unacked += snd;
+    }
 
-        /* Calculate the checksum */
-        cs = net_ipv6_checksum_pseudo(&sock->local_addr.sin6_addr,
-                                      &sock->remote_addr.sin6_addr, sz,
-                                      IPPROTO_TCP);
-        hdr->checksum = net_ipv4_checksum(seg, sz, cs);
-
-        if(v4)
-            net_ipv4_send_inplace(sock->data.net, frame, sz, -1,
-                                  sock->hop_limit, sock->tos, IPPROTO_TCP, v4src, v4dst);
-        else
-            net_ipv6_send(sock->data.net, seg, sz, sock->hop_limit, sock->tos, IPPROTO_TCP,
-                          &sock->local_addr.sin6_addr,
-                          &sock->remote_addr.sin6_addr);
+    /* The retransmission timer only (re)starts here if nothing was in flight;
+       otherwise it is restarted as ACKs for new data come in. Window probes
+       get the persist timer instead, so they aren't mistaken for losses. */
+    if(seq != start) {
+        if(probe) {
+            tcp_timer_clear(sock, TCP_TIMER_REXMT);
+            tcp_timer_set(sock, TCP_TIMER_PERSIST, sock->data.rto);
+        }
+        else if(resend || idle) {
+            tcp_timer_set(sock, TCP_TIMER_REXMT, sock->data.rto);
+        }
     }
 
-    sock->data.timer = timer_ms_gettime64();
     sock->data.sndbuf_head = head;
     sock->data.snd.nxt = seq;
+
+    if(SEQ_GT(seq, sock->data.snd_max))
+        sock->data.snd_max = seq;
+}
+
+/* Record the SACK blocks from an incoming segment in the scoreboard, which is
+   kept sorted and merged. Blocks that don't cover anything between snd.una and
+   snd_max are bogus (or D-SACKs) and get ignored. If the scoreboard fills up,
+   the highest ranges are dropped; that only costs us some precision. */
+static void tcp_sack_update(struct tcp_sock *sock, const struct tcp_opts *o) {
+    struct tcp_sack_blk *sb = sock->data.sacked, b;
+    int i, j;
+
+    for(j = 0; j < o->sack_count; ++j) {
+        b = o->sack[j];
+
+        if(!SEQ_LT(b.start, b.end) || SEQ_LE(b.end, sock->data.snd.una) ||
+                SEQ_GT(b.end, sock->data.snd_max))
+            continue;
+
+        if(SEQ_LT(b.start, sock->data.snd.una))
+            b.start = sock->data.snd.una;
+
+        /* Absorb anything this one overlaps or touches... */
+        for(i = 0; i < sock->data.sacked_count;) {
+            if(SEQ_LE(sb[i].start, b.end) && SEQ_GE(sb[i].end, b.start)) {
+                if(SEQ_LT(sb[i].start, b.start))
+                    b.start = sb[i].start;
+
+                if(SEQ_GT(sb[i].end, b.end))
+                    b.end = sb[i].end;
+
+                memmove(sb + i, sb + i + 1, (--sock->data.sacked_count - i) *
+                        sizeof(struct tcp_sack_blk));
+            }
+            else {
+                ++i;
+            }
+        }
+
+        /* ...and insert it in order. */
+        for(i = 0; i < sock->data.sacked_count &&
+                SEQ_LT(sb[i].start, b.start); ++i);
+
+        if(sock->data.sacked_count == TCP_SACK_SCOREBOARD) {
+            if(i == TCP_SACK_SCOREBOARD)
+                continue;
+
+            --sock->data.sacked_count;
+        }
+
+        memmove(sb + i + 1, sb + i, (sock->data.sacked_count - i) *
+                sizeof(struct tcp_sack_blk));
+        sb[i] = b;
+        ++sock->data.sacked_count;
+    }
+}
+
+/* Drop everything at or below snd.una from the scoreboard. */
+static void tcp_sack_trim(struct tcp_sock *sock) {
+    struct tcp_sack_blk *sb = sock->data.sacked;
+    int i = 0;
+
+    while(i < sock->data.sacked_count &&
+            SEQ_LE(sb[i].end, sock->data.snd.una))
+        ++i;
+
+    if(i) {
+        sock->data.sacked_count -= i;
+        memmove(sb, sb + i, sock->data.sacked_count *
+                sizeof(struct tcp_sack_blk));
+    }
+
+    if(sock->data.sacked_count && SEQ_LT(sb[0].start, sock->data.snd.una))
+        sb[0].start = sock->data.snd.una;
+}
+
+/* Find the first hole in the scoreboard at or after *seq: data the peer hasn't
+   got, with SACKed data above it. Updates *seq to the start of the hole and
+   returns its length (capped at one MSS), or returns 0 if there isn't one. */
+static uint32_t tcp_sack_next_hole(const struct tcp_sock *sock, uint32_t *seq) {
+    const struct tcp_sack_blk *sb = sock->data.sacked;
+    int i;
+
+    for(i = 0; i < sock->data.sacked_count; ++i) {
+        if(SEQ_LT(*seq, sb[i].start))
+            return MIN(sb[i].start - *seq, sock->data.snd.mss);
+
+        if(SEQ_LT(*seq, sb[i].end))
+            *seq = sb[i].end;
+    }
+
+    return 0;
+}
+
+/* Retransmit the next segment presumed lost, without disturbing snd.nxt. With
+   SACK information, that's the first hole at or after rxt_next. Without it, the
+   best we can do is the segment at snd.una. Returns 0 if there was nothing to
+   resend. */
+static int tcp_retransmit(struct tcp_sock *sock) {
+    uint32_t seq = sock->data.snd.una, len, head;
+
+    if(sock->data.sacked_count) {
+        if(SEQ_GT(sock->data.rxt_next, seq))
+            seq = sock->data.rxt_next;
+
+        len = tcp_sack_next_hole(sock, &seq);
+    }
+    else {
+        len = MIN(sock->data.snd.nxt - sock->data.snd.una, sock->data.snd.mss);
+    }
+
+    if(!len)
+        return 0;
+
+    head = sock->data.sndbuf_acked + (seq - sock->data.snd.una);
+
+    if(head >= sock->sndbuf_sz)
+        head -= sock->sndbuf_sz;
+
+    tcp_send_seg(sock, seq, head, len);
+    sock->data.rxt_next = seq + len;
+    sock->data.cc_flags &= ~TCP_CC_TIMING;
+    ++sock->data.retransmits;
+    return 1;
+}
+
+/* Reset the congestion control state of a connection, once the peer's MSS is
+   known. */
+static void tcp_cc_init(struct tcp_sock *sock) {
+    uint32_t mss = sock->data.snd.mss;
+
+    /* Initial window, as per RFC 5681 section 3.1 */
+    sock->data.cwnd = MIN(4 * mss, MAX(2 * mss, 4380));
+    sock->data.ssthresh = UINT32_MAX;
+    sock->data.snd_max = sock->data.snd.nxt;
+    sock->data.recover = sock->data.snd.una;
+    sock->data.rto = TCP_DEFAULT_RTTO;
+    sock->data.srtt = sock->data.rttvar = 0;
+    sock->data.dupacks = 0;
+    sock->data.cc_flags = 0;
+    sock->data.sacked_count = 0;
+    sock->data.rxt_next = sock->data.snd.una;
+    sock->data.retransmits = 0;
+    sock->data.fast_retransmits = 0;
+    sock->data.timeouts = 0;
+}
+
+/* Fold a new round-trip time measurement (in ms) into the smoothed estimates
+   and recompute the RTO, as per RFC 6298 section 2. */
+static void tcp_rtt_sample(struct tcp_sock *sock, uint32_t rtt) {
+    int32_t delta;
+    uint32_t rto;
+
+    if(!(sock->data.cc_flags & TCP_CC_RTTVALID)) {
+        sock->data.srtt = rtt << 3;
+        sock->data.rttvar = rtt << 1;
+        sock->data.cc_flags |= TCP_CC_RTTVALID;
+    }
+    else {
+        /* srtt += (rtt - srtt) / 8, rttvar += (|rtt - srtt| - rttvar) / 4 */
+        delta = (int32_t)rtt - (sock->data.srtt >> 3);
+        sock->data.srtt += delta;
+
+        if(delta < 0)
+            delta = -delta;
+
+        sock->data.rttvar += delta - (sock->data.rttvar >> 2);
+    }
+
+    /* RTO = srtt + max(G, 4 * rttvar), where G is our timer granularity. */
+    rto = (sock->data.srtt >> 3) + MAX(TCP_CLOCK_GRAN,
+                                       (uint32_t)sock->data.rttvar);
+    sock->data.rto = MIN(MAX(rto, TCP_MIN_RTO), TCP_MAX_RTO);
+}
+
+/* Handle an ACK that acknowledges acked bytes of new data. If the segment
+   carried a timestamp echo, tsecr is that, otherwise it is zero. */
+static void tcp_cc_ack(struct tcp_sock *sock, uint32_t ack, uint32_t acked,
+                       uint32_t tsecr) {
+    uint32_t mss = sock->data.snd.mss, inc;
+    int32_t rtt;
+
+    /* With timestamps, every ACK of new data gives an RTT sample, and there's
+       no retransmission ambiguity to worry about (RFC 7323 section 4). */
+    if(tsecr) {
+        rtt = (int32_t)(tcp_ts_now() - tsecr);
+
+        if(rtt >= 0)
+            tcp_rtt_sample(sock, rtt);
+
+        sock->data.cc_flags &= ~TCP_CC_TIMING;
+    }
+    else if((sock->data.cc_flags & TCP_CC_TIMING) &&
+            SEQ_GT(ack, sock->data.rtt_seq)) {
+        tcp_rtt_sample(sock, timer_ms_gettime64() - sock->data.rtt_time);
+        sock->data.cc_flags &= ~TCP_CC_TIMING;
+    }
+
+    sock->data.dupacks = 0;
+
+    if(sock->data.cc_flags & TCP_CC_RECOVERY) {
+        if(SEQ_GE(ack, sock->data.recover)) {
+            /* Full ACK: everything outstanding when we entered recovery has
+               arrived, so deflate the window and leave (RFC 6582 step 3). */
+            sock->data.cwnd = sock->data.ssthresh;
+            sock->data.cc_flags &= ~TCP_CC_RECOVERY;
+        }
+        else {
+            /* Partial ACK: the next segment was lost too, so resend it and
+               deflate the window by the amount acknowledged. */
+            tcp_retransmit(sock);
+            sock->data.cwnd -= MIN(sock->data.cwnd - mss, acked);
+
+            if(acked >= mss)
+                sock->data.cwnd += mss;
+        }
+
+        return;
+    }
+
+    if(sock->data.cwnd < sock->data.ssthresh) {
+        /* Slow start, with appropriate byte counting (RFC 3465, L = 2) */
+        inc = MIN(acked, 2 * mss);
+    }
+    else {
+        /* Congestion avoidance: roughly one MSS per round trip */
+        inc = mss * mss / sock->data.cwnd;
+
+        if(!inc)
+            inc = 1;
+    }
+
+    /* There's never any point in the window being larger than what we could
+       possibly have in flight. */
+    sock->data.cwnd = MIN(sock->data.cwnd + inc, MAX(sock->sndbuf_sz, mss));
+}
+
+/* Handle a duplicate ACK, entering fast retransmit/fast recovery on the third
+   in a row. */
+static void tcp_cc_dupack(struct tcp_sock *sock) {
+    uint32_t mss = sock->data.snd.mss;
+
+    if(sock->data.cc_flags & TCP_CC_RECOVERY) {
+        /* Each further duplicate means another segment has left the network.
+           If the peer's SACKs show another hole, fill that; otherwise inflate
+           the window to let a new segment in. */
+        if(!sock->data.sacked_count || !tcp_retransmit(sock)) {
+            sock->data.cwnd += mss;
+            tcp_send_data(sock, 0);
+        }
+
+        return;
+    }
+
+    if(++sock->data.dupacks != TCP_DUPACK_THRESH)
+        return;
+
+    /* Don't start another recovery for losses within the window we've already
+       recovered from (RFC 6582 section 3.2 step 2). */
+    if(!SEQ_GT(sock->data.snd.una, sock->data.recover))
+        return;
+
+    sock->data.ssthresh = MAX((sock->data.snd.nxt - sock->data.snd.una) / 2,
+                              2 * mss);
+    sock->data.recover = sock->data.snd_max;
+    sock->data.rxt_next = sock->data.snd.una;
+    sock->data.cc_flags |= TCP_CC_RECOVERY;
+
+    tcp_retransmit(sock);
+    ++sock->data.fast_retransmits;
+
+    sock->data.cwnd = sock->data.ssthresh + TCP_DUPACK_THRESH * mss;
+    tcp_timer_set(sock, TCP_TIMER_REXMT, sock->data.rto);
+}
+
+/* Handle expiry of the retransmission timer. */
+static void tcp_cc_timeout(struct tcp_sock *sock) {
+    uint32_t mss = sock->data.snd.mss;
+
+    /* With nothing in flight this is just a zero window probe, which shouldn't
+       be taken as a sign of congestion. */
+    if(sock->data.snd.nxt != sock->data.snd.una) {
+        sock->data.ssthresh = MAX((sock->data.snd.nxt - sock->data.snd.una) / 2,
+                                  2 * mss);
+        sock->data.cwnd = mss;
+        sock->data.recover = sock->data.snd_max;
+        ++sock->data.retransmits;
+        ++sock->data.timeouts;
+    }
+
+    sock->data.cc_flags &= ~(TCP_CC_RECOVERY | TCP_CC_TIMING);
+    sock->data.dupacks = 0;
+
+    /* The receiver is allowed to renege on anything it SACKed, so forget it
+       all and start over from snd.una (RFC 2018 section 8). */
+    sock->data.sacked_count = 0;
+
+    /* Back off the timer (RFC 6298 section 5.5). It'll be recalculated once
+       we get an RTT sample from new data. */
+    sock->data.rto = MIN(sock->data.rto * 2, TCP_MAX_RTO);
+
+    tcp_send_data(sock, 1);
+}
+
+/* Handle expiry of the persist timer by probing the peer's zero window again,
+   backing off the same way the retransmission timer does. */
+static void tcp_persist_timeout(struct tcp_sock *sock) {
+    if(!sock->data.sndbuf_cur_sz)
+        return;
+
+    /* The window opened up without us hearing about it in time. */
+    if(sock->data.snd.wnd) {
+        tcp_send_data(sock, 0);
+        return;
+    }
+
+    sock->data.rto = MIN(sock->data.rto * 2, TCP_MAX_RTO);
+    tcp_send_data(sock, 1);
+}
+
+/* Put a socket in the reset state, and wake up anything waiting on it. The
+   socket comes out of the lookup tables, so anything more that comes in for
+   the connection gets answered with a RST, and the port can be used again. */
+static void tcp_reset(struct tcp_sock *sock) {
+    uint32_t flags;
+
+    sock->state = TCP_STATE_RESET | TCP_STATE_CLOSED;
+    sock->poll_pending |= POLLHUP;
+    cond_signal(&sock->data.recv_cv);
+    cond_signal(&sock->data.send_cv);
+
+    flags = irq_disable();
+    tcp_hash_remove(sock);
+    irq_restore(flags);
+}
+
+/* Start the keepalive timer on an established connection, if it was asked for
+   with SO_KEEPALIVE. */
+static void tcp_keep_arm(struct tcp_sock *sock) {
+    if(!(sock->intflags & TCP_IFLAG_KEEPALIVE))
+        return;
+
+    if(sock->state != TCP_STATE_ESTABLISHED &&
+            sock->state != TCP_STATE_CLOSE_WAIT)
+        return;
+
+    sock->keep_probes = 0;
+    tcp_timer_set(sock, TCP_TIMER_KEEP, sock->keep_idle * 1000);
+}
+
+/* Handle expiry of the keepalive timer. Once the connection has been idle for
+   keep_idle seconds, send a probe every keep_intvl seconds, and give up on the
+   other side after keep_cnt of them go unanswered. */
+static void tcp_keep_timeout(struct tcp_sock *sock) {
+    uint64_t now = timer_ms_gettime64();
+    uint64_t idle = (uint64_t)sock->keep_idle * 1000;
+
+    if(!(sock->intflags & TCP_IFLAG_KEEPALIVE))
+        return;
+
+    if(sock->state != TCP_STATE_ESTABLISHED &&
+            sock->state != TCP_STATE_CLOSE_WAIT)
+        return;
+
+    /* If we've heard from them since the timer was set, just wait out the rest
+       of the idle time. */
+    if(!sock->keep_probes && sock->last_rcv + idle > now) {
+        tcp_timer_set(sock, TCP_TIMER_KEEP, sock->last_rcv + idle - now);
+        return;
+    }
+
+    if(sock->keep_probes >= sock->keep_cnt) {
+        tcp_rst(sock->data.net, &sock->local_addr.sin6_addr,
+                &sock->remote_addr.sin6_addr, sock->local_addr.sin6_port,
+                sock->remote_addr.sin6_port, TCP_FLAG_ACK | TCP_FLAG_RST,
+                sock->data.snd.nxt, sock->data.rcv.nxt);
+
+        tcp_reset(sock);
+        return;
+    }
+
+    /* An ACK for something just before what they've already acknowledged
+       makes the other side answer with an ACK of its own. */
+    ++sock->keep_probes;
+    tcp_send_ack_seq(sock, sock->data.snd.una - 1);
+    tcp_timer_set(sock, TCP_TIMER_KEEP, sock->keep_intvl * 1000);
+}
+
+/* Once everything queued before a close() has been acknowledged, send the FIN
+   that close() had to hold off on. */
+static void tcp_queued_fin(struct tcp_sock *sock) {
+    if(!(sock->intflags & TCP_IFLAG_QUEUEDCLOSE) || sock->data.sndbuf_cur_sz)
+        return;
+
+    if(sock->state == TCP_STATE_ESTABLISHED)
+        sock->state = TCP_STATE_FIN_WAIT_1;
+    else if(sock->state == TCP_STATE_CLOSE_WAIT)
+        sock->state = TCP_STATE_CLOSING;
+    else
+        return;
+
+    sock->intflags &= ~TCP_IFLAG_QUEUEDCLOSE;
+    tcp_send_fin_ack(sock);
+    ++sock->data.snd.nxt;
 }
 
 #define ADDR_EQUAL(a1, a2) \
@@ -2333,6 +3286,37 @@ static void tcp_send_data(struct tcp_sock *sock, int resend) {
      ((a1).__s6_addr.__s6_addr32[2] == (a2).__s6_addr.__s6_addr32[2]) && \
      ((a1).__s6_addr.__s6_addr32[3] == (a2).__s6_addr.__s6_addr32[3]))
 
+/* Does a socket match an incoming packet? */
+static inline bool tcp_sock_match(const struct tcp_sock *i,
+                                  const struct in6_addr *src,
+                                  const struct in6_addr *dst,
+                                  uint16_t sport, uint16_t dport, int domain) {
+    /* Ignore any closed sockets */
+    if(i->state == TCP_STATE_CLOSED)
+        return false;
+
+    /* Ignore any sockets that are IPv6 only when we have an incoming IPv4
+       packet, or any that are IPv4 only when we have an incoming IPv6
+       packet. */
+    if((domain == AF_INET && (i->flags & FS_SOCKET_V6ONLY)) ||
+            (domain == AF_INET6 && i->domain == AF_INET))
+        return false;
+
+    /* See if the remote end matches what's in the socket */
+    if(!IN6_IS_ADDR_UNSPECIFIED(&i->remote_addr.sin6_addr) &&
+            (!ADDR_EQUAL(i->remote_addr.sin6_addr, *src) ||
+             i->remote_addr.sin6_port != sport))
+        return false;
+
+    /* See if it matches the local end */
+    if((!IN6_IS_ADDR_UNSPECIFIED(&i->local_addr.sin6_addr) &&
+            !ADDR_EQUAL(i->local_addr.sin6_addr, *dst)) ||
+            i->local_addr.sin6_port != dport)
+        return false;
+
+    return true;
+}
+
 /* Match a socket to an incoming packet. If an actual socket is returned, it is
    the caller's responsibility  to release the socket's mutex when they're done
    with it. */
@@ -2340,45 +3324,121 @@ static struct tcp_sock *find_sock(const struct in6_addr *src,
                                   const struct in6_addr *dst,
                                   uint16_t sport, uint16_t dport, int domain) {
     struct tcp_sock *i;
+    uint32_t flags;
 
-    LIST_FOREACH(i, &tcp_socks, sock_list) {
-        /* Ignore any closed sockets */
-        if(i->state == TCP_STATE_CLOSED)
-            continue;
+    flags = irq_disable();
 
-        /* Ignore any sockets that are IPv6 only when we have an incoming IPv4
-           packet, or any that are IPv4 only when we have an incoming IPv6
-           packet. */
-        if((domain == AF_INET && (i->flags & FS_SOCKET_V6ONLY)) ||
-                (domain == AF_INET6 && i->domain == AF_INET))
-            continue;
+    /* Look for a fully-created connection first. See the comment at the top of
+       the file for why these have to take precedence. */
+    LIST_FOREACH(i, &tcp_conns[tcp_conn_hash(src, sport, dport)], conn_list) {
+        if(tcp_sock_match(i, src, dst, sport, dport, domain))
+            goto found;
+    }
 
-        /* See if the remote end matches what's in the socket */
-        if(!IN6_IS_ADDR_UNSPECIFIED(&i->remote_addr.sin6_addr) &&
-                (!ADDR_EQUAL(i->remote_addr.sin6_addr, *src) ||
-                 i->remote_addr.sin6_port != sport))
-            continue;
+    /* Failing that, anything listening on the port. Connected sockets were
+       all taken care of above. */
+    LIST_FOREACH(i, &tcp_ports[tcp_port_hash(dport)], port_list) {
+        if(IN6_IS_ADDR_UNSPECIFIED(&i->remote_addr.sin6_addr) &&
+                tcp_sock_match(i, src, dst, sport, dport, domain))
+            goto found;
+    }
 
-        /* See if it matches the local end */
-        if((!IN6_IS_ADDR_UNSPECIFIED(&i->local_addr.sin6_addr) &&
-                !ADDR_EQUAL(i->local_addr.sin6_addr, *dst)) ||
-                i->local_addr.sin6_port != dport)
-            continue;
+    irq_restore(flags);
+    return NULL;
 
-        if(mutex_lock_irqsafe(&i->mutex))
-            return (struct tcp_sock *) -1;
+found:
+    ++i->refs;
+    irq_restore(flags);
 
-        /* Because we always add new sockets to the head of the list, this
-           should be sufficient to match the socket. See the comment at the top
-           of the file for more discussion of this, if you're interested. */
-        return i;
-    }
+    if(tcp_sock_lock(i))
+        return (struct tcp_sock *) -1;
 
-    return NULL;
+    return i;
 }
 
 extern void __poll_event_trigger(int fd, short event);
 
+/* Parse the options of an incoming segment. The caller fills in the default MSS
+   beforehand. Returns -1 if the options are malformed. */
+static int tcp_parse_opts(const tcp_hdr_t *tcp, uint16_t flags,
+                          struct tcp_opts *o) {
+    const uint8_t *opt = tcp->options;
+    int j = 0, end_of_opts = TCP_GET_OFFSET(flags) - 20, len, i;
+
+    o->flags = 0;
+    o->sack_count = 0;
+
+    while(j < end_of_opts) {
+        if(opt[j] == TCP_OPT_EOL)
+            break;
+
+        if(opt[j] == TCP_OPT_NOP) {
+            ++j;
+            continue;
+        }
+
+        if(j + 1 >= end_of_opts || opt[j + 1] < 2 ||
+                j + opt[j + 1] > end_of_opts)
+            return -1;
+
+        len = opt[j + 1];
+
+        switch(opt[j]) {
+            case TCP_OPT_MSS:
+                if(len != 4)
+                    return -1;
+
+                o->mss = (opt[j + 2] << 8) | opt[j + 3];
+                break;
+
+            case TCP_OPT_WSCALE:
+                if(len != 3)
+                    return -1;
+
+                o->wscale = MIN(opt[j + 2], TCP_MAX_WSCALE);
+                o->flags |= TCP_OPTF_WSCALE;
+                break;
+
+            case TCP_OPT_SACK_PERM:
+                if(len != 2)
+                    return -1;
+
+                o->flags |= TCP_OPTF_SACK_PERM;
+                break;
+
+            case TCP_OPT_SACK:
+                if(len < 10 || (len - 2) % 8)
+                    return -1;
+
+                for(i = 0; i < (len - 2) / 8 && i < TCP_SACK_MAX_BLOCKS; ++i) {
+                    o->sack[i].start = tcp_get32(opt + j + 2 + i * 8);
+                    o->sack[i].end = tcp_get32(opt + j + 6 + i * 8);
+                }
+
+                o->sack_count = i;
+                o->flags |= TCP_OPTF_SACK;
+                break;
+
+            case TCP_OPT_TS:
+                if(len != 10)
+                    return -1;
+
+                o->tsval = tcp_get32(opt + j + 2);
+                o->tsecr = tcp_get32(opt + j + 6);
+                o->flags |= TCP_OPTF_TS;
+                break;
+
+            default:
+                /* Skip unknown options */
+                break;
+        }
+
+        j += len;
+    }
+
+    return 0;
+}
+
 /* This function is basically a direct implementation of the first two and a
    half steps of the SEGMENT ARRIVES event processing defined in RFC 793 on
    pages 65 and 66. There are a few parts that are omitted and some are put off
@@ -2386,9 +3446,9 @@ extern void __poll_event_trigger(int fd, short event);
 static int listen_pkt(netif_t *src, const struct in6_addr *srca,
                       const struct in6_addr *dsta, const tcp_hdr_t *tcp,
                       struct tcp_sock *s, uint16_t flags, int size) {
-    int j = 0;
-    int end_of_opts;
-    uint16_t mss = 576;
+    int j;
+    uint16_t mss;
+    struct tcp_opts opts;
 
     (void)size;
 
@@ -2401,35 +3461,12 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
         return -1;
 
     /* Parse options now, in case we need to update the max segment size. */
-    end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-    while(j < end_of_opts) {
-        switch(tcp->options[j]) {
-            case TCP_OPT_EOL:
-                j = end_of_opts;
-                break;
+    opts.mss = 576;
 
-            case TCP_OPT_NOP:
-                ++j;
-                break;
-
-            case TCP_OPT_MSS:
-                if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                    return -1;
-
-                mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                j += 4;
-                break;
-
-            default:
-
-                /* Skip unknown options */
-                if(j + 1 > end_of_opts || j + tcp->options[j + 1] > end_of_opts)
-                    return -1;
+    if(tcp_parse_opts(tcp, flags, &opts))
+        return -1;
 
-                j += tcp->options[j + 1];
-        }
-    }
+    mss = opts.mss;
 
     /* Silently cap the MSS... */
     if(mss > 1460)
@@ -2445,6 +3482,9 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
                 s->listen.queue[j].remote_addr.sin6_port == tcp->src_port) {
             s->listen.queue[j].isn = ntohl(tcp->seq);
             s->listen.queue[j].mss = mss;
+            s->listen.queue[j].wscale = opts.wscale;
+            s->listen.queue[j].opt_flags = opts.flags & TCP_OPTF_ALL;
+            s->listen.queue[j].ts_recent = opts.tsval;
             return 0;
         }
     }
@@ -2463,6 +3503,9 @@ static int listen_pkt(netif_t *src, const struct in6_addr *srca,
     s->listen.queue[s->listen.tail].isn = ntohl(tcp->seq);
     s->listen.queue[s->listen.tail].mss = mss;
     s->listen.queue[s->listen.tail].wnd = ntohs(tcp->wnd);
+    s->listen.queue[s->listen.tail].wscale = opts.wscale;
+    s->listen.queue[s->listen.tail].opt_flags = opts.flags & TCP_OPTF_ALL;
+    s->listen.queue[s->listen.tail].ts_recent = opts.tsval;
     ++s->listen.count;
     ++s->listen.tail;
 
@@ -2484,7 +3527,7 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
                        struct tcp_sock *s, uint16_t flags, int size) {
     uint32_t ack, seq;
     int sz = size - TCP_GET_OFFSET(flags), gotack = 0;
-    int j = 0, end_of_opts, mss = 536;
+    struct tcp_opts opts;
 
     (void)src;
 
@@ -2505,10 +3548,7 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
     /* Next, we check the RST bit */
     if(flags & TCP_FLAG_RST) {
         if(gotack) {
-            s->state = TCP_STATE_CLOSED | TCP_STATE_RESET;
-            s->poll_pending |= POLLHUP;
-            cond_signal(&s->data.recv_cv);
-            cond_signal(&s->data.send_cv);
+            tcp_reset(s);
             return 0;
         }
     }
@@ -2520,40 +3560,34 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
         s->data.rcv.nxt = seq + 1;
         s->data.rcv.irs = seq;
 
-        end_of_opts = TCP_GET_OFFSET(flags) - 20;
-
-        while(j < end_of_opts) {
-            switch(tcp->options[j]) {
-                case TCP_OPT_EOL:
-                    j = end_of_opts;
-                    break;
-
-                case TCP_OPT_NOP:
-                    ++j;
-                    break;
+        opts.mss = 536;
 
-                case TCP_OPT_MSS:
+        if(tcp_parse_opts(tcp, flags, &opts))
+            return -1;
 
-                    if(j + 4 > end_of_opts || tcp->options[j + 1] != 4)
-                        return -1;
+        /* Only keep the options both sides asked for. */
+        s->data.opt_flags &= opts.flags;
 
-                    mss = (tcp->options[j + 2] << 8) | tcp->options[j + 3];
-                    j += 4;
-                    break;
+        if(s->data.opt_flags & TCP_OPTF_WSCALE) {
+            s->data.snd_wscale = opts.wscale;
+        }
+        else {
+            s->data.snd_wscale = 0;
+            s->data.rcv_wscale = 0;
+        }
 
-                default:
+        if(s->data.opt_flags & TCP_OPTF_TS)
+            s->data.ts_recent = opts.tsval;
 
-                    /* Skip unknown options */
-                    if(j + 1 > end_of_opts ||
-                            j + tcp->options[j + 1] > end_of_opts)
-                        return -1;
+        s->data.snd.mss = opts.mss > 1460 ? 1460 : opts.mss;
 
-                    j += tcp->options[j + 1];
-            }
-        }
+        /* Our MSS is for data only, so leave room for the timestamps. */
+        if((s->data.opt_flags & TCP_OPTF_TS) &&
+                s->data.snd.mss > 2 * TCP_TS_OPT_LEN)
+            s->data.snd.mss -= TCP_TS_OPT_LEN;
 
-        s->data.snd.mss = mss > 1460 ? 1460 : mss;
         s->data.snd.wnd = htons(tcp->wnd);
+        tcp_cc_init(s);
 
         if(gotack) {
             s->data.snd.una = ack;
@@ -2563,6 +3597,8 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
             if(SEQ_GT(ack, s->data.snd.iss)) {
                 s->state = TCP_STATE_ESTABLISHED;
                 tcp_send_ack(s);
+                tcp_timer_clear(s, TCP_TIMER_REXMT);
+                tcp_keep_arm(s);
                 s->poll_pending |= (POLLWRNORM | POLLWRBAND);
                 cond_signal(&s->data.send_cv);
             }
@@ -2579,23 +3615,32 @@ static int synsent_pkt(netif_t *src, const struct in6_addr *srca,
 }
 
 /* Buffer an out-of-order segment: copy data to the correct offset in
-   the circular receive buffer, and record the range in the OOO table. */
+   the circular receive buffer, and record the range in the OOO table.
+   Segments that touch a range already there just extend it, so the table
+   only fills up if there are more holes than it has entries. */
 /* Returns 0 on success, -1 if table is full (data NOT buffered). */
 static int tcp_ooo_add(struct tcp_sock *s, uint32_t seq, size_t sz,
                         const uint8_t *data) {
-    if(s->data.ooo_count >= TCP_OOO_MAX)
-        return -1;
+    struct tcp_ooo_seg *o = s->data.ooo;
+    uint32_t end = seq + sz;
+    int i, j;
 
     /* Reject duplicates — if this segment overlaps with an existing
        OOO entry, skip it. Without this check, retransmitted OOO
-       segments decrement rcv.wnd repeatedly, eventually leaking
-       the window to zero and deadlocking the connection. */
-    for(int i = 0; i < s->data.ooo_count; i++) {
-        uint32_t ooo_end = s->data.ooo[i].seq + s->data.ooo[i].len;
-        if(SEQ_GE(seq, s->data.ooo[i].seq) && SEQ_LT(seq, ooo_end))
+       segments get counted twice when they're consumed. */
+    for(i = 0; i < s->data.ooo_count; i++) {
+        if(SEQ_LT(seq, o[i].seq + o[i].len) && SEQ_GT(end, o[i].seq))
             return -1;
     }
 
+    for(i = 0; i < s->data.ooo_count; i++) {
+        if(o[i].seq + o[i].len == seq || o[i].seq == end)
+            break;
+    }
+
+    if(i == s->data.ooo_count && s->data.ooo_count >= TCP_OOO_MAX)
+        return -1;
+
     /* Place data at correct offset in the circular buffer */
     uint32_t gap = (uint32_t)(seq - s->data.rcv.nxt);
     uint32_t offset = (s->data.rcvbuf_tail + gap) % s->rcvbuf_sz;
@@ -2609,9 +3654,33 @@ static int tcp_ooo_add(struct tcp_sock *s, uint32_t seq, size_t sz,
         memcpy(s->data.rcvbuf, data + first, sz - first);
     }
 
-    s->data.ooo[s->data.ooo_count].seq = seq;
-    s->data.ooo[s->data.ooo_count].len = (uint16_t)sz;
-    s->data.ooo_count++;
+    s->data.ooo_last = seq;
+
+    if(i == s->data.ooo_count) {
+        o[i].seq = seq;
+        o[i].len = sz;
+        s->data.ooo_count++;
+        return 0;
+    }
+
+    if(o[i].seq == end)
+        o[i].seq = seq;
+
+    o[i].len += sz;
+
+    /* It may have closed the gap to the range on its other side too */
+    for(j = 0; j < s->data.ooo_count; j++) {
+        if(j != i && (o[j].seq == o[i].seq + o[i].len ||
+                      o[j].seq + o[j].len == o[i].seq)) {
+            if(o[j].seq + o[j].len == o[i].seq)
+                o[i].seq = o[j].seq;
+
+            o[i].len += o[j].len;
+            o[j] = o[--s->data.ooo_count];
+            break;
+        }
+    }
+
     return 0;
 }
 
@@ -2653,9 +3722,10 @@ static uint32_t tcp_ooo_consume(struct tcp_sock *s) {
 static int process_pkt(netif_t *src, const struct in6_addr *srca,
                        const struct in6_addr *dsta, const tcp_hdr_t *tcp,
                        struct tcp_sock *s, uint16_t flags, size_t size) {
-    uint32_t seq, ack, up;
+    uint32_t seq, ack, up, acked;
     size_t sz;
     int bad_pkt = 0, tmp, acksyn = 0;
+    struct tcp_opts opts;
     const uint8_t *buf = (const uint8_t *)tcp;
     uint8_t *rb;
 
@@ -2669,6 +3739,25 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
     sz = size - TCP_GET_OFFSET(flags);
     buf += TCP_GET_OFFSET(flags);
 
+    opts.mss = 0;
+
+    if(tcp_parse_opts(tcp, flags, &opts))
+        return 0;
+
+    /* Only pay attention to the options that were negotiated. */
+    opts.flags &= s->data.opt_flags | TCP_OPTF_SACK;
+
+    if(!(s->data.opt_flags & TCP_OPTF_SACK_PERM))
+        opts.flags &= ~TCP_OPTF_SACK;
+
+    /* PAWS (RFC 7323 section 5): a segment with a timestamp older than the
+       most recent one we've seen is an old duplicate. */
+    if((opts.flags & TCP_OPTF_TS) && !(flags & TCP_FLAG_RST) &&
+            (int32_t)(opts.tsval - s->data.ts_recent) < 0) {
+        tcp_send_ack(s);
+        return 0;
+    }
+
     if(s->data.rcv.wnd == 0) {
         if(sz || seq != s->data.rcv.nxt)
             bad_pkt = 1;
@@ -2701,6 +3790,14 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         return 0;
     }
 
+    /* Remember the timestamp to echo back (RFC 7323 section 4.3). */
+    if((opts.flags & TCP_OPTF_TS) && SEQ_LE(seq, s->data.last_ack_sent))
+        s->data.ts_recent = opts.tsval;
+
+    /* Anything acceptable shows the peer is still out there. */
+    s->last_rcv = timer_ms_gettime64();
+    s->keep_probes = 0;
+
     /* See if we have a reset, and process it */
     if(flags & TCP_FLAG_RST) {
         if(s->state == TCP_STATE_SYN_SENT) {
@@ -2715,10 +3812,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
             return 0;
         }
         else {
-            s->state = TCP_STATE_RESET | TCP_STATE_CLOSED;
-            s->poll_pending |= POLLHUP;
-            cond_signal(&s->data.recv_cv);
-            cond_signal(&s->data.send_cv);
+            tcp_reset(s);
             return 0;
         }
     }
@@ -2743,6 +3837,8 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         if(SEQ_LE(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.nxt)) {
             s->state = TCP_STATE_ESTABLISHED;
             acksyn = 1;
+            tcp_timer_clear(s, TCP_TIMER_REXMT);
+            tcp_keep_arm(s);
         }
         else {
             tcp_bpkt_rst(s->data.net, srca, dsta, tcp, sz);
@@ -2750,10 +3846,22 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         }
     }
 
-    /* Check the ack number for validity */
-    if(SEQ_LT(s->data.snd.una, ack) && SEQ_LE(ack, s->data.snd.nxt)) {
-        s->data.sndbuf_acked += (int32_t)(ack - s->data.snd.una - acksyn);
-        s->data.sndbuf_cur_sz -= (int32_t)(ack - s->data.snd.una - acksyn);
+    if(opts.flags & TCP_OPTF_SACK)
+        tcp_sack_update(s, &opts);
+
+    /* Check the ack number for validity. After a retransmission timeout,
+       snd.nxt gets pulled back to snd.una, so anything up to snd_max is
+       still something we've actually sent. */
+    if(SEQ_LT(s->data.snd.una, ack) && (SEQ_LE(ack, s->data.snd.nxt) ||
+                                        SEQ_LE(ack, s->data.snd_max))) {
+        acked = ack - s->data.snd.una - acksyn;
+
+        /* Our FIN takes up a sequence number, but nothing in the buffer. */
+        if(acked > s->data.sndbuf_cur_sz)
+            acked = s->data.sndbuf_cur_sz;
+
+        s->data.sndbuf_acked += acked;
+        s->data.sndbuf_cur_sz -= acked;
         s->data.snd.una = ack;
         s->poll_pending |= (POLLWRNORM | POLLWRBAND);
         cond_signal(&s->data.send_cv);
@@ -2761,12 +3869,65 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
         if(s->data.sndbuf_acked >= s->sndbuf_sz)
             s->data.sndbuf_acked -= s->sndbuf_sz;
 
+        if(SEQ_GT(ack, s->data.snd.nxt)) {
+            s->data.snd.nxt = ack;
+            s->data.sndbuf_head = s->data.sndbuf_acked;
+        }
+
+        if(s->data.sacked_count)
+            tcp_sack_trim(s);
+
         if(SEQ_LT(s->data.snd.wl1, seq) ||
                 (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack))) {
-            s->data.snd.wnd = ntohs(tcp->wnd);
+            s->data.snd.wnd = ntohs(tcp->wnd) << s->data.snd_wscale;
             s->data.snd.wl1 = seq;
             s->data.snd.wl2 = ack;
         }
+
+        if(acked) {
+            tcp_cc_ack(s, ack, acked,
+                       (opts.flags & TCP_OPTF_TS) ? opts.tsecr : 0);
+
+            /* Restart the retransmission timer if there's still something in
+               flight, otherwise stop it (RFC 6298 section 5). */
+            if(s->data.snd.nxt != s->data.snd.una)
+                tcp_timer_set(s, TCP_TIMER_REXMT, s->data.rto);
+            else
+                tcp_timer_clear(s, TCP_TIMER_REXMT);
+
+            /* Let the ACK clock out any data that was held back by the
+               window. */
+            if(s->data.sndbuf_cur_sz > s->data.snd.nxt - s->data.snd.una)
+                tcp_send_data(s, 0);
+            else if(!s->data.sndbuf_cur_sz)
+                tcp_queued_fin(s);
+        }
+    }
+    else if(ack == s->data.snd.una && !sz && s->data.snd.nxt != ack &&
+            !(flags & (TCP_FLAG_SYN | TCP_FLAG_FIN)) &&
+            ((opts.flags & TCP_OPTF_SACK) ||
+             (uint32_t)ntohs(tcp->wnd) << s->data.snd_wscale ==
+             s->data.snd.wnd)) {
+        /* Duplicate ACK, as defined in RFC 5681 section 2. One carrying SACK
+           blocks counts even if the window moved (RFC 6675 section 2). */
+        tcp_cc_dupack(s);
+    }
+    else if(ack == s->data.snd.una) {
+        /* Nothing new acknowledged, but this may still be a window update
+           (RFC 793 lets SND.UNA =< SEG.ACK =< SND.NXT update the window).
+           This is how a zero window gets reopened. */
+        if(SEQ_LT(s->data.snd.wl1, seq) ||
+                (s->data.snd.wl1 == seq && SEQ_LE(s->data.snd.wl2, ack))) {
+            s->data.snd.wnd = ntohs(tcp->wnd) << s->data.snd_wscale;
+            s->data.snd.wl1 = seq;
+            s->data.snd.wl2 = ack;
+
+            if(s->data.snd.wnd && s->data.sndbuf_cur_sz >
+                    s->data.snd.nxt - s->data.snd.una) {
+                tcp_timer_clear(s, TCP_TIMER_PERSIST);
+                tcp_send_data(s, 0);
+            }
+        }
     }
     else if(SEQ_GT(ack, s->data.snd.nxt)) {
         /* This ACKs something we haven't sent, so try to correct the other side
@@ -2791,7 +3952,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
             /* If the FIN has been acked, go to TIME-WAIT */
             if(ack == s->data.snd.nxt) {
                 s->state = TCP_STATE_TIME_WAIT;
-                s->data.timer = timer_ms_gettime64();
+                tcp_timer_set(s, TCP_TIMER_2MSL, 2 * TCP_DEFAULT_MSL);
                 break;
             }
             else {
@@ -2810,7 +3971,7 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
         case TCP_STATE_TIME_WAIT:
             /* ACK the FIN again, and restart the timer */
-            s->data.timer = timer_ms_gettime64();
+            tcp_timer_set(s, TCP_TIMER_2MSL, 2 * TCP_DEFAULT_MSL);
             tcp_send_ack(s);
             break;
     }
@@ -2860,9 +4021,10 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
                     extra = tcp_ooo_consume(s);
                     if(extra) {
                         /* Data already in buffer from when OOO arrived.
-                           Advance tail and cur_sz. rcv.wnd was already
-                           decremented when the OOO segment was buffered,
-                           and rcv.nxt was advanced by tcp_ooo_consume. */
+                           Advance tail and cur_sz, and take it out of the
+                           window now that it's the app's. rcv.nxt was
+                           advanced by tcp_ooo_consume. */
+                        s->data.rcv.wnd -= extra;
                         s->data.rcvbuf_cur_sz += extra;
                         s->data.rcvbuf_tail =
                             (s->data.rcvbuf_tail + extra) % s->rcvbuf_sz;
@@ -2872,27 +4034,28 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
                 s->poll_pending |= POLLRDNORM;
                 cond_signal(&s->data.recv_cv);
 
-                /* Delayed ACK: ACK every 2nd in-order segment to
+                /* Delayed ACK: only ACK every few in-order segments to
                    reduce TX load on the RX thread (each ACK TX takes
                    ~150us during which RX is blocked, risking RTL8139
                    buffer overflow). Pending ACKs are flushed by the
-                   10ms timer in tcp_thd_cb. Also ACK immediately
-                   after consuming OOO segments (big jump in rcv.nxt
-                   tells the sender to stop retransmitting). */
-                s->data.ack_pending++;
-                if(s->data.ack_pending >= 8 || extra > 0) {
+                   delayed ACK timer. Also ACK immediately after
+                   consuming OOO segments (big jump in rcv.nxt tells the
+                   sender to stop retransmitting). */
+                if(++s->data.ack_pending >= 8 || extra > 0)
                     tcp_send_ack(s);
-                    s->data.ack_pending = 0;
-                }
+                else if(s->data.ack_pending == 1)
+                    tcp_timer_set(s, TCP_TIMER_DELACK, TCP_DELACK_MS);
             }
             else if(SEQ_GT(seq, s->data.rcv.nxt)) {
                 /* --- Out-of-order segment: buffer for reassembly --- */
-                if(tcp_ooo_add(s, seq, sz, buf) == 0) {
-                    /* Only shrink window if data was actually buffered.
-                       If table was full, data was dropped — don't account
-                       for phantom bytes or the app gets garbage later. */
-                    s->data.rcv.wnd -= sz;
-                }
+                /* It goes in the space the window already promised, so
+                   the window doesn't shrink (which would strand whatever
+                   the sender has put in flight past the new right edge);
+                   just don't take anything beyond it. */
+                if(seq + sz - s->data.rcv.nxt > s->data.rcv.wnd)
+                    sz = s->data.rcv.nxt + s->data.rcv.wnd - seq;
+
+                tcp_ooo_add(s, seq, sz, buf);
 
                 /* Send dup ACK (with current rcv.nxt) so the sender
                    can do fast retransmit after 3 dup ACKs. */
@@ -2934,11 +4097,11 @@ static int process_pkt(netif_t *src, const struct in6_addr *srca,
 
             case TCP_STATE_FIN_WAIT_2:
                 s->state = TCP_STATE_TIME_WAIT;
-                s->data.timer = timer_ms_gettime64();
+                tcp_timer_set(s, TCP_TIMER_2MSL, 2 * TCP_DEFAULT_MSL);
                 break;
 
             case TCP_STATE_TIME_WAIT:
-                s->data.timer = timer_ms_gettime64();
+                tcp_timer_set(s, TCP_TIMER_2MSL, 2 * TCP_DEFAULT_MSL);
                 break;
         }
     }
@@ -2996,16 +4159,11 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
 
     flags = ntohs(tcp->off_flags);
 
-    if(rwsem_read_lock_irqsafe(&tcp_sem))
-        return -1;
-
     /* Find a matching socket */
     if((s = find_sock(&srca, &dsta, tcp->src_port, tcp->dst_port, domain))) {
         /* Make sure we take care of busy sockets... */
-        if(s == (struct tcp_sock *) - 1) {
-            rwsem_read_unlock(&tcp_sem);
+        if(s == (struct tcp_sock *) - 1)
             return 0;
-        }
 
         /* We have to do different things for different states, so figure out
            what this socket is doing. */
@@ -3014,11 +4172,6 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
                 rv = listen_pkt(src, &srca, &dsta, tcp, s, flags, size);
                 break;
 
-            case TCP_STATE_LISTEN | TCP_STATE_ACCEPTING:
-                /* Ugly hack... */
-                rv = 0;
-                break;
-
             case TCP_STATE_SYN_SENT:
                 rv = synsent_pkt(src, &srca, &dsta, tcp, s, flags, size);
                 break;
@@ -3035,6 +4188,12 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
                 break;
         }
 
+        /* If that finished off a socket that's already been closed, hand it
+           to the timer thread to be freed. */
+        if((s->intflags & TCP_IFLAG_CANBEDEL) &&
+                (s->state & 0x0F) == TCP_STATE_CLOSED)
+            tcp_timer_set(s, TCP_TIMER_REAP, 0);
+
         short poll_ev = s->poll_pending;
         file_t poll_fd = s->sock;
         s->poll_pending = 0;
@@ -3047,8 +4206,6 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
             __poll_event_trigger(poll_fd, poll_ev);
     }
 
-    rwsem_read_unlock(&tcp_sem);
-
     /* If we get in here, something went wrong... Send a RST. */
     if(rv && !(flags & TCP_FLAG_RST)) {
         tcp_bpkt_rst(src, &srca, &dsta, tcp, size - TCP_GET_OFFSET(flags));
@@ -3057,114 +4214,163 @@ static int net_tcp_input(netif_t *src, int domain, const void *hdr,
     return 0;
 }
 
-static void net_tcp_job(workqueue_t *wq, workqueue_job_t *job) {
-    struct tcp_sock *i, *tmp;
-    uint64_t timer;
+/* Free a socket that has been closed by the user and is done with the
+   connection. Must be called with the socket's mutex held. */
+static void tcp_reap(struct tcp_sock *s) {
+    cond_destroy(&s->data.send_cv);
+    cond_destroy(&s->data.recv_cv);
+    free(s->data.sndbuf);
+    free(s->data.rcvbuf);
+    tcp_sock_free(s);
+}
 
-    rwsem_read_lock(&tcp_sem);
+/* Run whichever of a socket's timers have come due, and put it back on the
+   timer queue for the next one (or free it, if it's done with). The socket must
+   have already been taken out of the queue, and be locked. */
+static void tcp_timer_run(struct tcp_sock *s) {
+    uint64_t now, next = 0;
+    short poll_ev;
+    file_t poll_fd;
+    int i;
 
-    LIST_FOREACH(i, &tcp_socks, sock_list) {
-        mutex_lock_scoped(&i->mutex);
-        timer = timer_ms_gettime64();
+    now = timer_ms_gettime64();
 
-        switch(i->state) {
-            case TCP_STATE_LISTEN:
-                break;
+    for(i = 0; i < TCP_TIMER_COUNT; ++i) {
+        if(!s->timers[i] || s->timers[i] > now)
+            continue;
 
-            case TCP_STATE_SYN_SENT:
+        s->timers[i] = 0;
 
-                /* If our last <SYN> was sent more than one  retransmission
-                   timeout period ago and we are still in the SYN-SENT state,
-                   send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_syn(i, 0);
-                    i->data.timer = timer;
+        switch(i) {
+            case TCP_TIMER_REXMT:
+                if(s->state == TCP_STATE_SYN_SENT ||
+                        s->state == TCP_STATE_SYN_RECEIVED) {
+                    /* Our <SYN> (or <SYN,ACK>) went unanswered, so send it
+                       again. */
+                    tcp_send_syn(s, s->state == TCP_STATE_SYN_RECEIVED);
+                    tcp_timer_set(s, TCP_TIMER_REXMT, TCP_DEFAULT_RTTO);
+                }
+                else if((s->state == TCP_STATE_ESTABLISHED ||
+                         s->state == TCP_STATE_CLOSE_WAIT) &&
+                        s->data.sndbuf_cur_sz) {
+                    tcp_cc_timeout(s);
+                }
+                else if((s->state == TCP_STATE_FIN_WAIT_1 ||
+                         s->state == TCP_STATE_CLOSING ||
+                         s->state == TCP_STATE_LAST_ACK) &&
+                        s->data.snd.nxt != s->data.snd.una) {
+                    /* Our <FIN> went unanswered. Everything before it had
+                       been acknowledged before it was sent, so it's all
+                       that's left to resend. */
+                    s->data.rto = MIN(s->data.rto * 2, TCP_MAX_RTO);
+                    ++s->data.retransmits;
+                    ++s->data.timeouts;
+                    --s->data.snd.nxt;
+                    tcp_send_fin_ack(s);
+                    ++s->data.snd.nxt;
                 }
 
                 break;
 
-            case TCP_STATE_SYN_RECEIVED:
-
-                /* If our last <SYN,ACK> was sent more than one  retransmission
-                   timeout period ago and we are still in the SYN-RECEIVED
-                   state, send another one. */
-                if(i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_syn(i, 1);
-                    i->data.timer = timer;
-                }
+            case TCP_TIMER_PERSIST:
+                if(s->state == TCP_STATE_ESTABLISHED ||
+                        s->state == TCP_STATE_CLOSE_WAIT)
+                    tcp_persist_timeout(s);
 
                 break;
 
-            case TCP_STATE_TIME_WAIT:
-
-                /* If the TIME-WAIT timer has expired, then clean up the rest of
-                   the connection (the fd was already taken care of by a close()
-                   call earlier that ended up putting us in this state). */
-                if(i->data.timer + 2 * TCP_DEFAULT_MSL <= timer)
-                    i->state = TCP_STATE_CLOSED;
+            case TCP_TIMER_DELACK:
+                /* Flush the pending delayed ACK. Without this, a single
+                   unACKed segment stalls the sender until its RTO. */
+                if(s->data.ack_pending > 0)
+                    tcp_send_ack(s);
 
                 break;
 
-            case TCP_STATE_ESTABLISHED:
-            case TCP_STATE_CLOSE_WAIT:
+            case TCP_TIMER_KEEP:
+                tcp_keep_timeout(s);
+                break;
 
-                /* Flush pending delayed ACK. Without this, a single
-                   unACKed segment stalls the sender indefinitely. */
-                if(i->data.ack_pending > 0) {
-                    tcp_send_ack(i);
-                    i->data.ack_pending = 0;
-                }
+            case TCP_TIMER_2MSL:
+                /* Clean up the rest of the connection (the fd was already
+                   taken care of by a close() call earlier that ended up
+                   putting us in this state). */
+                if(s->state == TCP_STATE_TIME_WAIT)
+                    s->state = TCP_STATE_CLOSED;
 
-                if(i->data.sndbuf_cur_sz &&
-                        i->data.timer + TCP_DEFAULT_RTTO <= timer) {
-                    tcp_send_data(i, 1);
-                }
-                else if(!i->data.sndbuf_cur_sz &&
-                        (i->intflags & TCP_IFLAG_QUEUEDCLOSE)) {
-                    if(i->state == TCP_STATE_ESTABLISHED) {
-                        i->state = TCP_STATE_FIN_WAIT_1;
-                    }
-                    else {
-                        i->state = TCP_STATE_CLOSING;
-                    }
-
-                    tcp_send_fin_ack(i);
-                    ++i->data.snd.nxt;
-                }
+                break;
 
+            case TCP_TIMER_REAP:
                 break;
         }
     }
 
-    rwsem_read_unlock(&tcp_sem);
+    /* Anything the handlers above armed is in here too. */
+    for(i = 0; i < TCP_TIMER_COUNT; ++i) {
+        if(s->timers[i] && (!next || s->timers[i] < next))
+            next = s->timers[i];
+    }
 
-    /* Go through and clean up any sockets that need to be destroyed. */
-    rwsem_write_lock(&tcp_sem);
+    if(next) {
+        irq_disable_scoped();
+        tcp_timer_link(s, next);
+    }
+    else {
+        tcp_timer_unlink(s);
+    }
 
-    i = LIST_FIRST(&tcp_socks);
+    if((s->intflags & TCP_IFLAG_CANBEDEL) &&
+            (s->state & 0x0F) == TCP_STATE_CLOSED) {
+        tcp_reap(s);
+        return;
+    }
 
-    while(i) {
-        tmp = LIST_NEXT(i, sock_list);
+    poll_ev = s->poll_pending;
+    poll_fd = s->sock;
+    s->poll_pending = 0;
 
-        if((i->intflags & TCP_IFLAG_CANBEDEL) &&
-                (i->state & 0x0F) == TCP_STATE_CLOSED) {
-            LIST_REMOVE(i, sock_list);
-            cond_destroy(&i->data.send_cv);
-            cond_destroy(&i->data.recv_cv);
-            mutex_destroy(&i->mutex);
-            free(i->data.sndbuf);
-            free(i->data.rcvbuf);
-            free(i);
-        }
+    mutex_unlock(&s->mutex);
 
-        i = tmp;
-    }
+    if(poll_ev)
+        __poll_event_trigger(poll_fd, poll_ev);
+}
+
+/* Body of the timer thread. Runs every socket timer that's due, then sleeps
+   until the next one is (or until a new earliest deadline is set). Once the
+   queue is empty, it returns and the thread waits for tcp_timer_set() to wake
+   it back up. */
+static void tcp_timer_cb(void *d) {
+    struct tcp_sock *s;
+    uint64_t now;
+    uint32_t flags;
+
+    (void)d;
 
-    rwsem_write_unlock(&tcp_sem);
+    for(;;) {
+        flags = irq_disable();
 
-    /* Reprogram the workqueue job */
-    job->time_ms = timer_ms_gettime64() + TCP_POLL_PERIOD_MS;
-    workqueue_enqueue(wq, job);
+        s = tcp_timer_first();
+        now = timer_ms_gettime64();
+
+        if(tcp_timer_quit || !s || s->timer_next > now) {
+            if(tcp_timer_quit || !s) {
+                irq_restore(flags);
+                return;
+            }
+
+            genwait_wait(&tcp_timers, "tcp_timers",
+                         (unsigned int)MIN(s->timer_next - now, UINT32_MAX));
+            irq_restore(flags);
+            continue;
+        }
+
+        tcp_timer_remove(s);
+        ++s->refs;
+        irq_restore(flags);
+
+        if(!tcp_sock_lock(s))
+            tcp_timer_run(s);
+    }
 }
 
 /* Protocol handler for fs_socket. */
@@ -3191,22 +4397,35 @@ static fs_socket_proto_t proto = {
     net_tcp_poll                        /* poll */
 };
 
-static workqueue_job_t net_tcp_wq_job = {
-    .cb = net_tcp_job,
+static const kthread_attr_t tcp_timer_attr = {
+    .label = "tcp-timers",
 };
 
 int net_tcp_init(void) {
-    net_tcp_wq_job.time_ms = timer_ms_gettime64() + TCP_POLL_PERIOD_MS;
-    workqueue_enqueue(net_wq, &net_tcp_wq_job);
+    tcp_timer_quit = false;
+    tcp_timer_thd = thd_worker_create_ex(&tcp_timer_attr, tcp_timer_cb, NULL);
+
+    if(!tcp_timer_thd) {
+        dbglog(DBG_ERROR, "net_tcp: couldn't create timer thread\n");
+        return -1;
+    }
 
     return fs_socket_proto_add(&proto);
 }
 
 void net_tcp_shutdown(void) {
     struct tcp_sock *i, *tmp;
+    uint32_t flags;
+    int j;
 
-    /* Cancel the job and make sure we can grab the lock */
-    workqueue_cancel(net_wq, &net_tcp_wq_job);
+    /* Stop the timer thread and make sure we can grab the lock */
+    flags = irq_disable();
+    tcp_timer_quit = true;
+    genwait_wake_all(&tcp_timers);
+    irq_restore(flags);
+
+    thd_worker_destroy(tcp_timer_thd);
+    tcp_timer_thd = NULL;
 
     /* Disable IRQs so we can kill the sockets in peace... */
     irq_disable_scoped();
@@ -3234,6 +4453,13 @@ void net_tcp_shutdown(void) {
     }
 
     LIST_INIT(&tcp_socks);
+    timerq_init(&tcp_timers, tcp_timer_key);
+
+    for(j = 0; j < TCP_PORT_HASH_SIZE; ++j)
+        LIST_INIT(&tcp_ports[j]);
+
+    for(j = 0; j < TCP_CONN_HASH_SIZE; ++j)
+        LIST_INIT(&tcp_conns[j]);
 
     /* Remove us from fs_socket and clean up the semaphore */
     fs_socket_proto_remove(&proto);
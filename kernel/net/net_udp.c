@@ -15,6 +15,7 @@
 #include <kos/net.h>
 #include <kos/mutex.h>
 #include <kos/genwait.h>
+#include <kos/irq.h>
 #include <sys/queue.h>
 #include <kos/fs_socket.h>
 #include <sys/socket.h>
@@ -23,6 +24,7 @@
 
 #include "net_ipv4.h"
 #include "net_ipv6.h"
+#include "net_pbuf.h"
 
 #if __GNUC__ >= 9
 #pragma GCC diagnostic push
@@ -39,20 +41,19 @@ typedef struct {
     uint16_t checksum __packed;
 } udp_hdr_t;
 
-struct udp_pkt {
-    TAILQ_ENTRY(udp_pkt) pkt_queue;
-    struct sockaddr_in6 from;
-    uint8_t *data;
-    uint16_t datasize;
-};
+/* Received datagrams are queued on their socket as packet buffers, holding
+   just the payload, with the address they came from in the control block. */
+#define UDP_PKT_FROM(pkt)   ((struct sockaddr_in6 *)(pkt)->cb)
 
-TAILQ_HEAD(udp_pkt_queue, udp_pkt);
+_Static_assert(sizeof(struct sockaddr_in6) <= sizeof(((net_pbuf_t *)0)->cb),
+               "sockaddr_in6 doesn't fit in a packet buffer's control block");
 
 #define UDPSOCK_NO_CHECKSUM 0x00000001
 #define UDPSOCK_LITE_RCVCOV 0x00000002
 
 struct udp_sock {
     LIST_ENTRY(udp_sock) sock_list;
+    LIST_ENTRY(udp_sock) port_list;
     struct sockaddr_in6 local_addr;
     struct sockaddr_in6 remote_addr;
 
@@ -63,26 +64,95 @@ struct udp_sock {
     int hop_limit;
     int tos;
     file_t sock;
+    mutex_t mutex;
 
     struct {
         uint16_t send_cscov;
         uint16_t recv_cscov;
     } udp_lite;
 
-    struct udp_pkt_queue packets;
+    struct net_pbuf_queue packets;
 };
 
 LIST_HEAD(udp_sock_list, udp_sock);
 
+/* Each socket has a mutex of its own, held by the socket calls while they look
+   at or change it, so calls on different sockets don't get in each other's
+   way. Incoming packets don't take any of them. The socket list, the port
+   table, each socket's queue of received packets, and the parts of a socket
+   that incoming packets are matched against are only changed (or looked at, on
+   the receive side) with IRQs disabled instead, which never has to wait. That
+   way, a packet that comes in during an interrupt is never dropped just
+   because a UDP call was in progress. */
 static struct udp_sock_list net_udp_sockets = LIST_HEAD_INITIALIZER(0);
-static mutex_t udp_mutex = MUTEX_INITIALIZER;
 static net_udp_stats_t udp_stats = { 0 };
 
+/* Bound sockets, hashed on their local port so that incoming packets don't
+   have to be checked against every socket. */
+#define UDP_PORT_HASH_BITS  5
+#define UDP_PORT_HASH_SIZE  (1 << UDP_PORT_HASH_BITS)
+
+static struct udp_sock_list udp_ports[UDP_PORT_HASH_SIZE];
+
+static inline struct udp_sock_list *udp_port_bucket(uint16_t port) {
+    return &udp_ports[((uint32_t)port * 0x9e3779b1u) >>
+                      (32 - UDP_PORT_HASH_BITS)];
+}
+
+/* Set the local port of a socket (in network byte order), moving it to the
+   right hash bucket. Must be called with IRQs disabled. */
+static void udp_set_port(struct udp_sock *sock, uint16_t port) {
+    if(sock->local_addr.sin6_port)
+        LIST_REMOVE(sock, port_list);
+
+    sock->local_addr.sin6_port = port;
+
+    if(port)
+        LIST_INSERT_HEAD(udp_port_bucket(port), sock, port_list);
+}
+
+static int udp_port_in_use(uint16_t port) {
+    struct udp_sock *i;
+
+    LIST_FOREACH(i, udp_port_bucket(port), port_list) {
+        if(i->local_addr.sin6_port == port)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Find an unused port to bind to, returned in network byte order. Must be
+   called with IRQs disabled, and the port claimed (with udp_set_port()) before
+   they're turned back on. */
+static uint16_t udp_ephemeral_port(void) {
+    uint16_t port = 1024;
+
+    while(udp_port_in_use(htons(port)))
+        ++port;
+
+    return htons(port);
+}
+
 static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
                             const struct sockaddr_in6 *dst, const uint8_t *data,
                             size_t size, uint32_t flags, int hops, int tos,
                             uint32_t iflags, int proto, uint16_t cscov);
 
+static struct udp_sock *udp_lock_and_get_sock(net_socket_t *hnd) {
+    struct udp_sock *sock;
+
+    if(!(sock = (struct udp_sock *)hnd->data)) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    if(mutex_lock_irqsafe(&sock->mutex))
+        return NULL;
+
+    return sock;
+}
+
 static int net_udp_accept(net_socket_t *hnd, struct sockaddr *addr,
                           socklen_t *addr_len) {
     (void)hnd;
@@ -94,9 +164,11 @@ static int net_udp_accept(net_socket_t *hnd, struct sockaddr *addr,
 
 static int net_udp_bind(net_socket_t *hnd, const struct sockaddr *addr,
                         socklen_t addr_len) {
-    struct udp_sock *udpsock, *iter;
+    struct udp_sock *udpsock;
+    uint16_t port;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
+    uint32_t old;
 
     /* Verify the parameters sent in first */
     if(addr == NULL) {
@@ -144,64 +216,45 @@ static int net_udp_bind(net_socket_t *hnd, const struct sockaddr *addr,
             return -1;
     }
 
-    if(mutex_lock_irqsafe(&udp_mutex))
+    if(!(udpsock = udp_lock_and_get_sock(hnd)))
         return -1;
 
-    udpsock = (struct udp_sock *)hnd->data;
-
-    if(udpsock == NULL) {
-        mutex_unlock(&udp_mutex);
-        errno = EBADF;
-        return -1;
-    }
-
     /* Make sure the address family we're binding to matches that which is set
        on the socket itself */
     if(addr->sa_family != udpsock->domain) {
-        mutex_unlock(&udp_mutex);
+        mutex_unlock(&udpsock->mutex);
         errno = EINVAL;
         return -1;
     }
 
+    old = irq_disable();
+
     /* See if we requested a specific port or not */
     if(realaddr6.sin6_port != 0) {
         /* Make sure we don't already have a socket bound to the port
            specified */
-        LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-            if(iter == udpsock)
-                continue;
-
-            if(iter->local_addr.sin6_port == realaddr6.sin6_port) {
-                mutex_unlock(&udp_mutex);
-                errno = EADDRINUSE;
-                return -1;
-            }
+        if(udpsock->local_addr.sin6_port != realaddr6.sin6_port &&
+                udp_port_in_use(realaddr6.sin6_port)) {
+            irq_restore(old);
+            mutex_unlock(&udpsock->mutex);
+            errno = EADDRINUSE;
+            return -1;
         }
-
-        udpsock->local_addr = realaddr6;
     }
     else {
-        uint16_t port = 1024, tmp = 0;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-            }
-        }
-
-        udpsock->local_addr = realaddr6;
-        udpsock->local_addr.sin6_port = htons(port);
+        /* Grab the first unused port >= 1024. */
+        realaddr6.sin6_port = udp_ephemeral_port();
     }
 
+    port = realaddr6.sin6_port;
+    realaddr6.sin6_port = udpsock->local_addr.sin6_port;
+    udpsock->local_addr = realaddr6;
+    udp_set_port(udpsock, port);
+
     udpsock->sock = hnd->fd;
+    irq_restore(old);
 
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&udpsock->mutex);
 
     return 0;
 }
@@ -211,6 +264,7 @@ static int net_udp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     struct udp_sock *udpsock;
     struct sockaddr_in *realaddr4;
     struct sockaddr_in6 realaddr6;
+    uint32_t old;
 
     if(addr == NULL) {
         errno = EDESTADDRREQ;
@@ -256,28 +310,20 @@ static int net_udp_connect(net_socket_t *hnd, const struct sockaddr *addr,
             return -1;
     }
 
-    if(mutex_lock_irqsafe(&udp_mutex))
+    if(!(udpsock = udp_lock_and_get_sock(hnd)))
         return -1;
 
-    udpsock = (struct udp_sock *)hnd->data;
-
-    if(udpsock == NULL) {
-        mutex_unlock(&udp_mutex);
-        errno = EBADF;
-        return -1;
-    }
-
     /* Make sure the address family we're binding to matches that which is set
        on the socket itself */
     if(addr->sa_family != udpsock->domain) {
-        mutex_unlock(&udp_mutex);
+        mutex_unlock(&udpsock->mutex);
         errno = EINVAL;
         return -1;
     }
 
     /* Make sure the socket isn't already connected */
     if(!IN6_IS_ADDR_UNSPECIFIED(&udpsock->remote_addr.sin6_addr)) {
-        mutex_unlock(&udp_mutex);
+        mutex_unlock(&udpsock->mutex);
         errno = EISCONN;
         return -1;
     }
@@ -285,15 +331,17 @@ static int net_udp_connect(net_socket_t *hnd, const struct sockaddr *addr,
     /* Make sure we have a valid address to connect to */
     if(IN6_IS_ADDR_UNSPECIFIED(&realaddr6.sin6_addr) ||
             realaddr6.sin6_port == 0) {
-        mutex_unlock(&udp_mutex);
+        mutex_unlock(&udpsock->mutex);
         errno = EADDRNOTAVAIL;
         return -1;
     }
 
     /* "Connect" to the specified address */
+    old = irq_disable();
     udpsock->remote_addr = realaddr6;
+    irq_restore(old);
 
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&udpsock->mutex);
 
     return 0;
 }
@@ -309,26 +357,19 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
                                 int flags, struct sockaddr *addr,
                                 socklen_t *addr_len) {
     struct udp_sock *udpsock;
-    struct udp_pkt *pkt;
-
-    if(mutex_lock_irqsafe(&udp_mutex))
-        return -1;
-
-    udpsock = (struct udp_sock *)hnd->data;
+    net_pbuf_t *pkt;
+    uint32_t old;
 
-    if(udpsock == NULL) {
-        mutex_unlock(&udp_mutex);
-        errno = EBADF;
+    if(!(udpsock = udp_lock_and_get_sock(hnd)))
         return -1;
-    }
 
     if(udpsock->flags & (SHUT_RD << 24)) {
-        mutex_unlock(&udp_mutex);
+        mutex_unlock(&udpsock->mutex);
         return 0;
     }
 
     if(buffer == NULL || (addr != NULL && addr_len == NULL)) {
-        mutex_unlock(&udp_mutex);
+        mutex_unlock(&udpsock->mutex);
         errno = EFAULT;
         return -1;
     }
@@ -336,25 +377,34 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
     if(TAILQ_EMPTY(&udpsock->packets) &&
        ((udpsock->flags & FS_SOCKET_NONBLOCK) || (flags & MSG_DONTWAIT) ||
         irq_inside_int())) {
-        mutex_unlock(&udp_mutex);
+        mutex_unlock(&udpsock->mutex);
         errno = EWOULDBLOCK;
         return -1;
     }
 
+    /* Packets are queued with IRQs disabled, so check for one and go to sleep
+       with them disabled too. That way, one can't sneak in between the two and
+       have its wakeup missed. Don't hold on to the socket while asleep, so
+       that it can still be sent on in the meantime. */
+    old = irq_disable();
+
     while(TAILQ_EMPTY(&udpsock->packets)) {
-        mutex_unlock(&udp_mutex);
+        mutex_unlock(&udpsock->mutex);
         genwait_wait(udpsock, "net_udp_recvfrom", 0);
-        mutex_lock(&udp_mutex);
+        irq_restore(old);
+        mutex_lock(&udpsock->mutex);
+        old = irq_disable();
     }
 
     pkt = TAILQ_FIRST(&udpsock->packets);
+    irq_restore(old);
 
-    if(pkt->datasize > length) {
+    if(pkt->len > length) {
         memcpy(buffer, pkt->data, length);
     }
     else {
-        memcpy(buffer, pkt->data, pkt->datasize);
-        length = pkt->datasize;
+        memcpy(buffer, pkt->data, pkt->len);
+        length = pkt->len;
     }
 
     if(addr != NULL) {
@@ -364,8 +414,8 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
             memset(&realaddr, 0, sizeof(struct sockaddr_in));
             realaddr.sin_family = AF_INET;
             realaddr.sin_addr.s_addr =
-                pkt->from.sin6_addr.__s6_addr.__s6_addr32[3];
-            realaddr.sin_port = pkt->from.sin6_port;
+                UDP_PKT_FROM(pkt)->sin6_addr.__s6_addr.__s6_addr32[3];
+            realaddr.sin_port = UDP_PKT_FROM(pkt)->sin6_port;
 
             if(*addr_len < sizeof(struct sockaddr_in)) {
                 memcpy(addr, &realaddr, *addr_len);
@@ -380,8 +430,8 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
 
             memset(&realaddr6, 0, sizeof(struct sockaddr_in6));
             realaddr6.sin6_family = AF_INET6;
-            realaddr6.sin6_addr = pkt->from.sin6_addr;
-            realaddr6.sin6_port = pkt->from.sin6_port;
+            realaddr6.sin6_addr = UDP_PKT_FROM(pkt)->sin6_addr;
+            realaddr6.sin6_port = UDP_PKT_FROM(pkt)->sin6_port;
 
             if(*addr_len < sizeof(struct sockaddr_in6)) {
                 memcpy(addr, &realaddr6, *addr_len);
@@ -395,12 +445,13 @@ static ssize_t net_udp_recvfrom(net_socket_t *hnd, void *buffer, size_t length,
 
     /* Remove the packet if we're pulling data out of the queue. */
     if(!(flags & MSG_PEEK)) {
-        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt->data);
-        free(pkt);
+        old = irq_disable();
+        TAILQ_REMOVE(&udpsock->packets, pkt, queue);
+        irq_restore(old);
+        net_pbuf_free(pkt);
     }
 
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&udpsock->mutex);
 
     return length;
 }
@@ -418,16 +469,9 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
 
     (void)flags;
 
-    if(mutex_lock_irqsafe(&udp_mutex))
+    if(!(udpsock = udp_lock_and_get_sock(hnd)))
         return -1;
 
-    udpsock = (struct udp_sock *)hnd->data;
-
-    if(udpsock == NULL) {
-        errno = EBADF;
-        goto err;
-    }
-
     if(udpsock->flags & (SHUT_WR << 24)) {
         errno = EPIPE;
         goto err;
@@ -484,22 +528,8 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
     }
 
     if(udpsock->local_addr.sin6_port == 0) {
-        uint16_t port = 1024, tmp = 0;
-        struct udp_sock *iter;
-
-        /* Grab the first unused port >= 1024. This is, unfortunately, O(n^2) */
-        while(tmp != port) {
-            tmp = port;
-
-            LIST_FOREACH(iter, &net_udp_sockets, sock_list) {
-                if(iter->local_addr.sin6_port == port) {
-                    ++port;
-                    break;
-                }
-            }
-        }
-
-        udpsock->local_addr.sin6_port = htons(port);
+        irq_disable_scoped();
+        udp_set_port(udpsock, udp_ephemeral_port());
     }
 
     local_addr = udpsock->local_addr;
@@ -509,39 +539,31 @@ static ssize_t net_udp_sendto(net_socket_t *hnd, const void *message,
     proto = udpsock->proto;
     tos = udpsock->tos;
     cscov = udpsock->udp_lite.send_cscov;
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&udpsock->mutex);
 
     return net_udp_send_raw(NULL, &local_addr, &realaddr6,
                             (const uint8_t *)message, length, sflags, hops, tos,
                             iflags, proto, cscov);
 err:
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&udpsock->mutex);
     return -1;
 }
 
 static int net_udp_shutdownsock(net_socket_t *hnd, int how) {
     struct udp_sock *udpsock;
 
-    if(mutex_lock_irqsafe(&udp_mutex))
+    if(!(udpsock = udp_lock_and_get_sock(hnd)))
         return -1;
 
-    udpsock = (struct udp_sock *)hnd->data;
-
-    if(udpsock == NULL) {
-        mutex_unlock(&udp_mutex);
-        errno = EBADF;
-        return -1;
-    }
-
     if(how & 0xFFFFFFFC) {
-        mutex_unlock(&udp_mutex);
+        mutex_unlock(&udpsock->mutex);
         errno = EINVAL;
         return -1;
     }
 
     udpsock->flags |= (how << 24);
 
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&udpsock->mutex);
 
     return 0;
 }
@@ -569,53 +591,52 @@ static int net_udp_socket(net_socket_t *hnd, int domain, int type, int proto) {
     }
 
     memset(udpsock, 0, sizeof(struct udp_sock));
-    TAILQ_INIT(&udpsock->packets);
-    udpsock->domain = domain;
-    udpsock->proto = proto;
-    udpsock->hop_limit = UDP_DEFAULT_HOPS;
 
-    if(mutex_lock_irqsafe(&udp_mutex)) {
+    if(mutex_init(&udpsock->mutex, MUTEX_TYPE_NORMAL)) {
         free(udpsock);
+        errno = ENOMEM;
         return -1;
     }
 
-    LIST_INSERT_HEAD(&net_udp_sockets, udpsock, sock_list);
+    TAILQ_INIT(&udpsock->packets);
+    udpsock->domain = domain;
+    udpsock->proto = proto;
+    udpsock->hop_limit = UDP_DEFAULT_HOPS;
     hnd->data = udpsock;
-    mutex_unlock(&udp_mutex);
+
+    irq_disable_scoped();
+    LIST_INSERT_HEAD(&net_udp_sockets, udpsock, sock_list);
 
     return 0;
 }
 
 static void net_udp_close(net_socket_t *hnd) {
     struct udp_sock *udpsock;
-    struct udp_pkt *pkt;
-    struct udp_pkt *it;
+    net_pbuf_t *pkt;
+    net_pbuf_t *it;
+    uint32_t old;
 
-    if(mutex_lock_irqsafe(&udp_mutex))
+    if(!(udpsock = udp_lock_and_get_sock(hnd)))
         return;
 
-    udpsock = (struct udp_sock *)hnd->data;
-
-    if(udpsock == NULL) {
-        mutex_unlock(&udp_mutex);
-        errno = EBADF;
-        return;
-    }
+    /* Once it's out of the port table, nothing else gets queued on it. */
+    old = irq_disable();
+    LIST_REMOVE(udpsock, sock_list);
+    udp_set_port(udpsock, 0);
+    irq_restore(old);
 
     it = udpsock->packets.tqh_first;
     while(it) {
         pkt = it;
-        it = it->pkt_queue.tqe_next;
+        it = it->queue.tqe_next;
 
-        free(pkt->data);
-        TAILQ_REMOVE(&udpsock->packets, pkt, pkt_queue);
-        free(pkt);
+        TAILQ_REMOVE(&udpsock->packets, pkt, queue);
+        net_pbuf_free(pkt);
     }
 
-    LIST_REMOVE(udpsock, sock_list);
-
+    mutex_unlock(&udpsock->mutex);
+    mutex_destroy(&udpsock->mutex);
     free(udpsock);
-    mutex_unlock(&udp_mutex);
 }
 
 static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
@@ -623,14 +644,8 @@ static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
     struct udp_sock *sock;
     int tmp;
 
-    if(mutex_lock_irqsafe(&udp_mutex))
-        return -1;
-
-    if(!(sock = (struct udp_sock *)hnd->data)) {
-        mutex_unlock(&udp_mutex);
-        errno = EBADF;
+    if(!(sock = udp_lock_and_get_sock(hnd)))
         return -1;
-    }
 
     switch(level) {
         case SOL_SOCKET:
@@ -713,12 +728,12 @@ static int net_udp_getsockopt(net_socket_t *hnd, int level, int option_name,
     }
 
     /* If it wasn't handled, return that error. */
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     errno = ENOPROTOOPT;
     return -1;
 
 ret_inval:
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     errno = EINVAL;
     return -1;
 
@@ -731,7 +746,7 @@ copy_int:
         memcpy(option_value, &tmp, *option_len);
     }
 
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     return 0;
 }
 
@@ -740,15 +755,9 @@ static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
     struct udp_sock *sock;
     int tmp;
 
-    if(mutex_lock_irqsafe(&udp_mutex))
+    if(!(sock = udp_lock_and_get_sock(hnd)))
         return -1;
 
-    if(!(sock = (struct udp_sock *)hnd->data)) {
-        mutex_unlock(&udp_mutex);
-        errno = EBADF;
-        return -1;
-    }
-
     switch(level) {
         case SOL_SOCKET:
             switch(option_name) {
@@ -896,17 +905,17 @@ static int net_udp_setsockopt(net_socket_t *hnd, int level, int option_name,
     }
 
     /* If it wasn't handled, return that error. */
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     errno = ENOPROTOOPT;
     return -1;
 
 ret_inval:
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     errno = EINVAL;
     return -1;
 
 ret_success:
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     return 0;
 }
 
@@ -921,15 +930,9 @@ static int net_udp_getsockname(net_socket_t *hnd, struct sockaddr *name,
         return -1;
     }
 
-    if(mutex_lock_irqsafe(&udp_mutex))
+    if(!(sock = udp_lock_and_get_sock(hnd)))
         return -1;
 
-    if(!(sock = (struct udp_sock *)hnd->data)) {
-        mutex_unlock(&udp_mutex);
-        errno = EBADF;
-        return -1;
-    }
-
     if(sock->domain == AF_INET) {
         memset(&realaddr, 0, sizeof(struct sockaddr_in));
         realaddr.sin_family = AF_INET;
@@ -966,12 +969,12 @@ static int net_udp_getsockname(net_socket_t *hnd, struct sockaddr *name,
         goto ret_success;
     }
 
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     errno = ENOTSOCK;
     return -1;
 
 ret_success:
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     return 0;
 }
 
@@ -985,20 +988,19 @@ static int net_udp_getpeername(net_socket_t *hnd, struct sockaddr *name, socklen
         return -1;
     }
 
-    if(mutex_lock_irqsafe(&udp_mutex)) {
-        errno = EWOULDBLOCK;
+    if(!(sock = (struct udp_sock *)hnd->data)) {
+        errno = EBADF;
         return -1;
     }
 
-    if(!(sock = (struct udp_sock *)hnd->data)) {
-        mutex_unlock(&udp_mutex);
-        errno = EBADF;
+    if(mutex_lock_irqsafe(&sock->mutex)) {
+        errno = EWOULDBLOCK;
         return -1;
     }
 
     /* If the socket is not connected, return an error */
     if(IN6_IS_ADDR_UNSPECIFIED(&sock->remote_addr.sin6_addr) || sock->remote_addr.sin6_port == 0) {
-        mutex_unlock(&udp_mutex);
+        mutex_unlock(&sock->mutex);
         errno = ENOTCONN;
         return -1;
     }
@@ -1036,12 +1038,12 @@ static int net_udp_getpeername(net_socket_t *hnd, struct sockaddr *name, socklen
         }
     }
 
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     errno = ENOTSOCK;
     return -1;
 
 ret_success:
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     return 0;
 }
 
@@ -1050,14 +1052,8 @@ static int net_udp_fcntl(net_socket_t *hnd, int cmd, va_list ap) {
     long val;
     int rv = -1;
 
-    if(mutex_lock_irqsafe(&udp_mutex))
-        return -1;
-
-    if(!(sock = (struct udp_sock *)hnd->data)) {
-        mutex_unlock(&udp_mutex);
-        errno = EBADF;
+    if(!(sock = udp_lock_and_get_sock(hnd)))
         return -1;
-    }
 
     switch(cmd) {
         case F_SETFL:
@@ -1088,7 +1084,7 @@ static int net_udp_fcntl(net_socket_t *hnd, int cmd, va_list ap) {
     errno = EINVAL;
 
 out:
-    mutex_unlock(&udp_mutex);
+    mutex_unlock(&sock->mutex);
     return rv;
 }
 
@@ -1096,19 +1092,13 @@ static short net_udp_poll(net_socket_t *hnd, short events) {
     struct udp_sock *sock;
     short rv = POLLWRNORM;
 
-    if(mutex_lock_irqsafe(&udp_mutex))
-        return 0;
-
-    if(!(sock = (struct udp_sock *)hnd->data)) {
-        mutex_unlock(&udp_mutex);
+    if(!(sock = (struct udp_sock *)hnd->data))
         return POLLNVAL;
-    }
 
+    /* This only peeks at the queue, so there's no need to lock anything. */
     if(!TAILQ_EMPTY(&sock->packets))
         rv |= POLLRDNORM;
 
-    mutex_unlock(&udp_mutex);
-
     return rv & events;
 }
 
@@ -1120,7 +1110,8 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
     uint16_t cs, cscov = 0;
     int partial = 1;
     struct udp_sock *sock;
-    struct udp_pkt *pkt;
+    net_pbuf_t *pkt;
+    uint32_t old;
 
     (void)src;
 
@@ -1173,11 +1164,9 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         }
     }
 
-    if(mutex_lock_irqsafe(&udp_mutex))
-        /* If the mutex is locked, there isn't much that can be done. */
-        return -1;
+    old = irq_disable();
 
-    LIST_FOREACH(sock, &net_udp_sockets, sock_list) {
+    LIST_FOREACH(sock, udp_port_bucket(hdr->dst_port), port_list) {
         /* Don't even bother looking at IPv6-only sockets */
         if(sock->domain == AF_INET6 && (sock->flags & FS_SOCKET_V6ONLY))
             continue;
@@ -1211,48 +1200,39 @@ static int net_udp_input4(netif_t *src, const ip_hdr_t *ip, const uint8_t *data,
         if((sock->int_flags & UDPSOCK_LITE_RCVCOV) && partial &&
            cscov < sock->udp_lite.recv_cscov) {
             /* Silently drop packets that fail the partial coverage check. */
-            mutex_unlock(&udp_mutex);
+            irq_restore(old);
             return 0;
         }
 
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
-            mutex_unlock(&udp_mutex);
+        if(!(pkt = net_pbuf_alloc(0, size - sizeof(udp_hdr_t)))) {
+            irq_restore(old);
             return -1;
         }
 
-        memset(pkt, 0, sizeof(struct udp_pkt));
-
-        pkt->datasize = size - sizeof(udp_hdr_t);
-
-        if(!(pkt->data = (uint8_t *)malloc(pkt->datasize))) {
-            free(pkt);
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
+        memset(UDP_PKT_FROM(pkt), 0, sizeof(struct sockaddr_in6));
+        UDP_PKT_FROM(pkt)->sin6_family = AF_INET6;
+        UDP_PKT_FROM(pkt)->sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
+        UDP_PKT_FROM(pkt)->sin6_addr.__s6_addr.__s6_addr32[3] = ip->src;
+        UDP_PKT_FROM(pkt)->sin6_port = hdr->src_port;
 
-        pkt->from.sin6_family = AF_INET6;
-        pkt->from.sin6_addr.__s6_addr.__s6_addr16[5] = 0xFFFF;
-        pkt->from.sin6_addr.__s6_addr.__s6_addr32[3] = ip->src;
-        pkt->from.sin6_port = hdr->src_port;
+        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->len);
 
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
-
-        TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
+        TAILQ_INSERT_TAIL(&sock->packets, pkt, queue);
 
         ++udp_stats.pkt_recv;
         genwait_wake_one(sock);
 
-        /* Fire poll wakeups after releasing udp_mutex to avoid the
-           poll-mutex / udp_mutex ABBA deadlock. */
+        /* Fire poll wakeups after turning IRQs back on, since the poll
+           code has a mutex of its own to take. */
         file_t poll_fd = sock->sock;
-        mutex_unlock(&udp_mutex);
+        irq_restore(old);
         __poll_event_trigger(poll_fd, POLLRDNORM);
 
         return 0;
     }
 
     ++udp_stats.pkt_recv_no_sock;
-    mutex_unlock(&udp_mutex);
+    irq_restore(old);
 
     return -1;
 }
@@ -1263,7 +1243,8 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
     uint16_t cs, cscov = 0;
     int partial = 1;
     struct udp_sock *sock;
-    struct udp_pkt *pkt;
+    net_pbuf_t *pkt;
+    uint32_t old;
 
     (void)src;
 
@@ -1314,11 +1295,9 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
         }
     }
 
-    if(mutex_lock_irqsafe(&udp_mutex))
-        /* If the mutex is locked, there isn't much that can be done. */
-        return -1;
+    old = irq_disable();
 
-    LIST_FOREACH(sock, &net_udp_sockets, sock_list) {
+    LIST_FOREACH(sock, udp_port_bucket(hdr->dst_port), port_list) {
         /* Don't even bother looking at IPv4 sockets */
         if(sock->domain == AF_INET)
             continue;
@@ -1352,47 +1331,38 @@ static int net_udp_input6(netif_t *src, const ipv6_hdr_t *ip, const uint8_t *dat
         if((sock->int_flags & UDPSOCK_LITE_RCVCOV) && partial &&
            cscov < sock->udp_lite.recv_cscov) {
             /* Silently drop packets that fail the partial coverage check. */
-            mutex_unlock(&udp_mutex);
+            irq_restore(old);
             return 0;
         }
 
-        if(!(pkt = (struct udp_pkt *)malloc(sizeof(struct udp_pkt)))) {
-            mutex_unlock(&udp_mutex);
+        if(!(pkt = net_pbuf_alloc(0, size - sizeof(udp_hdr_t)))) {
+            irq_restore(old);
             return -1;
         }
 
-        memset(pkt, 0, sizeof(struct udp_pkt));
+        memset(UDP_PKT_FROM(pkt), 0, sizeof(struct sockaddr_in6));
+        UDP_PKT_FROM(pkt)->sin6_family = AF_INET6;
+        UDP_PKT_FROM(pkt)->sin6_addr = ip->src_addr;
+        UDP_PKT_FROM(pkt)->sin6_port = hdr->src_port;
 
-        pkt->datasize = size - sizeof(udp_hdr_t);
+        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->len);
 
-        if(!(pkt->data = (uint8_t *)malloc(pkt->datasize))) {
-            free(pkt);
-            mutex_unlock(&udp_mutex);
-            return -1;
-        }
-
-        pkt->from.sin6_family = AF_INET6;
-        pkt->from.sin6_addr = ip->src_addr;
-        pkt->from.sin6_port = hdr->src_port;
-
-        memcpy(pkt->data, data + sizeof(udp_hdr_t), pkt->datasize);
-
-        TAILQ_INSERT_TAIL(&sock->packets, pkt, pkt_queue);
+        TAILQ_INSERT_TAIL(&sock->packets, pkt, queue);
 
         ++udp_stats.pkt_recv;
         genwait_wake_one(sock);
 
-        /* Fire poll wakeups after releasing udp_mutex to avoid the
-           poll-mutex / udp_mutex ABBA deadlock. */
+        /* Fire poll wakeups after turning IRQs back on, since the poll
+           code has a mutex of its own to take. */
         file_t poll_fd = sock->sock;
-        mutex_unlock(&udp_mutex);
+        irq_restore(old);
         __poll_event_trigger(poll_fd, POLLRDNORM);
 
         return 0;
     }
 
     ++udp_stats.pkt_recv_no_sock;
-    mutex_unlock(&udp_mutex);
+    irq_restore(old);
 
     return -1;
 }
@@ -1415,8 +1385,9 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
                             const struct sockaddr_in6 *dst, const uint8_t *data,
                             size_t size, uint32_t flags, int hops, int tos,
                             uint32_t iflags, int proto, uint16_t cscov) {
-    uint8_t buf[size + sizeof(udp_hdr_t)];
-    udp_hdr_t *hdr = (udp_hdr_t *)buf;
+    net_pbuf_t *pb;
+    uint8_t *buf;
+    udp_hdr_t *hdr;
     uint16_t cs;
     int err;
     struct in6_addr srcaddr = src->sin6_addr;
@@ -1459,6 +1430,17 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
         }
     }
 
+    /* Build the datagram with room in front for the IPv4 and ethernet headers,
+       so that the IPv4 code can send it without copying it again. */
+    if(!(pb = net_pbuf_alloc(NET_IPV4_FRAME_HDR_SIZE,
+                             size + sizeof(udp_hdr_t)))) {
+        ++udp_stats.pkt_send_failed;
+        return -1;
+    }
+
+    buf = pb->data;
+    hdr = (udp_hdr_t *)buf;
+
     memcpy(buf + sizeof(udp_hdr_t), data, size);
     size += sizeof(udp_hdr_t);
 
@@ -1490,8 +1472,16 @@ static int net_udp_send_raw(netif_t *net, const struct sockaddr_in6 *src,
     }
 
     /* Pass everything off to the network layer to do the rest. */
-    err = net_ipv6_send(net, buf, size, hops, tos, proto, &srcaddr,
-                        &dst->sin6_addr);
+    if(IN6_IS_ADDR_V4MAPPED(&srcaddr) && IN6_IS_ADDR_V4MAPPED(&dst->sin6_addr))
+        err = net_ipv4_send_inplace(net, buf - NET_IPV4_FRAME_HDR_SIZE, size,
+                                    -1, hops, tos, proto,
+                                    srcaddr.__s6_addr.__s6_addr32[3],
+                                    dst->sin6_addr.__s6_addr.__s6_addr32[3]);
+    else
+        err = net_ipv6_send(net, buf, size, hops, tos, proto, &srcaddr,
+                            &dst->sin6_addr);
+
+    net_pbuf_free(pb);
 
     if(err < 0) {
         ++udp_stats.pkt_send_failed;
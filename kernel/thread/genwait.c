@@ -17,59 +17,75 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <errno.h>
 
 #include <kos/timer.h>
 #include <kos/dbglog.h>
 #include <kos/genwait.h>
+#include <kos/intmath.h>
 #include <kos/sem.h>
 
-/* Our sleep queues table. This is also modeled after the BSD numbers. I
-   figure if they've been using it as long as they have, they must be
-   on to something. :) */
-#define TABLESIZE   128
-static TAILQ_HEAD(slpquehead, kthread) slpque[TABLESIZE];
-#define LOOKUP(x)   (((uintptr_t)(x) >> 8) & (TABLESIZE - 1))
+#include "timerq.h"
+
+/* Our sleep queues table. The default size is also modeled after the BSD
+   numbers. I figure if they've been using it as long as they have, they must
+   be on to something. :) It can be resized at runtime with
+   genwait_set_table_size(), in which case it is dynamically allocated. */
+TAILQ_HEAD(slpquehead, kthread);
+static struct slpquehead slpque_default[GENWAIT_TABLE_SIZE_DEFAULT];
+static struct slpquehead *slpque = slpque_default;
+static size_t slpque_size = GENWAIT_TABLE_SIZE_DEFAULT;
+static unsigned int slpque_bits;
+
+/* Objects are hashed with a multiplicative (Fibonacci) hash, so that the
+   bucket depends on all of the address bits. Wait objects are often close
+   together in memory (e.g. an array of mutexes in a structure), and simply
+   using a few bits of the address made them all land in the same bucket. */
+#define LOOKUP(x)   (((uint32_t)(uintptr_t)(x) * 0x9e3779b1u) >> (32 - slpque_bits))
+
+/* Statistics, see genwait_get_stats(). */
+static size_t stat_waiters;
+static uint64_t stat_wake_calls;
+static uint64_t stat_wake_scanned;
+static uint64_t stat_wake_woken;
 
 /* Timed event queue. Anything that isn't ready to run yet, but will be
    ready to run at a later time will be placed here. Note that this doesn't
    deal with pre-emptive timeslice context switching, only things that are
    specifically blocked for a timed event (thd_sleep, genwait_wait, etc).
-   This queue is sorted by remaining time (smallest at the front). */
-static struct ktqueue timer_queue;
 
-/* Internal function to insert a thread on the timer queue. Maintains
-   sorting order by wait time. */
-static void __nonnull_all tq_insert(kthread_t *thd) {
+   This is a timer queue (see timerq.h), whose root is the next thread to
+   time out. */
+static timerq_t timer_queue = TIMERQ_INITIALIZER(timerq_thd_timeout);
+
+/* Returns the top thread on the timer queue (next event). If nothing is
+   queued, we'll return NULL. */
+static inline kthread_t *tq_next(void) {
+    return timerq_thd_first(&timer_queue);
+}
+
+/* Insert a thread in the sleep queue of its wait object, sorted by
+   priority. */
+static void __nonnull_all slpque_insert(kthread_t *thd) {
+    struct slpquehead *queue = &slpque[LOOKUP(thd->wait_obj)];
     kthread_t *t;
 
-    /* Search for its place; note that new threads will be placed at
-       the end of a group with the same timeout. */
-    TAILQ_FOREACH_REVERSE(t, &timer_queue, slpquehead, timerq) {
-        if(thd->wait_timeout >= t->wait_timeout) {
-            TAILQ_INSERT_AFTER(&timer_queue, t, thd, timerq);
+    /* Go through and find where to insert */
+    TAILQ_FOREACH(t, queue, thdq) {
+        if(thd->prio < t->prio) {
+            TAILQ_INSERT_BEFORE(t, thd, thdq);
             return;
         }
     }
 
-    /* Couldn't find anything scheduled earlier, put this at the start. */
-    TAILQ_INSERT_HEAD(&timer_queue, thd, timerq);
-}
-
-/* Internal function to remove a thread from the timer queue. */
-static void __nonnull_all tq_remove(kthread_t *thd) {
-    TAILQ_REMOVE(&timer_queue, thd, timerq);
-}
-
-/* Returns the top thread on the timer queue (next event). If nothing is
-   queued, we'll return NULL. */
-static kthread_t *tq_next(void) {
-    return TAILQ_FIRST(&timer_queue);
+    /* We got to the end of the list, so insert at end */
+    TAILQ_INSERT_TAIL(queue, thd, thdq);
 }
 
 int genwait_wait(void *obj, const char *mesg, unsigned int timeout) {
-    kthread_t   *me, *t;
+    kthread_t   *me;
 
     assert(!irq_inside_int());
 
@@ -84,22 +100,13 @@ int genwait_wait(void *obj, const char *mesg, unsigned int timeout) {
     if(timeout > 0) {
         /* If we have a timeout, insert us on the timer queue. */
         me->wait_timeout = timer_ms_gettime64() + timeout;
-        tq_insert(me);
+        timerq_insert(&timer_queue, &me->timerq);
     }
     else
         me->wait_timeout = 0;
 
-    /* Go through and find where to insert */
-    TAILQ_FOREACH(t, &slpque[LOOKUP(obj)], thdq) {
-        if(me->prio < t->prio) {
-            TAILQ_INSERT_BEFORE(t, me, thdq);
-            break;
-        }
-    }
-
-    /* We got to the end of the list, so insert at end */
-    if(!t)
-        TAILQ_INSERT_TAIL(&slpque[LOOKUP(obj)], me, thdq);
+    stat_waiters++;
+    slpque_insert(me);
 
     /* Block us until we're signaled */
     return thd_block_now(&me->context);
@@ -119,10 +126,11 @@ static void __nonnull_all genwait_unqueue(kthread_t *thd, int err) {
 
     /* Remove it from the queue */
     TAILQ_REMOVE(&slpque[LOOKUP(thd->wait_obj)], thd, thdq);
+    stat_waiters--;
 
     /* Also remove it from the timer queue if applicable */
     if(thd->wait_timeout)
-        tq_remove(thd);
+        timerq_remove(&timer_queue, &thd->timerq);
 
     /* Clean up wait stuff */
     thd->wait_obj = NULL;
@@ -141,12 +149,17 @@ static int genwait_wake_thd_cnt(const void *obj, int cntmax, kthread_t *thd, int
     /* Twiddle interrupt state */
     irq_disable_scoped();
 
+    stat_wake_calls++;
+
     /* Go through and find any matching entries */
     TAILQ_FOREACH_SAFE(t, &slpque[LOOKUP(obj)], thdq, nt) {
+        stat_wake_scanned++;
+
         /* Is this thread a match? */
         if(t->wait_obj == obj && (!thd || t == thd)) {
             /* Yes, remove it from the wait queue */
             genwait_unqueue(t, err);
+            stat_wake_woken++;
 
             /* Check to see if we've filled our quota */
             if(cntmax > 0) {
@@ -208,11 +221,116 @@ uint64_t genwait_next_timeout(void) {
         return t->wait_timeout;
 }
 
+int genwait_set_table_size(size_t size) {
+    struct slpquehead *table, *old;
+    size_t i, old_size;
+    kthread_t *t;
+
+    if(size < 2 || !is_power_of_two(size) || size > GENWAIT_TABLE_SIZE_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(size == GENWAIT_TABLE_SIZE_DEFAULT) {
+        table = slpque_default;
+    }
+    else {
+        table = malloc(size * sizeof(*table));
+
+        if(!table) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    irq_disable_scoped();
+
+    if(table == slpque)
+        return 0;
+
+    old = slpque;
+    old_size = slpque_size;
+
+    for(i = 0; i < size; i++)
+        TAILQ_INIT(&table[i]);
+
+    slpque = table;
+    slpque_size = size;
+    slpque_bits = log2_rdown(size);
+
+    /* Move the sleeping threads over to the new table. */
+    for(i = 0; i < old_size; i++) {
+        while((t = TAILQ_FIRST(&old[i]))) {
+            TAILQ_REMOVE(&old[i], t, thdq);
+            slpque_insert(t);
+        }
+    }
+
+    if(old != slpque_default)
+        free(old);
+
+    return 0;
+}
+
+size_t genwait_get_table_size(void) {
+    return slpque_size;
+}
+
+size_t genwait_get_stats(genwait_stats_t *stats, size_t *occupancy,
+                         size_t count) {
+    size_t i, chain;
+    kthread_t *t;
+
+    irq_disable_scoped();
+
+    if(stats) {
+        stats->table_size = slpque_size;
+        stats->waiters = stat_waiters;
+        stats->used_buckets = 0;
+        stats->max_chain = 0;
+        stats->wake_calls = stat_wake_calls;
+        stats->wake_scanned = stat_wake_scanned;
+        stats->wake_woken = stat_wake_woken;
+    }
+
+    for(i = 0; i < slpque_size; i++) {
+        chain = 0;
+
+        TAILQ_FOREACH(t, &slpque[i], thdq)
+            chain++;
+
+        if(occupancy && i < count)
+            occupancy[i] = chain;
+
+        if(stats && chain) {
+            stats->used_buckets++;
+
+            if(chain > stats->max_chain)
+                stats->max_chain = chain;
+        }
+    }
+
+    return slpque_size;
+}
+
+void genwait_reset_stats(void) {
+    irq_disable_scoped();
+
+    stat_wake_calls = 0;
+    stat_wake_scanned = 0;
+    stat_wake_woken = 0;
+}
+
 int genwait_init(void) {
-    for(size_t i = 0; i < TABLESIZE; i++)
+    slpque_bits = log2_rdown(slpque_size);
+
+    for(size_t i = 0; i < slpque_size; i++)
         TAILQ_INIT(&slpque[i]);
 
-    TAILQ_INIT(&timer_queue);
+    stat_waiters = 0;
+    genwait_reset_stats();
+
+    timerq_init(&timer_queue, timerq_thd_timeout);
     return 0;
 }
 
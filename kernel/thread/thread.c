@@ -33,6 +33,8 @@
 #include <arch/stack.h>
 #include <arch/tls_static.h>
 
+#include "timerq.h"
+
 /*
 
 This module supports thread scheduling in KOS. The timer interrupt is used
@@ -68,13 +70,60 @@ static unsigned int thd_ageing_ms_log2;
 static struct ktlist thd_list;
 
 /* Run queue. This is more like on a standard time sharing system than the
-   previous versions. The top element of this priority queue should be the
-   thread that is ready to run next. When a thread is scheduled, it will be
-   removed from this queue. When it's de-scheduled, it will be re-inserted
-   by its priority value at the end of its priority group. Note that right
-   now this condition is being broken because sleeping threads are on the
-   same queue. We deal with those in thd_switch below. */
-static struct ktqueue run_queue;
+   previous versions. Runnable threads are kept in an array of buckets indexed
+   by their effective priority, with a bitmap of the non-empty buckets, so that
+   finding the next thread is a constant-time operation. The lowest priority
+   values (which include PRIO_DEFAULT) each get their own bucket, in which
+   threads are kept in round-robin order, so enqueueing them is constant-time
+   too. Higher values share logarithmically sized buckets which are kept
+   sorted by priority, so enqueueing one of those threads is linear in the
+   number of threads sharing its bucket. The last bucket is reserved for the
+   idle thread. When a thread is scheduled, it will be removed from its
+   bucket. When it's de-scheduled, it will be re-inserted at the end of its
+   priority group. Only ready threads are kept in the run queue. */
+#define THD_RUNQ_BUCKETS    32
+#define THD_RUNQ_EXACT      24
+
+static struct ktqueue run_queue[THD_RUNQ_BUCKETS];
+
+/* Bitmap of the non-empty run queue buckets. */
+static uint32_t run_queue_mask;
+
+/* Time of the last scheduler pass, used to compute the effective priority of
+   threads being enqueued without reading the timer again. */
+static uint32_t thd_sched_now;
+
+/* Time at which the queued threads' priorities will next be re-evaluated. */
+static uint32_t thd_rebalance_next;
+
+/* Poll queue. Threads in the STATE_POLLING state are kept here rather than in
+   the run queue, so that the scheduler doesn't have to skip them when looking
+   for a thread to run. Threads sharing the same poll callback are kept next to
+   each other. The queue is rotated as the callbacks are evaluated, so that
+   when more threads are polling than can be evaluated in a single pass, the
+   next pass resumes where the previous one stopped. */
+static struct ktqueue poll_queue;
+
+/* Polling threads that have a timeout are also kept in a timer queue (see
+   timerq.h), so that finding the ones that timed out doesn't require going
+   through all of them. */
+static timerq_t poll_timer_queue = TIMERQ_INITIALIZER(timerq_thd_timeout);
+
+/* Set when the scheduler timer has been programmed for more than one tick,
+   because only the idle thread is runnable. */
+static bool thd_tickless;
+
+/* Maximum number of scheduler ticks skipped while the idle thread runs.
+   This bounds the latency of a thread woken up by an interrupt handler that
+   doesn't reschedule, if the interrupt hits right before the idle thread
+   enters sleep mode. */
+#define THD_IDLE_MAX_TICKS  16
+
+/* Number of threads in the poll queue. */
+static size_t thd_poll_count;
+
+/* Maximum number of poll callbacks evaluated per scheduler pass. */
+#define THD_POLL_BUDGET     16
 
 /* The currently executing thread. This thread should not be on any queues. */
 kthread_t *thd_current = NULL;
@@ -171,12 +220,11 @@ int thd_pslist(int (*pf)(const char *fmt, ...)) {
     return 0;
 }
 
-int thd_pslist_queue(int (*pf)(const char *fmt, ...)) {
+static void thd_pslist_queue_one(int (*pf)(const char *fmt, ...),
+                                 const struct ktqueue *queue) {
     kthread_t *cur;
 
-    pf("Queued threads:\n");
-    pf("addr\t\ttid\tprio\tflags\twait_timeout\tstate     name\n");
-    TAILQ_FOREACH(cur, &run_queue, thdq) {
+    TAILQ_FOREACH(cur, queue, thdq) {
         pf("%08lx\t", CONTEXT_PC(cur->context));
         pf("%d\t", cur->tid);
 
@@ -190,6 +238,19 @@ int thd_pslist_queue(int (*pf)(const char *fmt, ...)) {
         pf("%10s", thd_state_to_str(cur));
         pf("%s\n", cur->label);
     }
+}
+
+int thd_pslist_queue(int (*pf)(const char *fmt, ...)) {
+    unsigned int i;
+
+    pf("Queued threads:\n");
+    pf("addr\t\ttid\tprio\tflags\twait_timeout\tstate     name\n");
+
+    for(i = 0; i < THD_RUNQ_BUCKETS; i++)
+        thd_pslist_queue_one(pf, &run_queue[i]);
+
+    pf("Polling threads:\n");
+    thd_pslist_queue_one(pf, &poll_queue);
 
     return 0;
 }
@@ -197,22 +258,79 @@ int thd_pslist_queue(int (*pf)(const char *fmt, ...)) {
 /*****************************************************************************/
 /* Returns a fresh thread ID for each new thread */
 
-/* Highest thread id (used when assigning next thread id) */
+/* Thread IDs are allocated in the range [1, THD_TID_MAX]. Once the upper
+   bound is reached, the allocation wraps around and the IDs of the threads
+   which have been destroyed in the meantime are reused. */
+#define THD_TID_MAX         0xffff
+
+/* Thread ID hash table. As thread IDs are allocated sequentially, the low bits
+   of the ID are used directly as the hash. The table starts out with
+   THD_TID_HASH_MIN buckets and doubles whenever there are more than twice as
+   many threads as buckets, so that the chains stay short. Sizes are always
+   powers of two. */
+#define THD_TID_HASH_MIN    64
+
+static struct ktlist thd_tid_hash_min[THD_TID_HASH_MIN];
+static struct ktlist *thd_tid_hash = thd_tid_hash_min;
+static size_t thd_tid_hash_size = THD_TID_HASH_MIN;
+
+/* Next thread id to try (used when assigning next thread id) */
 static tid_t tid_highest;
 
-/* Return the next available thread id (assumes wraparound will not run
-   into old processes). */
-static tid_t thd_next_free(void) {
-    int id;
-    id = tid_highest++;
-    return id;
+static inline struct ktlist *thd_tid_bucket(tid_t tid) {
+    return &thd_tid_hash[tid & (thd_tid_hash_size - 1)];
+}
+
+/* Doubles the size of the thread ID hash table and rehashes every thread into
+   it. If the allocation fails, the old table is kept: lookups get slower but
+   still work, and growing is tried again on the next thread creation. */
+static void thd_tid_hash_grow(void) {
+    struct ktlist *old = thd_tid_hash;
+    size_t i, old_size = thd_tid_hash_size;
+    struct ktlist *tbl;
+    kthread_t *cur, *tmp;
+
+    tbl = malloc(old_size * 2 * sizeof(struct ktlist));
+
+    if(!tbl)
+        return;
+
+    thd_tid_hash = tbl;
+    thd_tid_hash_size = old_size * 2;
+
+    for(i = 0; i < thd_tid_hash_size; i++)
+        LIST_INIT(&tbl[i]);
+
+    for(i = 0; i < old_size; i++) {
+        LIST_FOREACH_SAFE(cur, &old[i], tid_hash, tmp) {
+            LIST_REMOVE(cur, tid_hash);
+            LIST_INSERT_HEAD(thd_tid_bucket(cur->tid), cur, tid_hash);
+        }
+    }
+
+    if(old != thd_tid_hash_min)
+        free(old);
+}
+
+/* Empties the thread ID hash table and shrinks it back to its initial size. */
+static void thd_tid_hash_reset(void) {
+    size_t i;
+
+    if(thd_tid_hash != thd_tid_hash_min)
+        free(thd_tid_hash);
+
+    thd_tid_hash = thd_tid_hash_min;
+    thd_tid_hash_size = THD_TID_HASH_MIN;
+
+    for(i = 0; i < THD_TID_HASH_MIN; i++)
+        LIST_INIT(&thd_tid_hash[i]);
 }
 
 /* Given a thread ID, locates the thread structure */
 kthread_t *thd_by_tid(tid_t tid) {
     kthread_t *np;
 
-    LIST_FOREACH(np, &thd_list, t_list) {
+    LIST_FOREACH(np, thd_tid_bucket(tid), tid_hash) {
         if(np->tid == tid)
             return np;
     }
@@ -220,18 +338,31 @@ kthread_t *thd_by_tid(tid_t tid) {
     return NULL;
 }
 
+/* Return the next available thread id, skipping over the ones still in use
+   after a wraparound. Returns -1 if all thread ids are in use. */
+static tid_t thd_next_free(void) {
+    tid_t id;
 
-static bool thd_has_polls(void) {
-    kthread_t *thd;
+    if(thd_count >= THD_TID_MAX)
+        return -1;
 
-    irq_disable_scoped();
+    do {
+        id = tid_highest;
 
-    TAILQ_FOREACH(thd, &run_queue, thdq) {
-        if(thd->state == STATE_POLLING)
-            return true;
-    }
+        if(++tid_highest > THD_TID_MAX)
+            tid_highest = 1;
+    } while(thd_by_tid(id));
+
+    return id;
+}
 
-    return false;
+
+static bool thd_has_polls(void) {
+    return thd_poll_count != 0;
+}
+
+static bool thd_has_ready(void) {
+    return run_queue_mask != 0;
 }
 
 /*****************************************************************************/
@@ -250,8 +381,10 @@ static void *thd_idle_task(void *param) {
     (void)param;
 
     for(;;) {
-        if(thd_has_polls())
-            thd_pass();     /* If some threads are polling, reschedule */
+        /* If some threads are polling, or if an interrupt made a thread
+           runnable while we were sleeping, reschedule */
+        if(thd_has_polls() || thd_has_ready())
+            thd_pass();
         else
             arch_sleep();   /* We can safely enter sleep mode here */
     }
@@ -333,60 +466,207 @@ void thd_exit(void *rv) {
 /*****************************************************************************/
 /* Thread creation and deletion */
 
+static inline prio_t thd_calc_prio(const kthread_t *thd, uint32_t now) {
+    prio_t prio = thd->prio;
+    uint32_t shift;
+
+    if(__predict_true(prio < PRIO_MAX)) {
+        shift = (now - (uint32_t)thd->cpu_time.scheduled) >> thd_ageing_ms_log2;
+        prio = shift < 32 ? prio >> shift : 0;
+    }
+
+    return prio;
+}
+
+/* Returns the run queue bucket for a given effective priority */
+static inline unsigned int thd_runq_bucket(prio_t prio) {
+    unsigned int bucket;
+
+    if(prio < THD_RUNQ_EXACT)
+        return prio > 0 ? prio : 0;
+
+    if(prio > PRIO_MAX)
+        return THD_RUNQ_BUCKETS - 1;
+
+    bucket = THD_RUNQ_EXACT - log2_rdown(THD_RUNQ_EXACT) + log2_rdown(prio);
+
+    if(bucket > THD_RUNQ_BUCKETS - 2)
+        bucket = THD_RUNQ_BUCKETS - 2;
+
+    return bucket;
+}
+
 /* Enqueue a process in the runnable queue; adds it right after the
    process group of the same priority (front_of_line==0) or
    right before the process group of the same priority (front_of_line!=0).
    See thd_schedule for why this is helpful. */
 void thd_add_to_runnable(kthread_t *t, bool front_of_line) {
+    struct ktqueue *queue;
+    unsigned int bucket;
     kthread_t *i;
-    int done;
 
     if(t->flags & THD_QUEUED)
         return;
 
-    done = 0;
+    t->sched_prio = thd_calc_prio(t, thd_sched_now);
+    bucket = thd_runq_bucket(t->sched_prio);
+    queue = &run_queue[bucket];
 
-    if(!front_of_line) {
-        /* Look for a thread of lower priority and insert
-           before it. If there is nothing on the run queue, we'll
-           fall through to the bottom. */
-        TAILQ_FOREACH(i, &run_queue, thdq) {
-            if(i->prio > t->prio) {
-                TAILQ_INSERT_BEFORE(i, t, thdq);
-                done = 1;
-                break;
-            }
-        }
+    if(bucket < THD_RUNQ_EXACT) {
+        /* Every thread in this bucket has the same priority. */
+        if(front_of_line)
+            TAILQ_INSERT_HEAD(queue, t, thdq);
+        else
+            TAILQ_INSERT_TAIL(queue, t, thdq);
     }
     else {
-        /* Look for a thread of the same or lower priority and
-           insert before it. If there is nothing on the run queue,
-           we'll fall through to the bottom. */
-        TAILQ_FOREACH(i, &run_queue, thdq) {
-            if(i->prio >= t->prio) {
-                TAILQ_INSERT_BEFORE(i, t, thdq);
-                done = 1;
+        /* Shared bucket: look for a thread of lower priority (or of the
+           same or lower priority, if front_of_line is set) and insert
+           before it. If there is none, we'll fall through to the bottom.
+           This is the only part of the run queue that isn't constant-time. */
+        TAILQ_FOREACH(i, queue, thdq) {
+            if(i->sched_prio > t->sched_prio ||
+               (front_of_line && i->sched_prio == t->sched_prio))
                 break;
-            }
         }
-    }
 
-    /* Didn't find one, put it at the end */
-    if(!done)
-        TAILQ_INSERT_TAIL(&run_queue, t, thdq);
+        if(i)
+            TAILQ_INSERT_BEFORE(i, t, thdq);
+        else
+            TAILQ_INSERT_TAIL(queue, t, thdq);
+    }
 
+    run_queue_mask |= 1u << bucket;
     t->flags |= THD_QUEUED;
 }
 
 /* Removes a thread from the runnable queue, if it's there. */
 int thd_remove_from_runnable(kthread_t *thd) {
+    unsigned int bucket;
+
     if(!(thd->flags & THD_QUEUED)) return 0;
 
+    bucket = thd_runq_bucket(thd->sched_prio);
+
     thd->flags &= ~THD_QUEUED;
-    TAILQ_REMOVE(&run_queue, thd, thdq);
+    TAILQ_REMOVE(&run_queue[bucket], thd, thdq);
+
+    if(TAILQ_EMPTY(&run_queue[bucket]))
+        run_queue_mask &= ~(1u << bucket);
+
     return 0;
 }
 
+/* Returns the first thread of the highest priority bucket */
+static inline kthread_t *thd_runq_first(void) {
+    if(!run_queue_mask)
+        return NULL;
+
+    return TAILQ_FIRST(&run_queue[__builtin_ctz(run_queue_mask)]);
+}
+
+/* Apply ageing to the queued threads: any thread whose effective priority
+   improved since it was enqueued is moved to its new bucket. Threads in the
+   first bucket cannot improve, and the idle thread never ages. */
+static void thd_runq_rebalance(void) {
+    kthread_t *thd, *tmp;
+    unsigned int i;
+
+    for(i = 1; i < THD_RUNQ_BUCKETS - 1; i++) {
+        if(!(run_queue_mask & (1u << i)))
+            continue;
+
+        TAILQ_FOREACH_SAFE(thd, &run_queue[i], thdq, tmp) {
+            if(thd_calc_prio(thd, thd_sched_now) < thd->sched_prio) {
+                thd_remove_from_runnable(thd);
+                thd_add_to_runnable(thd, false);
+            }
+        }
+    }
+}
+
+/* Adds a thread to the poll queue, right after the other threads polling
+   with the same callback if there are any. */
+static void thd_poll_add(kthread_t *thd) {
+    kthread_t *i, *last = NULL;
+
+    TAILQ_FOREACH(i, &poll_queue, thdq) {
+        if(i->poll_cb == thd->poll_cb)
+            last = i;
+        else if(last)
+            break;
+    }
+
+    if(last)
+        TAILQ_INSERT_AFTER(&poll_queue, last, thd, thdq);
+    else
+        TAILQ_INSERT_TAIL(&poll_queue, thd, thdq);
+
+    if(thd->wait_timeout)
+        timerq_insert(&poll_timer_queue, &thd->timerq);
+
+    thd_poll_count++;
+}
+
+/* Removes a thread from the poll queue (and from the poll timer queue, if it
+   has a timeout). */
+static void thd_poll_remove(kthread_t *thd) {
+    TAILQ_REMOVE(&poll_queue, thd, thdq);
+    thd_poll_count--;
+
+    if(thd->wait_timeout) {
+        timerq_remove(&poll_timer_queue, &thd->timerq);
+        thd->wait_timeout = 0;
+    }
+}
+
+/* Removes a thread from the poll queue and makes it runnable again, with the
+   given return value for thd_poll(). */
+static void thd_poll_wake(kthread_t *thd, int ret) {
+    thd_poll_remove(thd);
+
+    thd->state = STATE_READY;
+    CONTEXT_RET(thd->context) = ret;
+    thd_add_to_runnable(thd, false);
+}
+
+/* Evaluate the poll callbacks of the polling threads. The ones that timed out
+   are woken up first, in the order of their timeouts. Then at most
+   THD_POLL_BUDGET callbacks are called; the threads that were evaluated
+   without success are moved to the back of the queue, so that the next pass
+   starts with the ones that were not. */
+static void thd_check_polls(uint64_t now) {
+    unsigned int budget = THD_POLL_BUDGET;
+    kthread_t *thd;
+    size_t count;
+    int ret;
+
+    while((thd = timerq_thd_first(&poll_timer_queue)) &&
+          thd->wait_timeout < now)
+        thd_poll_wake(thd, 0);
+
+    /* Each thread is evaluated at most once per pass, even if it goes back
+       in the queue. */
+    count = thd_poll_count;
+
+    while(count-- && budget--) {
+        thd = TAILQ_FIRST(&poll_queue);
+
+        if(!thd)
+            break;
+
+        ret = thd->poll_cb(thd->wait_obj);
+
+        if(ret) {
+            thd_poll_wake(thd, ret);
+        }
+        else {
+            TAILQ_REMOVE(&poll_queue, thd, thdq);
+            TAILQ_INSERT_TAIL(&poll_queue, thd, thdq);
+        }
+    }
+}
+
 /* New thread function; given a routine address, it will create a
    new thread with the given attributes. When the routine returns,
    the thread will exit. Returns the new thread struct.
@@ -421,7 +701,11 @@ kthread_t *thd_create_ex(const kthread_attr_t *restrict attr,
     /* Get a new thread id */
     tid = thd_next_free();
 
-    if(tid >= 0) {
+    if(tid < 0) {
+        errno = EAGAIN;
+        return NULL;
+    }
+    else {
         /* Create a new thread structure */
         nt = aligned_alloc(32, sizeof(kthread_t));
 
@@ -504,12 +788,16 @@ kthread_t *thd_create_ex(const kthread_attr_t *restrict attr,
             /* Initialize thread-local storage. */
             LIST_INIT(&nt->tls_list);
 
-            /* Insert it into the thread list */
+            /* Insert it into the thread list and the thread ID hash */
             LIST_INSERT_HEAD(&thd_list, nt, t_list);
+            LIST_INSERT_HEAD(thd_tid_bucket(tid), nt, tid_hash);
 
             /* Add it to our count */
             ++thd_count;
 
+            if(thd_count > thd_tid_hash_size * 2)
+                thd_tid_hash_grow();
+
             /* Schedule it */
             thd_add_to_runnable(nt, 0);
         }
@@ -543,8 +831,13 @@ int thd_destroy(kthread_t *thd) {
     /* De-schedule the thread if it's scheduled. */
     thd_remove_from_runnable(thd);
 
-    /* Remove it from the thread list. */
+    /* Remove it from the poll queue if it's polling. */
+    if(thd->state == STATE_POLLING)
+        thd_poll_remove(thd);
+
+    /* Remove it from the thread list and the thread ID hash. */
     LIST_REMOVE(thd, t_list);
+    LIST_REMOVE(thd, tid_hash);
 
     /* Call destructors on TLS entries.  */
     LIST_FOREACH(i, &thd->tls_list, kv_list) {
@@ -641,15 +934,6 @@ static inline void thd_schedule_inner(kthread_t *thd, uint64_t now) {
     irq_set_context(&thd_current->context);
 }
 
-static inline prio_t thd_calc_prio(const kthread_t *thd, uint32_t now) {
-    prio_t prio = thd->prio;
-
-    if(__predict_true(prio < PRIO_MAX))
-       prio >>= (now - (uint32_t)thd->cpu_time.scheduled) >> thd_ageing_ms_log2;
-
-    return prio;
-}
-
 /* Thread scheduler; this function will find a new thread to run when a
    context switch is requested. No work is done in here except to change
    out the thd_current variable contents. Assumed that we are in an
@@ -667,12 +951,11 @@ static inline prio_t thd_calc_prio(const kthread_t *thd, uint32_t now) {
    don't want a full context switch inside the same priority group.
 */
 void thd_schedule(bool front_of_line) {
-    kthread_t *thd, *next_thd = NULL;
-    prio_t prio, max_prio = INT_MAX;
+    kthread_t *next_thd;
     uint64_t now;
-    int ret;
 
     now = timer_ms_gettime64();
+    thd_sched_now = (uint32_t)now;
 
     /* If there's only two thread left, it's the idle task and the reaper task:
        exit the OS */
@@ -691,38 +974,21 @@ void thd_schedule(bool front_of_line) {
     /* Look for timed out waits */
     genwait_check_timeouts(now);
 
-    /* Search downwards through the run queue for a runnable thread; if
-       we don't find a normal runnable thread, the idle process will
-       always be there at the bottom. */
-    TAILQ_FOREACH(thd, &run_queue, thdq) {
-        if(__predict_false(thd->state == STATE_POLLING)) {
-            /* Is it polling? Call the polling function. */
-
-            if(thd->wait_timeout && thd->wait_timeout < now) {
-                thd->state = STATE_READY;
-                CONTEXT_RET(thd->context) = 0;
-            }
-            else {
-                ret = thd->poll_cb(thd->wait_obj);
-
-                if(ret) {
-                    thd->state = STATE_READY;
-                    CONTEXT_RET(thd->context) = ret;
-                }
-            }
-        }
-
-        /* Is it runnable? If not, keep going */
-        if(thd->state != STATE_READY)
-            continue;
+    /* Call the polling functions of any polling threads */
+    if(__predict_false(thd_poll_count))
+        thd_check_polls(now);
 
-        prio = thd_calc_prio(thd, now);
-        if(prio < max_prio) {
-            next_thd = thd;
-            max_prio = prio;
-        }
+    /* Periodically re-evaluate the priority of the queued threads */
+    if((int32_t)(thd_sched_now - thd_rebalance_next) >= 0) {
+        thd_runq_rebalance();
+        thd_rebalance_next = thd_sched_now + (1u << thd_ageing_ms_log2);
     }
 
+    /* Take the first runnable thread of the highest priority group; if we
+       don't find a normal runnable thread, the idle process will always be
+       there in the last bucket. */
+    next_thd = thd_runq_first();
+
     /* If we didn't already re-enqueue the thread and we are supposed to do so,
        do it now. */
     if(!front_of_line && thd_current->state == STATE_RUNNING) {
@@ -735,7 +1001,7 @@ void thd_schedule(bool front_of_line) {
             next_thd = thd_current;
     }
     else if(__predict_false(thd_current->state == STATE_POLLING)) {
-        thd_add_to_runnable(thd_current, front_of_line);
+        thd_poll_add(thd_current);
     }
 
     /* Didn't find one? Big problem here... */
@@ -744,6 +1010,13 @@ void thd_schedule(bool front_of_line) {
         arch_panic("couldn't find a runnable thread");
     }
 
+    /* If the timer was programmed for a long idle period, go back to the
+       regular timeslice now that a thread has something to do. */
+    if(thd_tickless && next_thd != thd_idle_thd) {
+        thd_tickless = false;
+        timer_primary_wakeup(thd_sched_ms);
+    }
+
     /* We should now have a runnable thread, so remove it from the
        run queue and switch to it. */
     thd_schedule_inner(next_thd, now);
@@ -796,12 +1069,31 @@ irq_context_t *thd_choose_new(void) {
    again until our next context switch (if any). For pre-empts, re-schedule
    threads, swap out contexts, and sleep. */
 static void thd_timer_hnd(irq_context_t *context) {
+    uint32_t wakeup = thd_sched_ms;
+    uint64_t next, now;
+
     (void)context;
 
     //printf("timer woke at %d\n", (uint32_t)now);
 
     thd_schedule(false);
-    timer_primary_wakeup(thd_sched_ms);
+
+    /* If only the idle thread is runnable, there is no need to preempt it
+       every tick: sleep until the next genwait timeout instead. */
+    thd_tickless = thd_current == thd_idle_thd && !thd_has_polls();
+
+    if(thd_tickless) {
+        wakeup *= THD_IDLE_MAX_TICKS;
+        next = genwait_next_timeout();
+        now = timer_ms_gettime64();
+
+        if(next && next <= now)
+            wakeup = 1;
+        else if(next && next - now < wakeup)
+            wakeup = (uint32_t)(next - now);
+    }
+
+    timer_primary_wakeup(wakeup);
 }
 
 /*****************************************************************************/
@@ -1084,6 +1376,7 @@ int thd_init(void) {
     };
 
     kthread_t *kern;
+    unsigned int i;
 
     /* Make sure we're not already running */
     if(thd_mode != THD_MODE_NONE)
@@ -1095,11 +1388,23 @@ int thd_init(void) {
     /* Initialize handle counters */
     tid_highest = 1;
 
-    /* Initialize the thread list */
+    /* Initialize the thread list and the thread ID hash */
     LIST_INIT(&thd_list);
+    thd_tid_hash_reset();
 
     /* Initialize the run queue */
-    TAILQ_INIT(&run_queue);
+    for(i = 0; i < THD_RUNQ_BUCKETS; i++)
+        TAILQ_INIT(&run_queue[i]);
+
+    run_queue_mask = 0;
+
+    /* Initialize the poll queue */
+    TAILQ_INIT(&poll_queue);
+    timerq_init(&poll_timer_queue, timerq_thd_timeout);
+    thd_poll_count = 0;
+    thd_tickless = false;
+    thd_sched_now = (uint32_t)timer_ms_gettime64();
+    thd_rebalance_next = thd_sched_now;
 
     /* Start off with no "current" thread */
     thd_current = NULL;
@@ -0,0 +1,108 @@
+/* KallistiOS ##version##
+
+   kernel/thread/timerq.c
+
+*/
+
+/* The pairing heap behind the timer queues, see timerq.h. Each node links to
+   its first child and to its next sibling; its prev link points to its
+   previous sibling, or to its parent if it is the first child. */
+
+#include <stddef.h>
+
+#include "timerq.h"
+
+/* Meld two heaps together, and return the new root. */
+static timerq_node_t *timerq_meld(const timerq_t *queue, timerq_node_t *a,
+                                  timerq_node_t *b) {
+    timerq_node_t *t;
+
+    if(!a)
+        return b;
+
+    if(!b)
+        return a;
+
+    if(queue->key(b) < queue->key(a)) {
+        t = a;
+        a = b;
+        b = t;
+    }
+
+    /* Make b the first child of a */
+    b->prev = a;
+    b->next = a->child;
+
+    if(b->next)
+        b->next->prev = b;
+
+    a->child = b;
+
+    return a;
+}
+
+/* Meld a list of sibling heaps into a single heap, using the standard
+   two-pass method: meld them in pairs from left to right, then meld the
+   resulting heaps from right to left. */
+static timerq_node_t *timerq_merge_pairs(const timerq_t *queue,
+                                         timerq_node_t *first) {
+    timerq_node_t *a, *b, *stack = NULL, *root = NULL;
+
+    while(first) {
+        a = first;
+        b = a->next;
+        first = b ? b->next : NULL;
+
+        a->next = a->prev = NULL;
+
+        if(b)
+            b->next = b->prev = NULL;
+
+        a = timerq_meld(queue, a, b);
+        a->next = stack;
+        stack = a;
+    }
+
+    while(stack) {
+        a = stack;
+        stack = a->next;
+        a->next = NULL;
+        root = timerq_meld(queue, root, a);
+    }
+
+    return root;
+}
+
+void timerq_insert(timerq_t *queue, timerq_node_t *node) {
+    node->child = node->next = node->prev = NULL;
+    queue->root = timerq_meld(queue, queue->root, node);
+}
+
+void timerq_remove(timerq_t *queue, timerq_node_t *node) {
+    timerq_node_t *prev = node->prev;
+    timerq_node_t *next = node->next;
+
+    if(node == queue->root) {
+        queue->root = timerq_merge_pairs(queue, node->child);
+    }
+    else {
+        /* Unlink it from its parent or siblings, then meld its children
+           back into the heap. */
+        if(prev->child == node)
+            prev->child = next;
+        else
+            prev->next = next;
+
+        if(next)
+            next->prev = prev;
+
+        queue->root = timerq_meld(queue, queue->root,
+                                  timerq_merge_pairs(queue, node->child));
+    }
+
+    node->child = node->next = node->prev = NULL;
+}
+
+uint64_t timerq_thd_timeout(const timerq_node_t *node) {
+    return timerq_entry(node, kthread_t, timerq)->wait_timeout;
+}
@@ -0,0 +1,76 @@
+/* KallistiOS ##version##
+
+   kernel/thread/timerq.h
+
+*/
+
+#ifndef __LOCAL_THREAD_TIMERQ_H
+#define __LOCAL_THREAD_TIMERQ_H
+
+#include <kos/cdefs.h>
+
+__BEGIN_DECLS
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kos/thread.h>
+
+/* Timer queues. A timer queue holds items ordered by the time they're due,
+   so that the next one to come due is always at hand. It is an intrusive
+   pairing heap, linked through a timerq_node_t embedded in each item:
+   inserting an item and finding the next one due are constant-time
+   operations, and removing an item is logarithmic (amortized).
+
+   The queue doesn't know what the items are; it asks the key function of
+   the queue when an item is due, in whatever units the user likes. An item's
+   key must not change while it's queued. An item can be on more than one
+   queue at a time only if it has a node for each.
+
+   genwait keeps one for the threads waiting with a timeout, and the scheduler
+   another for the polling threads that have a timeout, both keyed on their
+   wait_timeout. TCP keeps one for the sockets with timers armed. Nothing is
+   locked in here: users keep their queues safe themselves (all of those above
+   have interrupts disabled). */
+typedef struct timerq {
+    timerq_node_t *root;                        /* Next item due, or NULL */
+    uint64_t (*key)(const timerq_node_t *node); /* When an item is due */
+} timerq_t;
+
+#define TIMERQ_INITIALIZER(key) { NULL, (key) }
+
+/* Get the item that holds a node */
+#define timerq_entry(node, type, field) \
+    ((type *)((char *)(node) - offsetof(type, field)))
+
+/* Set up an empty queue, with the given key function. */
+static inline void timerq_init(timerq_t *queue,
+                               uint64_t (*key)(const timerq_node_t *node)) {
+    queue->root = NULL;
+    queue->key = key;
+}
+
+/* The node of the next item due, or NULL if the queue is empty. */
+static inline timerq_node_t *timerq_first(const timerq_t *queue) {
+    return queue->root;
+}
+
+/* Insert an item in a timer queue. Its key must be set already. */
+void timerq_insert(timerq_t *queue, timerq_node_t *node) __nonnull_all;
+
+/* Remove an item from the timer queue it's in. */
+void timerq_remove(timerq_t *queue, timerq_node_t *node) __nonnull_all;
+
+/* Key function for queues of threads, linked through their timerq field and
+   due at their wait_timeout. */
+uint64_t timerq_thd_timeout(const timerq_node_t *node);
+
+/* The next thread to time out in a queue of threads, or NULL if it's empty */
+static inline kthread_t *timerq_thd_first(const timerq_t *queue) {
+    timerq_node_t *node = timerq_first(queue);
+
+    return node ? timerq_entry(node, kthread_t, timerq) : NULL;
+}
+
+__END_DECLS
+
+#endif /* __LOCAL_THREAD_TIMERQ_H */
@@ -15,93 +15,209 @@
 #include <kos/thread.h>
 #include <kos/workqueue.h>
 
-typedef struct workqueue {
-    STAILQ_HEAD(workqueue_jobs, workqueue_job) jobs;
-    workqueue_job_t *curr_job;
+typedef struct workqueue_worker {
+    struct workqueue *wq;
     kthread_t *thd;
+    workqueue_job_t *curr_job;
+} workqueue_worker_t;
+
+typedef struct workqueue {
+    /* One time-ordered list per priority class, highest first */
+    STAILQ_HEAD(workqueue_jobs, workqueue_job) jobs[WORKQUEUE_PRIO_COUNT];
+    workqueue_worker_t *workers;
+    unsigned int nworkers;
     mutex_t lock;
-    condvar_t cond;
+    condvar_t cond;     /* The queues changed */
+    condvar_t idle;     /* A worker finished a job */
+    unsigned int cancel_waiters;
+    workqueue_stats_t stats;
     bool quit;
 } workqueue_t;
 
-static void *workqueue_thread(void *d) {
-    workqueue_t *wq = d;
-    workqueue_job_t *job;
-    uint64_t now;
-    int ret;
+static inline unsigned int workqueue_prio_idx(const workqueue_job_t *job) {
+    if(job->prio <= WORKQUEUE_PRIO_HIGH)
+        return 0;
+    else if(job->prio >= WORKQUEUE_PRIO_LOW)
+        return WORKQUEUE_PRIO_COUNT - 1;
 
-    while(!wq->quit) {
-        mutex_lock(&wq->lock);
+    return job->prio - WORKQUEUE_PRIO_HIGH;
+}
 
-        /* Signal that we're done with the previous job */
-        wq->curr_job = NULL;
-        cond_signal(&wq->cond);
+/* Is the job running on a worker thread other than the calling one? */
+static bool workqueue_running(workqueue_t *wq, workqueue_job_t *job) {
+    unsigned int i;
 
-        job = STAILQ_FIRST(&wq->jobs);
-        if(job)
-            now = timer_ms_gettime64();
+    for(i = 0; i < wq->nworkers; i++) {
+        if(wq->workers[i].curr_job == job && wq->workers[i].thd != thd_current)
+            return true;
+    }
 
-        if(!job || job->time_ms > now) {
-            ret = cond_wait_timed(&wq->cond, &wq->lock,
-                                  job ? job->time_ms - now : 0);
-            if (!ret) {
-                mutex_unlock(&wq->lock);
+    return false;
+}
+
+static void workqueue_remove(workqueue_t *wq, workqueue_job_t *job) {
+    STAILQ_REMOVE(&wq->jobs[job->queued - 1], job, workqueue_job, entry);
+    job->queued = 0;
+    wq->stats.pending--;
+}
 
-                /* We did not time out, so something was added to the queue. */
-                continue;
+/* Find the first job that is due, looking at the highest priority class
+   first. Jobs already running on another worker are left for that worker to
+   pick up again once it's done. If nothing is due, return NULL and set next to
+   the time the first job will be. */
+static workqueue_job_t *workqueue_pick(workqueue_t *wq, uint64_t now,
+                                       uint64_t *next) {
+    workqueue_job_t *job;
+    unsigned int i;
+
+    *next = UINT64_MAX;
+
+    for(i = 0; i < WORKQUEUE_PRIO_COUNT; i++) {
+        STAILQ_FOREACH(job, &wq->jobs[i], entry) {
+            if(job->time_ms > now) {
+                if(job->time_ms < *next)
+                    *next = job->time_ms;
+                break;
             }
+
+            if(!workqueue_running(wq, job))
+                return job;
+        }
+    }
+
+    return NULL;
+}
+
+static void *workqueue_thread(void *d) {
+    workqueue_worker_t *w = d;
+    workqueue_t *wq = w->wq;
+    workqueue_job_t *job;
+    uint64_t now, next, start, end;
+
+    mutex_lock(&wq->lock);
+
+    while(!wq->quit) {
+        now = timer_ms_gettime64();
+        job = workqueue_pick(wq, now, &next);
+
+        if(!job) {
+            /* Sleep until the next job is due, or the queues change. */
+            if(next == UINT64_MAX)
+                next = 0;
+            else if(next - now > INT_MAX)
+                next = INT_MAX;
+            else
+                next -= now;
+
+            cond_wait_timed(&wq->cond, &wq->lock, (int)next);
+            continue;
         }
 
         /* Remove the job from the queue */
-        STAILQ_REMOVE(&wq->jobs, job, workqueue_job, entry);
+        workqueue_remove(wq, job);
+        w->curr_job = job;
+
+        start = timer_us_gettime64();
+        if(start > job->time_ms * 1000) {
+            wq->stats.latency_total_us += start - job->time_ms * 1000;
+
+            if(start - job->time_ms * 1000 > wq->stats.latency_max_us)
+                wq->stats.latency_max_us = start - job->time_ms * 1000;
+        }
 
-        wq->curr_job = job;
         mutex_unlock(&wq->lock);
 
-        job->cb(d, job);
+        job->cb(wq, job);
+
+        end = timer_us_gettime64();
+        mutex_lock(&wq->lock);
+
+        /* Signal that we're done with the job */
+        w->curr_job = NULL;
+        wq->stats.executed++;
+        wq->stats.busy_us += end - start;
+
+        if(wq->cancel_waiters)
+            cond_broadcast(&wq->idle);
     }
 
+    mutex_unlock(&wq->lock);
     return NULL;
 }
 
-static const kthread_attr_t workqueue_attrs = {
-    .label = "[workqueue]",
-};
-
-workqueue_t *workqueue_create(void) {
+workqueue_t *workqueue_create_ex(const workqueue_attr_t *attr) {
+    kthread_attr_t thd_attr = { .label = "[workqueue]" };
     workqueue_t *wq;
+    unsigned int i, n = 1;
+
+    if(attr) {
+        if(attr->num_threads)
+            n = attr->num_threads;
+        if(attr->label)
+            thd_attr.label = attr->label;
+
+        thd_attr.prio = attr->prio;
+    }
 
     wq = calloc(1, sizeof(workqueue_t));
     if(!wq)
         return NULL;
 
+    wq->workers = calloc(n, sizeof(workqueue_worker_t));
+    if(!wq->workers) {
+        free(wq);
+        return NULL;
+    }
+
     wq->lock = (mutex_t)MUTEX_INITIALIZER;
     wq->cond = (condvar_t)COND_INITIALIZER;
-    STAILQ_INIT(&wq->jobs);
+    wq->idle = (condvar_t)COND_INITIALIZER;
 
-    wq->thd = thd_create_ex(&workqueue_attrs, workqueue_thread, wq);
-    if(!wq->thd) {
-        free(wq);
+    for(i = 0; i < WORKQUEUE_PRIO_COUNT; i++)
+        STAILQ_INIT(&wq->jobs[i]);
+
+    for(i = 0; i < n; i++) {
+        wq->workers[i].wq = wq;
+        wq->workers[i].thd = thd_create_ex(&thd_attr, workqueue_thread,
+                                           &wq->workers[i]);
+        if(!wq->workers[i].thd)
+            break;
+
+        wq->nworkers++;
+    }
+
+    if(wq->nworkers < n) {
+        workqueue_destroy(wq);
         return NULL;
     }
 
     return wq;
 }
 
+workqueue_t *workqueue_create(void) {
+    return workqueue_create_ex(NULL);
+}
+
 void workqueue_enqueue(workqueue_t *wq, workqueue_job_t *job) {
+    struct workqueue_jobs *list;
     workqueue_job_t *elm, *prev = NULL;
 
     mutex_lock_scoped(&wq->lock);
 
+    if(job->queued)
+        workqueue_remove(wq, job);
+
     if(!job->time_ms)
         job->time_ms = timer_ms_gettime64();
 
-    STAILQ_FOREACH(elm, &wq->jobs, entry) {
+    list = &wq->jobs[workqueue_prio_idx(job)];
+
+    STAILQ_FOREACH(elm, list, entry) {
         if(job->time_ms < elm->time_ms) {
             if(prev)
-                STAILQ_INSERT_AFTER(&wq->jobs, prev, job, entry);
+                STAILQ_INSERT_AFTER(list, prev, job, entry);
             else
-                STAILQ_INSERT_HEAD(&wq->jobs, job, entry);
+                STAILQ_INSERT_HEAD(list, job, entry);
             break;
         }
 
@@ -109,7 +225,11 @@ void workqueue_enqueue(workqueue_t *wq, workqueue_job_t *job) {
     }
 
     if(!elm)
-        STAILQ_INSERT_TAIL(&wq->jobs, job, entry);
+        STAILQ_INSERT_TAIL(list, job, entry);
+
+    job->queued = workqueue_prio_idx(job) + 1;
+    wq->stats.enqueued++;
+    wq->stats.pending++;
 
     cond_signal(&wq->cond);
 }
@@ -117,31 +237,52 @@ void workqueue_enqueue(workqueue_t *wq, workqueue_job_t *job) {
 void workqueue_cancel(workqueue_t *wq, workqueue_job_t *job) {
     mutex_lock_scoped(&wq->lock);
 
-    STAILQ_REMOVE(&wq->jobs, job, workqueue_job, entry);
+    for(;;) {
+        if(job->queued) {
+            workqueue_remove(wq, job);
+            wq->stats.cancelled++;
+        }
 
-    if(wq->curr_job == job) {
-        /* The job's callback is being executed. Wait until it's done. */
-        cond_wait(&wq->cond, &wq->lock);
-    }
+        if(!workqueue_running(wq, job))
+            break;
 
-    /* We modified the queue, so notify the thread that it should parse the
-     * list once again. */
-    cond_signal(&wq->cond);
+        /* The job's callback is being executed. Wait until it's done, then
+           check whether it enqueued itself again. */
+        wq->cancel_waiters++;
+        cond_wait(&wq->idle, &wq->lock);
+        wq->cancel_waiters--;
+    }
 }
 
 void workqueue_kill(workqueue_t *wq) {
-    if(!wq->quit) {
-        wq->quit = true;
-        cond_signal(&wq->cond);
-        thd_join(wq->thd, NULL);
+    unsigned int i;
+
+    mutex_lock(&wq->lock);
+
+    if(wq->quit) {
+        mutex_unlock(&wq->lock);
+        return;
     }
+
+    wq->quit = true;
+    cond_broadcast(&wq->cond);
+    mutex_unlock(&wq->lock);
+
+    for(i = 0; i < wq->nworkers; i++)
+        thd_join(wq->workers[i].thd, NULL);
 }
 
 void workqueue_destroy(workqueue_t *wq) {
     workqueue_kill(wq);
+    free(wq->workers);
     free(wq);
 }
 
 kthread_t *workqueue_get_thread(workqueue_t *wq) {
-    return wq->thd;
+    return wq->workers[0].thd;
+}
+
+void workqueue_get_stats(workqueue_t *wq, workqueue_stats_t *stats) {
+    mutex_lock_scoped(&wq->lock);
+    *stats = wq->stats;
 }
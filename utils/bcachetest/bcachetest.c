@@ -0,0 +1,555 @@
+/* KallistiOS ##version##
+
+   bcachetest.c
+
+   Test for the block device buffer cache (kernel/fs/bcache.c) under the ext2
+   and FAT filesystems. This builds the real cache and the real libkosext2fs
+   and libkosfat sources on a PC, with pthreads standing in for KOS threads,
+   on top of a block device that's an image file and counts what's asked of
+   it.
+
+   Each filesystem gets a fresh image: ext2 from mke2fs (skipped if it isn't
+   installed), FAT16 and FAT32 made here. Files are written a bit at a time,
+   some in a subdirectory, and read back. Then nothing happens for a while, to
+   check that the background flush writes everything back on its own, and the
+   filesystem is mounted again read-only and everything is checked again. The
+   ext2 image is also checked with e2fsck, if it's installed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <kos/fs.h>
+#include <kos/nmmgr.h>
+#include <kos/thread.h>
+#include <kos/dbglog.h>
+#include <kos/bcache.h>
+#include <kos/blockdev.h>
+#include <ext2/fs_ext2.h>
+#include <fat/fs_fat.h>
+
+#define IMG_PATH    "bcachetest.img"
+#define NFILES      16
+#define CHUNK       1000
+
+/* EXT2_CACHE_FLUSH_MS and FAT_CACHE_FLUSH_MS, from the libraries' own
+   headers */
+#define FLUSH_MS    2000
+
+/* Caches created by the filesystem that's mounted, caught on their way out
+   of bcache_create() */
+#define MAX_CACHES  4
+static bcache_t *caches[MAX_CACHES];
+static int ncaches;
+
+bcache_t *__real_bcache_create(kos_blockdev_t *dev, uint32_t dev_blocks,
+                               size_t count, size_t readahead);
+
+bcache_t *__wrap_bcache_create(kos_blockdev_t *dev, uint32_t dev_blocks,
+                               size_t count, size_t readahead) {
+    bcache_t *c = __real_bcache_create(dev, dev_blocks, count, readahead);
+
+    if(c && ncaches < MAX_CACHES)
+        caches[ncaches++] = c;
+
+    return c;
+}
+
+/* Stand-ins for the parts of KOS the filesystems use */
+kthread_t *thd_create(bool detach, void *(*routine)(void *param),
+                      void *param) {
+    pthread_t thd;
+
+    if(pthread_create(&thd, NULL, routine, param))
+        return NULL;
+
+    if(detach)
+        pthread_detach(thd);
+
+    return (kthread_t *)1;
+}
+
+static vfs_handler_t *mounted;
+
+int nmmgr_handler_add(nmmgr_handler_t *hnd) {
+    mounted = (vfs_handler_t *)hnd;
+    return 0;
+}
+
+int nmmgr_handler_remove(nmmgr_handler_t *hnd) {
+    if((vfs_handler_t *)hnd == mounted)
+        mounted = NULL;
+
+    return 0;
+}
+
+/* The image file, as a block device */
+typedef struct img_dev {
+    int fd;
+    uint64_t blocks;
+    uint32_t reads, writes;
+    uint64_t rblocks, wblocks;
+} img_dev_t;
+
+static int img_init(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int img_shutdown(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int img_read(const kos_blockdev_t *d, uint64_t block, size_t count,
+                    void *buf) {
+    img_dev_t *img = (img_dev_t *)d->dev_data;
+    size_t len = count << d->l_block_size;
+
+    if(block + count > img->blocks ||
+       pread(img->fd, buf, len, block << d->l_block_size) != (ssize_t)len) {
+        errno = EIO;
+        return -1;
+    }
+
+    ++img->reads;
+    img->rblocks += count;
+    return 0;
+}
+
+static int img_write(const kos_blockdev_t *d, uint64_t block, size_t count,
+                     const void *buf) {
+    img_dev_t *img = (img_dev_t *)d->dev_data;
+    size_t len = count << d->l_block_size;
+
+    if(block + count > img->blocks ||
+       pwrite(img->fd, buf, len, block << d->l_block_size) != (ssize_t)len) {
+        errno = EIO;
+        return -1;
+    }
+
+    ++img->writes;
+    img->wblocks += count;
+    return 0;
+}
+
+static uint64_t img_count(const kos_blockdev_t *d) {
+    return ((img_dev_t *)d->dev_data)->blocks;
+}
+
+static int img_flush(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static img_dev_t img;
+
+static kos_blockdev_t img_bd = {
+    &img, 9, img_init, img_shutdown, img_read, img_write, img_count, img_flush
+};
+
+static int img_open(void) {
+    if((img.fd = open(IMG_PATH, O_RDWR)) < 0) {
+        perror(IMG_PATH);
+        return -1;
+    }
+
+    img.blocks = lseek(img.fd, 0, SEEK_END) >> 9;
+    return 0;
+}
+
+static void img_close(void) {
+    close(img.fd);
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* Make an empty FAT16 or FAT32 image. The FAT32 one has 4KB clusters and a
+   few more clusters than FAT16 can have; the FAT16 one has 2KB clusters and
+   a 512 entry root directory. */
+static int make_fat(bool fat32) {
+    uint8_t bs[512], sect[512];
+    uint32_t spc = fat32 ? 8 : 4, clusters = fat32 ? 66000 : 8000;
+    uint32_t rsvd = fat32 ? 32 : 1, rootents = fat32 ? 0 : 512;
+    uint32_t fatsz, total, i;
+    int fd;
+
+    fatsz = ((clusters + 2) * (fat32 ? 4 : 2) + 511) / 512;
+    total = rsvd + 2 * fatsz + rootents * 32 / 512 + clusters * spc;
+
+    if((fd = open(IMG_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+       ftruncate(fd, (off_t)total * 512)) {
+        perror(IMG_PATH);
+        return -1;
+    }
+
+    memset(bs, 0, sizeof(bs));
+    bs[0] = 0xEB;
+    bs[1] = 0x58;
+    bs[2] = 0x90;
+    memcpy(bs + 3, "KOSTEST ", 8);
+    put16(bs + 11, 512);
+    bs[13] = spc;
+    put16(bs + 14, rsvd);
+    bs[16] = 2;
+    put16(bs + 17, rootents);
+    bs[21] = 0xF8;
+    put16(bs + 24, 32);
+    put16(bs + 26, 64);
+    put32(bs + 32, total);
+
+    if(fat32) {
+        put32(bs + 36, fatsz);
+        put32(bs + 44, 2);
+        put16(bs + 48, 1);
+        put16(bs + 50, 6);
+        bs[66] = 0x29;
+        memcpy(bs + 71, "BCACHETEST ", 11);
+        memcpy(bs + 82, "FAT32   ", 8);
+    }
+    else {
+        put16(bs + 22, fatsz);
+        bs[38] = 0x29;
+        memcpy(bs + 43, "BCACHETEST ", 11);
+        memcpy(bs + 54, "FAT16   ", 8);
+    }
+
+    bs[510] = 0x55;
+    bs[511] = 0xAA;
+
+    pwrite(fd, bs, 512, 0);
+
+    if(fat32) {
+        pwrite(fd, bs, 512, 6 * 512);
+
+        memset(sect, 0, sizeof(sect));
+        put32(sect, 0x41615252);
+        put32(sect + 484, 0x61417272);
+        put32(sect + 488, clusters - 1);
+        put32(sect + 492, 2);
+        put32(sect + 508, 0xAA550000);
+        pwrite(fd, sect, 512, 512);
+        pwrite(fd, sect, 512, 7 * 512);
+    }
+
+    /* The first entries of both FATs: the media byte, end of chain and (on
+       FAT32) the root directory's cluster. */
+    memset(sect, 0, sizeof(sect));
+
+    if(fat32) {
+        put32(sect, 0x0FFFFFF8);
+        put32(sect + 4, 0x0FFFFFFF);
+        put32(sect + 8, 0x0FFFFFFF);
+    }
+    else {
+        put16(sect, 0xFFF8);
+        put16(sect + 2, 0xFFFF);
+    }
+
+    for(i = 0; i < 2; ++i)
+        pwrite(fd, sect, 512, (off_t)(rsvd + i * fatsz) * 512);
+
+    close(fd);
+    return 0;
+}
+
+static int make_ext2(void) {
+    int fd;
+
+    if((fd = open(IMG_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+       ftruncate(fd, 32 * 1024 * 1024)) {
+        perror(IMG_PATH);
+        return -1;
+    }
+
+    close(fd);
+    return system("mke2fs -q -F -t ext2 -b 1024 " IMG_PATH " >/dev/null 2>&1");
+}
+
+static uint8_t pattern(int file, uint32_t off) {
+    return (uint8_t)(file * 131 + off * 7 + (off >> 9));
+}
+
+static uint32_t file_size(int file) {
+    return 3000 + file * 37000;
+}
+
+static void file_name(char *buf, int file) {
+    sprintf(buf, "%s/f%02d.bin", file & 1 ? "/dir" : "", file);
+}
+
+static int write_file(int f) {
+    uint8_t buf[CHUNK];
+    char name[32];
+    uint32_t off, n, i;
+    void *h;
+
+    file_name(name, f);
+
+    if(!(h = mounted->open(mounted, name, O_WRONLY | O_CREAT | O_TRUNC))) {
+        printf("  can't create %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    for(off = 0; off < file_size(f); off += n) {
+        n = file_size(f) - off < CHUNK ? file_size(f) - off : CHUNK;
+
+        for(i = 0; i < n; ++i)
+            buf[i] = pattern(f, off + i);
+
+        if(mounted->write(h, buf, n) != (ssize_t)n) {
+            printf("  write to %s failed: %s\n", name, strerror(errno));
+            mounted->close(h);
+            return -1;
+        }
+    }
+
+    mounted->close(h);
+    return 0;
+}
+
+static int write_files(void) {
+    int f;
+
+    if(mounted->mkdir(mounted, "/dir")) {
+        printf("  mkdir /dir failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for(f = 0; f < NFILES; ++f) {
+        if(write_file(f))
+            return -1;
+    }
+
+    return 0;
+}
+
+static int check_files(void) {
+    uint8_t buf[CHUNK];
+    char name[32];
+    uint32_t off, n, i;
+    ssize_t got;
+    void *h;
+    int f;
+
+    for(f = 0; f < NFILES; ++f) {
+        file_name(name, f);
+
+        if(!(h = mounted->open(mounted, name, O_RDONLY))) {
+            printf("  can't open %s: %s\n", name, strerror(errno));
+            return -1;
+        }
+
+        for(off = 0; off < file_size(f); off += n) {
+            n = file_size(f) - off < CHUNK ? file_size(f) - off : CHUNK;
+
+            if((got = mounted->read(h, buf, n)) != (ssize_t)n) {
+                printf("  read of %s at %u got %zd\n", name, off, got);
+                mounted->close(h);
+                return -1;
+            }
+
+            for(i = 0; i < n; ++i) {
+                if(buf[i] != pattern(f, off + i)) {
+                    printf("  %s is wrong at %u\n", name, off + i);
+                    mounted->close(h);
+                    return -1;
+                }
+            }
+        }
+
+        if(mounted->read(h, buf, 1) != 0) {
+            printf("  %s is too long\n", name);
+            mounted->close(h);
+            return -1;
+        }
+
+        mounted->close(h);
+    }
+
+    return 0;
+}
+
+static uint32_t dirty_buffers(void) {
+    uint32_t rv = 0;
+    int i;
+
+    for(i = 0; i < ncaches; ++i)
+        rv += bcache_get_stats(caches[i]).dirty;
+
+    return rv;
+}
+
+static void print_stats(const char *what) {
+    bcache_stats_t st;
+    int i;
+
+    printf("  %-22s device: %6u reads (%7llu blocks), %6u writes "
+           "(%7llu blocks)\n", what, img.reads,
+           (unsigned long long)img.rblocks, img.writes,
+           (unsigned long long)img.wblocks);
+
+    for(i = 0; i < ncaches; ++i) {
+        st = bcache_get_stats(caches[i]);
+        printf("  %22s cache %d: %6u hits, %5u misses, %5u readahead, "
+               "%5u evictions\n", "", i, st.hits, st.misses, st.readahead,
+               st.evictions);
+    }
+
+    memset(&img.reads, 0, sizeof(img) - offsetof(img_dev_t, reads));
+}
+
+typedef struct fs_ops {
+    const char *name;
+    int (*make)(void);
+    int (*mount)(const char *mp, kos_blockdev_t *dev, uint32_t flags);
+    int (*unmount)(const char *mp);
+    uint32_t rw;
+    const char *fsck;
+} fs_ops_t;
+
+static int make_fat16(void) {
+    return make_fat(false);
+}
+
+static int make_fat32(void) {
+    return make_fat(true);
+}
+
+static const fs_ops_t fses[] = {
+    { "ext2", make_ext2, fs_ext2_mount, fs_ext2_unmount,
+      FS_EXT2_MOUNT_READWRITE, "e2fsck -fn " IMG_PATH " >/dev/null 2>&1" },
+    { "FAT16", make_fat16, fs_fat_mount, fs_fat_unmount,
+      FS_FAT_MOUNT_READWRITE, NULL },
+    { "FAT32", make_fat32, fs_fat_mount, fs_fat_unmount,
+      FS_FAT_MOUNT_READWRITE, NULL }
+};
+
+static int test_fs(const fs_ops_t *ops) {
+    int rv = -1;
+
+    printf("%s:\n", ops->name);
+
+    if(ops->make()) {
+        printf("  can't make an image, skipping\n");
+        return 0;
+    }
+
+    if(img_open())
+        return -1;
+
+    ncaches = 0;
+
+    if(ops->mount("/test", &img_bd, ops->rw) || !mounted) {
+        printf("  mount failed: %s\n", strerror(errno));
+        goto out;
+    }
+
+    print_stats("mount:");
+
+    if(write_files())
+        goto out_mounted;
+
+    print_stats("write:");
+    printf("  %u buffers dirty\n", dirty_buffers());
+
+    if(check_files())
+        goto out_mounted;
+
+    print_stats("read back:");
+
+    /* Write the first file again, so that there's something to flush, and
+       leave it alone for long enough for the background flush. */
+    if(write_file(0))
+        goto out_mounted;
+
+    print_stats("write again:");
+    printf("  %u buffers dirty\n", dirty_buffers());
+    usleep(FLUSH_MS * 2000);
+
+    if(dirty_buffers()) {
+        printf("  %u buffers still dirty after %u ms\n", dirty_buffers(),
+               FLUSH_MS * 2);
+        goto out_mounted;
+    }
+
+    print_stats("background flush:");
+
+    ops->unmount("/test");
+    ncaches = 0;
+    print_stats("unmount:");
+
+    if(ops->mount("/test", &img_bd, 0) || !mounted) {
+        printf("  read-only mount failed: %s\n", strerror(errno));
+        goto out;
+    }
+
+    if(check_files())
+        goto out_mounted;
+
+    print_stats("read again:");
+    ops->unmount("/test");
+
+    rv = 0;
+
+    if(ops->fsck) {
+        rv = system(ops->fsck);
+
+        if(WIFEXITED(rv) && WEXITSTATUS(rv) == 127) {
+            printf("  fsck isn't installed\n");
+            rv = 0;
+        }
+        else if(rv)
+            printf("  fsck found problems: %d\n", rv);
+        else
+            printf("  fsck: clean\n");
+    }
+
+    rv = rv ? -1 : 0;
+    goto out;
+
+out_mounted:
+    ops->unmount("/test");
+out:
+    img_close();
+    printf("  %s\n", rv ? "FAILED" : "ok");
+    return rv;
+}
+
+int main(int argc, char *argv[]) {
+    size_t i;
+    int rv = 0;
+
+    if(argc > 1 && !strcmp(argv[1], "-v"))
+        dbglog_set_level(DBG_KDEBUG);
+
+    fs_ext2_init();
+    fs_fat_init();
+
+    for(i = 0; i < sizeof(fses) / sizeof(fses[0]); ++i) {
+        if(test_fs(&fses[i]))
+            rv = 1;
+    }
+
+    fs_fat_shutdown();
+    fs_ext2_shutdown();
+    unlink(IMG_PATH);
+
+    return rv;
+}
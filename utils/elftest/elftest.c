@@ -0,0 +1,339 @@
+/* KallistiOS ##version##
+
+   elftest.c
+
+   Test for the ELF loader. This builds the real kernel/fs/elf.c on a PC, with
+   the fs calls going straight to the host's files.
+
+   The fixture is a small relocatable SH object, written out to elftest.elf by
+   the test itself since there's no SH toolchain to build one with here: a
+   .text section with the four library entry points and a word relocated
+   against each kind of symbol the loader handles (an export, a section, a
+   symbol in .bss and an absolute one), a .data section that asks for 64 byte
+   alignment and a .bss. The good fixture has to load with everything in the
+   right place. Broken variants of it, with relocations against common
+   symbols, unloaded sections and reserved section indices, out of range
+   relocation offsets, bad alignments and a truncated file, have to be turned
+   down without touching memory they shouldn't (build with
+   -fsanitize=address to be sure of that).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../../kernel/fs/elf.c"
+
+#define FIXTURE     "elftest.elf"
+
+/* Where the fixture's only import lives */
+#define PRINTF_ADDR 0x8c001000
+
+/* Section layout of the fixture */
+enum {
+    S_NULL, S_TEXT, S_DATA, S_BSS, S_RELA, S_SYMTAB, S_STRTAB, S_SHSTRTAB,
+    S_COMMENT, S_COUNT
+};
+
+/* Symbols in the fixture */
+enum {
+    Y_NULL, Y_DATA, Y_GET_NAME, Y_GET_VERSION, Y_OPEN, Y_CLOSE, Y_PRINTF,
+    Y_COUNTER, Y_ABSVAL, Y_COMMON, Y_NOTE, Y_COUNT
+};
+
+/* The ways the fixture can be broken */
+enum {
+    F_GOOD, F_COMMON, F_UNLOADED, F_RESERVED, F_ROFF, F_ALIGN, F_TRUNCATED
+};
+
+static const char strtab[] =
+    "\0_lib_get_name\0_lib_get_version\0_lib_open\0_lib_close\0_printf"
+    "\0_counter\0_absval\0_common\0_note";
+
+static const char shstrtab[] =
+    "\0.text\0.data\0.bss\0.rela.text\0.symtab\0.strtab\0.shstrtab\0.comment";
+
+static const uint8_t data_sect[24] = {
+    1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+    13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24
+};
+
+/* Offset of a name in one of the string tables above */
+static uint32_t str_off(const char *tab, size_t size, const char *name) {
+    size_t i;
+
+    for(i = 1; i < size; i += strlen(tab + i) + 1) {
+        if(!strcmp(tab + i, name))
+            return i;
+    }
+
+    fprintf(stderr, "no string %s\n", name);
+    exit(1);
+}
+
+#define STR(n)      str_off(strtab, sizeof(strtab), n)
+#define SHSTR(n)    str_off(shstrtab, sizeof(shstrtab), n)
+
+static void write_fixture(int flaw) {
+    uint32_t text[4] = { 0xdeadbeef, 0, 0, 0 };
+    elf_shdr_t sh[S_COUNT];
+    elf_sym_t sym[Y_COUNT];
+    elf_rela_t rela[4];
+    elf_hdr_t hdr;
+    uint8_t file[4096];
+    size_t off = sizeof(hdr);
+    FILE *fp;
+
+    memset(file, 0, sizeof(file));
+    memset(sh, 0, sizeof(sh));
+    memset(sym, 0, sizeof(sym));
+
+    /* Symbols */
+    sym[Y_DATA].info = STT_SECTION;
+    sym[Y_DATA].shndx = S_DATA;
+
+    sym[Y_GET_NAME].name = STR("_lib_get_name");
+    sym[Y_GET_VERSION].name = STR("_lib_get_version");
+    sym[Y_OPEN].name = STR("_lib_open");
+    sym[Y_CLOSE].name = STR("_lib_close");
+    sym[Y_GET_NAME].value = 0;
+    sym[Y_GET_VERSION].value = 4;
+    sym[Y_OPEN].value = 8;
+    sym[Y_CLOSE].value = 12;
+
+    for(int i = Y_GET_NAME; i <= Y_CLOSE; i++) {
+        sym[i].info = (STB_GLOBAL << 4) | STT_FUNC;
+        sym[i].shndx = S_TEXT;
+    }
+
+    sym[Y_PRINTF].name = STR("_printf");
+    sym[Y_PRINTF].info = (STB_GLOBAL << 4) | STT_NOTYPE;
+    sym[Y_PRINTF].shndx = SHN_UNDEF;
+
+    sym[Y_COUNTER].name = STR("_counter");
+    sym[Y_COUNTER].info = (STB_GLOBAL << 4) | STT_OBJECT;
+    sym[Y_COUNTER].shndx = S_BSS;
+    sym[Y_COUNTER].value = 4;
+
+    sym[Y_ABSVAL].name = STR("_absval");
+    sym[Y_ABSVAL].info = (STB_GLOBAL << 4) | STT_NOTYPE;
+    sym[Y_ABSVAL].shndx = SHN_ABS;
+    sym[Y_ABSVAL].value = 0x1234;
+
+    sym[Y_COMMON].name = STR("_common");
+    sym[Y_COMMON].info = (STB_GLOBAL << 4) | STT_OBJECT;
+    sym[Y_COMMON].shndx = flaw == F_RESERVED ? 0xfff0 : SHN_COMMON;
+    sym[Y_COMMON].value = 4;
+
+    sym[Y_NOTE].name = STR("_note");
+    sym[Y_NOTE].info = (STB_GLOBAL << 4) | STT_OBJECT;
+    sym[Y_NOTE].shndx = S_COMMENT;
+
+    /* Relocations for each word of .text */
+    rela[0].offset = 0;
+    rela[0].info = (Y_PRINTF << 8) | R_SH_DIR32;
+    rela[0].addend = 0;
+    rela[1].offset = 4;
+    rela[1].info = (Y_DATA << 8) | R_SH_DIR32;
+    rela[1].addend = 8;
+    rela[2].offset = 8;
+    rela[2].info = (Y_COUNTER << 8) | R_SH_DIR32;
+    rela[2].addend = 0;
+    rela[3].offset = 12;
+    rela[3].info = (Y_ABSVAL << 8) | R_SH_DIR32;
+    rela[3].addend = 2;
+
+    if(flaw == F_COMMON || flaw == F_RESERVED)
+        rela[3].info = (Y_COMMON << 8) | R_SH_DIR32;
+    else if(flaw == F_UNLOADED)
+        rela[3].info = (Y_NOTE << 8) | R_SH_DIR32;
+    else if(flaw == F_ROFF)
+        rela[3].offset = 0xfffffffe;
+
+    /* Section contents, one after the other */
+#define PLACE(s, t, ptr, sz) \
+    do { \
+        sh[s].type = t; \
+        sh[s].offset = off; \
+        sh[s].size = sz; \
+        memcpy(file + off, ptr, sz); \
+        off = (off + sz + 3) & ~3; \
+    } while(0)
+
+    PLACE(S_TEXT, SHT_PROGBITS, text, sizeof(text));
+    PLACE(S_DATA, SHT_PROGBITS, data_sect, sizeof(data_sect));
+    PLACE(S_RELA, SHT_RELA, rela, sizeof(rela));
+    PLACE(S_SYMTAB, SHT_SYMTAB, sym, sizeof(sym));
+    PLACE(S_STRTAB, SHT_STRTAB, strtab, sizeof(strtab));
+    PLACE(S_SHSTRTAB, SHT_STRTAB, shstrtab, sizeof(shstrtab));
+    PLACE(S_COMMENT, SHT_PROGBITS, "test", 5);
+
+    sh[S_TEXT].name = SHSTR(".text");
+    sh[S_TEXT].flags = SHF_ALLOC | SHF_EXECINSTR;
+    sh[S_TEXT].addralign = 4;
+
+    sh[S_DATA].name = SHSTR(".data");
+    sh[S_DATA].flags = SHF_ALLOC | SHF_WRITE;
+    sh[S_DATA].addralign = flaw == F_ALIGN ? 24 : 64;
+
+    sh[S_BSS].name = SHSTR(".bss");
+    sh[S_BSS].type = SHT_NOBITS;
+    sh[S_BSS].flags = SHF_ALLOC | SHF_WRITE;
+    sh[S_BSS].addralign = 16;
+    sh[S_BSS].size = 100;
+
+    sh[S_RELA].name = SHSTR(".rela.text");
+    sh[S_RELA].link = S_SYMTAB;
+    sh[S_RELA].info = S_TEXT;
+    sh[S_RELA].entsize = sizeof(elf_rela_t);
+
+    sh[S_SYMTAB].name = SHSTR(".symtab");
+    sh[S_SYMTAB].link = S_STRTAB;
+    sh[S_SYMTAB].info = Y_GET_NAME;
+    sh[S_SYMTAB].entsize = sizeof(elf_sym_t);
+
+    sh[S_STRTAB].name = SHSTR(".strtab");
+    sh[S_SHSTRTAB].name = SHSTR(".shstrtab");
+    sh[S_COMMENT].name = SHSTR(".comment");
+
+    /* Section headers last, and the header in front */
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.ident, "\177ELF", 4);
+    hdr.ident[EI_CLASS] = ELFCLASS32;
+    hdr.ident[EI_DATA] = ELFDATA2LSB;
+    hdr.ident[EI_VERSION] = 1;
+    hdr.type = 1;
+    hdr.machine = EM_SH;
+    hdr.version = 1;
+    hdr.shoff = off;
+    hdr.ehsize = sizeof(hdr);
+    hdr.shentsize = sizeof(elf_shdr_t);
+    hdr.shnum = S_COUNT;
+    hdr.shstrndx = S_SHSTRTAB;
+
+    memcpy(file, &hdr, sizeof(hdr));
+    memcpy(file + off, sh, sizeof(sh));
+    off += sizeof(sh);
+
+    if(flaw == F_TRUNCATED)
+        off = hdr.shoff + sizeof(sh) / 2;
+
+    if(!(fp = fopen(FIXTURE, "wb")) || fwrite(file, off, 1, fp) != 1) {
+        perror(FIXTURE);
+        exit(1);
+    }
+
+    fclose(fp);
+}
+
+/* The fs and export calls the loader makes */
+file_t fs_open(const char *fn, int mode) {
+    return open(fn, mode);
+}
+
+int fs_close(file_t hnd) {
+    return close(hnd);
+}
+
+ssize_t fs_read(file_t hnd, void *buffer, size_t cnt) {
+    return read(hnd, buffer, cnt);
+}
+
+off_t fs_seek(file_t hnd, off_t offset, int whence) {
+    return lseek(hnd, offset, whence);
+}
+
+export_sym_t *export_lookup(const char *name) {
+    static export_sym_t printf_sym = { "printf", PRINTF_ADDR };
+
+    return strcmp(name, "printf") ? NULL : &printf_sym;
+}
+
+void arch_icache_sync_range(uintptr_t start, size_t count) {
+    (void)start;
+    (void)count;
+}
+
+static int fail(const char *what) {
+    printf("  %s: FAILED\n", what);
+    return 1;
+}
+
+static int check_good(void) {
+    elf_prog_t prog;
+    uint32_t base, *text;
+    uint8_t *img;
+    int i;
+
+    write_fixture(F_GOOD);
+
+    if(elf_load(FIXTURE, NULL, &prog) < 0)
+        return fail("good fixture doesn't load");
+
+    img = prog.data;
+    text = prog.data;
+    base = (uint32_t)(uintptr_t)img;
+
+    /* .text at 0, .data at 64, .bss at 96 */
+    if(((uintptr_t)img & 63) || prog.size != 196)
+        return fail("image alignment or size");
+
+    if(prog.lib_get_name != base || prog.lib_get_version != base + 4 ||
+       prog.lib_open != base + 8 || prog.lib_close != base + 12)
+        return fail("library entry points");
+
+    if(text[0] != PRINTF_ADDR || text[1] != base + 64 + 8 ||
+       text[2] != base + 96 + 4 || text[3] != 0x1234 + 2)
+        return fail("relocations");
+
+    if(memcmp(img + 64, data_sect, sizeof(data_sect)))
+        return fail(".data contents");
+
+    for(i = 0; i < 100; i++) {
+        if(img[96 + i])
+            return fail(".bss contents");
+    }
+
+    printf("  good fixture: ok, %u bytes read, %u bytes temporary\n",
+           prog.bytes_read, prog.peak_temp);
+
+    elf_free(&prog);
+
+    return 0;
+}
+
+static int check_bad(int flaw, const char *what) {
+    elf_prog_t prog;
+
+    write_fixture(flaw);
+
+    if(elf_load(FIXTURE, NULL, &prog) == 0 || prog.data) {
+        elf_free(&prog);
+        return fail(what);
+    }
+
+    printf("  %s: ok, rejected\n", what);
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int rv = 0;
+
+    if(argc > 1 && !strcmp(argv[1], "-v"))
+        dbglog_set_level(DBG_KDEBUG);
+
+    printf("ELF loader\n");
+
+    rv |= check_good();
+    rv |= check_bad(F_COMMON, "relocation against a common symbol");
+    rv |= check_bad(F_UNLOADED, "relocation against an unloaded section");
+    rv |= check_bad(F_RESERVED, "relocation against a reserved section");
+    rv |= check_bad(F_ROFF, "relocation offset past the section");
+    rv |= check_bad(F_ALIGN, "alignment that isn't a power of two");
+    rv |= check_bad(F_TRUNCATED, "truncated file");
+
+    return rv;
+}
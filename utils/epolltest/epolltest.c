@@ -0,0 +1,354 @@
+/* KallistiOS ##version##
+
+   epolltest.c
+
+   Test for epoll and poll(). This builds the real kernel/libc/koslib/epoll.c
+   and poll.c on a PC, over a small descriptor table of fake pipes that only
+   know whether they're readable.
+
+   Interrupts are played by taking the big lock from hoststubs' irq.h with
+   irq_host_inside set. That's used to check that events posted while someone
+   else has epoll busy aren't lost, and that files and instances closed then
+   are cleaned up afterwards. A second thread posting events as fast as it can
+   checks that a poll() or epoll_wait() going to sleep never misses a wakeup
+   (build with -fsanitize=address or thread to look harder).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "../../kernel/libc/koslib/epoll.c"
+#include "../../kernel/libc/koslib/poll.c"
+
+#define MAX_FDS     16
+#define RACES       2000
+
+/* A pipe, as far as epoll can tell */
+typedef struct {
+    atomic_int readable;
+} fake_t;
+
+static struct {
+    vfs_handler_t *hndl;
+    void *hnd;
+} fds[MAX_FDS];
+
+static int failed;
+
+#define CHECK(c) do { \
+        if(!(c)) { \
+            printf("%s:%d: %s failed\n", __func__, __LINE__, #c); \
+            failed = 1; \
+        } \
+    } while(0)
+
+static short fake_poll(void *hnd, short events) {
+    return ((fake_t *)hnd)->readable ? (events & POLLIN) : 0;
+}
+
+static vfs_handler_t fake_vh = { .poll = fake_poll };
+
+file_t fs_open_handle(vfs_handler_t *vfs, void *hnd) {
+    int i;
+
+    for(i = 0; i < MAX_FDS; ++i) {
+        if(!fds[i].hnd) {
+            fds[i].hndl = vfs;
+            fds[i].hnd = hnd;
+            return i;
+        }
+    }
+
+    errno = EMFILE;
+    return FILEHND_INVALID;
+}
+
+vfs_handler_t *fs_get_handler(file_t fd) {
+    return fd >= 0 && fd < MAX_FDS ? fds[fd].hndl : NULL;
+}
+
+void *fs_get_handle(file_t fd) {
+    return fd >= 0 && fd < MAX_FDS ? fds[fd].hnd : NULL;
+}
+
+/* What fs_hnd_unref() does once the last reference goes */
+static void fd_close(int fd) {
+    __epoll_hnd_close(fds[fd].hnd);
+
+    if(fds[fd].hndl->close)
+        fds[fd].hndl->close(fds[fd].hnd);
+
+    fds[fd].hndl = NULL;
+    fds[fd].hnd = NULL;
+}
+
+static int fake_open(fake_t *f) {
+    f->readable = 0;
+    return fs_open_handle(&fake_vh, f);
+}
+
+static void fake_post(fake_t *f, int readable) {
+    f->readable = readable;
+    __epoll_event_trigger(f, readable ? POLLIN : POLLOUT);
+}
+
+/* Run fn(arg) as an interrupt would */
+static void in_irq(void (*fn)(void *), void *arg) {
+    irq_mask_t old = irq_disable();
+
+    irq_host_inside = true;
+    fn(arg);
+    irq_host_inside = false;
+    irq_restore(old);
+}
+
+static void irq_post(void *f) {
+    fake_post((fake_t *)f, 1);
+}
+
+static void irq_hnd_close(void *f) {
+    __epoll_hnd_close(f);
+}
+
+static void irq_ep_close(void *fd) {
+    int epfd = *(int *)fd;
+
+    ep_close(fds[epfd].hnd);
+}
+
+static int add(int epfd, int fd, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.fd = fd };
+
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void check_triggers(void) {
+    struct epoll_event ev[4];
+    fake_t lt, et, os;
+    int epfd, flt, fet, fos;
+
+    epfd = epoll_create1(0);
+    flt = fake_open(&lt);
+    fet = fake_open(&et);
+    fos = fake_open(&os);
+
+    CHECK(!add(epfd, flt, EPOLLIN));
+    CHECK(!add(epfd, fet, EPOLLIN | EPOLLET));
+    CHECK(!add(epfd, fos, EPOLLIN | EPOLLONESHOT));
+    CHECK(add(epfd, flt, EPOLLIN) == -1 && errno == EEXIST);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 0);
+
+    /* Level-triggered: reported for as long as it's readable */
+    fake_post(&lt, 1);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 1 && ev[0].data.fd == flt &&
+          ev[0].events == EPOLLIN);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 1);
+    lt.readable = 0;
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 0);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 0);
+
+    /* Edge-triggered: reported once per event, readable or not */
+    fake_post(&et, 1);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 1 && ev[0].data.fd == fet);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 0);
+    fake_post(&et, 1);
+    fake_post(&et, 1);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 1 && ev[0].data.fd == fet);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 0);
+
+    /* Events that aren't asked for don't count */
+    fake_post(&et, 0);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 0);
+
+    /* One-shot: reported once, then not again until it's rearmed */
+    fake_post(&os, 1);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 1 && ev[0].data.fd == fos);
+    fake_post(&os, 1);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 0);
+    ev[0].events = EPOLLIN | EPOLLONESHOT;
+    CHECK(!epoll_ctl(epfd, EPOLL_CTL_MOD, fos, &ev[0]));
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 1 && ev[0].data.fd == fos);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 0);
+
+    /* All three at once, and no more than asked for */
+    lt.readable = 1;
+    fake_post(&lt, 1);
+    fake_post(&et, 1);
+    CHECK(epoll_wait(epfd, ev, 1, 0) == 1);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 2);
+
+    CHECK(!epoll_ctl(epfd, EPOLL_CTL_DEL, flt, NULL));
+    CHECK(epoll_ctl(epfd, EPOLL_CTL_DEL, flt, NULL) == -1 && errno == ENOENT);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 0);
+
+    fd_close(flt);
+    fd_close(fet);
+    fd_close(fos);
+    CHECK(ep_nitems == 0);
+    fd_close(epfd);
+}
+
+/* Everything an interrupt does while epoll is busy has to stick */
+static void check_busy(void) {
+    struct epoll_event ev[4];
+    fake_t a, b;
+    int epfd, epfd2, fa, fb;
+
+    epfd = epoll_create1(0);
+    fa = fake_open(&a);
+    fb = fake_open(&b);
+    CHECK(!add(epfd, fa, EPOLLIN | EPOLLET));
+    CHECK(!add(epfd, fb, EPOLLIN));
+
+    /* An event */
+    mutex_lock(&__epoll_mutex);
+    in_irq(irq_post, &a);
+    __epoll_unlock();
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 1 && ev[0].data.fd == fa);
+
+    /* A file going away. Its registration has to be dropped, without being
+       reported, and nothing can be posted to it after. */
+    mutex_lock(&__epoll_mutex);
+    in_irq(irq_hnd_close, &b);
+    CHECK(ep_nitems == 2);
+    __epoll_unlock();
+    fds[fb].hnd = NULL;
+    fake_post(&b, 1);
+    CHECK(epoll_wait(epfd, ev, 4, 0) == 0);
+    CHECK(ep_nitems == 1);
+
+    /* And an instance, with a registration on it */
+    epfd2 = epoll_create1(0);
+    CHECK(!add(epfd2, fa, EPOLLIN));
+    CHECK(ep_nitems == 2);
+    mutex_lock(&__epoll_mutex);
+    in_irq(irq_ep_close, &epfd2);
+    CHECK(!LIST_EMPTY(&ep_closed));
+    __epoll_unlock();
+    fds[epfd2].hnd = NULL;
+    CHECK(LIST_EMPTY(&ep_closed));
+    CHECK(ep_nitems == 1);
+
+    /* Not busy, in an interrupt: it can't wait, but can do everything else */
+    mutex_lock(&__epoll_mutex);
+    irq_host_inside = true;
+    CHECK(epoll_wait(epfd, ev, 4, 0) == -1 && errno == EBUSY);
+    irq_host_inside = false;
+    __epoll_unlock();
+    irq_host_inside = true;
+    CHECK(epoll_wait(epfd, ev, 4, 10) == -1 && errno == EPERM);
+    irq_host_inside = false;
+
+    fd_close(fa);
+    fd_close(epfd);
+    CHECK(ep_nitems == 0);
+}
+
+static void check_poll(void) {
+    struct pollfd pfd[2];
+    fake_t a, b;
+    uint64_t t;
+    int fb;
+
+    pfd[0].fd = fake_open(&a);
+    pfd[1].fd = fb = fake_open(&b);
+    pfd[0].events = pfd[1].events = POLLIN;
+
+    t = timer_ms_gettime64();
+    CHECK(poll(pfd, 2, 20) == 0);
+    CHECK(timer_ms_gettime64() - t >= 20);
+    CHECK(ep_nitems == 0);
+
+    b.readable = 1;
+    CHECK(poll(pfd, 2, 0) == 1 && !pfd[0].revents && pfd[1].revents == POLLIN);
+    CHECK(poll(pfd, 2, -1) == 1);
+
+    pfd[1].fd = 99;
+    CHECK(poll(pfd, 2, 0) == 1 && pfd[1].revents == POLLNVAL);
+
+    fd_close(pfd[0].fd);
+    fd_close(fb);
+    CHECK(ep_nitems == 0);
+}
+
+/* The other side of the races below: post as soon as the sleeper is ready */
+typedef struct {
+    fake_t f;
+    atomic_int go, stop;
+} racer_t;
+
+static void *race_thd(void *p) {
+    racer_t *r = (racer_t *)p;
+
+    while(!r->stop) {
+        if(!r->go) {
+            sched_yield();
+            continue;
+        }
+
+        in_irq(irq_post, &r->f);
+        r->go = 0;
+    }
+
+    return NULL;
+}
+
+static void check_races(void) {
+    struct epoll_event ev;
+    struct pollfd pfd;
+    pthread_t thd;
+    racer_t r = { 0 };
+    int i, epfd, lost = 0;
+
+    pfd.fd = fake_open(&r.f);
+    pfd.events = POLLIN;
+    epfd = epoll_create1(0);
+    CHECK(!add(epfd, pfd.fd, EPOLLIN | EPOLLET));
+    pthread_create(&thd, NULL, race_thd, &r);
+
+    for(i = 0; i < RACES; ++i) {
+        r.f.readable = 0;
+        r.go = 1;
+
+        if(poll(&pfd, 1, 1000) != 1 || pfd.revents != POLLIN)
+            ++lost;
+
+        while(r.go)
+            sched_yield();
+
+        /* Eat the edge poll() left behind */
+        epoll_wait(epfd, &ev, 1, 0);
+        r.go = 1;
+
+        if(epoll_wait(epfd, &ev, 1, 1000) != 1)
+            ++lost;
+
+        while(r.go)
+            sched_yield();
+    }
+
+    r.stop = 1;
+    pthread_join(thd, NULL);
+
+    if(lost)
+        printf("%d of %d wakeups lost\n", lost, RACES * 2);
+
+    CHECK(!lost);
+    fd_close(pfd.fd);
+    fd_close(epfd);
+    CHECK(ep_nitems == 0);
+}
+
+int main(void) {
+    check_triggers();
+    check_busy();
+    check_poll();
+    check_races();
+
+    printf("%s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
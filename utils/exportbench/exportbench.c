@@ -0,0 +1,174 @@
+/* KallistiOS ##version##
+
+   exportbench.c
+
+   Benchmark for the kernel export tables. This builds the real
+   kernel/exports/exports.c against a large synthetic table generated by
+   genexports.sh, and runs it on a PC.
+
+   It simulates loading a module with a lot of relocations: each one looks up
+   an undefined symbol by name, as elf_load() does. A share of them are not in
+   the table at all, as happens for symbols that come from other libraries.
+   The same is then done for export_lookup_addr(). Both are compared against
+   the linear scans they replaced.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../kernel/exports/exports.c"
+
+#define NRELOCS     20000
+#define MISS_PCT    10
+
+/* Keeps the compiler from throwing the timed lookups away */
+static export_sym_t *volatile sink;
+
+/* Just enough of nmmgr for exports.c */
+static nmmgr_list_t nmmgrs = SLIST_HEAD_INITIALIZER(nmmgrs);
+
+nmmgr_list_t *nmmgr_get_list(void) {
+    return &nmmgrs;
+}
+
+nmmgr_handler_t *nmmgr_lookup(const char *name) {
+    nmmgr_handler_t *nmmgr;
+
+    SLIST_FOREACH(nmmgr, &nmmgrs, list_ent) {
+        if(!strcmp(nmmgr->pathname, name))
+            return nmmgr;
+    }
+
+    return NULL;
+}
+
+int nmmgr_handler_add(nmmgr_handler_t *hnd) {
+    SLIST_INSERT_HEAD(&nmmgrs, hnd, list_ent);
+    return 0;
+}
+
+/* What export_lookup() used to do */
+static export_sym_t *linear_lookup(const char *name) {
+    nmmgr_handler_t *nmmgr;
+    symtab_handler_t *sth;
+    int i;
+
+    SLIST_FOREACH(nmmgr, &nmmgrs, list_ent) {
+        sth = (symtab_handler_t *)nmmgr;
+
+        for(i = 0; sth->table[i].name; i++) {
+            if(!strcmp(name, sth->table[i].name))
+                return sth->table + i;
+        }
+    }
+
+    return NULL;
+}
+
+/* What export_lookup_addr() used to do */
+static export_sym_t *linear_lookup_addr(uintptr_t addr) {
+    nmmgr_handler_t *nmmgr;
+    symtab_handler_t *sth;
+    uintptr_t dist = ~0;
+    export_sym_t *best = NULL;
+    int i;
+
+    SLIST_FOREACH(nmmgr, &nmmgrs, list_ent) {
+        sth = (symtab_handler_t *)nmmgr;
+
+        for(i = 0; sth->table[i].name; i++) {
+            if(addr - sth->table[i].ptr < dist) {
+                dist = addr - sth->table[i].ptr;
+                best = sth->table + i;
+            }
+        }
+    }
+
+    return best;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int main(int argc, char *argv[]) {
+    static char names[NRELOCS][64];
+    static uintptr_t addrs[NRELOCS];
+    export_sym_t *a, *b;
+    size_t nsyms, i;
+    unsigned int seed = 1;
+    double t0, t_lin, t_hash;
+
+    (void)argc;
+    (void)argv;
+
+    export_init();
+
+    for(nsyms = 0; kernel_symtab[nsyms].name; nsyms++)
+        ;
+
+    /* Make up the relocations */
+    for(i = 0; i < NRELOCS; i++) {
+        seed = seed * 1103515245 + 12345;
+
+        if((seed >> 16) % 100 < MISS_PCT)
+            snprintf(names[i], sizeof(names[i]), "not_exported_%u", seed);
+        else
+            strcpy(names[i], kernel_symtab[(seed >> 8) % nsyms].name);
+
+        addrs[i] = kernel_symtab[(seed >> 4) % nsyms].ptr + (seed & 3);
+    }
+
+    printf("%zu exported symbols, %d relocations (%d%% unresolved)\n",
+           nsyms, NRELOCS, MISS_PCT);
+
+    /* Make sure both agree before timing anything */
+    for(i = 0; i < NRELOCS; i++) {
+        if(export_lookup(names[i]) != linear_lookup(names[i])) {
+            fprintf(stderr, "mismatch looking up %s\n", names[i]);
+            return 1;
+        }
+
+        a = export_lookup_addr(addrs[i]);
+        b = linear_lookup_addr(addrs[i]);
+
+        if(a != b && (!a || !b || a->ptr != b->ptr)) {
+            fprintf(stderr, "mismatch looking up %#lx\n",
+                    (unsigned long)addrs[i]);
+            return 1;
+        }
+    }
+
+    t0 = now_ms();
+    for(i = 0; i < NRELOCS; i++)
+        sink = linear_lookup(names[i]);
+    t_lin = now_ms() - t0;
+
+    t0 = now_ms();
+    for(i = 0; i < NRELOCS; i++)
+        sink = export_lookup(names[i]);
+    t_hash = now_ms() - t0;
+
+    printf("by name:    linear %8.3f ms, hashed  %8.3f ms (%.1fx)\n",
+           t_lin, t_hash, t_lin / t_hash);
+
+    t0 = now_ms();
+    for(i = 0; i < NRELOCS; i++)
+        sink = linear_lookup_addr(addrs[i]);
+    t_lin = now_ms() - t0;
+
+    t0 = now_ms();
+    for(i = 0; i < NRELOCS; i++)
+        sink = export_lookup_addr(addrs[i]);
+    t_hash = now_ms() - t0;
+
+    printf("by address: linear %8.3f ms, indexed %8.3f ms (%.1fx)\n",
+           t_lin, t_hash, t_lin / t_hash);
+
+    return 0;
+}
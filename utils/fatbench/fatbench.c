@@ -0,0 +1,495 @@
+/* KallistiOS ##version##
+
+   fatbench.c
+
+   Benchmark for big reads and writes on FAT32. This builds the real
+   libkosfat (and the block cache under it) on a PC, with pthreads standing in
+   for KOS threads, on top of a simulated block device backed by an image
+   file. The device doesn't wait; it adds up how long each request would have
+   taken on a real card or disk (a fixed cost per request plus a cost per
+   block), and that's what the throughput is worked out from.
+
+   A file is written and read back in chunks of a few sizes, once from a
+   buffer that's aligned, so that whole clusters go straight between the
+   device and the buffer a run at a time, and once from one that isn't, so
+   that everything goes through the cluster cache. Everything read is checked.
+   Then mixing the two is checked: reading straight from the device has to see
+   what's only in the cache so far, and writing straight to it mustn't leave
+   anything stale in the cache, even when some of it is pinned there. Last,
+   the image is mounted again and the files are checked once more.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <kos/fs.h>
+#include <kos/nmmgr.h>
+#include <kos/bcache.h>
+#include <kos/thread.h>
+#include <kos/dbglog.h>
+#include <kos/blockdev.h>
+#include <fat/fs_fat.h>
+
+#define IMG_PATH    "fatbench.img"
+#define FILE_SIZE   (8 * 1024 * 1024)
+
+#define CMD_US      250         /* Device time for each request */
+#define BLOCK_US    20          /* Device time for each 512 byte block */
+
+/* Stand-ins for the parts of KOS libkosfat uses */
+kthread_t *thd_create(bool detach, void *(*routine)(void *param),
+                      void *param) {
+    pthread_t thd;
+
+    if(pthread_create(&thd, NULL, routine, param))
+        return NULL;
+
+    if(detach)
+        pthread_detach(thd);
+
+    return (kthread_t *)1;
+}
+
+static vfs_handler_t *mounted;
+
+int nmmgr_handler_add(nmmgr_handler_t *hnd) {
+    mounted = (vfs_handler_t *)hnd;
+    return 0;
+}
+
+int nmmgr_handler_remove(nmmgr_handler_t *hnd) {
+    if((vfs_handler_t *)hnd == mounted)
+        mounted = NULL;
+
+    return 0;
+}
+
+/* When pin_ranges is set, the first cached buffer of a range that's dropped
+   from the cache to be written straight to the device is pinned, as though
+   something were still using it, until the test is done with it. */
+static bool pin_ranges;
+static bcache_t *pinned_cache;
+static uint64_t pinned_block;
+
+int __real_bcache_invalidate_range(bcache_t *c, uint64_t block,
+                                   uint64_t count);
+
+int __wrap_bcache_invalidate_range(bcache_t *c, uint64_t block,
+                                   uint64_t count) {
+    uint64_t i;
+
+    for(i = 0; pin_ranges && !pinned_cache && i < count; ++i) {
+        if(!bcache_pin(c, block + i)) {
+            pinned_cache = c;
+            pinned_block = block + i;
+        }
+    }
+
+    return __real_bcache_invalidate_range(c, block, count);
+}
+
+/* The simulated device */
+typedef struct img_dev {
+    int fd;
+    uint64_t blocks;
+    uint32_t cmds;
+    uint64_t time_us;
+} img_dev_t;
+
+static int img_init(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int img_shutdown(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static int img_read(const kos_blockdev_t *d, uint64_t block, size_t count,
+                    void *buf) {
+    img_dev_t *img = (img_dev_t *)d->dev_data;
+    size_t len = count << d->l_block_size;
+
+    if(block + count > img->blocks ||
+       pread(img->fd, buf, len, block << d->l_block_size) != (ssize_t)len) {
+        errno = EIO;
+        return -1;
+    }
+
+    ++img->cmds;
+    img->time_us += CMD_US + count * BLOCK_US;
+    return 0;
+}
+
+static int img_write(const kos_blockdev_t *d, uint64_t block, size_t count,
+                     const void *buf) {
+    img_dev_t *img = (img_dev_t *)d->dev_data;
+    size_t len = count << d->l_block_size;
+
+    if(block + count > img->blocks ||
+       pwrite(img->fd, buf, len, block << d->l_block_size) != (ssize_t)len) {
+        errno = EIO;
+        return -1;
+    }
+
+    ++img->cmds;
+    img->time_us += CMD_US + count * BLOCK_US;
+    return 0;
+}
+
+static uint64_t img_count(const kos_blockdev_t *d) {
+    return ((img_dev_t *)d->dev_data)->blocks;
+}
+
+static int img_flush(kos_blockdev_t *d) {
+    (void)d;
+    return 0;
+}
+
+static img_dev_t img;
+
+static kos_blockdev_t img_bd = {
+    &img, 9, img_init, img_shutdown, img_read, img_write, img_count, img_flush
+};
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* Make an empty FAT32 image with 4KB clusters, with a few more clusters than
+   FAT16 can have. */
+static int make_fat32(void) {
+    uint8_t bs[512], sect[512];
+    uint32_t clusters = 66000, rsvd = 32, fatsz, total, i;
+
+    fatsz = ((clusters + 2) * 4 + 511) / 512;
+    total = rsvd + 2 * fatsz + clusters * 8;
+
+    if((img.fd = open(IMG_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+       ftruncate(img.fd, (off_t)total * 512)) {
+        perror(IMG_PATH);
+        return -1;
+    }
+
+    img.blocks = total;
+
+    memset(bs, 0, sizeof(bs));
+    bs[0] = 0xEB;
+    bs[1] = 0x58;
+    bs[2] = 0x90;
+    memcpy(bs + 3, "KOSTEST ", 8);
+    put16(bs + 11, 512);
+    bs[13] = 8;
+    put16(bs + 14, rsvd);
+    bs[16] = 2;
+    bs[21] = 0xF8;
+    put16(bs + 24, 32);
+    put16(bs + 26, 64);
+    put32(bs + 32, total);
+    put32(bs + 36, fatsz);
+    put32(bs + 44, 2);
+    put16(bs + 48, 1);
+    put16(bs + 50, 6);
+    bs[66] = 0x29;
+    memcpy(bs + 71, "FATBENCH   ", 11);
+    memcpy(bs + 82, "FAT32   ", 8);
+    bs[510] = 0x55;
+    bs[511] = 0xAA;
+
+    pwrite(img.fd, bs, 512, 0);
+    pwrite(img.fd, bs, 512, 6 * 512);
+
+    memset(sect, 0, sizeof(sect));
+    put32(sect, 0x41615252);
+    put32(sect + 484, 0x61417272);
+    put32(sect + 488, clusters - 1);
+    put32(sect + 492, 2);
+    put32(sect + 508, 0xAA550000);
+    pwrite(img.fd, sect, 512, 512);
+    pwrite(img.fd, sect, 512, 7 * 512);
+
+    /* The first entries of both FATs: the media byte, end of chain and the
+       root directory's cluster. */
+    memset(sect, 0, sizeof(sect));
+    put32(sect, 0x0FFFFFF8);
+    put32(sect + 4, 0x0FFFFFFF);
+    put32(sect + 8, 0x0FFFFFFF);
+
+    for(i = 0; i < 2; ++i)
+        pwrite(img.fd, sect, 512, (off_t)(rsvd + i * fatsz) * 512);
+
+    return 0;
+}
+
+static uint8_t pattern(uint32_t seed, uint32_t off) {
+    return (uint8_t)(seed * 131 + off * 7 + (off >> 9));
+}
+
+static void fill(uint8_t *buf, uint32_t seed, uint32_t off, size_t n) {
+    size_t i;
+
+    for(i = 0; i < n; ++i)
+        buf[i] = pattern(seed, off + i);
+}
+
+/* Write the file (or part of it, from off) in chunks, from buf. */
+static int write_file(const char *fn, uint32_t seed, uint32_t off,
+                      uint32_t size, uint8_t *buf, size_t chunk, int trunc) {
+    uint32_t n;
+    void *h;
+
+    /* libkosfat cuts files opened with O_WRONLY off where the last write to
+       them ends, so use O_RDWR for writing into the middle. */
+    if(!(h = mounted->open(mounted, fn, O_CREAT | (trunc ? O_WRONLY | O_TRUNC :
+                                                   O_RDWR)))) {
+        printf("  can't open %s: %s\n", fn, strerror(errno));
+        return -1;
+    }
+
+    if(off && mounted->seek64(h, off, SEEK_SET) != off) {
+        printf("  can't seek %s: %s\n", fn, strerror(errno));
+        mounted->close(h);
+        return -1;
+    }
+
+    for(; size; off += n, size -= n) {
+        n = size < chunk ? size : chunk;
+        fill(buf, seed, off, n);
+
+        if(mounted->write(h, buf, n) != (ssize_t)n) {
+            printf("  write to %s failed: %s\n", fn, strerror(errno));
+            mounted->close(h);
+            return -1;
+        }
+    }
+
+    mounted->close(h);
+    return 0;
+}
+
+/* Read the file back in chunks into buf, checking it against the seeds it
+   was written with: seed2 from off2 for len2 bytes, seed everywhere else. */
+static int read_file(const char *fn, uint32_t seed, uint32_t size,
+                     uint8_t *buf, size_t chunk, uint32_t seed2,
+                     uint32_t off2, uint32_t len2) {
+    uint32_t off, n, i;
+    void *h;
+
+    if(!(h = mounted->open(mounted, fn, O_RDONLY))) {
+        printf("  can't open %s: %s\n", fn, strerror(errno));
+        return -1;
+    }
+
+    for(off = 0; off < size; off += n) {
+        n = size - off < chunk ? size - off : chunk;
+
+        if(mounted->read(h, buf, n) != (ssize_t)n) {
+            printf("  read of %s failed at %u: %s\n", fn, off,
+                   strerror(errno));
+            mounted->close(h);
+            return -1;
+        }
+
+        for(i = 0; i < n; ++i) {
+            if(buf[i] != pattern(off + i >= off2 && off + i < off2 + len2 ?
+                                 seed2 : seed, off + i)) {
+                printf("  %s is wrong at %u\n", fn, off + i);
+                mounted->close(h);
+                return -1;
+            }
+        }
+    }
+
+    if(mounted->read(h, buf, 1) != 0) {
+        printf("  %s is too long\n", fn);
+        mounted->close(h);
+        return -1;
+    }
+
+    mounted->close(h);
+    return 0;
+}
+
+static void start(void) {
+    img.cmds = 0;
+    img.time_us = 0;
+}
+
+static double mb_per_sec(void) {
+    return (double)FILE_SIZE / img.time_us;
+}
+
+static int bench(size_t chunk, int aligned, uint8_t *buf) {
+    uint8_t *b = aligned ? buf : buf + 1;
+    uint32_t wcmds, seed = chunk + aligned;
+    double wmbs;
+
+    start();
+
+    if(write_file("/big.bin", seed, 0, FILE_SIZE, b, chunk, 1) ||
+       fs_fat_sync("/bench"))
+        return -1;
+
+    wcmds = img.cmds;
+    wmbs = mb_per_sec();
+    start();
+
+    if(read_file("/big.bin", seed, FILE_SIZE, b, chunk, 0, 0, 0))
+        return -1;
+
+    printf("  %6zu  %-9s  %8.2f  %7u  %8.2f  %7u\n", chunk,
+           aligned ? "aligned" : "unaligned", wmbs, wcmds, mb_per_sec(),
+           img.cmds);
+
+    return 0;
+}
+
+/* Mix direct I/O with the cache on the same clusters, without syncing in
+   between. */
+static int mix(uint8_t *buf) {
+    const uint32_t size = 256 * 1024;
+    int err;
+
+    /* Through the cache, then read straight from the device: the direct read
+       has to write back what's still dirty in the cache first. */
+    if(write_file("/mix.bin", 1, 0, size, buf + 1, 4096, 1) ||
+       read_file("/mix.bin", 1, size, buf, size, 0, 0, 0)) {
+        printf("  direct read after a cached write: FAILED\n");
+        return -1;
+    }
+
+    printf("  direct read after a cached write: ok\n");
+
+    /* Read part of it through the cache, overwrite the middle straight to
+       the device, then read it through the cache again: the cache mustn't
+       still have the old data. */
+    if(read_file("/mix.bin", 1, size, buf + 1, 4096, 0, 0, 0) ||
+       write_file("/mix.bin", 2, 64 * 1024, 64 * 1024, buf, 64 * 1024, 0) ||
+       read_file("/mix.bin", 1, size, buf + 1, 4096, 2, 64 * 1024,
+                 64 * 1024)) {
+        printf("  cached read after a direct write: FAILED\n");
+        return -1;
+    }
+
+    printf("  cached read after a direct write: ok\n");
+
+    /* Write over all of that, starting in the middle of a cluster, which goes
+       through the cache for the first part and straight to the device for
+       the rest. */
+    if(write_file("/mix.bin", 3, 1024, 140000, buf, 140000, 0) ||
+       read_file("/mix.bin", 1, size, buf, size, 3, 1024, 140000) ||
+       read_file("/mix.bin", 1, size, buf + 1, 3000, 3, 1024, 140000)) {
+        printf("  unaligned start of a direct write: FAILED\n");
+        return -1;
+    }
+
+    printf("  unaligned start of a direct write: ok\n");
+
+    /* Write a file through the cache and read it back, so that all of it
+       is in there, then write over it straight to the device while part of
+       it is pinned. What's pinned can't be dropped, so it has to be written
+       through the cache instead, or reading it back gets the old data. */
+    if(write_file("/pin.bin", 5, 0, 32768, buf + 1, 4096, 1) ||
+       fs_fat_sync("/bench") ||
+       read_file("/pin.bin", 5, 32768, buf + 1, 4096, 0, 0, 0))
+        goto pinned_fail;
+
+    pin_ranges = true;
+    err = write_file("/pin.bin", 6, 0, 32768, buf, 32768, 0);
+    pin_ranges = false;
+
+    if(!pinned_cache)
+        goto pinned_fail;
+
+    err = err || read_file("/pin.bin", 6, 32768, buf + 1, 4096, 0, 0, 0) ||
+          read_file("/pin.bin", 6, 32768, buf, 32768, 0, 0, 0);
+    bcache_unpin(pinned_cache, pinned_block);
+
+    if(err)
+        goto pinned_fail;
+
+    printf("  direct write over pinned clusters: ok\n");
+    return 0;
+
+pinned_fail:
+    printf("  direct write over pinned clusters: FAILED\n");
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t chunks[] = { 4096, 32768, 262144 };
+    uint8_t *buf;
+    size_t i;
+    int rv = 0;
+
+    if(argc > 1 && !strcmp(argv[1], "-v"))
+        dbglog_set_level(DBG_KDEBUG);
+
+    if(make_fat32())
+        return 1;
+
+    if(!(buf = aligned_alloc(32, 262144 + 32))) {
+        perror("aligned_alloc");
+        return 1;
+    }
+
+    fs_fat_init();
+
+    if(fs_fat_mount("/bench", &img_bd, FS_FAT_MOUNT_READWRITE) || !mounted) {
+        printf("mount failed: %s\n", strerror(errno));
+        return 1;
+    }
+
+    printf("Simulated device: %u us per request, %u us per block\n\n", CMD_US,
+           BLOCK_US);
+    printf("   chunk  buffer        write  requests      read  requests\n");
+    printf("                         MB/s                  MB/s\n");
+
+    for(i = 0; i < sizeof(chunks) / sizeof(chunks[0]); ++i) {
+        if(bench(chunks[i], 0, buf) || bench(chunks[i], 1, buf))
+            rv = 1;
+    }
+
+    printf("\nMixing direct I/O with the cache:\n");
+
+    if(mix(buf))
+        rv = 1;
+
+    /* Make sure everything got to the image properly. */
+    fs_fat_unmount("/bench");
+
+    if(fs_fat_mount("/bench", &img_bd, FS_FAT_MOUNT_READONLY) ||
+       read_file("/big.bin", chunks[i - 1] + 1, FILE_SIZE, buf + 1, 4096, 0, 0,
+                 0) ||
+       read_file("/mix.bin", 1, 256 * 1024, buf + 1, 4096, 3, 1024, 140000) ||
+       read_file("/pin.bin", 6, 32768, buf + 1, 4096, 0, 0, 0)) {
+        printf("  after remounting: FAILED\n");
+        rv = 1;
+    }
+    else {
+        printf("  after remounting: ok\n");
+    }
+
+    fs_fat_unmount("/bench");
+    fs_fat_shutdown();
+    close(img.fd);
+    unlink(IMG_PATH);
+    free(buf);
+
+    return rv;
+}
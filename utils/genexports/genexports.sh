@@ -17,8 +17,9 @@ outpsym=$3
 
 includes=`cat $inpfile | grep '^include ' | cut -d' ' -f2 | sort`
 
-# Get the list of export names
-names=`cat $inpfile | grep -v '^#' | grep -v '^include ' | grep -v '^$' | sort`
+# Get the list of export names. Sort in the C locale so the order doesn't
+# depend on the host.
+names=`cat $inpfile | grep -v '^#' | grep -v '^include ' | grep -v '^$' | LC_ALL=C sort -u`
 
 # Write out a header
 rm -f $outpfile
@@ -33,6 +34,7 @@ echo '#endif' >> $outpfile
 for i in $includes; do
 	echo "#include <$i>" >> $outpfile
 done
+echo '#include <kos/exports.h>' >> $outpfile
 
 # Now write out the sym table
 echo '#pragma GCC diagnostic ignored "-Wdeprecated-declarations"' >> $outpfile
@@ -43,3 +45,42 @@ done
 
 echo "	{ 0, 0 }" >> $outpfile
 echo "};" >> $outpfile
+
+# And the name hash index for it: an open-addressed table, at most half full,
+# of 1-based indices into the sym table. The hash must match export_hash() in
+# kernel/exports/exports.c.
+echo "$names" | grep -v '^$' | LC_ALL=C awk -v sym="$outpsym" '
+BEGIN {
+	for(i = 1; i < 256; i++)
+		ord[sprintf("%c", i)] = i
+}
+{
+	name[NR - 1] = $0
+}
+END {
+	n = NR
+	if(n >= 65535) {
+		print "genexports.sh: too many exports" > "/dev/stderr"
+		exit 1
+	}
+
+	size = 1
+	while(size < 2 * n)
+		size *= 2
+
+	for(i = 0; i < n; i++) {
+		h = 5381
+		for(j = 1; j <= length(name[i]); j++)
+			h = (h * 33 + ord[substr(name[i], j, 1)]) % 4294967296
+		s = h % size
+		while(s in slot)
+			s = (s + 1) % size
+		slot[s] = i + 1
+	}
+
+	printf "static const uint16_t %s_hash_slots[] = {\n", sym
+	for(i = 0; i < size; i++)
+		printf "\t%d,\n", (i in slot) ? slot[i] : 0
+	printf "};\n"
+	printf "const export_hash_t %s_hash = { %d, %s_hash_slots };\n", sym, size - 1, sym
+}' >> $outpfile || exit 1
@@ -0,0 +1,18 @@
+/* KallistiOS ##version##
+
+   utils/hoststubs/dc/vblank.h
+
+   Stand-in for the real header. The harness provides the functions.
+*/
+
+#ifndef __DC_VBLANK_H
+#define __DC_VBLANK_H
+
+#include <stdint.h>
+
+typedef void (*asic_evt_handler)(uint32_t code, void *data);
+
+int vblank_handler_add(asic_evt_handler hnd, void *data);
+int vblank_handler_remove(int handle);
+
+#endif /* __DC_VBLANK_H */
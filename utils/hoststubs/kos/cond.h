@@ -0,0 +1,80 @@
+/* KallistiOS ##version##
+
+   utils/hoststubs/kos/cond.h
+
+   Stand-in for the real header on top of pthreads.
+*/
+
+#ifndef __KOS_COND_H
+#define __KOS_COND_H
+
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <kos/mutex.h>
+
+typedef pthread_cond_t condvar_t;
+
+#define COND_INITIALIZER    PTHREAD_COND_INITIALIZER
+
+static inline int cond_init(condvar_t *cv) {
+    return pthread_cond_init(cv, NULL);
+}
+
+static inline int cond_destroy(condvar_t *cv) {
+    return pthread_cond_destroy(cv);
+}
+
+static inline int cond_wait(condvar_t *cv, mutex_t *m) {
+    return pthread_cond_wait(cv, m);
+}
+
+/* With "interrupts" disabled, sleep on the interrupt lock instead, so that
+   nobody can post and signal between letting go of the mutex and going to
+   sleep. As on the real thing, a timeout of 0 means forever. */
+static inline int cond_wait_timed(condvar_t *cv, mutex_t *m, int timeout) {
+    pthread_mutex_t *lock = irq_host_depth ? &irq_host_lock : m;
+    struct timespec ts;
+    int rv;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout / 1000;
+    ts.tv_nsec += (timeout % 1000) * 1000000L;
+
+    if(ts.tv_nsec >= 1000000000L) {
+        ++ts.tv_sec;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    if(lock != m)
+        pthread_mutex_unlock(m);
+
+    if(timeout)
+        rv = pthread_cond_timedwait(cv, lock, &ts);
+    else
+        rv = pthread_cond_wait(cv, lock);
+
+    /* Don't sit on the interrupt lock while waiting for the mutex */
+    if(lock != m) {
+        pthread_mutex_unlock(&irq_host_lock);
+        pthread_mutex_lock(m);
+        pthread_mutex_lock(&irq_host_lock);
+    }
+
+    if(rv) {
+        errno = rv;
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline int cond_signal(condvar_t *cv) {
+    return pthread_cond_signal(cv);
+}
+
+static inline int cond_broadcast(condvar_t *cv) {
+    return pthread_cond_broadcast(cv);
+}
+
+#endif /* __KOS_COND_H */
@@ -0,0 +1,39 @@
+/* KallistiOS ##version##
+
+   utils/hoststubs/kos/dbglog.h
+
+   Stand-in for the real header. Messages up to the level set with
+   dbglog_set_level() go to stderr; none do by default.
+*/
+
+#ifndef __KOS_DBGLOG_H
+#define __KOS_DBGLOG_H
+
+#include <stdio.h>
+
+#define DBG_DEAD        0
+#define DBG_CRITICAL    1
+#define DBG_ERROR       2
+#define DBG_WARNING     3
+#define DBG_NOTICE      4
+#define DBG_INFO        5
+#define DBG_DEBUG       6
+#define DBG_KDEBUG      7
+#define DBG_MAX         8
+
+/* The switches for each system's verbose messages are all off */
+#define DBG_SOURCE(x)   DBG_MAX
+
+__attribute__((weak)) int dbglog_host_level = -1;
+
+static inline void dbglog_set_level(int level) {
+    dbglog_host_level = level;
+}
+
+#define dbglog(lvl, ...) \
+    do { \
+        if((lvl) <= dbglog_host_level) \
+            fprintf(stderr, __VA_ARGS__); \
+    } while(0)
+
+#endif /* __KOS_DBGLOG_H */
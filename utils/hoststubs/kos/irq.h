@@ -0,0 +1,49 @@
+/* KallistiOS ##version##
+
+   utils/hoststubs/kos/irq.h
+
+   Stand-in for the real header. Disabling interrupts takes one big lock, so
+   a test can play the part of an interrupt handler from another thread by
+   taking it (with irq_disable()) and setting irq_host_inside for the
+   duration. Nothing else runs in interrupt context on a PC.
+*/
+
+#ifndef __KOS_IRQ_H
+#define __KOS_IRQ_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef int irq_mask_t;
+
+__attribute__((weak)) pthread_mutex_t irq_host_lock = PTHREAD_MUTEX_INITIALIZER;
+__attribute__((weak)) __thread int irq_host_depth;
+__attribute__((weak)) __thread bool irq_host_inside;
+
+static inline bool irq_inside_int(void) {
+    return irq_host_inside;
+}
+
+/* Nested calls just count, like the real ones only save the old state */
+static inline irq_mask_t irq_disable(void) {
+    if(!irq_host_depth)
+        pthread_mutex_lock(&irq_host_lock);
+
+    return irq_host_depth++;
+}
+
+static inline void irq_restore(irq_mask_t old) {
+    if(old < irq_host_depth && !(irq_host_depth = old))
+        pthread_mutex_unlock(&irq_host_lock);
+}
+
+static inline void __irq_scoped_cleanup(irq_mask_t *state) {
+    irq_restore(*state);
+}
+
+#define ___irq_disable_scoped(l) \
+    irq_mask_t __scoped_irq_##l __attribute__((cleanup(__irq_scoped_cleanup))) = irq_disable()
+#define __irq_disable_scoped(l) ___irq_disable_scoped(l)
+#define irq_disable_scoped() __irq_disable_scoped(__LINE__)
+
+#endif /* __KOS_IRQ_H */
@@ -0,0 +1,60 @@
+/* KallistiOS ##version##
+
+   utils/hoststubs/kos/mutex.h
+
+   Stand-in for the real header on top of pthreads. As on the real thing,
+   mutex_lock_irqsafe() only tries the lock when in an "interrupt" (see irq.h).
+*/
+
+#ifndef __KOS_MUTEX_H
+#define __KOS_MUTEX_H
+
+#include <pthread.h>
+#include <errno.h>
+#include <kos/irq.h>
+
+typedef pthread_mutex_t mutex_t;
+
+#define MUTEX_TYPE_NORMAL   0
+#define MUTEX_INITIALIZER   PTHREAD_MUTEX_INITIALIZER
+
+static inline int mutex_init(mutex_t *m, int type) {
+    (void)type;
+    return pthread_mutex_init(m, NULL);
+}
+
+static inline int mutex_destroy(mutex_t *m) {
+    return pthread_mutex_destroy(m);
+}
+
+static inline int mutex_lock(mutex_t *m) {
+    return pthread_mutex_lock(m);
+}
+
+static inline int mutex_lock_irqsafe(mutex_t *m) {
+    if(!irq_inside_int())
+        return pthread_mutex_lock(m);
+
+    if(pthread_mutex_trylock(m)) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline int mutex_unlock(mutex_t *m) {
+    return pthread_mutex_unlock(m);
+}
+
+static inline void __mutex_scoped_cleanup(mutex_t **m) {
+    mutex_unlock(*m);
+}
+
+#define ___mutex_lock_scoped(m, l) \
+    mutex_t *__scoped_mutex_##l __attribute__((cleanup(__mutex_scoped_cleanup))) = \
+        (mutex_lock(m), (m))
+#define __mutex_lock_scoped(m, l) ___mutex_lock_scoped(m, l)
+#define mutex_lock_scoped(m) __mutex_lock_scoped((m), __LINE__)
+
+#endif /* __KOS_MUTEX_H */
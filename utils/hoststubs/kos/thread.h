@@ -0,0 +1,22 @@
+/* KallistiOS ##version##
+
+   utils/hoststubs/kos/thread.h
+
+   Stand-in for the real header. The harness provides the functions, and
+   each thread sets thd_current to something of its own.
+*/
+
+#ifndef __KOS_THREAD_H
+#define __KOS_THREAD_H
+
+#include <stdbool.h>
+
+typedef struct kthread kthread_t;
+typedef int (*thd_cb_t)(void *);
+
+extern __thread kthread_t *thd_current;
+
+kthread_t *thd_create(bool detach, void *(*routine)(void *param), void *param);
+int thd_poll(thd_cb_t cb, void *data, unsigned long timeout_ms);
+
+#endif /* __KOS_THREAD_H */
@@ -0,0 +1,25 @@
+/* KallistiOS ##version##
+
+   utils/hoststubs/kos/timer.h
+
+   Stand-in for the real header, on the host's monotonic clock.
+*/
+
+#ifndef __KOS_TIMER_H
+#define __KOS_TIMER_H
+
+#include <stdint.h>
+#include <time.h>
+
+static inline uint64_t timer_us_gettime64(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t timer_ms_gettime64(void) {
+    return timer_us_gettime64() / 1000;
+}
+
+#endif /* __KOS_TIMER_H */
@@ -0,0 +1,27 @@
+/* KallistiOS ##version##
+
+   utils/hoststubs/sys/queue.h
+
+   The host's sys/queue.h, plus the _SAFE list macros glibc's lacks.
+*/
+
+#ifndef __HOSTSTUBS_SYS_QUEUE_H
+#define __HOSTSTUBS_SYS_QUEUE_H
+
+#include_next <sys/queue.h>
+
+#ifndef LIST_FOREACH_SAFE
+#define LIST_FOREACH_SAFE(var, head, field, tvar) \
+    for((var) = LIST_FIRST((head)); \
+        (var) && ((tvar) = LIST_NEXT((var), field), 1); \
+        (var) = (tvar))
+#endif
+
+#ifndef TAILQ_FOREACH_SAFE
+#define TAILQ_FOREACH_SAFE(var, head, field, tvar) \
+    for((var) = TAILQ_FIRST((head)); \
+        (var) && ((tvar) = TAILQ_NEXT((var), field), 1); \
+        (var) = (tvar))
+#endif
+
+#endif /* __HOSTSTUBS_SYS_QUEUE_H */
@@ -0,0 +1,713 @@
+/* KallistiOS ##version##
+
+   isoindextest.c
+
+   Test for the fs_iso9660 path index. This builds the real
+   kernel/arch/dreamcast/fs/fs_iso9660.c on a PC, with the CD sector reads
+   served from a disc image in memory, and counts every read command (each of
+   which is a seek on the real drive).
+
+   With no arguments, it makes three images of the same directory tree: a
+   plain ISO9660 one, a Rock Ridge one and a Joliet one. The tree has a big
+   directory, nested ones, names with no extension, a file and a directory
+   with the same name, names that only differ in case and a hidden file. An
+   image file can be given instead.
+
+   For each image, a lot of paths (with their case changed, extra slashes,
+   version numbers and typos) are looked up by searching the directories and
+   with the index, and both must always give the same answer. The images are
+   swapped like discs would be, to check the index follows along. Then every
+   file is opened, with and without the index, counting the reads.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "../../kernel/arch/dreamcast/fs/fs_iso9660.c"
+
+#define ENC_ISO     0       /* Uppercase ISO9660 names */
+#define ENC_RR      1       /* Made up ISO9660 names, real ones in NM */
+#define ENC_UCS     2       /* Joliet */
+
+#define NBIG        1200    /* Files in the big directory */
+#define NLEVELS     20
+
+__thread kthread_t *thd_current = (kthread_t *)1;
+
+/* A file or directory of the tree that gets put on the images */
+typedef struct node {
+    char name[32];
+    int id;
+    int dir;
+    uint8_t flags;                  /* Besides the directory flag */
+    struct node *child, *last, *next;
+    uint32_t extent[2], size[2];    /* Per tree, for directories */
+} node_t;
+
+typedef struct disc {
+    uint8_t *data;
+    uint32_t nsect;
+} disc_t;
+
+static node_t *root;
+static int nnodes;
+static const disc_t *disc;
+static unsigned int ncmds, nsects;
+static unsigned int seed = 1;
+
+static unsigned int rnd(unsigned int n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+}
+
+/********************************************************************************/
+/* What fs_iso9660.c needs from the rest of KOS */
+
+int cdrom_read_sectors_ex(void *buffer, uint32_t sector, size_t cnt, bool dma) {
+    (void)dma;
+
+    ncmds++;
+    nsects += cnt;
+    sector -= 150;
+
+    if(!disc || sector + cnt > disc->nsect)
+        return ERR_SYS;
+
+    memcpy(buffer, disc->data + sector * 2048, cnt * 2048);
+    return ERR_OK;
+}
+
+int cdrom_reinit(void) {
+    return 0;
+}
+
+int cdrom_read_toc(cd_toc_t *toc_buffer, bool high_density) {
+    (void)toc_buffer;
+    (void)high_density;
+    return 0;
+}
+
+uint32_t cdrom_locate_data_track(cd_toc_t *toc) {
+    (void)toc;
+    return 150;
+}
+
+int cdrom_get_status(int *status, int *disc_type) {
+    *status = CD_STATUS_PAUSED;
+    *disc_type = CD_CDROM_XA;
+    return 0;
+}
+
+int cdrom_stream_start(int sector, int cnt, bool dma) {
+    (void)sector;
+    (void)cnt;
+    (void)dma;
+    return -1;
+}
+
+int cdrom_stream_stop(bool abort_dma) {
+    (void)abort_dma;
+    return 0;
+}
+
+int cdrom_stream_request(void *buffer, size_t size, bool block) {
+    (void)buffer;
+    (void)size;
+    (void)block;
+    return -1;
+}
+
+int cdrom_stream_progress(size_t *size) {
+    *size = 0;
+    return 0;
+}
+
+int thd_poll(thd_cb_t cb, void *data, unsigned long timeout_ms) {
+    (void)timeout_ms;
+
+    while(!cb(data))
+        ;
+
+    return 0;
+}
+
+int vblank_handler_add(asic_evt_handler hnd, void *data) {
+    (void)hnd;
+    (void)data;
+    return 1;
+}
+
+int vblank_handler_remove(int handle) {
+    (void)handle;
+    return 0;
+}
+
+int nmmgr_handler_add(nmmgr_handler_t *hnd) {
+    (void)hnd;
+    return 0;
+}
+
+int nmmgr_handler_remove(nmmgr_handler_t *hnd) {
+    (void)hnd;
+    return 0;
+}
+
+/********************************************************************************/
+/* Making the images */
+
+static node_t *add(node_t *parent, const char *name, int dir) {
+    node_t *n = calloc(1, sizeof(node_t));
+
+    snprintf(n->name, sizeof(n->name), "%s", name);
+    n->id = nnodes++;
+    n->dir = dir;
+
+    if(parent) {
+        if(parent->last)
+            parent->last->next = n;
+        else
+            parent->child = n;
+
+        parent->last = n;
+    }
+
+    return n;
+}
+
+static void make_tree(void) {
+    node_t *d, *l;
+    char name[32];
+    int i;
+
+    root = add(NULL, "", 1);
+    add(root, "1ST_READ.BIN", 0);
+    add(root, "readme", 0);
+    add(root, "hidden.bin", 0)->flags = 1;
+
+    d = add(root, "data", 1);
+
+    for(i = 0; i < NBIG; i++) {
+        sprintf(name, "tex_%04d.pvr", i);
+        add(d, name, 0);
+    }
+
+    d = add(root, "levels", 1);
+
+    for(i = 0; i < NLEVELS; i++) {
+        sprintf(name, "Level%02d", i);
+        l = add(d, name, 1);
+        add(l, "map.dat", 0);
+        add(l, "Music.adx", 0);
+        add(l, "readme", 0);
+        add(add(l, "sub", 1), "deep.bin", 0);
+    }
+
+    /* A file and a directory with the same name */
+    add(root, "save", 0);
+    add(add(root, "save", 1), "slot1.bin", 0);
+
+    /* Only the first of these can be found by name (on a plain ISO9660 disc
+       the names are the same anyway) */
+    add(add(root, "Music", 1), "a.adx", 0);
+    add(add(root, "MUSIC", 1), "b.adx", 0);
+}
+
+static void put733(uint8_t *p, uint32_t v) {
+    p[0] = p[7] = v;
+    p[1] = p[6] = v >> 8;
+    p[2] = p[5] = v >> 16;
+    p[3] = p[4] = v >> 24;
+}
+
+/* The name a node gets in a directory record. Returns its length. */
+static int rec_name(const node_t *n, int enc, uint8_t *out) {
+    char iso[40];
+    int i, len;
+
+    if(enc == ENC_RR)
+        sprintf(iso, "N%05d", n->id);
+    else
+        strcpy(iso, n->name);
+
+    /* Files always get a version, and a period if they don't have one */
+    if(!n->dir)
+        strcat(iso, strchr(iso, '.') || enc == ENC_UCS ? ";1" : ".;1");
+
+    len = strlen(iso);
+
+    if(enc == ENC_UCS) {
+        for(i = 0; i < len; i++) {
+            out[i * 2] = 0;
+            out[i * 2 + 1] = iso[i];
+        }
+
+        return len * 2;
+    }
+
+    for(i = 0; i < len; i++)
+        out[i] = toupper((int)iso[i]);
+
+    return len;
+}
+
+/* Fill in a directory record, or just work out its length if p is NULL.
+   special is 0 for ".", 1 for ".." and -1 otherwise. */
+static int put_rec(uint8_t *p, const node_t *n, int enc, int tree,
+                   int special) {
+    uint8_t name[80];
+    int nl, len, rr = 0;
+
+    if(special >= 0) {
+        name[0] = special;
+        nl = 1;
+    }
+    else {
+        nl = rec_name(n, enc, name);
+
+        if(enc == ENC_RR)
+            rr = 5 + strlen(n->name);
+    }
+
+    len = 33 + nl + !(nl & 1) + rr;
+    len += len & 1;
+
+    if(!p)
+        return len;
+
+    memset(p, 0, len);
+    p[0] = len;
+    put733(p + 2, n->dir ? n->extent[tree] : n->extent[0]);
+    put733(p + 10, n->dir ? n->size[tree] : n->size[0]);
+    p[25] = (n->dir ? 2 : 0) | n->flags;
+    p[28] = 1;
+    p[31] = 1;
+    p[32] = nl;
+    memcpy(p + 33, name, nl);
+
+    if(rr) {
+        p += 33 + nl + !(nl & 1);
+        p[0] = 'N';
+        p[1] = 'M';
+        p[2] = rr;
+        p[3] = 1;
+        memcpy(p + 5, n->name, rr - 5);
+    }
+
+    return len;
+}
+
+/* Lay out (img == NULL) or write out a directory's records. Returns the size
+   of the directory in sectors. */
+static uint32_t put_dir(uint8_t *img, const node_t *d, const node_t *parent,
+                        int enc, int tree) {
+    const node_t *n = d;
+    uint32_t off = 0;
+    uint8_t *p = img ? img + d->extent[tree] * 2048 : NULL;
+    int len, special = 0;
+
+    while(n) {
+        len = put_rec(NULL, n, enc, tree, special);
+
+        /* Records don't cross sectors */
+        if((off % 2048) + len > 2048)
+            off = (off + 2047) & ~2047;
+
+        if(p)
+            put_rec(p + off, n, enc, tree, special);
+
+        off += len;
+
+        if(special == 0) {
+            n = parent;
+            special = 1;
+        }
+        else {
+            n = special == 1 ? d->child : n->next;
+            special = -1;
+        }
+    }
+
+    return (off + 2047) / 2048;
+}
+
+static uint32_t place_dirs(node_t *d, node_t *parent, int enc, int tree,
+                           uint32_t sect) {
+    node_t *n;
+
+    d->extent[tree] = sect;
+    d->size[tree] = put_dir(NULL, d, parent, enc, tree) * 2048;
+    sect += d->size[tree] / 2048;
+
+    for(n = d->child; n; n = n->next) {
+        if(n->dir)
+            sect = place_dirs(n, d, enc, tree, sect);
+    }
+
+    return sect;
+}
+
+static uint32_t place_files(node_t *d, uint32_t sect) {
+    node_t *n;
+
+    for(n = d->child; n; n = n->next) {
+        if(n->dir) {
+            sect = place_files(n, sect);
+        }
+        else {
+            n->extent[0] = sect++;
+            n->size[0] = 100 + n->id * 7 % 2000;
+        }
+    }
+
+    return sect;
+}
+
+static void write_dirs(uint8_t *img, node_t *d, node_t *parent, int enc,
+                       int tree) {
+    node_t *n;
+
+    put_dir(img, d, parent, enc, tree);
+
+    for(n = d->child; n; n = n->next) {
+        if(n->dir)
+            write_dirs(img, n, d, enc, tree);
+    }
+}
+
+static void put_vd(uint8_t *p, int type, const node_t *r, int tree) {
+    p[0] = type;
+    memcpy(p + 1, "CD001", 5);
+    p[6] = 1;
+
+    if(type == 2)
+        memcpy(p + 88, "%/E", 3);
+
+    if(r)
+        put_rec(p + 156, r, ENC_ISO, tree, 0);
+}
+
+/* The ISO9660 tree and, with Joliet, a second one with the long names. Path
+   tables are left out, since fs_iso9660 doesn't use them. */
+static void make_disc(disc_t *d, int enc) {
+    int ntrees = enc == ENC_UCS ? 2 : 1;
+    uint32_t sect = 16 + ntrees + 1;
+
+    sect = place_dirs(root, root, enc == ENC_UCS ? ENC_ISO : enc, 0, sect);
+
+    if(ntrees == 2)
+        sect = place_dirs(root, root, ENC_UCS, 1, sect);
+
+    d->nsect = place_files(root, sect);
+    d->data = calloc(d->nsect, 2048);
+
+    put_vd(d->data + 16 * 2048, 1, root, 0);
+
+    if(ntrees == 2)
+        put_vd(d->data + 17 * 2048, 2, root, 1);
+
+    put_vd(d->data + (16 + ntrees) * 2048, 255, NULL, 0);
+
+    write_dirs(d->data, root, root, enc == ENC_UCS ? ENC_ISO : enc, 0);
+
+    if(ntrees == 2)
+        write_dirs(d->data, root, root, ENC_UCS, 1);
+}
+
+static int load_disc(disc_t *d, const char *fn) {
+    FILE *f = fopen(fn, "rb");
+    long size;
+
+    if(!f)
+        return -1;
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    d->nsect = size / 2048;
+    d->data = malloc(d->nsect * 2048);
+
+    if(!d->data || fread(d->data, 2048, d->nsect, f) != d->nsect) {
+        fclose(f);
+        return -1;
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/********************************************************************************/
+/* Paths to look up */
+
+static char **paths;
+static int npaths, paths_cap;
+
+static void add_path(const char *p) {
+    if(npaths == paths_cap) {
+        paths_cap = paths_cap ? paths_cap * 2 : 1024;
+        paths = realloc(paths, paths_cap * sizeof(char *));
+    }
+
+    paths[npaths++] = strdup(p);
+}
+
+/* Every path in the tree, and some that are a bit off */
+static void tree_paths(const node_t *d, const char *prefix) {
+    const node_t *n;
+    char p[256], q[300];
+    size_t i;
+
+    for(n = d->child; n; n = n->next) {
+        sprintf(p, "%s/%s", prefix, n->name);
+        add_path(p);
+
+        /* Not every file in the big directory, there are too many */
+        if(!n->dir && strncmp(n->name, "tex_", 4) == 0 && rnd(8))
+            continue;
+
+        strcpy(q, p);
+        for(i = 0; q[i]; i++)
+            q[i] = rnd(2) ? toupper((int)q[i]) : tolower((int)q[i]);
+        add_path(q);
+
+        sprintf(q, "%s/", p);
+        add_path(q);
+        sprintf(q, "/%s", p);
+        add_path(q);
+        sprintf(q, "%s;1", p);
+        add_path(q);
+        sprintf(q, "%sx", p);
+        add_path(q);
+        sprintf(q, "%s.", p);
+        add_path(q);
+
+        strcpy(q, p);
+        q[strlen(q) - 1] = 0;
+        add_path(q);
+
+        if(n->dir)
+            tree_paths(n, p);
+    }
+}
+
+/* Paths from the directories, the way a program would see them */
+static void disc_paths(const char *dir) {
+    char p[1024];
+    const dirent_t *de;
+    void *h;
+
+    if(!(h = iso_open(NULL, dir, O_RDONLY | O_DIR)))
+        return;
+
+    while((de = iso_readdir(h))) {
+        sprintf(p, "%s/%s", dir, de->name);
+        add_path(p);
+
+        if(de->attr & O_DIR)
+            disc_paths(p);
+    }
+
+    iso_close(h);
+}
+
+static void free_paths(void) {
+    while(npaths)
+        free(paths[--npaths]);
+}
+
+/********************************************************************************/
+
+typedef struct {
+    int found;
+    uint32_t extent, size;
+} result_t;
+
+static void insert(const disc_t *d) {
+    disc = d;
+    iso_reset();
+}
+
+static int check_disc(const char *what, const disc_t *d) {
+    result_t *res;
+    const char *p;
+    int i, dir, r, found = 0;
+    unsigned int walk_cmds, idx_cmds, idx_sects;
+    size_t nfiles = 0;
+    void *h;
+
+    iso_index_enable(0);
+    insert(d);
+
+    if(init_percd() < 0) {
+        fprintf(stderr, "%s: can't mount the disc\n", what);
+        return -1;
+    }
+
+    percd_done = true;
+
+    if(root)
+        tree_paths(root, "");
+
+    disc_paths("");
+    add_path("");
+    add_path("/");
+    add_path("//");
+    add_path("/nothing/here");
+
+    /* Look everything up by searching the directories */
+    res = calloc(npaths * 2, sizeof(result_t));
+
+    for(i = 0; i < npaths * 2; i++) {
+        r = iso_find(paths[i / 2], i & 1, &res[i].extent, &res[i].size);
+        res[i].found = r == 0;
+        found += res[i].found;
+    }
+
+    /* Then with the index, which should give the same answers */
+    iso_index_enable(1);
+
+    if(!path_index) {
+        fprintf(stderr, "%s: index wasn't built\n", what);
+        return -1;
+    }
+
+    for(i = 0; i < npaths * 2; i++) {
+        uint32_t extent = 0, size = 0;
+
+        p = paths[i / 2];
+        dir = i & 1;
+        r = iso_find(p, dir, &extent, &size);
+
+        if((r == 0) != res[i].found ||
+           (r == 0 && (extent != res[i].extent || size != res[i].size))) {
+            fprintf(stderr, "%s: looking up '%s' as a %s: searching %s, "
+                    "index %s\n", what, p, dir ? "directory" : "file",
+                    res[i].found ? "found it" : "didn't",
+                    r == 0 ? "found it" : "didn't");
+            return -1;
+        }
+    }
+
+    printf("%s: %u paths indexed (%u bytes of names), %d lookups agree "
+           "(%d found)\n", what, (unsigned int)path_index->count,
+           (unsigned int)path_index->pool_size, npaths * 2, found);
+
+    /* Open every file that readdir gave, searching and with the index */
+    iso_index_enable(0);
+    bclear();
+    ncmds = nsects = 0;
+
+    for(i = 0; i < npaths * 2; i += 2) {
+        if(res[i].found && (h = iso_open(NULL, paths[i / 2], O_RDONLY))) {
+            iso_close(h);
+            nfiles++;
+        }
+    }
+
+    walk_cmds = ncmds;
+
+    ncmds = nsects = 0;
+    iso_index_enable(1);
+    idx_cmds = ncmds;
+    idx_sects = nsects;
+
+    ncmds = 0;
+
+    for(i = 0; i < npaths * 2; i += 2) {
+        if(res[i].found && (h = iso_open(NULL, paths[i / 2], O_RDONLY)))
+            iso_close(h);
+    }
+
+    printf("  opening %5u paths: searching %6u reads, index %u reads "
+           "(%u to build it, %u sectors)\n", (unsigned int)nfiles,
+           walk_cmds, ncmds, idx_cmds, idx_sects);
+
+    free(res);
+    free_paths();
+    return 0;
+}
+
+/* Swap discs with the index enabled, and check it follows */
+static int check_swap(const disc_t *a, const disc_t *b) {
+    uint32_t ea, eb, ew, size;
+    void *h;
+
+    iso_index_enable(1);
+    insert(a);
+
+    if(!(h = iso_open(NULL, "/levels/level03/map.dat", O_RDONLY)))
+        return -1;
+
+    iso_close(h);
+
+    if(!path_index || iso_find("save/slot1.bin", 0, &ea, &size) < 0)
+        return -1;
+
+    /* A different disc, with a different layout */
+    insert(b);
+
+    if(path_index)
+        return -1;
+
+    if(!(h = iso_open(NULL, "/levels/level03/map.dat", O_RDONLY)))
+        return -1;
+
+    iso_close(h);
+
+    if(!path_index || iso_find("save/slot1.bin", 0, &eb, &size) < 0)
+        return -1;
+
+    iso_index_enable(0);
+
+    if(iso_find("save/slot1.bin", 0, &ew, &size) < 0)
+        return -1;
+
+    return ea != eb && eb == ew ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    static const char *names[] = { "ISO9660", "Rock Ridge", "Joliet" };
+    disc_t discs[3];
+    int i;
+
+    if(argc > 1 && !strcmp(argv[1], "-v")) {
+        dbglog_set_level(DBG_KDEBUG);
+        argc--;
+        argv++;
+    }
+
+    fs_iso9660_init();
+
+    if(argc > 1) {
+        if(load_disc(&discs[0], argv[1]) < 0) {
+            fprintf(stderr, "can't read %s\n", argv[1]);
+            return 1;
+        }
+
+        return check_disc(argv[1], &discs[0]) ? 1 : 0;
+    }
+
+    make_tree();
+
+    for(i = 0; i < 3; i++) {
+        make_disc(&discs[i], i);
+
+        if(check_disc(names[i], &discs[i]))
+            return 1;
+    }
+
+    for(i = 0; i < 3; i++) {
+        if(check_swap(&discs[i], &discs[(i + 1) % 3])) {
+            fprintf(stderr, "index didn't follow a swap from %s to %s\n",
+                    names[i], names[(i + 1) % 3]);
+            return 1;
+        }
+    }
+
+    printf("Swapping discs: ok\n");
+
+    fs_iso9660_shutdown();
+    return 0;
+}
@@ -0,0 +1,474 @@
+/* KallistiOS ##version##
+
+   isoschedbench.c
+
+   Benchmark for reading several files off a CD at once. This builds the real
+   kernel/arch/dreamcast/fs/fs_iso9660.c on a PC, with pthreads standing in
+   for KOS threads, on top of a simulated drive that serves an image in memory
+   and takes time to seek and to transfer sectors. The drive also checks that
+   it's only ever asked to do one thing at a time.
+
+   Three threads read at the same time, like a game loading a level while
+   music plays: one reads a music file a little at a time, one loads big level
+   files in large chunks and one reads lots of small files. Everything read is
+   checked. This is done without readahead and then with it, printing what
+   each file's statistics say and how many seeks the drive did.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "../../kernel/arch/dreamcast/fs/fs_iso9660.c"
+
+#define SEEK_US     3000        /* Drive time to seek */
+#define SECT_US     40          /* Drive time to transfer a sector */
+
+#define MUSIC_SIZE  (1024 * 1024)
+#define LEVEL_SIZE  (1024 * 1024)
+#define NLEVELS     3
+#define ASSET_SIZE  (6 * 1024)
+#define NASSETS     48
+
+__thread kthread_t *thd_current;
+
+/* A file on the image */
+typedef struct img_file {
+    char name[16];
+    uint32_t extent, size;
+} img_file_t;
+
+static img_file_t music, levels[NLEVELS], assets[NASSETS];
+static uint8_t *image;
+static uint32_t image_sects;
+
+static atomic_int busy;
+static unsigned int drive_cmds, drive_seeks, overlaps;
+static uint32_t drive_head;
+static size_t stream_at, stream_end;
+static volatile bool playing;
+static int errors;
+
+static uint8_t pattern(size_t off) {
+    return (off * 2654435761u) >> 24;
+}
+
+static void drive_time(uint32_t sector, size_t nsect) {
+    if(sector != drive_head) {
+        drive_seeks++;
+        usleep(SEEK_US);
+    }
+
+    usleep(SECT_US * nsect);
+    drive_head = sector + nsect;
+}
+
+static void drive_enter(void) {
+    if(atomic_fetch_add(&busy, 1))
+        overlaps++;
+}
+
+static void drive_leave(void) {
+    atomic_fetch_sub(&busy, 1);
+}
+
+/********************************************************************************/
+/* What fs_iso9660.c needs from the rest of KOS */
+
+int cdrom_read_sectors_ex(void *buffer, uint32_t sector, size_t cnt, bool dma) {
+    (void)dma;
+
+    sector -= 150;
+
+    if(sector + cnt > image_sects)
+        return ERR_SYS;
+
+    drive_enter();
+    drive_cmds++;
+    drive_time(sector, cnt);
+    memcpy(buffer, image + sector * 2048, cnt * 2048);
+    drive_leave();
+
+    return ERR_OK;
+}
+
+int cdrom_stream_start(int sector, int cnt, bool dma) {
+    (void)dma;
+
+    sector -= 150;
+
+    if(sector + cnt > (int)image_sects)
+        return ERR_SYS;
+
+    drive_enter();
+    drive_cmds++;
+    drive_time(sector, 0);
+    stream_at = sector * 2048;
+    stream_end = stream_at + cnt * 2048;
+    drive_leave();
+
+    return ERR_OK;
+}
+
+int cdrom_stream_stop(bool abort_dma) {
+    (void)abort_dma;
+
+    stream_at = stream_end = 0;
+    return ERR_OK;
+}
+
+int cdrom_stream_request(void *buffer, size_t size, bool block) {
+    size_t cnt;
+
+    (void)block;
+
+    if(stream_at + size > stream_end)
+        return ERR_SYS;
+
+    drive_enter();
+    cnt = (stream_at + size + 2047) / 2048 - stream_at / 2048;
+    drive_time(drive_head, stream_at % 2048 ? cnt - 1 : cnt);
+    memcpy(buffer, image + stream_at, size);
+    stream_at += size;
+    drive_leave();
+
+    return ERR_OK;
+}
+
+int cdrom_stream_progress(size_t *size) {
+    *size = stream_end - stream_at;
+    return 0;
+}
+
+int cdrom_reinit(void) {
+    return 0;
+}
+
+int cdrom_read_toc(cd_toc_t *toc_buffer, bool high_density) {
+    (void)toc_buffer;
+    (void)high_density;
+    return 0;
+}
+
+uint32_t cdrom_locate_data_track(cd_toc_t *toc) {
+    (void)toc;
+    return 150;
+}
+
+int cdrom_get_status(int *status, int *disc_type) {
+    *status = CD_STATUS_PAUSED;
+    *disc_type = CD_CDROM_XA;
+    return 0;
+}
+
+int thd_poll(thd_cb_t cb, void *data, unsigned long timeout_ms) {
+    (void)timeout_ms;
+
+    while(!cb(data))
+        ;
+
+    return 0;
+}
+
+int vblank_handler_add(asic_evt_handler hnd, void *data) {
+    (void)hnd;
+    (void)data;
+    return 1;
+}
+
+int vblank_handler_remove(int handle) {
+    (void)handle;
+    return 0;
+}
+
+int nmmgr_handler_add(nmmgr_handler_t *hnd) {
+    (void)hnd;
+    return 0;
+}
+
+int nmmgr_handler_remove(nmmgr_handler_t *hnd) {
+    (void)hnd;
+    return 0;
+}
+
+/********************************************************************************/
+/* The image: a root directory with all the files in it, spread out over the
+   disc so that going from one to another is a seek. */
+
+static void put733(uint8_t *p, uint32_t v) {
+    p[0] = p[7] = v;
+    p[1] = p[6] = v >> 8;
+    p[2] = p[5] = v >> 16;
+    p[3] = p[4] = v >> 24;
+}
+
+static uint32_t place(img_file_t *f, const char *name, uint32_t size,
+                      uint32_t sect) {
+    strcpy(f->name, name);
+    f->extent = sect;
+    f->size = size;
+    return sect + (size + 2047) / 2048 + 64;
+}
+
+/* Add a directory record at *off, moving to the next sector if it doesn't
+   fit in this one */
+static void put_rec(uint8_t *p, uint32_t *off, const char *name,
+                    uint32_t extent, uint32_t size, int dir) {
+    int nl = name[0] ? (int)strlen(name) : 1, len = 33 + nl + !(nl & 1);
+
+    if(*off % 2048 + len > 2048)
+        *off = (*off + 2047) & ~2047;
+
+    p += *off;
+    *off += len;
+
+    memset(p, 0, len);
+    p[0] = len;
+    put733(p + 2, extent);
+    put733(p + 10, size);
+    p[25] = dir ? 2 : 0;
+    p[32] = nl;
+    memcpy(p + 33, name, nl);
+}
+
+static void make_image(void) {
+    uint32_t sect = 24, off;
+    uint8_t *dir;
+    char name[16];
+    size_t i;
+    int j;
+
+    sect = place(&music, "MUSIC.ADX;1", MUSIC_SIZE, sect);
+
+    for(j = 0; j < NLEVELS; j++) {
+        sprintf(name, "LEVEL%d.DAT;1", j);
+        sect = place(&levels[j], name, LEVEL_SIZE, sect);
+    }
+
+    for(j = 0; j < NASSETS; j++) {
+        sprintf(name, "ASSET%02d.BIN;1", j);
+        sect = place(&assets[j], name, ASSET_SIZE, sect);
+    }
+
+    image_sects = sect;
+    image = malloc(image_sects * 2048);
+
+    for(i = 0; i < image_sects * 2048; i++)
+        image[i] = pattern(i);
+
+    memset(image, 0, 24 * 2048);
+    image[16 * 2048] = 1;
+    memcpy(image + 16 * 2048 + 1, "CD001", 5);
+    off = 156;
+    put_rec(image + 16 * 2048, &off, "\0", 20, 4 * 2048, 1);
+    image[17 * 2048] = 255;
+    memcpy(image + 17 * 2048 + 1, "CD001", 5);
+
+    dir = image + 20 * 2048;
+    memset(dir, 0, 4 * 2048);
+    off = 0;
+    put_rec(dir, &off, "\0", 20, 4 * 2048, 1);
+    put_rec(dir, &off, "\1", 20, 4 * 2048, 1);
+    put_rec(dir, &off, music.name, music.extent, music.size, 0);
+
+    for(j = 0; j < NLEVELS; j++)
+        put_rec(dir, &off, levels[j].name, levels[j].extent, levels[j].size, 0);
+
+    for(j = 0; j < NASSETS; j++)
+        put_rec(dir, &off, assets[j].name, assets[j].extent, assets[j].size, 0);
+}
+
+/********************************************************************************/
+/* The readers */
+
+typedef struct client {
+    const char *what;
+    uint32_t readahead;
+    iso_stats_t stats;
+    pthread_t thd;
+} client_t;
+
+static int iso_ioctl_va(void *h, int cmd, ...) {
+    va_list ap;
+    int rv;
+
+    va_start(ap, cmd);
+    rv = iso_ioctl(h, cmd, ap);
+    va_end(ap);
+
+    return rv;
+}
+
+static void *open_file(client_t *c, const img_file_t *f) {
+    char path[32];
+    void *h;
+
+    sprintf(path, "/%.*s", (int)(strchr(f->name, ';') - f->name), f->name);
+
+    if(!(h = iso_open(NULL, path, O_RDONLY))) {
+        fprintf(stderr, "%s: can't open %s\n", c->what, path);
+        errors++;
+        return NULL;
+    }
+
+    if(c->readahead)
+        iso_ioctl_va(h, IOCTL_ISO9660_READAHEAD, &c->readahead);
+
+    return h;
+}
+
+static void close_file(client_t *c, void *h) {
+    iso_stats_t st;
+
+    iso_ioctl_va(h, IOCTL_ISO9660_STATS, &st);
+    c->stats.bytes += st.bytes;
+    c->stats.time_us += st.time_us;
+    c->stats.reads += st.reads;
+    c->stats.seeks += st.seeks;
+    c->stats.ra_hits += st.ra_hits;
+    iso_close(h);
+}
+
+/* Read a whole file in chunks, checking what comes back */
+static void read_file(client_t *c, const img_file_t *f, size_t chunk,
+                      unsigned int pause_us) {
+    static __thread uint8_t buf[65536] __attribute__((aligned(32)));
+    size_t off = 0, i;
+    ssize_t n;
+    void *h;
+
+    if(!(h = open_file(c, f)))
+        return;
+
+    while((n = iso_read(h, buf, chunk)) > 0) {
+        for(i = 0; i < (size_t)n; i++) {
+            if(buf[i] != pattern(f->extent * 2048 + off + i)) {
+                fprintf(stderr, "%s: bad data in %s at %zu\n", c->what,
+                        f->name, off + i);
+                errors++;
+                break;
+            }
+        }
+
+        off += n;
+
+        if(pause_us)
+            usleep(pause_us);
+    }
+
+    if(n < 0 || off != f->size) {
+        fprintf(stderr, "%s: read %zu of %s\n", c->what, off, f->name);
+        errors++;
+    }
+
+    close_file(c, h);
+}
+
+static void *music_thd(void *p) {
+    client_t *c = p;
+
+    thd_current = (kthread_t *)c;
+
+    /* Play until everything's loaded */
+    while(playing)
+        read_file(c, &music, 4096, 400);
+
+    return NULL;
+}
+
+static void *level_thd(void *p) {
+    client_t *c = p;
+    int i;
+
+    thd_current = (kthread_t *)c;
+
+    for(i = 0; i < NLEVELS; i++)
+        read_file(c, &levels[i], 65536, 0);
+
+    return NULL;
+}
+
+static void *asset_thd(void *p) {
+    client_t *c = p;
+    int i;
+
+    thd_current = (kthread_t *)c;
+
+    for(i = 0; i < NASSETS; i++)
+        read_file(c, &assets[i], 1024, 0);
+
+    return NULL;
+}
+
+static int run(const char *what, uint32_t readahead) {
+    client_t clients[3] = {
+        { "music", readahead, { 0 }, 0 },
+        { "levels", 0, { 0 }, 0 },
+        { "assets", readahead, { 0 }, 0 }
+    };
+    void *(*fns[3])(void *) = { music_thd, level_thd, asset_thd };
+    double t0 = timer_us_gettime64(), secs;
+    iso_cache_stats_t cs0 = iso_cache_get_stats(), cs;
+    client_t *c;
+    int i;
+
+    iso_reset();
+    drive_cmds = drive_seeks = overlaps = 0;
+    playing = true;
+
+    for(i = 0; i < 3; i++)
+        pthread_create(&clients[i].thd, NULL, fns[i], &clients[i]);
+
+    pthread_join(clients[1].thd, NULL);
+    pthread_join(clients[2].thd, NULL);
+    playing = false;
+    pthread_join(clients[0].thd, NULL);
+
+    secs = (timer_us_gettime64() - t0) / 1000000.0;
+    cs = iso_cache_get_stats();
+
+    printf("%s: %.2f s, drive did %u commands, %u seeks\n", what, secs,
+           drive_cmds, drive_seeks);
+    printf("  cache: %u hits, %u misses, %u sectors in %u reads\n",
+           cs.inode_hits + cs.data_hits - cs0.inode_hits - cs0.data_hits,
+           cs.inode_misses + cs.data_misses - cs0.inode_misses -
+           cs0.data_misses, cs.sectors - cs0.sectors, cs.reads - cs0.reads);
+
+    for(i = 0; i < 3; i++) {
+        c = &clients[i];
+        printf("  %-7s %8llu bytes %8.1f KB/s %5u reads %5u seeks "
+               "%6u readahead hits\n", c->what,
+               (unsigned long long)c->stats.bytes,
+               c->stats.time_us ? c->stats.bytes * 1000000.0 /
+               c->stats.time_us / 1024 : 0.0, c->stats.reads,
+               c->stats.seeks, c->stats.ra_hits);
+    }
+
+    if(overlaps) {
+        fprintf(stderr, "the drive was asked to do two things at once %u "
+                "times\n", overlaps);
+        return -1;
+    }
+
+    return errors ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    static int me;
+
+    if(argc > 1 && !strcmp(argv[1], "-v"))
+        dbglog_set_level(DBG_KDEBUG);
+
+    thd_current = (kthread_t *)&me;
+
+    make_image();
+    fs_iso9660_init();
+
+    if(run("No readahead", 0) || run("32 KB readahead", 32768))
+        return 1;
+
+    fs_iso9660_shutdown();
+    return 0;
+}
@@ -0,0 +1,126 @@
+/* KallistiOS ##version##
+
+   nmmgrbench.c
+
+   Benchmark for name handler lookups. This builds the real
+   kernel/exports/nmmgr.c on a PC (with the stand-in headers in
+   utils/hoststubs), and registers the kind of handlers a game might have
+   mounted: romdisks, the CD, the VMUs, an SD card, ptys, sockets and a few
+   devices.
+
+   It then resolves a mix of paths the way fs_open() does, with the prefix
+   tree and with the list search it replaced, and checks that both always
+   agree, including after handlers come and go.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../kernel/exports/nmmgr.c"
+
+#define NLOOKUPS    200000
+
+static const char *mounts[] = {
+    "/rd", "/rd/music", "/rd/levels", "/cd", "/pc", "/sd", "/ext2", "/ram",
+    "/vmu/a1", "/vmu/a2", "/vmu/b1", "/vmu/b2", "/vmu/c1", "/vmu/c2",
+    "/vmu/d1", "/vmu/d2", "/pty", "/sock", "/dev/null", "/dev/zero",
+    "/dev/random", "/dev/urandom", "/dev/console", "/dev/kmsg", "/dev/irq",
+    "/dev/pipe", "/dev/mouse", "/dev/kbd", "/dev/ser", "/romdisk",
+    "/CD/video", "/exports/kernel"
+};
+
+#define NMOUNTS (sizeof(mounts) / sizeof(mounts[0]))
+
+static const char *paths[] = {
+    "/rd/textures/player.pvr", "/rd/music/level1.adx", "/cd/data/level2.bin",
+    "/CD/VIDEO/intro.roq", "/pc/home/user/log.txt", "/vmu/a1/SAVEGAME",
+    "/vmu/d2/", "/sd/mods/config.ini", "/dev/null", "/dev/urandom",
+    "/pty/ma00", "/sock/udp", "/ram/tmp/cache.bin", "/nothing/here",
+    "/rd/levels/1/map.dat", "/exports/kernel", "relative/path"
+};
+
+#define NPATHS (sizeof(paths) / sizeof(paths[0]))
+
+static nmmgr_handler_t *volatile sink;
+
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int verify(void) {
+    unsigned int i;
+
+    for(i = 0; i < NPATHS; i++) {
+        if(nmmgr_lookup(paths[i]) != nmmgr_list_lookup(paths[i])) {
+            fprintf(stderr, "mismatch looking up %s\n", paths[i]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    static nmmgr_handler_t hnds[NMOUNTS], dups[NMOUNTS];
+    unsigned int i, seed = 1;
+    double t0, t_list, t_tree;
+
+    (void)argc;
+    (void)argv;
+
+    nmmgr_init();
+
+    for(i = 0; i < NMOUNTS; i++) {
+        strcpy(hnds[i].pathname, mounts[i]);
+        nmmgr_handler_add(&hnds[i]);
+
+        if(verify())
+            return 1;
+    }
+
+    /* Shadow half of them with handlers of the same name, then take them
+       away again */
+    for(i = 0; i < NMOUNTS; i += 2) {
+        strcpy(dups[i].pathname, mounts[i]);
+        nmmgr_handler_add(&dups[i]);
+
+        if(verify())
+            return 1;
+    }
+
+    for(i = 0; i < NMOUNTS; i += 2) {
+        nmmgr_handler_remove(i % 4 ? &dups[i] : &hnds[i]);
+
+        if(verify())
+            return 1;
+    }
+
+    printf("%u handlers, %u paths: lookups agree\n", (unsigned int)NMOUNTS,
+           (unsigned int)NPATHS);
+
+    t0 = now_ms();
+    for(i = 0; i < NLOOKUPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        sink = nmmgr_list_lookup(paths[(seed >> 16) % NPATHS]);
+    }
+    t_list = now_ms() - t0;
+
+    seed = 1;
+    t0 = now_ms();
+    for(i = 0; i < NLOOKUPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        sink = nmmgr_lookup(paths[(seed >> 16) % NPATHS]);
+    }
+    t_tree = now_ms() - t0;
+
+    printf("%d lookups: list %8.3f ms, tree %8.3f ms (%.1fx)\n",
+           NLOOKUPS, t_list, t_tree, t_list / t_tree);
+
+    nmmgr_shutdown();
+    return 0;
+}
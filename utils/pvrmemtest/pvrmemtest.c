@@ -0,0 +1,270 @@
+/* KallistiOS ##version##
+
+   pvrmemtest.c
+
+   Fuzzer and benchmark for the PVR memory allocator core. This builds the
+   real kernel/arch/dreamcast/hardware/pvr/pvr_mem_tlsf.c and runs it on a PC
+   against an 8MB pool backed by an ordinary buffer.
+
+   The fuzzer does random allocations (of texture-like and buffer-like sizes,
+   alignments and placement), frees and compactions. Every block is filled
+   with a pattern unique to it, and after each step the pool's invariants are
+   checked, as is every live block's pattern, so a block handed out twice or
+   moved without its contents shows up right away.
+
+   The benchmark then times a steady state of allocations and frees like a
+   game streaming textures in and out, and reports the resulting
+   fragmentation before and after compacting.
+
+   Usage: pvrmemtest [iterations] [seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pvr_mem_tlsf.h"
+
+#define POOL_SIZE   (8 * 1024 * 1024)
+#define MAX_LIVE    2048
+
+typedef struct live {
+    tlsf_blk_t *blk;
+    uint32_t size;          /* As asked for */
+    uint32_t tag;
+} live_t;
+
+static uint8_t *vram;
+static live_t lives[MAX_LIVE];
+static int nlive;
+static uint32_t seed = 1;
+
+static uint32_t rnd(void) {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void fill(live_t *l) {
+    uint32_t i;
+
+    for(i = 0; i < l->size; i++)
+        vram[l->blk->off + i] = (uint8_t)(l->tag + i * 7);
+}
+
+static int verify(live_t *l) {
+    uint32_t i;
+
+    for(i = 0; i < l->size; i++) {
+        if(vram[l->blk->off + i] != (uint8_t)(l->tag + i * 7))
+            return -1;
+    }
+
+    return 0;
+}
+
+static void copy(uint32_t dst, uint32_t src, uint32_t size, void *ctx) {
+    (void)ctx;
+
+    if(dst >= src)
+        abort();
+
+    memmove(vram + dst, vram + src, size);
+}
+
+static void moved(tlsf_blk_t *blk, uint32_t old_off, void *ctx) {
+    (void)ctx;
+
+    if(blk->off >= old_off || ((live_t *)blk->udata)->blk != blk)
+        abort();
+}
+
+/* Roughly what textures and vertex buffers look like */
+static uint32_t rnd_size(int *flags, uint32_t *align) {
+    uint32_t r = rnd() % 100;
+
+    *flags = 0;
+    *align = 0;
+
+    if(r < 50)
+        return 32 << (rnd() % 8);               /* Small power of two */
+    else if(r < 80)
+        return (8 << (rnd() % 10)) * (8 << (rnd() % 4)) * 2;  /* Texture */
+    else if(r < 90)
+        return 1 + rnd() % 4096;                /* Odd sized */
+
+    /* A buffer, placed at the top with a bigger alignment */
+    *flags = TLSF_TOP;
+    *align = 32 << (rnd() % 4);
+    return 1024 + rnd() % 65536;
+}
+
+static int fuzz(tlsf_t *t, int iters) {
+    tlsf_stats_t st;
+    live_t *l;
+    uint32_t size, align, tag = 0;
+    int i, j, flags, err;
+
+    for(i = 0; i < iters; i++) {
+        uint32_t op = rnd() % 100;
+
+        if(op < 55 && nlive < MAX_LIVE) {
+            size = rnd_size(&flags, &align);
+            l = &lives[nlive];
+            l->blk = tlsf_alloc(t, size, align, flags);
+
+            if(l->blk) {
+                if(l->blk->off & ((align ? align : TLSF_ALIGN) - 1)) {
+                    fprintf(stderr, "%d: misaligned block\n", i);
+                    return -1;
+                }
+
+                l->size = size;
+                l->tag = ++tag;
+                l->blk->udata = l;
+                l->blk->movable = rnd() % 4 != 0;
+                fill(l);
+                nlive++;
+            }
+        }
+        else if(op < 98 && nlive) {
+            j = rnd() % nlive;
+
+            if(tlsf_find(t, lives[j].blk->off) != lives[j].blk) {
+                fprintf(stderr, "%d: lost block\n", i);
+                return -1;
+            }
+
+            tlsf_free(t, lives[j].blk);
+            lives[j] = lives[--nlive];
+
+            if(j < nlive)
+                lives[j].blk->udata = &lives[j];
+        }
+        else {
+            tlsf_compact(t, copy, moved, NULL);
+        }
+
+        if((err = tlsf_check(t))) {
+            fprintf(stderr, "%d: check failed at line %d\n", i, err);
+            return -1;
+        }
+
+        /* Checking every block every time is slow; do a few */
+        for(j = 0; j < nlive; j += 1 + nlive / 16) {
+            if(verify(&lives[j])) {
+                fprintf(stderr, "%d: block %u corrupted\n", i, lives[j].tag);
+                return -1;
+            }
+        }
+    }
+
+    for(j = 0; j < nlive; j++) {
+        if(verify(&lives[j])) {
+            fprintf(stderr, "block %u corrupted\n", lives[j].tag);
+            return -1;
+        }
+    }
+
+    tlsf_get_stats(t, &st);
+    printf("fuzz: %d operations OK, %d blocks live, %u bytes used\n",
+           iters, nlive, st.used);
+
+    return 0;
+}
+
+static void print_frag(const char *what, tlsf_t *t) {
+    tlsf_stats_t st;
+
+    tlsf_get_stats(t, &st);
+    printf("%-16s %5u used, %5u free blocks, largest free %7u of %7u "
+           "(%u%% fragmented)\n", what, st.used_blocks, st.free_blocks,
+           st.largest_free, st.free,
+           st.free ? 100 - (unsigned)((uint64_t)st.largest_free * 100 /
+                                      st.free) : 0);
+}
+
+static void nop_copy(uint32_t dst, uint32_t src, uint32_t size, void *ctx) {
+    (void)dst; (void)src; (void)size; (void)ctx;
+}
+
+static void nop_moved(tlsf_blk_t *blk, uint32_t old_off, void *ctx) {
+    (void)blk; (void)old_off; (void)ctx;
+}
+
+static void bench(tlsf_t *t, int iters) {
+    static tlsf_blk_t *blks[MAX_LIVE];
+    uint32_t size, align;
+    int i, j, n = 0, flags, fails = 0;
+    double t0, dt;
+
+    tlsf_init(t, POOL_SIZE);
+
+    t0 = now_ms();
+
+    for(i = 0; i < iters; i++) {
+        /* Keep the pool about three quarters full */
+        if(n < MAX_LIVE && (t->used < POOL_SIZE / 4 * 3 || !n)) {
+            size = rnd_size(&flags, &align);
+
+            if((blks[n] = tlsf_alloc(t, size, align, flags))) {
+                blks[n]->movable = 1;
+                n++;
+            }
+            else {
+                fails++;
+            }
+        }
+        else {
+            j = rnd() % n;
+            tlsf_free(t, tlsf_find(t, blks[j]->off));
+            blks[j] = blks[--n];
+        }
+    }
+
+    dt = now_ms() - t0;
+
+    printf("bench: %d operations in %.3f ms (%.1f ns each), %d failed\n",
+           iters, dt, dt * 1000000.0 / iters, fails);
+
+    print_frag("before compact:", t);
+
+    t0 = now_ms();
+    tlsf_compact(t, nop_copy, nop_moved, NULL);
+    dt = now_ms() - t0;
+
+    print_frag("after compact:", t);
+    printf("compact took %.3f ms\n", dt);
+}
+
+int main(int argc, char *argv[]) {
+    static tlsf_t t;
+    int iters = 200000;
+
+    if(argc > 1)
+        iters = atoi(argv[1]);
+    if(argc > 2)
+        seed = strtoul(argv[2], NULL, 0);
+
+    vram = malloc(POOL_SIZE);
+    if(!vram || tlsf_init(&t, POOL_SIZE)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    if(fuzz(&t, iters))
+        return 1;
+
+    bench(&t, iters * 5);
+    tlsf_destroy(&t);
+    free(vram);
+
+    return 0;
+}
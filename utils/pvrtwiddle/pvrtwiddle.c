@@ -0,0 +1,294 @@
+/* KallistiOS ##version##
+
+   pvrtwiddle.c
+
+   Verification and benchmark for the texture twiddler used by
+   pvr_txr_load_ex(). This builds kernel/arch/dreamcast/hardware/pvr/
+   pvr_twiddle.h on a PC, writing to an ordinary buffer instead of the store
+   queues.
+
+   Every format is twiddled at every size from 8x8 to 1024x1024, both ways up,
+   and compared against a plain texel-by-texel twiddle. The non-inverted ones
+   are also compared against the loops pvr_txr_load_ex() used before, which
+   are kept below as they were. (Those got inverted 4bpp and 8bpp textures
+   wrong: rows were swapped in pairs.) The conversions from 32bpp are checked
+   against converting first and twiddling after.
+
+   Then both twiddlers are timed on a few common sizes.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pvr_twiddle.h"
+
+/* What pvr_txr_load_ex() used to do */
+#define TWIDTAB(x) ( (x&1)|((x&2)<<1)|((x&4)<<2)|((x&8)<<3)|((x&16)<<4)| \
+                     ((x&32)<<5)|((x&64)<<6)|((x&128)<<7)|((x&256)<<8)|((x&512)<<9) )
+#define TWIDOUT(x, y) ( TWIDTAB((y)) | (TWIDTAB((x)) << 1) )
+
+#define MIN(a, b) ( (a)<(b)? (a):(b) )
+
+static void old_twiddle(const void *src, void *dst, uint32_t w, uint32_t h,
+                        uint32_t bpp, int invert) {
+    uint32_t x, y, yout, min, mask;
+
+    min = MIN(w, h);
+    mask = min - 1;
+
+    switch(bpp) {
+        case 4: {
+            uint8_t * pixels;
+            uint16_t * vtex;
+            pixels = (uint8_t *) src;
+            vtex = (uint16_t *)dst;
+
+            for(y = 0; y < h; y += 2) {
+                if(!invert)
+                    yout = y;
+                else
+                    yout = ((h - 1) - y);
+
+                for(x = 0; x < w; x += 2) {
+                    vtex[TWIDOUT((x & mask) / 2, (yout & mask) / 2) +
+                         (x / min + yout / min)*min * min / 4] =
+                             (pixels[(x + y * w) >> 1] & 15) | ((pixels[(x + (y + 1) * w) >> 1] & 15) << 4) |
+                             ((pixels[(x + y * w) >> 1] >> 4) << 8) | ((pixels[(x + (y + 1) * w) >> 1] >> 4) << 12);
+                }
+            }
+        }
+        break;
+        case 8: {
+            uint8_t * pixels;
+            uint16_t * vtex;
+            pixels = (uint8_t *) src;
+            vtex = (uint16_t *)dst;
+
+            for(y = 0; y < h; y += 2) {
+                if(!invert)
+                    yout = y;
+                else
+                    yout = ((h - 1) - y);
+
+                for(x = 0; x < w; x++) {
+                    vtex[TWIDOUT((yout & mask) / 2, x & mask) +
+                         (x / min + yout / min)*min * min / 2] =
+                             pixels[y * w + x] | (pixels[(y + 1) * w + x] << 8);
+                }
+            }
+        }
+        break;
+        case 16: {
+            uint16_t * pixels;
+            uint16_t * vtex;
+            pixels = (uint16_t *) src;
+            vtex = (uint16_t *)dst;
+
+            for(y = 0; y < h; y++) {
+                if(!invert)
+                    yout = y;
+                else
+                    yout = ((h - 1) - y);
+
+                for(x = 0; x < w; x++) {
+                    vtex[TWIDOUT(x & mask, yout & mask) +
+                         (x / min + yout / min)*min * min] = pixels[y * w + x];
+                }
+            }
+        }
+        break;
+    }
+}
+
+/* The definition of twiddling, one texel at a time */
+static void ref_twiddle(const void *src, void *dst, uint32_t w, uint32_t h,
+                        uint32_t bpp, int invert) {
+    const uint8_t *s = src;
+    uint8_t *d = dst;
+    uint32_t x, y, yout, min = MIN(w, h), idx, v;
+
+    memset(dst, 0, w * h * bpp / 8);
+
+    for(y = 0; y < h; y++) {
+        yout = invert ? h - 1 - y : y;
+
+        for(x = 0; x < w; x++) {
+            idx = TWIDOUT(x & (min - 1), yout & (min - 1)) +
+                  (x / min + yout / min) * min * min;
+
+            switch(bpp) {
+                case 4:
+                    v = (s[(y * w + x) / 2] >> ((x & 1) * 4)) & 15;
+                    d[idx / 2] |= v << ((idx & 1) * 4);
+                    break;
+                case 8:
+                    d[idx] = s[y * w + x];
+                    break;
+                default:
+                    ((uint16_t *)d)[idx] = ((const uint16_t *)s)[y * w + x];
+                    break;
+            }
+        }
+    }
+}
+
+static void convert(const uint32_t *src, uint16_t *dst, uint32_t n, int fmt) {
+    uint32_t i;
+
+    for(i = 0; i < n; i++)
+        dst[i] = tw_texel16((const uint8_t *)src, i, fmt);
+}
+
+/* What pvr_txr_load_ex() does now, minus the store queues */
+static inline void new_twiddle_fmt(const txr_twiddle_t *tw, uint32_t *d,
+                                   int fmt) {
+    uint32_t n;
+
+    for(n = 0; n < tw->lines; n++, d += 8)
+        txr_twiddle_line(tw, n, d, fmt);
+}
+
+static int new_twiddle(const void *src, void *dst, uint32_t w, uint32_t h,
+                       int fmt, int invert) {
+    txr_twiddle_t tw;
+
+    if(txr_twiddle_init(&tw, src, w, h, fmt, invert))
+        return -1;
+
+    switch(fmt) {
+        case TW_FMT_4BPP:
+            new_twiddle_fmt(&tw, dst, TW_FMT_4BPP);
+            break;
+        case TW_FMT_8BPP:
+            new_twiddle_fmt(&tw, dst, TW_FMT_8BPP);
+            break;
+        case TW_FMT_16BPP:
+            new_twiddle_fmt(&tw, dst, TW_FMT_16BPP);
+            break;
+        case TW_FMT_ARGB4444:
+            new_twiddle_fmt(&tw, dst, TW_FMT_ARGB4444);
+            break;
+        case TW_FMT_RGB565:
+            new_twiddle_fmt(&tw, dst, TW_FMT_RGB565);
+            break;
+        case TW_FMT_ARGB1555:
+            new_twiddle_fmt(&tw, dst, TW_FMT_ARGB1555);
+            break;
+    }
+
+    return 0;
+}
+
+static const uint32_t fmt_bpp[] = { 4, 8, 16, 32, 32, 32 };
+static const char *fmt_name[] = {
+    "4bpp", "8bpp", "16bpp", "ARGB4444", "RGB565", "ARGB1555"
+};
+
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int main(int argc, char *argv[]) {
+    uint8_t *src, *tmp, *a, *b;
+    uint32_t w, h, i, bytes, outbytes, bpp, seed = 1;
+    int fmt, inv, reps, checked = 0;
+    double t0, t_old, t_new;
+
+    (void)argc;
+    (void)argv;
+
+    src = malloc(1024 * 1024 * 4);
+    tmp = malloc(1024 * 1024 * 2);
+    a = malloc(1024 * 1024 * 2);
+    b = malloc(1024 * 1024 * 2);
+
+    if(!src || !tmp || !a || !b) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for(i = 0; i < 1024 * 1024 * 4; i++) {
+        seed = seed * 1103515245 + 12345;
+        src[i] = seed >> 16;
+    }
+
+    for(fmt = TW_FMT_4BPP; fmt <= TW_FMT_ARGB1555; fmt++) {
+        for(w = 8; w <= 1024; w <<= 1) {
+            for(h = 8; h <= 1024; h <<= 1) {
+                for(inv = 0; inv < 2; inv++) {
+                    bpp = fmt_bpp[fmt];
+                    outbytes = w * h * (bpp > 16 ? 16 : bpp) / 8;
+
+                    memset(a, 0xaa, outbytes);
+                    new_twiddle(src, a, w, h, fmt, inv);
+
+                    if(bpp == 32) {
+                        convert((const uint32_t *)src, (uint16_t *)tmp,
+                                w * h, fmt);
+                        ref_twiddle(tmp, b, w, h, 16, inv);
+                    }
+                    else {
+                        ref_twiddle(src, b, w, h, bpp, inv);
+                    }
+
+                    if(memcmp(a, b, outbytes)) {
+                        fprintf(stderr, "%s %ux%u%s: mismatch\n",
+                                fmt_name[fmt], w, h, inv ? " inverted" : "");
+                        return 1;
+                    }
+
+                    /* The old code matches the definition, except inverted
+                       4bpp and 8bpp. */
+                    if(bpp <= 16 && (!inv || bpp == 16)) {
+                        old_twiddle(src, b, w, h, bpp, inv);
+
+                        if(memcmp(a, b, outbytes)) {
+                            fprintf(stderr, "%s %ux%u%s: differs from old\n",
+                                    fmt_name[fmt], w, h,
+                                    inv ? " inverted" : "");
+                            return 1;
+                        }
+                    }
+
+                    checked++;
+                }
+            }
+        }
+    }
+
+    printf("%d textures verified\n", checked);
+
+    for(fmt = TW_FMT_4BPP; fmt <= TW_FMT_16BPP; fmt++) {
+        for(w = 64; w <= 1024; w <<= 2) {
+            h = w;
+            bpp = fmt_bpp[fmt];
+            bytes = w * h * bpp / 8;
+            reps = (64 * 1024 * 1024) / bytes;
+
+            t0 = now_ms();
+            for(i = 0; i < (uint32_t)reps; i++)
+                old_twiddle(src, a, w, h, bpp, 0);
+            t_old = (now_ms() - t0) / reps;
+
+            t0 = now_ms();
+            for(i = 0; i < (uint32_t)reps; i++)
+                new_twiddle(src, b, w, h, fmt, 0);
+            t_new = (now_ms() - t0) / reps;
+
+            printf("%-6s %4ux%-4u old %8.3f ms, new %8.3f ms (%.1fx)\n",
+                   fmt_name[fmt], w, h, t_old, t_new, t_old / t_new);
+        }
+    }
+
+    free(src);
+    free(tmp);
+    free(a);
+    free(b);
+
+    return 0;
+}
@@ -0,0 +1,8 @@
+/* KallistiOS ##version##
+
+   utils/tcptest/arpa/inet.h
+
+   Brings in KOS's own header instead of the host's.
+*/
+
+#include "../../../include/arpa/inet.h"
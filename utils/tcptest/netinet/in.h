@@ -0,0 +1,8 @@
+/* KallistiOS ##version##
+
+   utils/tcptest/netinet/in.h
+
+   Brings in KOS's own header instead of the host's.
+*/
+
+#include "../../../include/netinet/in.h"
@@ -0,0 +1,8 @@
+/* KallistiOS ##version##
+
+   utils/tcptest/netinet/tcp.h
+
+   Brings in KOS's own header instead of the host's.
+*/
+
+#include "../../../include/netinet/tcp.h"
@@ -0,0 +1,8 @@
+/* KallistiOS ##version##
+
+   utils/tcptest/poll.h
+
+   Brings in KOS's own header instead of the host's.
+*/
+
+#include "../../include/poll.h"
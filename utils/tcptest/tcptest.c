@@ -0,0 +1,550 @@
+/* KallistiOS ##version##
+
+   tcptest.c
+
+   Test for TCP congestion control and retransmission. This builds the real
+   kernel/net/net_tcp.c on a PC, with the IPv6 layer replaced by a simulated
+   link between two addresses, and runs bulk transfers over it on simulated
+   time.
+
+   The link has a one-way delay, a bottleneck of a given rate with a drop-tail
+   queue in front of it, random loss, and can also drop one particular data
+   segment, the first <FIN> each way, or everything for a while. Each transfer
+   has to arrive intact, and the sender's TCP_INFO counters have to show the
+   loss being dealt with the way it should be: no retransmissions on a clean
+   link, a single fast retransmit (and no timeout) for a single lost segment,
+   timeouts only when the link goes away, and an RTT estimate that matches the
+   link. Both ends then have to close down and be freed.
+
+   Everything runs in one thread. Sockets are non-blocking, and the timer
+   thread's work is done by the main loop once its deadlines come up.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../kernel/net/net_tcp.c"
+
+#define MAX_FDS         16
+#define XFER_SIZE       (1024 * 1024)
+
+/* Give up on a transfer after this long (simulated) */
+#define XFER_LIMIT_MS   120000
+
+/* The link */
+typedef struct {
+    const char *name;
+    uint32_t delay;             /* One-way delay, in ms */
+    uint32_t rate;              /* Bottleneck rate, in bytes per ms */
+    int qlimit;                 /* Packets queued at the bottleneck */
+    uint32_t loss;              /* Random loss, per 10000 packets */
+    int drop_seg;               /* Drop this data segment only (1-based) */
+    uint32_t outage;            /* Drop everything for this long (ms)... */
+    uint32_t outage_at;         /* ...starting this far into the transfer */
+    int drop_fins;              /* Drop the first <FIN> each way */
+} link_t;
+
+typedef struct pkt {
+    TAILQ_ENTRY(pkt) entry;
+    uint64_t sent;              /* When it clears the bottleneck (us) */
+    uint64_t due;               /* When it arrives (us) */
+    ipv6_hdr_t ip;
+    size_t len;
+    uint8_t data[];
+} pkt_t;
+
+TAILQ_HEAD(pktq, pkt);
+
+static const link_t *cur_link;
+static struct pktq wire[2] = {
+    TAILQ_HEAD_INITIALIZER(wire[0]), TAILQ_HEAD_INITIALIZER(wire[1])
+};
+static uint64_t busy_until[2];
+static uint64_t outage_start;
+static int data_segs, dropped, fins[2];
+static uint32_t rng = 2463534242u;
+
+static const struct in6_addr addr_a = {{{ 0xfd, 0, 0, 0, 0, 0, 0, 0,
+                                          0, 0, 0, 0, 0, 0, 0, 1 }}};
+static const struct in6_addr addr_b = {{{ 0xfd, 0, 0, 0, 0, 0, 0, 0,
+                                          0, 0, 0, 0, 0, 0, 0, 2 }}};
+
+static net_socket_t *fds[MAX_FDS];
+static int failed;
+
+#define CHECK(c) do { \
+        if(!(c)) { \
+            printf("  %s:%d: %s failed\n", cur_link->name, __LINE__, #c); \
+            failed = 1; \
+        } \
+    } while(0)
+
+/* What the kernel would provide */
+static uint64_t sim_us;
+static netif_t dev = { .mtu = 1500, .mtu6 = 1500 };
+netif_t *net_default_dev = &dev;
+const struct in6_addr in6addr_any = IN6ADDR_ANY_INIT;
+int dbglog_level = DBG_WARNING;
+int inside_int;
+
+timer_val_t __dreamcast_get_ticks(void) {
+    return (timer_val_t){
+        .secs = sim_us / 1000000,
+        .ticks = (sim_us % 1000000) * 1000 / 80
+    };
+}
+
+/* Nothing ever has to wait: there's only one thread. */
+int mutex_init(mutex_t *m, unsigned int mtype) { (void)m; (void)mtype; return 0; }
+int mutex_destroy(mutex_t *m) { (void)m; return 0; }
+int mutex_lock_timed(mutex_t *m, unsigned int t) { (void)m; (void)t; return 0; }
+int mutex_lock_irqsafe(mutex_t *m) { (void)m; return 0; }
+int mutex_trylock(mutex_t *m) { (void)m; return 0; }
+int mutex_unlock(mutex_t *m) { (void)m; return 0; }
+int cond_init(condvar_t *cv) { (void)cv; return 0; }
+int cond_destroy(condvar_t *cv) { (void)cv; return 0; }
+int cond_signal(condvar_t *cv) { (void)cv; return 0; }
+void genwait_wake_one(const void *obj) { (void)obj; }
+void genwait_wake_all(const void *obj) { (void)obj; }
+void thd_worker_wakeup(kthread_worker_t *thd) { (void)thd; }
+void thd_worker_destroy(kthread_worker_t *thd) { (void)thd; }
+void __poll_event_trigger(int fd, short event) { (void)fd; (void)event; }
+int fs_socket_proto_add(fs_socket_proto_t *p) { (void)p; return 0; }
+int fs_socket_proto_remove(fs_socket_proto_t *p) { (void)p; return 0; }
+int fs_close(file_t fd) { (void)fd; return 0; }
+
+static void blocked(const char *what) {
+    printf("%s() would have blocked\n", what);
+    exit(1);
+}
+
+int cond_wait(condvar_t *cv, mutex_t *m) {
+    (void)cv; (void)m;
+    blocked("cond_wait");
+    return -1;
+}
+
+int cond_wait_timed(condvar_t *cv, mutex_t *m, int t) {
+    (void)cv; (void)m; (void)t;
+    blocked("cond_wait_timed");
+    return -1;
+}
+
+int genwait_wait(void *obj, const char *mesg, unsigned int t) {
+    (void)obj; (void)mesg; (void)t;
+    blocked("genwait_wait");
+    return -1;
+}
+
+void thd_pass(void) {
+    blocked("thd_pass");
+}
+
+kthread_worker_t *thd_worker_create_ex(const kthread_attr_t *attr,
+                                       void (*routine)(void *), void *data) {
+    static int dummy;
+
+    (void)attr; (void)routine; (void)data;
+    return (kthread_worker_t *)&dummy;
+}
+
+net_socket_t *fs_socket_open_sock(fs_socket_proto_t *p) {
+    int i;
+
+    for(i = 0; i < MAX_FDS; ++i) {
+        if(!fds[i]) {
+            fds[i] = calloc(1, sizeof(net_socket_t));
+            fds[i]->fd = i;
+            fds[i]->protocol = p;
+            return fds[i];
+        }
+    }
+
+    errno = EMFILE;
+    return NULL;
+}
+
+uint32_t net_ipv4_address(const uint8_t addr[4]) {
+    return (addr[0] << 24) | (addr[1] << 16) | (addr[2] << 8) | (addr[3]);
+}
+
+uint16_t net_ipv4_checksum(const uint8_t *data, size_t bytes, uint16_t sum) {
+    uint32_t acc = sum;
+    uint16_t w;
+
+    for(; bytes > 1; bytes -= 2, data += 2) {
+        memcpy(&w, data, 2);
+        acc += w;
+    }
+
+    if(bytes)
+        acc += *data;
+
+    while(acc >> 16)
+        acc = (acc >> 16) + (acc & 0xFFFF);
+
+    return (uint16_t)~acc;
+}
+
+uint16_t net_ipv6_checksum_pseudo(const struct in6_addr *src,
+                                  const struct in6_addr *dst,
+                                  uint32_t upper_len, uint8_t next_hdr) {
+    uint8_t ps[40] = { 0 };
+
+    memcpy(ps, src, 16);
+    memcpy(ps + 16, dst, 16);
+    upper_len = htonl(upper_len);
+    memcpy(ps + 32, &upper_len, 4);
+    ps[39] = next_hdr;
+
+    return ~net_ipv4_checksum(ps, sizeof(ps), 0);
+}
+
+int net_ipv4_send_inplace(netif_t *net, uint8_t *frame, size_t size, int id,
+                          int ttl, int tos, int proto, uint32_t src,
+                          uint32_t dst) {
+    (void)net; (void)frame; (void)size; (void)id; (void)ttl; (void)tos;
+    (void)proto; (void)src; (void)dst;
+    printf("IPv4 send on an IPv6 link\n");
+    exit(1);
+}
+
+static uint32_t rnd(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+/* Put a segment on the wire, unless the link loses it. */
+int net_ipv6_send(netif_t *net, const uint8_t *data, size_t size, int hops,
+                  int tos, int proto, const struct in6_addr *src,
+                  const struct in6_addr *dst) {
+    int dir = !memcmp(src, &addr_b, sizeof(addr_b));
+    size_t hlen = (data[12] >> 4) * 4;
+    uint64_t start;
+    pkt_t *p;
+    int queued = 0;
+
+    (void)net; (void)hops; (void)tos; (void)proto;
+
+    if(size > hlen && !dir && ++data_segs == cur_link->drop_seg)
+        goto drop;
+
+    if((data[13] & TCP_FLAG_FIN) && cur_link->drop_fins && !fins[dir]++)
+        goto drop;
+
+    if(cur_link->loss && rnd() % 10000 < cur_link->loss)
+        goto drop;
+
+    if(outage_start && sim_us >= outage_start &&
+            sim_us < outage_start + cur_link->outage * 1000)
+        goto drop;
+
+    /* Drop-tail at the bottleneck */
+    TAILQ_FOREACH(p, &wire[dir], entry) {
+        if(p->sent > sim_us)
+            ++queued;
+    }
+
+    if(queued >= cur_link->qlimit)
+        goto drop;
+
+    p = malloc(sizeof(pkt_t) + size);
+    memset(&p->ip, 0, sizeof(p->ip));
+    p->ip.src_addr = *src;
+    p->ip.dst_addr = *dst;
+    p->len = size;
+    memcpy(p->data, data, size);
+
+    start = busy_until[dir] > sim_us ? busy_until[dir] : sim_us;
+    p->sent = busy_until[dir] = start + size * 1000 / cur_link->rate;
+    p->due = p->sent + cur_link->delay * 1000;
+
+    /* Everything going one way has the same delay, so it stays in order */
+    TAILQ_INSERT_TAIL(&wire[dir], p, entry);
+    return 0;
+
+drop:
+    ++dropped;
+    return 0;
+}
+
+static void deliver(int dir) {
+    pkt_t *p;
+
+    while((p = TAILQ_FIRST(&wire[dir])) && p->due <= sim_us) {
+        TAILQ_REMOVE(&wire[dir], p, entry);
+        net_tcp_input(&dev, AF_INET6, &p->ip, p->data, p->len);
+        free(p);
+    }
+}
+
+/* What the timer thread would do */
+static void run_timers(void) {
+    struct tcp_sock *s;
+
+    while((s = tcp_timer_first()) && s->timer_next <= timer_ms_gettime64()) {
+        tcp_timer_remove(s);
+        ++s->refs;
+
+        if(!tcp_sock_lock(s))
+            tcp_timer_run(s);
+    }
+}
+
+static void step(void) {
+    deliver(0);
+    deliver(1);
+    run_timers();
+    sim_us += 250;
+}
+
+static net_socket_t *new_sock(void) {
+    net_socket_t *hnd = fs_socket_open_sock(&proto);
+
+    if(proto.socket(hnd, AF_INET6, SOCK_STREAM, IPPROTO_TCP)) {
+        printf("socket() failed\n");
+        exit(1);
+    }
+
+    ((struct tcp_sock *)hnd->data)->flags |= FS_SOCKET_NONBLOCK;
+    return hnd;
+}
+
+static void close_sock(net_socket_t *hnd) {
+    proto.close(hnd);
+    fds[hnd->fd] = NULL;
+    free(hnd);
+}
+
+static int sock_bind(net_socket_t *hnd, const struct in6_addr *addr,
+                     uint16_t port) {
+    struct sockaddr_in6 sa = { .sin6_family = AF_INET6 };
+
+    sa.sin6_addr = *addr;
+    sa.sin6_port = htons(port);
+    return proto.bind(hnd, (struct sockaddr *)&sa, sizeof(sa));
+}
+
+static uint8_t pattern(size_t i) {
+    return (uint8_t)(i * 7 + (i >> 10));
+}
+
+static void xfer(const link_t *l, uint16_t port) {
+    static uint8_t buf[16384];
+    struct sockaddr_in6 sa = { .sin6_family = AF_INET6 };
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    net_socket_t *lis, *cli, *srv = NULL;
+    size_t sent = 0, rcvd = 0, i;
+    uint64_t start;
+    ssize_t n;
+    int fd, bad = 0;
+
+    cur_link = l;
+    data_segs = dropped = fins[0] = fins[1] = 0;
+    busy_until[0] = busy_until[1] = 0;
+    start = sim_us;
+    outage_start = l->outage ? start + l->outage_at * 1000 : 0;
+
+    lis = new_sock();
+    CHECK(!sock_bind(lis, &addr_b, port));
+    CHECK(!proto.listen(lis, 1));
+
+    cli = new_sock();
+    CHECK(!sock_bind(cli, &addr_a, 0));
+    sa.sin6_addr = addr_b;
+    sa.sin6_port = htons(port);
+    CHECK(proto.connect(cli, (struct sockaddr *)&sa, sizeof(sa)) == -1 &&
+          errno == EINPROGRESS);
+
+    while(rcvd < XFER_SIZE && sim_us - start < XFER_LIMIT_MS * 1000ull) {
+        step();
+
+        if(!srv && (fd = proto.accept(lis, NULL, NULL)) >= 0) {
+            srv = fds[fd];
+            ((struct tcp_sock *)srv->data)->flags |= FS_SOCKET_NONBLOCK;
+        }
+
+        if(((struct tcp_sock *)cli->data)->state != TCP_STATE_ESTABLISHED)
+            continue;
+
+        while(sent < XFER_SIZE) {
+            for(i = 0; i < sizeof(buf) && sent + i < XFER_SIZE; ++i)
+                buf[i] = pattern(sent + i);
+
+            if((n = proto.sendto(cli, buf, i, MSG_DONTWAIT, NULL, 0)) <= 0)
+                break;
+
+            sent += n;
+        }
+
+        while(srv && (n = proto.recvfrom(srv, buf, sizeof(buf), MSG_DONTWAIT,
+                                         NULL, NULL)) > 0) {
+            for(i = 0; i < (size_t)n; ++i)
+                bad |= buf[i] != pattern(rcvd + i);
+
+            rcvd += n;
+        }
+    }
+
+    CHECK(!proto.getsockopt(cli, IPPROTO_TCP, TCP_INFO, &ti, &len));
+    printf("%-22s %7.2f s %7.1f KB/s  %5d lost  %4u rexmit  %3u fast  "
+           "%2u rto   rtt %3u ms  rto %4u ms\n", l->name,
+           (sim_us - start) / 1e6, rcvd / 1024.0 / ((sim_us - start) / 1e6),
+           dropped, ti.tcpi_total_retrans, ti.tcpi_fast_retrans,
+           ti.tcpi_timeouts, ti.tcpi_rtt, ti.tcpi_rto);
+
+    CHECK(rcvd == XFER_SIZE);
+    CHECK(!bad);
+
+    /* The RTT estimate should be in the neighborhood of the real thing: twice
+       the delay, plus the time a segment spends at the bottleneck. */
+    CHECK(ti.tcpi_rtt >= 2 * l->delay &&
+          ti.tcpi_rtt <= 2 * l->delay + l->qlimit * 1500 / l->rate + 50);
+    CHECK(ti.tcpi_rto >= TCP_MIN_RTO && ti.tcpi_rto < TCP_DEFAULT_RTTO);
+
+    if(!dropped)
+        CHECK(!ti.tcpi_total_retrans);
+
+    if(l->drop_seg) {
+        CHECK(ti.tcpi_fast_retrans == 1);
+        CHECK(ti.tcpi_total_retrans == 1);
+    }
+
+    /* Dropped segments with more behind them should all be caught by
+       duplicate ACKs. Only taking the link away should need a timeout. */
+    if(l->outage)
+        CHECK(ti.tcpi_timeouts > 0);
+    else if(dropped == !!l->drop_seg)
+        CHECK(!ti.tcpi_timeouts);
+
+    /* Tear everything down: the client goes first, and the server once it's
+       seen the end of the stream. Then wait out TIME-WAIT. */
+    close_sock(cli);
+    start = sim_us;
+    n = -1;
+
+    while(srv && sim_us - start < XFER_LIMIT_MS * 1000ull) {
+        step();
+
+        if(!(n = proto.recvfrom(srv, buf, sizeof(buf), MSG_DONTWAIT, NULL,
+                                NULL)))
+            break;
+
+        CHECK(n == -1 && errno == EAGAIN);
+    }
+
+    CHECK(!n);
+
+    if(srv)
+        close_sock(srv);
+
+    close_sock(lis);
+
+    while(!LIST_EMPTY(&tcp_socks) &&
+            sim_us - start < (XFER_LIMIT_MS + 4 * TCP_DEFAULT_MSL) * 1000ull)
+        step();
+
+    CHECK(LIST_EMPTY(&tcp_socks));
+
+    if(l->drop_fins)
+        CHECK(fins[0] == 2 && fins[1] == 2);
+}
+
+/* Let a connection go quiet with keepalives on, and take the link away. Once
+   the keepalives give up, the socket has to let go of its port. */
+static void keepalive(uint16_t port) {
+    static const link_t l = { "keepalive timeout", 20, 250, 64, 0, 0, 60000, 0,
+                              0 };
+    struct sockaddr_in6 sa = { .sin6_family = AF_INET6 };
+    net_socket_t *lis, *cli, *srv = NULL, *again;
+    struct tcp_sock *s;
+    uint64_t start;
+    int one = 1, fd;
+
+    cur_link = &l;
+    outage_start = 0;
+    start = sim_us;
+
+    lis = new_sock();
+    CHECK(!sock_bind(lis, &addr_b, port));
+    CHECK(!proto.listen(lis, 1));
+
+    cli = new_sock();
+    CHECK(!sock_bind(cli, &addr_a, 0));
+    sa.sin6_addr = addr_b;
+    sa.sin6_port = htons(port);
+    CHECK(proto.connect(cli, (struct sockaddr *)&sa, sizeof(sa)) == -1 &&
+          errno == EINPROGRESS);
+
+    s = (struct tcp_sock *)cli->data;
+
+    while((!srv || s->state != TCP_STATE_ESTABLISHED) &&
+            sim_us - start < XFER_LIMIT_MS * 1000ull) {
+        step();
+
+        if(!srv && (fd = proto.accept(lis, NULL, NULL)) >= 0)
+            srv = fds[fd];
+    }
+
+    CHECK(srv && s->state == TCP_STATE_ESTABLISHED);
+
+    CHECK(!proto.setsockopt(cli, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one)));
+    CHECK(!proto.setsockopt(cli, IPPROTO_TCP, TCP_KEEPIDLE, &one,
+                            sizeof(one)));
+    CHECK(!proto.setsockopt(cli, IPPROTO_TCP, TCP_KEEPINTVL, &one,
+                            sizeof(one)));
+    CHECK(!proto.setsockopt(cli, IPPROTO_TCP, TCP_KEEPCNT, &one, sizeof(one)));
+
+    outage_start = sim_us;
+    start = sim_us;
+
+    while(s->state == TCP_STATE_ESTABLISHED &&
+            sim_us - start < XFER_LIMIT_MS * 1000ull)
+        step();
+
+    printf("%-22s %7.2f s\n", l.name, (sim_us - start) / 1e6);
+    CHECK(s->state == (TCP_STATE_RESET | TCP_STATE_CLOSED));
+
+    /* Nothing should find it any more, and its port should be free. */
+    CHECK(!find_sock(&addr_b, &addr_a, htons(port), s->local_addr.sin6_port,
+                     AF_INET6));
+    again = new_sock();
+    CHECK(!sock_bind(again, &addr_a, ntohs(s->local_addr.sin6_port)));
+
+    close_sock(again);
+    close_sock(cli);
+    close_sock(srv);
+    close_sock(lis);
+}
+
+static const link_t links[] = {
+    /* name                  delay rate qlim loss seg outage  at fins */
+    { "clean",                  20, 250,  64,   0,   0,    0,   0, 0 },
+    { "one lost segment",       20, 250,  64,   0, 100,    0,   0, 0 },
+    { "1% loss",                20, 250,  64, 100,   0,    0,   0, 0 },
+    { "3% loss",                20, 250,  64, 300,   0,    0,   0, 0 },
+    { "small queue",            20, 250,   8,   0,   0,    0,   0, 0 },
+    { "long delay, 1% loss",   150, 250,  64, 100,   0,    0,   0, 0 },
+    { "1 s outage",             20, 250,  64,   0,   0, 1000, 500, 0 },
+    { "lost FINs",              20, 250,  64,   0,   0,    0,   0, 1 },
+};
+
+int main(void) {
+    size_t i;
+
+    sim_us = 1000000;
+    net_tcp_init();
+
+    for(i = 0; i < sizeof(links) / sizeof(links[0]); ++i)
+        xfer(&links[i], 5000 + i);
+
+    keepalive(6000);
+    net_tcp_shutdown();
+
+    printf("%s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
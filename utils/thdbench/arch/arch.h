@@ -0,0 +1,24 @@
+/* KallistiOS ##version##
+
+   utils/thdbench/arch/arch.h
+
+   Stand-in for the real header, which has SH4 assembly in it. The harness
+   provides the functions.
+*/
+
+#ifndef __ARCH_ARCH_H
+#define __ARCH_ARCH_H
+
+#include <stdint.h>
+
+#define THD_SCHED_HZ    100
+
+extern uintptr_t _arch_mem_top;
+
+void arch_exit(void) __attribute__((noreturn));
+void arch_panic(const char *str) __attribute__((noreturn));
+
+static inline void arch_sleep(void) {
+}
+
+#endif /* __ARCH_ARCH_H */
@@ -0,0 +1,59 @@
+/* KallistiOS ##version##
+
+   utils/thdbench/arch/irq.h
+
+   Stand-in for the real header, which has SH4 assembly in it. There are no
+   interrupts to mask, and a context only holds what the scheduler looks at,
+   in registers as wide as the host's pointers. The harness provides the
+   functions.
+*/
+
+#include <kos/irq.h>
+
+#ifndef __ARCH_IRQ_H
+#define __ARCH_IRQ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct irq_context {
+    uintptr_t pc;
+    uintptr_t r[16];
+};
+
+#define CONTEXT_PC(c)   ((c).pc)
+#define CONTEXT_FP(c)   ((c).r[14])
+#define CONTEXT_SP(c)   ((c).r[15])
+#define CONTEXT_RET(c)  ((c).r[0])
+
+enum irq_exception {
+    EXC_RESET
+};
+
+extern int inside_int;
+
+static inline int arch_irq_inside_int(void) {
+    return inside_int;
+}
+
+static inline void arch_irq_restore(irq_mask_t old) {
+    (void)old;
+}
+
+static inline irq_mask_t arch_irq_disable(void) {
+    return 0;
+}
+
+static inline void arch_irq_enable(void) {
+}
+
+void arch_irq_create_context(irq_context_t *context, uintptr_t stack_pointer,
+                             uintptr_t routine, const uintptr_t *args);
+int arch_irq_set_handler(irq_t code, irq_hdl_t hnd, void *data);
+irq_cb_t arch_irq_get_handler(irq_t code);
+int arch_irq_set_global_handler(irq_hdl_t hnd, void *data);
+irq_cb_t arch_irq_get_global_handler(void);
+void arch_irq_set_context(irq_context_t *cxt);
+irq_context_t *arch_irq_get_context(void);
+
+#endif /* __ARCH_IRQ_H */
@@ -0,0 +1,46 @@
+/* KallistiOS ##version##
+
+   utils/thdbench/hostdefs.h
+
+   Included ahead of everything else, so that the kernel sources build with
+   the host's compiler and C library: the attributes newlib's sys/cdefs.h
+   provides, the _SAFE list macros glibc's sys/queue.h lacks, and a different
+   name for KOS's timer_gettime(), which clashes with the POSIX one.
+*/
+
+#ifndef __THDBENCH_HOSTDEFS_H
+#define __THDBENCH_HOSTDEFS_H
+
+#include <assert.h>
+#include <time.h>
+#include <sys/queue.h>
+
+#define __weak_symbol       __attribute__((weak))
+#define __pure              __attribute__((pure))
+#define __pure2             __attribute__((const))
+#define __used              __attribute__((used))
+#define __nonnull_all       __attribute__((nonnull))
+#define __result_use_check  __attribute__((warn_unused_result))
+#define __printflike(f, a)  __attribute__((format(printf, f, a)))
+#define __predict_true(x)   __builtin_expect(!!(x), 1)
+#define __predict_false(x)  __builtin_expect(!!(x), 0)
+
+#define assert_msg(e, m)    assert(e)
+
+#define timer_gettime       kos_timer_gettime
+
+#ifndef LIST_FOREACH_SAFE
+#define LIST_FOREACH_SAFE(var, head, field, tvar) \
+    for((var) = LIST_FIRST((head)); \
+        (var) && ((tvar) = LIST_NEXT((var), field), 1); \
+        (var) = (tvar))
+#endif
+
+#ifndef TAILQ_FOREACH_SAFE
+#define TAILQ_FOREACH_SAFE(var, head, field, tvar) \
+    for((var) = TAILQ_FIRST((head)); \
+        (var) && ((tvar) = TAILQ_NEXT((var), field), 1); \
+        (var) = (tvar))
+#endif
+
+#endif /* __THDBENCH_HOSTDEFS_H */
@@ -0,0 +1,22 @@
+/* KallistiOS ##version##
+
+   utils/thdbench/reent.h
+
+   Stand-in for newlib's header: just enough of a struct _reent for each
+   thread to have its own errno.
+*/
+
+#ifndef __THDBENCH_REENT_H
+#define __THDBENCH_REENT_H
+
+struct _reent {
+    int _errno;
+};
+
+#define _REENT_INIT_PTR(r)  ((r)->_errno = 0)
+#define _reclaim_reent(r)   ((void)(r))
+#define __errno_r(r)        ((r)->_errno)
+
+extern struct _reent *_impure_ptr;
+
+#endif /* __THDBENCH_REENT_H */
@@ -0,0 +1,944 @@
+/* KallistiOS ##version##
+
+   thdbench.c
+
+   Benchmark for the thread scheduler. This builds the real
+   kernel/thread/thread.c on a PC, along with genwait.c, sem.c and timerq.c,
+   with the stand-in headers in this directory for the SH4 specific parts.
+
+   Nothing ever runs on the threads' stacks: the harness calls the timer
+   handler the way the timer interrupt would, on a simulated clock, and then
+   plays the part of whichever thread was picked. A thread that should block
+   (the reaper, say) does so by calling the real blocking functions, which
+   end up in the scheduler through thd_block_now().
+
+   It compares the cost of a scheduler tick with 10, 100 and 1000 runnable
+   threads against the single sorted run queue that the buckets replaced,
+   and checks that threads of the same priority still take turns, that
+   higher priorities still come first, and that polling threads wake up on
+   time without going over the per-tick budget of poll callbacks. It also
+   churns through a few hundred thousand short-lived threads to check that
+   thread IDs get recycled and can still be looked up, and checks that timed
+   waits come due in order while the scheduler timer is only programmed for
+   the next of them, comparing the cost of queueing one against the sorted
+   timer queue that the heap replaced.
+*/
+
+#include "../../kernel/thread/thread.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Simulated uptime, in microseconds */
+static uint64_t sim_us;
+
+/* What the scheduler last programmed the timer for, in milliseconds */
+static uint32_t timer_wakeup;
+
+/* The kernel thread's stack, as far as thd_init() is concerned */
+static uint8_t kern_stack[THD_KERNEL_STACK_SIZE];
+uintptr_t _arch_mem_top = (uintptr_t)kern_stack + sizeof(kern_stack);
+
+struct _reent *_impure_ptr;
+int inside_int;
+int dbglog_level = DBG_WARNING;
+
+/*****************************************************************************/
+/* What the kernel would otherwise provide */
+
+timer_val_t __dreamcast_get_ticks(void) {
+    return (timer_val_t){
+        .secs = sim_us / 1000000,
+        .ticks = (sim_us % 1000000) * 1000 / 80
+    };
+}
+
+timer_primary_callback_t timer_primary_set_callback(timer_primary_callback_t cb) {
+    (void)cb;
+    return NULL;
+}
+
+void timer_primary_wakeup(uint32_t millis) {
+    timer_wakeup = millis;
+}
+
+void arch_irq_create_context(irq_context_t *context, uintptr_t stack_pointer,
+                             uintptr_t routine, const uintptr_t *args) {
+    (void)args;
+    memset(context, 0, sizeof(*context));
+    CONTEXT_PC(*context) = routine;
+    CONTEXT_SP(*context) = stack_pointer;
+}
+
+void arch_irq_set_context(irq_context_t *cxt) {
+    (void)cxt;
+}
+
+void arch_stk_setup(kthread_t *nt) {
+    (void)nt;
+}
+
+bool arch_tls_setup_data(kthread_t *thd) {
+    (void)thd;
+    return true;
+}
+
+void arch_tls_destroy_data(kthread_t *thd) {
+    (void)thd;
+}
+
+void arch_tls_init(void) {
+}
+
+int kthread_tls_init(void) {
+    return 0;
+}
+
+void kthread_tls_shutdown(void) {
+}
+
+void arch_exit(void) {
+    fprintf(stderr, "arch_exit() called\n");
+    exit(1);
+}
+
+void arch_panic(const char *str) {
+    fprintf(stderr, "panic: %s\n", str);
+    abort();
+}
+
+int dbgio_printf(const char *fmt, ...) {
+    (void)fmt;
+    return 0;
+}
+
+/* The calling thread gives up the CPU. On the real thing, this only returns
+   once the thread is scheduled again; here it returns right away, and the
+   harness carries on as whichever thread the scheduler picked. */
+int thd_block_now(irq_context_t *mycxt) {
+    (void)mycxt;
+    thd_choose_new();
+    return 0;
+}
+
+/*****************************************************************************/
+
+static double now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* One timer interrupt */
+static void tick(void) {
+    sim_us += thd_sched_ms * 1000;
+    thd_timer_hnd(NULL);
+}
+
+static void *never_runs(void *param) {
+    (void)param;
+    abort();
+}
+
+/* Set things up, and let the reaper block on its semaphore like it would
+   the first time it runs. */
+static void start(void) {
+    kthread_t *reaper;
+
+    if(thd_init()) {
+        fprintf(stderr, "thd_init failed\n");
+        exit(1);
+    }
+
+    /* The reaper has the best priority, so the first tick picks it */
+    tick();
+    reaper = thd_current;
+
+    if(strcmp(reaper->label, "[reaper]")) {
+        fprintf(stderr, "expected the reaper to run first, got %s\n",
+                reaper->label);
+        exit(1);
+    }
+
+    sem_wait(&thd_reap_sem);
+}
+
+static kthread_t *spawn(prio_t prio) {
+    kthread_attr_t attr = { .prio = prio, .label = "bench" };
+    kthread_t *thd;
+
+    if(!(thd = thd_create_ex(&attr, never_runs, NULL))) {
+        fprintf(stderr, "thd_create_ex failed\n");
+        exit(1);
+    }
+
+    return thd;
+}
+
+/*****************************************************************************/
+/* The run queue as it was before it was split into buckets: one queue
+   sorted by priority, searched on every tick for the thread with the best
+   effective priority. This is a copy of the old thd_add_to_runnable() and
+   thd_schedule() on a minimal thread structure. */
+
+typedef struct othd {
+    TAILQ_ENTRY(othd) thdq;
+    prio_t prio;
+    int state;
+    uint64_t scheduled;
+    int (*poll_cb)(void *);
+    void *wait_obj;
+    uint64_t wait_timeout;
+    int queued;
+} othd_t;
+
+static TAILQ_HEAD(, othd) old_run_queue = TAILQ_HEAD_INITIALIZER(old_run_queue);
+static othd_t *old_current;
+
+static void old_add_to_runnable(othd_t *t, bool front_of_line) {
+    othd_t *i;
+    int done = 0;
+
+    if(t->queued)
+        return;
+
+    if(!front_of_line) {
+        TAILQ_FOREACH(i, &old_run_queue, thdq) {
+            if(i->prio > t->prio) {
+                TAILQ_INSERT_BEFORE(i, t, thdq);
+                done = 1;
+                break;
+            }
+        }
+    }
+    else {
+        TAILQ_FOREACH(i, &old_run_queue, thdq) {
+            if(i->prio >= t->prio) {
+                TAILQ_INSERT_BEFORE(i, t, thdq);
+                done = 1;
+                break;
+            }
+        }
+    }
+
+    if(!done)
+        TAILQ_INSERT_TAIL(&old_run_queue, t, thdq);
+
+    t->queued = 1;
+}
+
+static void old_remove_from_runnable(othd_t *t) {
+    if(!t->queued)
+        return;
+
+    TAILQ_REMOVE(&old_run_queue, t, thdq);
+    t->queued = 0;
+}
+
+static inline prio_t old_calc_prio(const othd_t *thd, uint32_t now) {
+    prio_t prio = thd->prio;
+    uint32_t shift;
+
+    if(prio < PRIO_MAX) {
+        shift = (now - (uint32_t)thd->scheduled) >> thd_ageing_ms_log2;
+        prio = shift < 32 ? prio >> shift : 0;
+    }
+
+    return prio;
+}
+
+static void old_schedule(uint64_t now) {
+    othd_t *thd, *next_thd = NULL;
+    prio_t prio, max_prio = INT_MAX;
+    int ret;
+
+    TAILQ_FOREACH(thd, &old_run_queue, thdq) {
+        if(thd->state == STATE_POLLING) {
+            if(thd->wait_timeout && thd->wait_timeout < now) {
+                thd->state = STATE_READY;
+            }
+            else {
+                ret = thd->poll_cb(thd->wait_obj);
+
+                if(ret)
+                    thd->state = STATE_READY;
+            }
+        }
+
+        if(thd->state != STATE_READY)
+            continue;
+
+        prio = old_calc_prio(thd, now);
+        if(prio < max_prio) {
+            next_thd = thd;
+            max_prio = prio;
+        }
+    }
+
+    if(old_current->state == STATE_RUNNING) {
+        old_current->state = STATE_READY;
+        old_add_to_runnable(old_current, false);
+
+        if(next_thd == NULL)
+            next_thd = old_current;
+    }
+
+    old_remove_from_runnable(next_thd);
+    next_thd->scheduled = now;
+    next_thd->state = STATE_RUNNING;
+    old_current = next_thd;
+}
+
+static othd_t *old_spawn(prio_t prio) {
+    othd_t *t = calloc(1, sizeof(othd_t));
+
+    t->prio = prio;
+    t->state = STATE_READY;
+    t->scheduled = sim_us / 1000;
+    old_add_to_runnable(t, false);
+
+    return t;
+}
+
+/* The genwait timer queue as it was before it became a pairing heap: sorted
+   by timeout, with a reverse linear scan to insert. */
+
+typedef struct otmr {
+    TAILQ_ENTRY(otmr) timerq;
+    uint64_t wait_timeout;
+} otmr_t;
+
+static TAILQ_HEAD(otmrq, otmr) old_timer_queue =
+    TAILQ_HEAD_INITIALIZER(old_timer_queue);
+
+static void old_tq_insert(otmr_t *thd) {
+    otmr_t *t;
+
+    TAILQ_FOREACH_REVERSE(t, &old_timer_queue, otmrq, timerq) {
+        if(thd->wait_timeout >= t->wait_timeout) {
+            TAILQ_INSERT_AFTER(&old_timer_queue, t, thd, timerq);
+            return;
+        }
+    }
+
+    TAILQ_INSERT_HEAD(&old_timer_queue, thd, timerq);
+}
+
+static void old_tq_remove(otmr_t *thd) {
+    TAILQ_REMOVE(&old_timer_queue, thd, timerq);
+}
+
+/*****************************************************************************/
+/* Benchmarks */
+
+#define TICKS       20000
+#define ENQUEUES    200000
+
+/* Cost of a timer tick with n runnable threads, in nanoseconds */
+static double bench_ticks(void) {
+    double t0 = now_ns();
+    int i;
+
+    for(i = 0; i < TICKS; i++)
+        tick();
+
+    return (now_ns() - t0) / TICKS;
+}
+
+static double bench_old_ticks(void) {
+    double t0 = now_ns();
+    int i;
+
+    for(i = 0; i < TICKS; i++) {
+        sim_us += thd_sched_ms * 1000;
+        old_schedule(sim_us / 1000);
+    }
+
+    return (now_ns() - t0) / TICKS;
+}
+
+/* Cost of taking a thread off the run queue and putting it back, as happens
+   when it blocks and is woken up right away, in nanoseconds. The thread is
+   made to look like it just ran, so that it goes back with its own priority
+   rather than an aged one. */
+static double bench_enqueue(kthread_t *thd) {
+    double t0 = now_ns();
+    int i;
+
+    for(i = 0; i < ENQUEUES; i++) {
+        thd_remove_from_runnable(thd);
+        thd->cpu_time.scheduled = thd_sched_now;
+        thd_add_to_runnable(thd, false);
+    }
+
+    return (now_ns() - t0) / ENQUEUES;
+}
+
+static double bench_old_enqueue(othd_t *thd) {
+    double t0 = now_ns();
+    int i;
+
+    for(i = 0; i < ENQUEUES; i++) {
+        old_remove_from_runnable(thd);
+        thd->scheduled = sim_us / 1000;
+        old_add_to_runnable(thd, false);
+    }
+
+    return (now_ns() - t0) / ENQUEUES;
+}
+
+static void run_benchmarks(void) {
+    static const int counts[] = { 10, 100, 1000 };
+    static othd_t old_kern = { .prio = PRIO_DEFAULT, .state = STATE_RUNNING };
+    kthread_t *last = NULL;
+    othd_t *old_last = NULL;
+    double tnew, told, enew, eold;
+    int i, n = 0;
+
+    old_current = &old_kern;
+
+    printf("Scheduler cost, all threads runnable at the default priority\n\n");
+    printf(" threads     tick: old       new    enqueue: old       new\n");
+
+    for(i = 0; i < (int)__array_size(counts); i++) {
+        for(; n < counts[i]; n++) {
+            last = spawn(PRIO_DEFAULT);
+            old_last = old_spawn(PRIO_DEFAULT);
+        }
+
+        tnew = bench_ticks();
+        told = bench_old_ticks();
+
+        /* Make sure the thread being moved around is queued */
+        while(thd_current == last)
+            tick();
+
+        while(old_current == old_last)
+            old_schedule((sim_us += thd_sched_ms * 1000) / 1000);
+
+        enew = bench_enqueue(last);
+        eold = bench_old_enqueue(old_last);
+
+        printf("%8d %11.0f ns %6.0f ns %11.0f ns %6.0f ns\n",
+               n, told, tnew, eold, enew);
+    }
+
+    printf("\n");
+}
+
+#define REQUEUES    200000
+
+/* Cost of taking a random thread out of a timer queue of n and putting it
+   back with a new timeout, as happens when a timed wait is woken and the
+   thread goes back to waiting, in nanoseconds. */
+static void bench_timeouts(void) {
+    static const int counts[] = { 10, 100, 1000 };
+    kthread_t *thds;
+    timerq_t queue = TIMERQ_INITIALIZER(timerq_thd_timeout);
+    otmr_t *old;
+    double tnew, told;
+    int i, j, n;
+
+    printf("Timed wait cost, requeueing one of n waiters\n\n");
+    printf(" waiters      old       new\n");
+
+    for(i = 0; i < (int)__array_size(counts); i++) {
+        n = counts[i];
+        thds = aligned_alloc(32, n * sizeof(kthread_t));
+        old = calloc(n, sizeof(otmr_t));
+        memset(thds, 0, n * sizeof(kthread_t));
+        srand(3);
+
+        for(j = 0; j < n; j++) {
+            thds[j].wait_timeout = old[j].wait_timeout = rand();
+            timerq_insert(&queue, &thds[j].timerq);
+            old_tq_insert(&old[j]);
+        }
+
+        srand(4);
+        tnew = now_ns();
+
+        for(j = 0; j < REQUEUES; j++) {
+            kthread_t *t = &thds[rand() % n];
+
+            timerq_remove(&queue, &t->timerq);
+            t->wait_timeout += rand() % 1000000;
+            timerq_insert(&queue, &t->timerq);
+        }
+
+        tnew = (now_ns() - tnew) / REQUEUES;
+        srand(4);
+        told = now_ns();
+
+        for(j = 0; j < REQUEUES; j++) {
+            otmr_t *t = &old[rand() % n];
+
+            old_tq_remove(t);
+            t->wait_timeout += rand() % 1000000;
+            old_tq_insert(t);
+        }
+
+        told = (now_ns() - told) / REQUEUES;
+
+        printf("%8d %8.0f ns %6.0f ns\n", n, told, tnew);
+
+        timerq_init(&queue, timerq_thd_timeout);
+        TAILQ_INIT(&old_timer_queue);
+        free(thds);
+        free(old);
+    }
+
+    printf("\n");
+}
+
+/*****************************************************************************/
+/* Checks */
+
+static int fail(const char *what) {
+    printf("  %s: FAILED\n", what);
+    return 1;
+}
+
+/* Park the current thread for good, the way a thread blocked on something
+   that never happens would be. */
+static void park(void) {
+    genwait_wait(thd_current, "parked", 0);
+}
+
+/* Threads of the same priority take turns, and a better priority runs as
+   soon as it's ready. This runs on its own set of threads, so it's done
+   before the benchmarks add theirs. */
+static int check_order(void) {
+    kthread_t *thds[8], *hi;
+    int runs[8] = { 0 };
+    uint64_t slept;
+    int i, j, rv = 0;
+
+    printf("Scheduling order\n");
+
+    for(i = 0; i < 8; i++)
+        thds[i] = spawn(PRIO_DEFAULT);
+
+    /* The kernel thread is in the rotation too */
+    for(i = 0; i < 9 * 50; i++) {
+        tick();
+
+        for(j = 0; j < 8; j++) {
+            if(thd_current == thds[j])
+                runs[j]++;
+        }
+    }
+
+    for(j = 0; j < 8 && runs[j] == 50; j++)
+        ;
+
+    if(j < 8)
+        rv |= fail("round robin");
+    else
+        printf("  round robin: ok\n");
+
+    /* A better priority runs right away */
+    hi = spawn(1);
+    tick();
+    i = thd_current == hi;
+
+    /* Then sleeps, and is the next one to run once it's due */
+    slept = sim_us;
+
+    if(i) {
+        thd_sleep(100);
+
+        while(thd_current != hi && sim_us - slept < 200000)
+            tick();
+    }
+
+    if(thd_current != hi || sim_us - slept < 100000 ||
+       sim_us - slept > 100000 + 2 * thd_sched_ms * 1000)
+        rv |= fail("priorities");
+    else
+        printf("  priorities: ok\n");
+
+    /* Get rid of them */
+    for(i = 0; i < 8; i++) {
+        if(thds[i] != thd_current)
+            thd_destroy(thds[i]);
+    }
+
+    park();
+
+    printf("\n");
+
+    return rv;
+}
+
+/* A polling thread of the checks below, and what it's up to */
+typedef struct poller {
+    kthread_t *thd;
+    int ready;              /* What its callback returns */
+    unsigned int timeout;   /* What it passes to thd_poll() */
+    int polling;            /* Whether it has called thd_poll() */
+    uint64_t deadline;      /* When it should time out, in ms */
+    int woken;              /* Tick it stopped polling at, or -1 */
+    uint64_t woke_ms;       /* When it stopped polling */
+    int ret;                /* What thd_poll() returned */
+    int last_eval;          /* Last tick its callback was called at */
+    int max_gap;            /* Most ticks between two calls */
+} poller_t;
+
+static int cur_tick, poll_calls;
+
+static int poll_cb(void *data) {
+    poller_t *p = data;
+
+    poll_calls++;
+
+    if(p->polling && cur_tick - p->last_eval > p->max_gap)
+        p->max_gap = cur_tick - p->last_eval;
+
+    p->last_eval = cur_tick;
+
+    return p->ready;
+}
+
+static poller_t *find_poller(poller_t *p, int n, kthread_t *thd) {
+    int i;
+
+    for(i = 0; i < n; i++) {
+        if(p[i].thd == thd)
+            return &p[i];
+    }
+
+    return NULL;
+}
+
+/* Run the pollers for a number of ticks, returning the most callbacks called
+   from a single tick. Each poller calls thd_poll() the first time it runs,
+   and parks once it's done polling. */
+static int run_pollers(poller_t *p, int n, int ticks) {
+    int i, calls, max_calls = 0;
+    poller_t *cur;
+
+    while(ticks--) {
+        poll_calls = 0;
+        cur_tick++;
+        tick();
+
+        if(poll_calls > max_calls)
+            max_calls = poll_calls;
+
+        for(i = 0; i < n; i++) {
+            if(p[i].polling && p[i].woken < 0 &&
+               p[i].thd->state != STATE_POLLING) {
+                p[i].woken = cur_tick;
+                p[i].woke_ms = sim_us / 1000;
+                p[i].ret = CONTEXT_RET(p[i].thd->context);
+            }
+        }
+
+        while((cur = find_poller(p, n, thd_current))) {
+            if(!cur->polling) {
+                cur->polling = 1;
+                cur->last_eval = cur_tick;
+                cur->deadline = sim_us / 1000 + cur->timeout;
+                calls = poll_calls;
+                thd_poll(poll_cb, cur, cur->timeout);
+                poll_calls = calls;
+            }
+            else if(cur->woken >= 0) {
+                park();
+            }
+            else {
+                break;
+            }
+        }
+    }
+
+    return max_calls;
+}
+
+static void spawn_pollers(poller_t *p, int n) {
+    int i;
+
+    memset(p, 0, n * sizeof(poller_t));
+
+    for(i = 0; i < n; i++) {
+        p[i].thd = spawn(1);
+        p[i].woken = -1;
+    }
+}
+
+/* Polling threads wake up when their callback says so, or when they time
+   out, and the scheduler never calls more than THD_POLL_BUDGET callbacks per
+   tick while still getting to every one of them in turn. */
+static int check_polls(void) {
+    static poller_t p[200];
+    int i, rounds, max_calls, rv = 0;
+    uint64_t late;
+
+    printf("Polling\n");
+
+    /* One that times out while another keeps polling */
+    spawn_pollers(p, 2);
+    p[1].timeout = 50;
+    run_pollers(p, 2, 20);
+
+    if(p[1].woken < 0 || p[1].ret || p[0].woken >= 0)
+        rv |= fail("timeout next to another poller");
+    else
+        printf("  timeout next to another poller: ok\n");
+
+    p[0].ready = 7;
+    run_pollers(p, 2, 2);
+
+    if(p[0].woken < 0 || p[0].ret != 7)
+        rv |= fail("ready callback");
+    else
+        printf("  ready callback: ok\n");
+
+    /* Lots of them, timing out in no particular order */
+    spawn_pollers(p, 200);
+    srand(1);
+
+    for(i = 0; i < 200; i++)
+        p[i].timeout = 100 + rand() % 2000;
+
+    max_calls = run_pollers(p, 200, 300);
+    rounds = (200 + THD_POLL_BUDGET - 1) / THD_POLL_BUDGET;
+
+    for(i = 0; i < 200; i++) {
+        late = p[i].woke_ms - p[i].deadline;
+
+        if(p[i].woken < 0 || p[i].ret || p[i].max_gap > rounds + 1 ||
+           p[i].woke_ms <= p[i].deadline ||
+           late > 2 * thd_sched_ms)
+            break;
+    }
+
+    if(i < 200 || max_calls > THD_POLL_BUDGET)
+        rv |= fail("200 timeouts");
+    else
+        printf("  200 timeouts: ok, at most %d callbacks per tick\n",
+               max_calls);
+
+    printf("\n");
+
+    return rv;
+}
+
+/* A thread of the check below, and what it's up to */
+typedef struct sleeper {
+    kthread_t *thd;
+    unsigned int timeout;   /* What it passes to genwait_wait() */
+    int waiting;            /* Whether it has called genwait_wait() */
+    uint64_t deadline;      /* When it should time out, in ms */
+    uint64_t woke_ms;       /* When it was woken, or 0 */
+    int ret;                /* What genwait_wait() returned */
+    int err;                /* And errno */
+} sleeper_t;
+
+static sleeper_t *find_sleeper(sleeper_t *s, int n, kthread_t *thd) {
+    int i;
+
+    for(i = 0; i < n; i++) {
+        if(s[i].thd == thd)
+            return &s[i];
+    }
+
+    return NULL;
+}
+
+/* Threads in timed waits are woken once their timeout has passed, in the
+   order of their timeouts. While nothing else can run, the scheduler timer
+   isn't programmed for every tick, only for the next timeout (or at most
+   THD_IDLE_MAX_TICKS ticks away). */
+static int check_timeouts(void) {
+    static sleeper_t s[200];
+    static int obj;
+    uint64_t start_us, last = 0;
+    int i, woken = 0, irqs = 0, bad = 0, rv = 0;
+    sleeper_t *cur;
+
+    printf("Timed waits\n");
+
+    memset(s, 0, sizeof(s));
+    srand(2);
+
+    for(i = 0; i < 200; i++) {
+        s[i].thd = spawn(1);
+        s[i].timeout = 100 + rand() % 20000;
+    }
+
+    start_us = sim_us;
+
+    while(woken < 200 && sim_us - start_us < 30000000) {
+        /* The timer goes off when the scheduler asked it to */
+        sim_us += (uint64_t)timer_wakeup * 1000;
+        thd_timer_hnd(NULL);
+        irqs++;
+
+        for(i = 0; i < 200; i++) {
+            if(s[i].waiting && !s[i].woke_ms &&
+               s[i].thd->state != STATE_WAIT) {
+                s[i].woke_ms = sim_us / 1000;
+                s[i].ret = CONTEXT_RET(s[i].thd->context);
+                s[i].err = *thd_get_errno(s[i].thd);
+                woken++;
+
+                if(s[i].deadline > last)
+                    last = s[i].deadline;
+            }
+        }
+
+        /* Anything else that runs (the kernel thread, to begin with) is
+           parked, so that the idle thread gets to run. */
+        while(thd_current != thd_idle_thd) {
+            cur = find_sleeper(s, 200, thd_current);
+
+            if(cur && !cur->waiting) {
+                cur->waiting = 1;
+                cur->deadline = sim_us / 1000 + cur->timeout;
+                genwait_wait(&obj, "sleeper", cur->timeout);
+            }
+            else {
+                park();
+            }
+        }
+    }
+
+    /* Each one is woken with EAGAIN, no more than a tick after its
+       timeout. */
+    for(i = 0; i < 200; i++) {
+        if(!s[i].woke_ms || s[i].ret != -1 || s[i].err != EAGAIN ||
+           s[i].woke_ms < s[i].deadline ||
+           s[i].woke_ms > s[i].deadline + thd_sched_ms)
+            bad = 1;
+    }
+
+    if(bad)
+        rv |= fail("200 timeouts");
+    else
+        printf("  200 timeouts: ok, each on time\n");
+
+    /* Without skipping idle ticks, that would have been one per tick. With
+       it, each wakeup takes the interrupt at the timeout and then a regular
+       tick, since the woken thread ran, and the gaps between them take one
+       every THD_IDLE_MAX_TICKS ticks. */
+    if(irqs > 2 * 200 + (int)(last - start_us / 1000) /
+       (int)(thd_sched_ms * THD_IDLE_MAX_TICKS) + 10)
+        rv |= fail("idle ticks");
+    else
+        printf("  idle ticks: ok, %d timer interrupts instead of %d\n", irqs,
+               (int)((sim_us - start_us) / 1000 / thd_sched_ms));
+
+    printf("\n");
+
+    return rv;
+}
+
+/* Thread IDs stay unique and can be looked up through thousands of threads
+   being created and destroyed, the allocation wrapping around several times,
+   and the ID hash table growing along the way. */
+static int check_tids(void) {
+    static kthread_t *live[4000];
+    kthread_attr_t attr = { .stack_size = 4096, .label = "churn" };
+    size_t base = thd_count, buckets;
+    int i, j, wraps = 0, bad = 0, rv = 0;
+    tid_t last = 0;
+    double t;
+
+    printf("Thread IDs\n");
+
+    for(i = 0; i < 4000; i++) {
+        if(!(live[i] = thd_create_ex(&attr, never_runs, NULL)))
+            break;
+    }
+
+    buckets = thd_tid_hash_size;
+
+    if(i < 4000 || buckets * 2 < thd_count)
+        rv |= fail("hash table growth");
+    else
+        printf("  hash table growth: ok, %zu buckets for %zu threads\n",
+               buckets, thd_count);
+
+    t = now_ns();
+
+    for(j = 0; j < 100; j++) {
+        for(i = 0; i < 4000; i++) {
+            if(thd_by_tid(live[i]->tid) != live[i])
+                break;
+        }
+    }
+
+    t = (now_ns() - t) / (100 * 4000);
+
+    /* Replace random threads, far past the end of the ID range */
+    srand(2);
+
+    for(j = 0; j < 200000 && !bad; j++) {
+        i = rand() % 4000;
+        thd_destroy(live[i]);
+
+        if(!(live[i] = thd_create_ex(&attr, never_runs, NULL)) ||
+           thd_by_tid(live[i]->tid) != live[i] ||
+           live[i]->tid < 1 || live[i]->tid > THD_TID_MAX) {
+            bad = 1;
+            break;
+        }
+
+        if(live[i]->tid < last)
+            wraps++;
+
+        last = live[i]->tid;
+
+        if(j % 10000)
+            continue;
+
+        /* Every live thread is still found under its own ID */
+        for(i = 0; i < 4000; i++) {
+            if(thd_by_tid(live[i]->tid) != live[i]) {
+                bad = 1;
+                break;
+            }
+        }
+    }
+
+    if(bad)
+        rv |= fail("churn");
+    else
+        printf("  churn: ok, %d creations, %d wraparounds, "
+               "%.0f ns per lookup\n", j, wraps, t);
+
+    for(i = 0; i < 4000; i++) {
+        if(live[i])
+            thd_destroy(live[i]);
+    }
+
+    if(thd_count != base || thd_tid_hash_size != buckets)
+        rv |= fail("cleanup");
+
+    printf("\n");
+
+    return rv;
+}
+
+int main(int argc, char *argv[]) {
+    int rv = 0;
+
+    if(argc > 1 && !strcmp(argv[1], "-v"))
+        dbglog_level = DBG_KDEBUG;
+
+    start();
+
+    rv |= check_order();
+    rv |= check_polls();
+    rv |= check_timeouts();
+    rv |= check_tids();
+    run_benchmarks();
+    bench_timeouts();
+
+    return rv;
+}
@@ -0,0 +1,30 @@
+/* KallistiOS ##version##
+
+   utils/vmufstest/dc/maple.h
+
+   Stand-in for the real header, with just enough of a maple device for
+   vmufs.c to build on a PC.
+*/
+
+#ifndef __DC_MAPLE_H
+#define __DC_MAPLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAPLE_FUNC_MEMCARD  0x02000000
+
+#define MAPLE_PORT_COUNT    4
+#define MAPLE_UNIT_COUNT    6
+
+typedef struct maple_devinfo {
+    uint32_t functions;
+} maple_devinfo_t;
+
+typedef struct maple_device {
+    int             port;
+    int             unit;
+    maple_devinfo_t info;
+} maple_device_t;
+
+#endif /* __DC_MAPLE_H */
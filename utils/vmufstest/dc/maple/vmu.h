@@ -0,0 +1,18 @@
+/* KallistiOS ##version##
+
+   utils/vmufstest/dc/maple/vmu.h
+
+   Stand-in for the real header. The block functions are implemented by the
+   simulated cards in vmufstest.c.
+*/
+
+#ifndef __DC_MAPLE_VMU_H
+#define __DC_MAPLE_VMU_H
+
+#include <dc/maple.h>
+
+int vmu_block_read(maple_device_t *dev, uint16_t blocknum, uint8_t *buffer);
+int vmu_block_write(maple_device_t *dev, uint16_t blocknum,
+                    const uint8_t *buffer);
+
+#endif /* __DC_MAPLE_VMU_H */
@@ -0,0 +1,385 @@
+/* KallistiOS ##version##
+
+   vmufstest.c
+
+   Test for the vmufs metadata cache. This builds the real
+   kernel/arch/dreamcast/fs/vmufs.c on a PC, on top of simulated VMUs that
+   keep their blocks in memory and count every block read and write (each of
+   which is a maple frame on the real thing).
+
+   First a game saves and loads a few times, showing how many frames each
+   call takes. Then random writes, overwrites, reads and deletes go to two
+   cards, with cards being swapped in and out of a slot and block writes
+   failing now and then. After each call, what vmufs reports is checked
+   against what it should be, and against what it reports after being made to
+   read everything from the card again.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../kernel/arch/dreamcast/fs/vmufs.c"
+
+#define NNAMES      8
+#define NOPS        20000
+#define MAXBLKS     40
+
+/* A simulated card, and what we expect to find on it */
+typedef struct card {
+    uint8_t blocks[256][512];
+    uint8_t *data[NNAMES];
+    int size[NNAMES];           /* In blocks, or 0 if the file isn't there */
+} card_t;
+
+static card_t cards[3];
+static card_t *slot[MAPLE_PORT_COUNT][MAPLE_UNIT_COUNT];
+static maple_device_t devs[2] = {
+    { 0, 1, { MAPLE_FUNC_MEMCARD } },
+    { 1, 1, { MAPLE_FUNC_MEMCARD } }
+};
+
+static unsigned int nreads, nwrites;
+static int fail_write = -1;     /* Fail the nth block write from now */
+static unsigned int seed = 1;
+
+static unsigned int rnd(unsigned int n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+}
+
+int vmu_block_read(maple_device_t *dev, uint16_t blocknum, uint8_t *buffer) {
+    nreads++;
+    memcpy(buffer, slot[dev->port][dev->unit]->blocks[blocknum], 512);
+    return 0;
+}
+
+int vmu_block_write(maple_device_t *dev, uint16_t blocknum,
+                    const uint8_t *buffer) {
+    nwrites++;
+
+    if(fail_write >= 0 && fail_write-- == 0)
+        return -1;
+
+    memcpy(slot[dev->port][dev->unit]->blocks[blocknum], buffer, 512);
+    return 0;
+}
+
+/* The layout of a standard card: 200 user blocks, then 41 hidden ones, then
+   the directory (13 blocks counting down from 253), the FAT and the root. */
+static void format(card_t *c) {
+    vmu_root_t *root = (vmu_root_t *)c->blocks[255];
+    uint16_t *fat = (uint16_t *)c->blocks[254];
+    int i;
+
+    memset(c->blocks, 0, sizeof(c->blocks));
+    memset(root->magic, 0x55, sizeof(root->magic));
+    root->fat_loc = 254;
+    root->fat_size = 1;
+    root->dir_loc = 253;
+    root->dir_size = 13;
+    root->blk_cnt = 200;
+
+    for(i = 0; i < 241; i++)
+        fat[i] = 0xfffc;
+
+    for(i = 242; i < 254; i++)
+        fat[i] = i - 1;
+
+    fat[241] = 0xfffa;
+    fat[254] = 0xfffa;
+    fat[255] = 0xfffa;
+
+    for(i = 0; i < NNAMES; i++) {
+        free(c->data[i]);
+        c->data[i] = NULL;
+        c->size[i] = 0;
+    }
+}
+
+static void name(char *fn, int i) {
+    sprintf(fn, "GAME_SAVE%d", i);
+}
+
+static int check_dirents(const vmu_dir_t *d, int cnt, const card_t *c,
+                         const char *what) {
+    int i, j, n = 0;
+    char fn[13];
+
+    for(i = 0; i < NNAMES; i++) {
+        if(!c->size[i])
+            continue;
+
+        n++;
+        name(fn, i);
+
+        for(j = 0; j < cnt; j++) {
+            if(!strncmp(d[j].filename, fn, 12))
+                break;
+        }
+
+        if(j == cnt || d[j].filesize != c->size[i] || d[j].dirty) {
+            fprintf(stderr, "%s: bad entry for %s\n", what, fn);
+            return -1;
+        }
+    }
+
+    if(n != cnt) {
+        fprintf(stderr, "%s: %d entries, expected %d\n", what, cnt, n);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Check everything vmufs says about a card, with what's cached and then
+   with what's on the card */
+static int check(maple_device_t *dev, const char *what) {
+    card_t *c = slot[dev->port][dev->unit];
+    vmu_dir_t *d;
+    void *buf;
+    int cnt, size, i, used = 0, pass;
+    char fn[13];
+
+    for(pass = 0; pass < 2; pass++) {
+        if(pass)
+            vmufs_cache_invalidate(dev);
+
+        if(vmufs_readdir(dev, &d, &cnt) < 0 ||
+           check_dirents(d, cnt, c, what)) {
+            fprintf(stderr, "%s: readdir failed (%s)\n", what,
+                    pass ? "from card" : "cached");
+            return -1;
+        }
+
+        free(d);
+
+        for(i = 0, used = 0; i < NNAMES; i++) {
+            name(fn, i);
+            used += c->size[i];
+
+            if(vmufs_read(dev, fn, &buf, &size) < 0) {
+                if(!c->size[i])
+                    continue;
+
+                fprintf(stderr, "%s: can't read %s\n", what, fn);
+                return -1;
+            }
+
+            if(size != c->size[i] * 512 || memcmp(buf, c->data[i], size)) {
+                fprintf(stderr, "%s: %s has the wrong contents\n", what, fn);
+                return -1;
+            }
+
+            free(buf);
+        }
+
+        if(vmufs_free_blocks(dev) != 200 - used) {
+            fprintf(stderr, "%s: %d blocks free, expected %d\n", what,
+                    vmufs_free_blocks(dev), 200 - used);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* After a failed call, vmufs should give the same answer with and without
+   its cache. */
+static int coherent(maple_device_t *dev) {
+    vmu_dir_t *d1, *d2;
+    int cnt1, cnt2, rv = 0;
+
+    if(vmufs_readdir(dev, &d1, &cnt1) < 0)
+        return -1;
+
+    vmufs_cache_invalidate(dev);
+
+    if(vmufs_readdir(dev, &d2, &cnt2) < 0) {
+        free(d1);
+        return -1;
+    }
+
+    if(cnt1 != cnt2 || (cnt1 && memcmp(d1, d2, cnt1 * sizeof(vmu_dir_t)))) {
+        fprintf(stderr, "cached directory doesn't match the card\n");
+        rv = -1;
+    }
+
+    free(d1);
+    free(d2);
+    return rv;
+}
+
+static void frames(const char *what) {
+    printf("  %-34s %3u reads, %3u writes\n", what, nreads, nwrites);
+    nreads = nwrites = 0;
+}
+
+static int save_game(void) {
+    maple_device_t *dev = &devs[0];
+    uint8_t save[10 * 512];
+    void *buf;
+    vmu_dir_t *d;
+    int cnt, size, i;
+
+    memset(save, 0x5a, sizeof(save));
+    nreads = nwrites = 0;
+
+    printf("Saving and loading a 10 block file:\n");
+
+    if(vmufs_readdir(dev, &d, &cnt) < 0)
+        return -1;
+
+    free(d);
+    frames("vmufs_readdir (first call)");
+
+    if(vmufs_free_blocks(dev) != 200)
+        return -1;
+
+    frames("vmufs_free_blocks");
+
+    for(i = 0; i < 3; i++) {
+        save[0] = i;
+
+        if(vmufs_write(dev, "GAME_SAVE0", save, sizeof(save),
+                       VMUFS_OVERWRITE) < 0)
+            return -1;
+
+        frames(i ? "vmufs_write (overwrite)" : "vmufs_write (new file)");
+
+        if(vmufs_read(dev, "GAME_SAVE0", &buf, &size) < 0 ||
+           size != sizeof(save) || memcmp(buf, save, size))
+            return -1;
+
+        free(buf);
+        frames("vmufs_read");
+    }
+
+    if(vmufs_readdir(dev, &d, &cnt) < 0 || cnt != 1)
+        return -1;
+
+    free(d);
+    frames("vmufs_readdir");
+
+    if(vmufs_delete(dev, "GAME_SAVE0") < 0)
+        return -1;
+
+    frames("vmufs_delete");
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    maple_device_t *dev;
+    uint8_t buf[MAXBLKS * 512];
+    card_t *c, *spare;
+    int op, i, n, rv, swaps = 0, fails = 0;
+    char fn[13];
+
+    if(argc > 1 && !strcmp(argv[1], "-v"))
+        dbglog_set_level(DBG_KDEBUG);
+
+    for(i = 0; i < 3; i++)
+        format(&cards[i]);
+
+    slot[0][1] = &cards[0];
+    slot[1][1] = &cards[1];
+    spare = &cards[2];
+
+    vmufs_init();
+
+    if(save_game()) {
+        fprintf(stderr, "saving a game failed\n");
+        return 1;
+    }
+
+    for(op = 0; op < NOPS; op++) {
+        dev = &devs[rnd(2)];
+        c = slot[dev->port][dev->unit];
+        i = rnd(NNAMES);
+        name(fn, i);
+
+        switch(rnd(10)) {
+            case 0:
+                /* Swap the card in the slot */
+                slot[dev->port][dev->unit] = spare;
+                spare = c;
+                vmufs_cache_invalidate(dev);
+                swaps++;
+                break;
+
+            case 1:
+            case 2:
+                rv = vmufs_delete(dev, fn);
+
+                if(rv != (c->size[i] ? 0 : -1)) {
+                    fprintf(stderr, "deleting %s returned %d\n", fn, rv);
+                    return 1;
+                }
+
+                free(c->data[i]);
+                c->data[i] = NULL;
+                c->size[i] = 0;
+                break;
+
+            default:
+                n = rnd(MAXBLKS) + 1;
+
+                for(int j = 0; j < n * 512; j++)
+                    buf[j] = rnd(256);
+
+                /* Now and then, one of the block writes fails */
+                if(!rnd(50))
+                    fail_write = rnd(n + 2);
+
+                rv = vmufs_write(dev, fn, buf, n * 512, VMUFS_OVERWRITE);
+                fail_write = -1;
+
+                if(rv < 0) {
+                    if(coherent(dev)) {
+                        fprintf(stderr, "after failing to write %s (%d)\n",
+                                fn, rv);
+                        return 1;
+                    }
+
+                    /* The card may be leaking blocks now, so start over */
+                    format(c);
+                    vmufs_cache_invalidate(dev);
+                    fails++;
+                    break;
+                }
+
+                free(c->data[i]);
+                c->data[i] = malloc(n * 512);
+                memcpy(c->data[i], buf, n * 512);
+                c->size[i] = n;
+
+                /* Keep some room free, so there's something to do */
+                if(vmufs_free_blocks(dev) < MAXBLKS) {
+                    for(i = 0; i < NNAMES; i++) {
+                        name(fn, i);
+                        vmufs_delete(dev, fn);
+                        free(c->data[i]);
+                        c->data[i] = NULL;
+                        c->size[i] = 0;
+                    }
+                }
+
+                break;
+        }
+
+        if(!(op % 64) && check(dev, "random operations"))
+            return 1;
+    }
+
+    for(i = 0; i < 2; i++) {
+        if(check(&devs[i], "at the end"))
+            return 1;
+    }
+
+    printf("%d random operations with %d card swaps and %d failed writes: ok\n",
+           NOPS, swaps, fails);
+
+    vmufs_shutdown();
+    return 0;
+}